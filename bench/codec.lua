@@ -0,0 +1,74 @@
+-- fan.data2hex/hex2data and fan.base64_encode/base64_decode throughput for
+-- a few input sizes, next to a plain lua hex codec for reference.
+--
+-- usage (from the repo root): lua bench/codec.lua [megabytes]
+local fan = require "fan"
+local utils = require "fan.utils"
+
+local gettime = utils.gettime
+
+local megabytes = tonumber(arg[1]) or 64
+local SIZES = {16, 64, 256, 4096, 65536, 1024 * 1024}
+
+local function lua_data2hex(data)
+    return (data:gsub(".", function(c)
+        return string.format("%02X", c:byte())
+    end))
+end
+
+local function lua_hex2data(hex)
+    return (hex:gsub("..", function(cc)
+        return string.char(tonumber(cc, 16))
+    end))
+end
+
+local function random_data(size)
+    local t = {}
+    for i = 1, size do
+        t[i] = string.char(math.random(0, 255))
+    end
+    return table.concat(t)
+end
+
+-- MB/s of input consumed, f runs until about `megabytes` went through.
+local function throughput(size, total, f, input)
+    local loops = math.max(1, math.floor(total / size))
+    local start = gettime()
+    for i = 1, loops do
+        f(input)
+    end
+    return loops * #input / (gettime() - start) / 1024 / 1024
+end
+
+math.randomseed(0)
+
+print(string.format("%-9s %11s %11s %11s %11s %11s %11s", "size", "data2hex", "hex2data", "b64enc", "b64dec", "b64url", "lua hex"))
+
+for _, size in ipairs(SIZES) do
+    local data = random_data(size)
+    local hex = fan.data2hex(data)
+    local b64 = fan.base64_encode(data)
+    local b64url = fan.base64_encode(data, true)
+
+    assert(fan.hex2data(hex) == data)
+    assert(fan.base64_decode(b64) == data)
+    assert(fan.base64_decode(b64url, true) == data)
+    assert(lua_data2hex(data) == hex and lua_hex2data(hex) == data)
+
+    local total = megabytes * 1024 * 1024
+    print(
+        string.format(
+            "%-9d %8.0f MB/s %6.0f MB/s %6.0f MB/s %6.0f MB/s %6.0f MB/s %6.0f MB/s",
+            size,
+            throughput(size, total, fan.data2hex, data),
+            throughput(size * 2, total, fan.hex2data, hex),
+            throughput(size, total, fan.base64_encode, data),
+            throughput(#b64, total, fan.base64_decode, b64),
+            throughput(#b64url, total, function(s)
+                return fan.base64_decode(s, true)
+            end, b64url),
+            -- the lua codec is slow, it gets a hundredth of the data.
+            throughput(size, total / 100, lua_data2hex, data)
+        )
+    )
+end
@@ -0,0 +1,89 @@
+-- objectbuf.encode against the encoder of a fan.so built from the baseline
+-- commit (if its path is given) and cjson (skipped if it's not installed),
+-- on the sample of the docs, a large table of duplicates and a small message.
+--
+-- usage (from the repo root): lua bench/objectbuf_encode.lua [loopcount] [baseline/fan.so]
+local objectbuf = require "fan.objectbuf"
+local core = require "fan.objectbuf.core"
+local utils = require "fan.utils"
+
+local baseline = arg[2] and assert(package.loadlib(arg[2], "luaopen_fan_objectbuf_core"))()
+
+local has_cjson, cjson = pcall(require, "cjson")
+
+local loopcount = tonumber(arg[1]) or 2000
+
+local docs = {
+    b = {
+        1234556789,
+        12345.6789,
+        nil,
+        -1234556789,
+        -12345.6789,
+        0,
+        "asdfa"
+    },
+    averyvery = string.rep("long long text", 12)
+}
+math.randomseed(0)
+for i = 1, 100 do
+    table.insert(docs.b, string.rep("abc", math.random(1000)))
+end
+
+local duplicates = {}
+for i = 1, 10000 do
+    duplicates[i] = "duplicate string"
+end
+
+local small = {id = 1001, name = "player", pos = {x = 1.5, y = 2}, tags = {"a", "b", "c"}}
+
+local samples = {
+    {"docs", docs, 1},
+    {"duplicates", duplicates, 10},
+    {"small", small, 1 / 50}
+}
+
+local function timed(name, sample, count, f)
+    local start = utils.gettime()
+    local data
+    for i = 1, count do
+        data = f()
+    end
+    local elapsed = utils.gettime() - start
+    print(string.format("%-12s %-22s %9.2f us/op %10d bytes", sample, name, elapsed / count * 1e6, #data))
+end
+
+for _, sample in ipairs(samples) do
+    local name, obj = sample[1], sample[2]
+    local count = math.max(1, math.floor(loopcount / sample[3]))
+    local sym = objectbuf.symbol(obj)
+
+    timed("encode", name, count, function()
+        return core.encode(obj)
+    end)
+    if baseline then
+        timed("baseline encode", name, count, function()
+            return baseline.encode(obj)
+        end)
+    end
+    timed("encode +sym", name, count, function()
+        return core.encode(obj, sym)
+    end)
+    if baseline then
+        timed("baseline encode +sym", name, count, function()
+            return baseline.encode(obj, sym)
+        end)
+    end
+    if has_cjson then
+        timed("cjson.encode", name, count, function()
+            return cjson.encode(obj)
+        end)
+    end
+end
+
+if not baseline then
+    print("no baseline fan.so given, skipped.")
+end
+if not has_cjson then
+    print("cjson not found, skipped.")
+end
@@ -0,0 +1,111 @@
+-- rudp fec on a lossy loopback link: delivery latency and wire overhead
+-- for a few fec group sizes at a few loss rates.
+--
+-- usage (from the repo root): lua bench/rudp_fec.lua [count]
+package.path = "tests/?.lua;" .. package.path
+
+local fan = require "fan"
+local udpd = require "fan.udpd"
+local rudp = require "fan.rudp"
+local utils = require "fan.utils"
+local lossy_relay = require "lossy_relay"
+
+local count = tonumber(arg[1]) or 500
+
+local MTU = 1200
+-- both ends need the same window, the receiver drops what lies beyond its own.
+local WINDOW_SIZE = 64
+local BODY_SIZE = MTU - 28 - 8
+local LOSSES = {0, 0.01, 0.03, 0.05}
+local FECS = {0, 4, 8}
+-- 1, 3 and 8 part messages.
+local SIZES = {BODY_SIZE - 100, BODY_SIZE * 3 - 10, BODY_SIZE * 8}
+
+local function percentile(list, p)
+    if #list == 0 then
+        return 0
+    end
+    table.sort(list)
+    return list[math.max(1, math.ceil(#list * p))]
+end
+
+local function run(loss, fec)
+    local sent_at = {}
+    local latencies = {}
+    local payload = 0
+    local server_session
+
+    local server =
+        rudp.new {
+        mtu = MTU,
+        fec = fec,
+        window_size = WINDOW_SIZE,
+        accept = true,
+        onread = function(session, buf)
+            server_session = session
+            local i = tonumber(buf:sub(1, 8))
+            latencies[#latencies + 1] = utils.gettime() - sent_at[i]
+        end
+    }
+    local server_conn = udpd.new {bind_host = "127.0.0.1"}
+    server:attach(server_conn)
+
+    local relay = lossy_relay.new(server_conn:getPort(), loss, 0)
+
+    local client = rudp.new {mtu = MTU, fec = fec, window_size = WINDOW_SIZE, congestion = "cubic"}
+    local client_conn = udpd.new {bind_host = "127.0.0.1"}
+    client:attach(client_conn)
+    local session = client:session(udpd.make_dest("127.0.0.1", relay.port))
+
+    local start = utils.gettime()
+    for i = 1, count do
+        local size = SIZES[i % #SIZES + 1]
+        local buf = string.format("%08d", i) .. string.rep("x", size - 8)
+        payload = payload + size
+        sent_at[i] = utils.gettime()
+        session:send(buf)
+        fan.sleep(0.002)
+    end
+
+    local deadline = utils.gettime() + 60
+    while #latencies < count and utils.gettime() < deadline do
+        fan.sleep(0.05)
+    end
+
+    local stats = session:stats()
+    print(
+        string.format(
+            "loss=%.2f fec=%d  %d/%d %.2fs  p50=%.1fms p99=%.1fms  overhead=%.1f%%  " ..
+                "resent=%d parity=%d recovered=%d",
+            loss,
+            fec,
+            #latencies,
+            count,
+            utils.gettime() - start,
+            percentile(latencies, 0.5) * 1000,
+            percentile(latencies, 0.99) * 1000,
+            (stats.outgoing_bytes_total / payload - 1) * 100,
+            stats.udp_resend_total,
+            stats.udp_fec_send_total,
+            server_session and server_session.udp_fec_recover_total or 0
+        )
+    )
+
+    client:close()
+    client_conn:close()
+    server:close()
+    server_conn:close()
+    relay.close()
+end
+
+fan.loop(
+    function()
+        math.randomseed(1)
+        for _, loss in ipairs(LOSSES) do
+            for _, fec in ipairs(FECS) do
+                run(loss, fec)
+            end
+        end
+        fan.loopbreak()
+    end
+)
@@ -0,0 +1,70 @@
+-- fec kernel throughput: building the xor parity of a group of parts and
+-- rebuilding a lost part from the parity and the rest of the group, for a
+-- few group sizes and mtus. MB/s of part data consumed, through
+-- rudp.parity, which runs the same kernel as the engine.
+--
+-- usage (from the repo root): lua bench/rudp_parity.lua [megabytes]
+local rudp = require "fan.rudp"
+local utils = require "fan.utils"
+
+local gettime = utils.gettime
+
+local megabytes = tonumber(arg[1]) or 256
+local GROUPS = {2, 4, 8, 16}
+-- body sizes of mtu 576, 1500 and 9000.
+local PART_SIZES = {540, 1464, 8964}
+
+local function random_data(size)
+    local t = {}
+    for i = 1, size do
+        t[i] = string.char(math.random(0, 255))
+    end
+    return table.concat(t)
+end
+
+-- MB/s of input, f runs until about `megabytes` went through.
+local function throughput(bytes, f)
+    local loops = math.max(1, math.floor(megabytes * 1024 * 1024 / bytes))
+    local start = gettime()
+    for i = 1, loops do
+        f()
+    end
+    return loops * bytes / (gettime() - start) / 1024 / 1024
+end
+
+math.randomseed(0)
+
+print(string.format("%-6s %-6s %13s %13s", "part", "group", "build", "recover"))
+
+for _, size in ipairs(PART_SIZES) do
+    for _, group in ipairs(GROUPS) do
+        local parts = {}
+        for i = 1, group do
+            -- the last part of a message is shorter.
+            parts[i] = random_data(i == group and size - 17 or size)
+        end
+
+        local parity = rudp.parity(parts)
+        -- the first part is lost.
+        local survivors = {parity}
+        for i = 2, group do
+            survivors[i] = parts[i]
+        end
+        assert(rudp.parity(survivors) == parts[1])
+
+        local bytes = size * group
+        print(
+            string.format(
+                "%-6d %-6d %8.0f MB/s %8.0f MB/s",
+                size,
+                group,
+                throughput(bytes, function()
+                    rudp.parity(parts)
+                end),
+                throughput(bytes, function()
+                    rudp.parity(survivors)
+                end)
+            )
+        )
+    end
+end
@@ -0,0 +1,90 @@
+-- Get<T>Array/Add<T>Array against a loop of single Get<T>/Add<T> calls, for
+-- each stream backend (ffi and bit only run on luajit, ffi needs
+-- libstream_ffi, see modules/fan/stream/ffi.lua).
+--
+-- usage (from the repo root): lua bench/stream_array.lua [count] [rounds]
+local utils = require "fan.utils"
+
+-- the bit backend packs doubles with string.pack.
+if not string.pack then
+    pcall(require, "compat53")
+end
+
+local gettime = utils.gettime
+
+local count = tonumber(arg[1]) or 20000
+local rounds = tonumber(arg[2]) or 20
+
+local KINDS = {
+    {"U8", 255},
+    {"U16", 65535},
+    {"U24", 16777215},
+    -- there is no single AddU32.
+    {"U32", 4294967295, true},
+    {"D64", 1e9}
+}
+
+local BACKENDS = {"fan.stream.core", "fan.stream.ffi", "fan.stream.bit"}
+
+local function timed(backend, name, f)
+    local start = gettime()
+    for i = 1, rounds do
+        f()
+    end
+    local elapsed = gettime() - start
+    print(string.format("%-16s %-18s %8.2f ns/value", backend, name, elapsed / rounds / count * 1e9))
+end
+
+for _, backend in ipairs(BACKENDS) do
+    local st, stream = pcall(require, backend)
+    if not st then
+        print(backend, "skipped:", stream)
+    else
+        for _, kind in ipairs(KINDS) do
+            local name, max, no_add = kind[1], kind[2], kind[3]
+            local get, add = "Get" .. name, "Add" .. name
+            local get_array, add_array = get .. "Array", add .. "Array"
+
+            local values = {}
+            for i = 1, count do
+                values[i] = i % max
+            end
+
+            local data
+            timed(backend, add_array, function()
+                local s = stream.new()
+                s[add_array](s, values)
+                data = s:package()
+            end)
+
+            if not no_add then
+                local looped
+                timed(backend, add .. " loop", function()
+                    local s = stream.new()
+                    for i = 1, count do
+                        s[add](s, values[i])
+                    end
+                    looped = s:package()
+                end)
+                assert(data == looped, name)
+            end
+
+            local result
+            timed(backend, get_array, function()
+                local s = stream.new(data)
+                result = s[get_array](s, count)
+            end)
+            assert(#result == count and result[count] == values[count], name)
+
+            timed(backend, get .. " loop", function()
+                local s = stream.new(data)
+                local t = {}
+                for i = 1, count do
+                    t[i] = s[get](s)
+                end
+                result = t
+            end)
+            assert(result[count] == values[count], name)
+        end
+    end
+end
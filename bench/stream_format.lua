@@ -0,0 +1,93 @@
+-- stream.compile_format against string.pack/string.unpack on the packaged
+-- data and against one Add/Get call per field, for a small fixed record.
+--
+-- usage (from the repo root): lua bench/stream_format.lua [records] [rounds]
+local stream = require "fan.stream"
+local utils = require "fan.utils"
+
+local gettime = utils.gettime
+
+local records = tonumber(arg[1]) or 100000
+local rounds = tonumber(arg[2]) or 10
+
+local FMT = "<H i3 d B >I4"
+local format = stream.compile_format(FMT)
+
+local has_string_pack = pcall(function()
+    assert(string.unpack(FMT, string.pack(FMT, 1, -2, 0.5, 4, 5)) == 1)
+end)
+
+local function timed(name, f)
+    local start = gettime()
+    for i = 1, rounds do
+        f()
+    end
+    local elapsed = gettime() - start
+    print(string.format("%-28s %8.2f ns/record", name, elapsed / rounds / records * 1e9))
+end
+
+local data
+timed("format:pack", function()
+    local s = stream.new()
+    for i = 1, records do
+        format:pack(s, i % 65536, -i % 8388608, i / 3, i % 256, i)
+    end
+    data = s:package()
+end)
+
+timed("Add per field", function()
+    local s = stream.new()
+    for i = 1, records do
+        s:AddU16(i % 65536)
+        s:AddS24(-i % 8388608)
+        s:AddD64(i / 3)
+        s:AddU8(i % 256)
+        s:AddU32BE(i)
+    end
+    assert(s:package() == data)
+end)
+
+if has_string_pack then
+    timed("string.pack", function()
+        local t = {}
+        for i = 1, records do
+            t[i] = string.pack(FMT, i % 65536, -i % 8388608, i / 3, i % 256, i)
+        end
+        assert(table.concat(t) == data)
+    end)
+end
+
+timed("format:unpack", function()
+    local s = stream.new(data)
+    local sum = 0
+    for i = 1, records do
+        local a, b, c, d, e = format:unpack(s)
+        sum = sum + e
+    end
+    assert(sum == records * (records + 1) / 2)
+end)
+
+timed("Get per field", function()
+    local s = stream.new(data)
+    local sum = 0
+    for i = 1, records do
+        local a, b, c, d, e = s:GetU16(), s:GetS24(), s:GetD64(), s:GetU8(), s:GetU32BE()
+        sum = sum + e
+    end
+    assert(sum == records * (records + 1) / 2)
+end)
+
+if has_string_pack then
+    timed("string.unpack", function()
+        local pos = 1
+        local sum = 0
+        for i = 1, records do
+            local a, b, c, d, e
+            a, b, c, d, e, pos = string.unpack(FMT, data, pos)
+            sum = sum + e
+        end
+        assert(sum == records * (records + 1) / 2)
+    end)
+else
+    print("string.pack not found, skipped.")
+end
@@ -0,0 +1,111 @@
+-- fan.timerwheel with 50k session deadlines: add/touch/cancel cost, and
+-- the loop lag it causes compared to the old periodic scan of every
+-- session's outstanding packages.
+--
+-- usage (from the repo root): lua bench/timerwheel.lua [sessions]
+local fan = require "fan"
+local timerwheel = require "fan.timerwheel"
+local utils = require "fan.utils"
+
+local gettime = utils.gettime
+
+local SESSIONS = tonumber(arg[1]) or 50000
+local PACKAGES = 4
+
+local sessions = {}
+for i = 1, SESSIONS do
+    local packages = {}
+    for j = 1, PACKAGES do
+        packages[j] = {deadline = math.huge}
+    end
+    sessions[i] = {packages = packages}
+end
+
+local function timed(name, f)
+    local start = gettime()
+    f()
+    local elapsed = gettime() - start
+    print(string.format("%-32s %8.2f ms  %6.0f ns/op", name, elapsed * 1000, elapsed / SESSIONS * 1e9))
+end
+
+-- max delay of a 10ms sleep loop over duration seconds.
+local function loop_lag(duration)
+    local max_lag = 0
+    local stop = gettime() + duration
+    while gettime() < stop do
+        local start = gettime()
+        fan.sleep(0.01)
+        local lag = gettime() - start - 0.01
+        if lag > max_lag then
+            max_lag = lag
+        end
+    end
+    return max_lag
+end
+
+fan.loop(
+    function()
+        local expired = 0
+        local tw =
+            timerwheel.new {
+            tick = 0.01,
+            onexpire = function(keys)
+                expired = expired + #keys
+            end
+        }
+
+        timed(
+            "timerwheel add",
+            function()
+                for i = 1, SESSIONS do
+                    tw:add(sessions[i], 30 + i % 30)
+                end
+            end
+        )
+
+        timed(
+            "timerwheel touch (re-add)",
+            function()
+                for i = 1, SESSIONS do
+                    tw:add(sessions[i], 30 + i % 17)
+                end
+            end
+        )
+
+        print(string.format("timerwheel loop lag, %d pending   %8.2f ms", tw:count(), loop_lag(2) * 1000))
+
+        timed(
+            "timerwheel cancel",
+            function()
+                for i = 1, SESSIONS do
+                    tw:cancel(sessions[i])
+                end
+            end
+        )
+
+        -- the previous connector: every 0.5s, walk the packages of every
+        -- session looking for a passed deadline.
+        local scanning = true
+        coroutine.wrap(
+            function()
+                while scanning do
+                    fan.sleep(0.5)
+                    local now = gettime()
+                    for i = 1, SESSIONS do
+                        for _, package in ipairs(sessions[i].packages) do
+                            if package.deadline < now then
+                                expired = expired + 1
+                            end
+                        end
+                    end
+                end
+            end
+        )()
+
+        print(string.format("periodic scan loop lag             %8.2f ms", loop_lag(2) * 1000))
+        scanning = false
+
+        tw:close()
+        fan.loopbreak()
+    end
+)
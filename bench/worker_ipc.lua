@@ -0,0 +1,84 @@
+-- fan.worker master/slave round trips over the fifo and shm transports:
+-- throughput and per task latency for a few payload sizes.
+--
+-- usage (from the repo root), once per transport:
+--   lua bench/worker_ipc.lua fifo [slaves] [concurrency] [seconds]
+--   lua bench/worker_ipc.lua shm [slaves] [concurrency] [seconds]
+local fan = require "fan"
+local utils = require "fan.utils"
+local worker = require "fan.worker"
+
+local gettime = utils.gettime
+
+local transport = arg[1] or "fifo"
+local slaves = tonumber(arg[2]) or 1
+local concurrency = tonumber(arg[3]) or 20
+local seconds = tonumber(arg[4]) or 3
+local SIZES = {16, 1024, 64 * 1024}
+
+local commander =
+    worker.new(
+    {
+        echo = function(data)
+            return data
+        end
+    },
+    slaves,
+    concurrency,
+    transport == "shm" and "shm:" or nil
+)
+
+local function percentile(list, p)
+    table.sort(list)
+    return list[math.max(1, math.ceil(#list * p))] or 0
+end
+
+local function run(size)
+    local data = string.rep("x", size)
+    local latencies = {}
+    local running = concurrency
+    local stop = gettime() + seconds
+    local start = gettime()
+
+    for i = 1, concurrency do
+        coroutine.wrap(
+            function()
+                while gettime() < stop do
+                    local t = gettime()
+                    local status, echoed = commander:echo(data)
+                    assert(status and echoed == data, echoed)
+                    latencies[#latencies + 1] = gettime() - t
+                end
+                running = running - 1
+            end
+        )()
+    end
+
+    while running > 0 do
+        fan.sleep(0.1)
+    end
+
+    local elapsed = gettime() - start
+    print(
+        string.format(
+            "%-4s size=%-6d %9.0f tasks/s %8.1f MB/s  p50=%.3fms p99=%.3fms",
+            transport,
+            size,
+            #latencies / elapsed,
+            #latencies * size * 2 / elapsed / 1024 / 1024,
+            percentile(latencies, 0.5) * 1000,
+            percentile(latencies, 0.99) * 1000
+        )
+    )
+end
+
+fan.loop(
+    function()
+        commander.wait_all_slaves()
+        for _, size in ipairs(SIZES) do
+            run(size)
+        end
+        commander:terminate()
+        fan.loopbreak()
+    end
+)
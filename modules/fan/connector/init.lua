@@ -5,6 +5,7 @@ local scheme_map = {}
 scheme_map["tcp"] = require "fan.connector.tcp"
 scheme_map["udp"] = require "fan.connector.udp"
 scheme_map["fifo"] = require "fan.connector.fifo"
+scheme_map["shm"] = require "fan.connector.shm"
 
 local function extract_url(url)
   if not url then
@@ -53,6 +54,19 @@ local function bind(url, args)
   return connector.bind(host, port, path, args)
 end
 
+-- some schemes (shm) need resources created before fork.
+local function prepare(url, ...)
+  local scheme, host, port, path = extract_url(url)
+  if not scheme then
+    return
+  end
+
+  local connector = scheme_map[scheme:lower()]
+  if connector and connector.prepare then
+    return connector.prepare(path, ...)
+  end
+end
+
 local function tmpfifoname()
   local fifoname = os.tmpname()
   print(fifoname)
@@ -64,5 +78,6 @@ end
 return {
   connect = connect,
   bind = bind,
+  prepare = prepare,
   tmpfifoname = tmpfifoname
 }
@@ -0,0 +1,239 @@
+local fan = require "fan"
+local shm = require "fan.shm"
+local fdpass = require "fan.fdpass"
+local stream = require "fan.stream"
+local config = require "config"
+
+-- channels are shared memory rings (plus a unix socketpair for fd passing)
+-- created before fork, bind takes side 0 of every channel of a name, connect
+-- takes side 1 of the channel at index.
+local channels = {}
+
+local apt_mt = {}
+apt_mt.__index = apt_mt
+
+function apt_mt:send(buf)
+  if self.disconnected or not self._ch then
+    return nil
+  end
+
+  if #(self._output_queue) == 0 then
+    local sent = self._ch:send(buf)
+    if not sent then
+      return nil
+    elseif sent == #(buf) then
+      return true
+    end
+
+    buf = buf:sub(sent + 1)
+  end
+
+  table.insert(self._output_queue, buf)
+  table.insert(self._sender_queue, coroutine.running())
+  self._ch:send_req()
+  return coroutine.yield()
+end
+
+function apt_mt:_onsendready()
+  while #(self._output_queue) > 0 do
+    local buf = self._output_queue[1]
+    local sent = self._ch:send(buf)
+    if not sent then
+      break
+    elseif sent < #(buf) then
+      self._output_queue[1] = buf:sub(sent + 1)
+      self._ch:send_req()
+      return
+    end
+
+    table.remove(self._output_queue, 1)
+    local running = table.remove(self._sender_queue, 1)
+    local st, msg = coroutine.resume(running, true)
+    if not st then
+      print(msg)
+    end
+
+    if not self._ch then
+      return
+    end
+  end
+end
+
+-- pass fd (closed here once sent) with data to the peer's onfd.
+function apt_mt:send_fd(fd, data)
+  if self.disconnected or not self._fdch then
+    return nil, "disconnected."
+  end
+
+  return self._fdch:send_fd(fd, data)
+end
+
+function apt_mt:receive(expect)
+  if self.disconnected then
+    return nil
+  end
+
+  expect = expect or 1
+
+  if self._readstream:available() >= expect then
+    return self._readstream
+  else
+    self.receiving_expect = expect
+    self.receiving = coroutine.running()
+    return coroutine.yield()
+  end
+end
+
+function apt_mt:_onread(input)
+  if self.receiving and (not input or input:available() >= self.receiving_expect) then
+    local receiving = self.receiving
+    self.receiving = nil
+    self.receiving_expect = 0
+
+    local st, msg = coroutine.resume(receiving, input)
+    if not st then
+      print(msg)
+    end
+    return true
+  end
+end
+
+function apt_mt:close()
+  self.disconnected = true
+
+  self:_onread(nil)
+  if self._ch then
+    self._ch:close()
+    self._ch = nil
+  end
+  if self._fdch then
+    self._fdch:close()
+    self._fdch = nil
+  end
+
+  while #(self._sender_queue) > 0 do
+    local running = table.remove(self._sender_queue, 1)
+    assert(coroutine.resume(running))
+  end
+end
+
+local function open(ch, side)
+  local apt = {
+    _ch = ch.ring,
+    _fdch = ch.fd,
+    _readstream = stream.new(),
+    _output_queue = {},
+    _sender_queue = {}
+  }
+  setmetatable(apt, apt_mt)
+
+  apt._fdch:open {
+    side = side,
+    onfd = function(fd, data)
+      if apt.onfd then
+        apt.onfd(apt, fd, data)
+      else
+        fan.close(fd)
+      end
+    end
+  }
+
+  -- the ring is copied straight into the read stream.
+  apt._ch:open {
+    side = side,
+    stream = apt._readstream,
+    onread = function(input)
+      if not apt:_onread(input) and apt.onread then
+        apt.onread(input)
+      end
+    end,
+    onsendready = function()
+      apt:_onsendready()
+    end,
+    ondisconnected = function(msg)
+      apt:close()
+    end
+  }
+
+  return apt
+end
+
+-- create count channels for path, must be called before fork.
+local function prepare(path, count, size)
+  local list = {}
+  for i = 1, count do
+    list[i] = {
+      ring = assert(shm.new {size = size or config.shm_ring_size}),
+      fd = assert(fdpass.new())
+    }
+  end
+  channels[path] = list
+end
+
+local function connect(host, port, path, args)
+  local list = channels[path]
+  local index = args and args.index or 1
+  local ch = list and list[index]
+  if ch == false then
+    return nil, "shm channel closed, it can't be opened again."
+  elseif not ch then
+    return nil, "shm channel not prepared."
+  end
+
+  -- a closed channel can't be opened again.
+  list[index] = false
+
+  -- channels of the other workers are not used in this process.
+  for i, other in ipairs(list) do
+    if other then
+      other.ring:close()
+      other.fd:close()
+      list[i] = false
+    end
+  end
+
+  return open(ch, 1)
+end
+
+local function bind(host, port, path)
+  local obj = {apts = {}}
+  local list = channels[path] or {}
+
+  obj.close = function(self)
+    for _, apt in ipairs(self.apts) do
+      apt:close()
+    end
+    self.apts = {}
+  end
+
+  -- accept after onaccept is set, the peers may not have opened their side
+  -- yet, data sent in between waits in the ring.
+  local co = coroutine.create(function()
+    fan.sleep(0)
+    for i, ch in ipairs(list) do
+      if ch then
+        list[i] = false
+        local apt = open(ch, 0)
+        table.insert(obj.apts, apt)
+        if obj.onaccept then
+          local st, msg = coroutine.resume(coroutine.create(obj.onaccept), apt)
+          if not st then
+            print(msg)
+          end
+        end
+      end
+    end
+  end)
+  local st, msg = coroutine.resume(co)
+  if not st then
+    print(msg)
+  end
+
+  return obj
+end
+
+return {
+  connect = connect,
+  bind = bind,
+  prepare = prepare
+}
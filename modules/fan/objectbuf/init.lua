@@ -28,6 +28,8 @@ end
 return {
     encode = encode,
     decode = decode,
+    decoder = core.decoder,
+    compile = core.compile,
     sample = function(obj, optional_result_count)
         local count_map = {}
         local count_list = {}
@@ -106,6 +108,8 @@ return {
 
         index_map[false] = 1
         index_map[true] = 2
+        index_map_vk[1] = false
+        index_map_vk[2] = true
 
         table.sort(
             ctx[CTX_INDEX_STRINGS],
@@ -0,0 +1,243 @@
+--[[
+pull mode for tcpd/udpd objects: obj:pull() puts the object in one ready
+queue, lua takes the ids with next() (onready wakes up once per loop turn)
+and reads/sends through the functions here. on luajit they are ffi calls
+into fan.so, so handler loops don't leave compiled code.
+]]
+local core = require "fan.pull.core"
+require "fan.tcpd"
+require "fan.udpd"
+
+local registry = debug.getregistry()
+local conn_mt = registry["<tcpd.connect>"]
+local accept_mt = registry["<tcpd.accept %s %d>"]
+local udp_mt = registry["UDPD_CONNECTION_TYPE"]
+
+local pull = {
+  onready = core.onready,
+  next = core.next,
+  pending = core.pending
+}
+
+-- portable versions, the lua c api methods of the objects.
+function pull.send(obj, data)
+  return obj:send(data)
+end
+
+function pull.sendv(obj, bufs)
+  return obj:sendv(bufs)
+end
+
+function pull.read(obj)
+  return obj:read()
+end
+
+function pull.udp_send(conn, data, addr)
+  return conn:send(data, addr)
+end
+
+function pull.udp_sendv(conn, bufs, addr)
+  return conn:sendv(bufs, addr)
+end
+
+function pull.udp_recv(conn)
+  return conn:recv()
+end
+
+local ok, ffi = pcall(require, "ffi")
+if not ok or not package.searchpath then
+  return pull
+end
+
+ffi.cdef [[
+typedef struct {
+  const void *base;
+  size_t len;
+} fan_pull_iovec_t;
+
+typedef struct {
+  uint64_t data[16];
+  unsigned int len;
+} fan_pull_addr_t;
+
+int fan_pull_next(void);
+
+ssize_t tcpd_ffi_conn_send(void *conn, const char *data, size_t len);
+ssize_t tcpd_ffi_conn_sendv(void *conn, const fan_pull_iovec_t *iov, int count);
+ssize_t tcpd_ffi_conn_read(void *conn, char *buf, size_t len);
+size_t tcpd_ffi_conn_available(void *conn);
+
+ssize_t tcpd_ffi_accept_send(void *accept, const char *data, size_t len);
+ssize_t tcpd_ffi_accept_sendv(void *accept, const fan_pull_iovec_t *iov, int count);
+ssize_t tcpd_ffi_accept_read(void *accept, char *buf, size_t len);
+size_t tcpd_ffi_accept_available(void *accept);
+
+ssize_t udpd_ffi_send(void *conn, const char *data, size_t len, const void *addr, unsigned int addrlen);
+int udpd_ffi_sendv(void *conn, const fan_pull_iovec_t *iov, int count, const void *addr, unsigned int addrlen);
+ssize_t udpd_ffi_peek(void *conn);
+ssize_t udpd_ffi_recv(void *conn, char *buf, size_t len, void *addr, unsigned int *addrlen);
+]]
+
+-- may be declared by fan.stream.ffi already.
+pcall(ffi.cdef, "char *strerror(int errnum);")
+
+local path = package.searchpath("fan", package.cpath)
+local st, lib = pcall(ffi.load, path)
+if not path or not st then
+  return pull
+end
+
+local tonumber = tonumber
+local iovec_t = ffi.typeof("fan_pull_iovec_t [?]")
+local addr_t = ffi.typeof("fan_pull_addr_t")
+local char_t = ffi.typeof("char [?]")
+
+-- the ffi calls take the object as a raw pointer, anything but the expected
+-- userdata would be read as the wrong struct. true for a tcpd connection,
+-- false for an accepted one.
+local function tcp_is_conn(obj)
+  local mt = getmetatable(obj)
+  if mt == conn_mt then
+    return true
+  elseif mt == accept_mt then
+    return false
+  end
+  error("bad argument #1 (tcpd connection or accept expected, got " .. type(obj) .. ")", 3)
+end
+
+local function udp_check(conn)
+  if getmetatable(conn) ~= udp_mt then
+    error("bad argument #1 (udpd connection expected, got " .. type(conn) .. ")", 3)
+  end
+end
+
+local function make_iovec(bufs)
+  local count = #bufs
+  local iov = iovec_t(count)
+  for i = 1, count do
+    local s = bufs[i]
+    iov[i - 1].base = s
+    iov[i - 1].len = #s
+  end
+  return iov, count
+end
+
+function pull.next()
+  local id = lib.fan_pull_next()
+  if id ~= 0 then
+    return id
+  end
+end
+
+function pull.send(obj, data)
+  if tcp_is_conn(obj) then
+    return tonumber(lib.tcpd_ffi_conn_send(obj, data, #data))
+  else
+    return tonumber(lib.tcpd_ffi_accept_send(obj, data, #data))
+  end
+end
+
+function pull.sendv(obj, bufs)
+  local is_conn = tcp_is_conn(obj)
+  -- bufs keeps the strings alive during the call.
+  local iov, count = make_iovec(bufs)
+  if is_conn then
+    return tonumber(lib.tcpd_ffi_conn_sendv(obj, iov, count))
+  else
+    return tonumber(lib.tcpd_ffi_accept_sendv(obj, iov, count))
+  end
+end
+
+-- read into a caller buffer, return the count, 0 if no input, -1 once
+-- disconnected.
+function pull.read_into(obj, buf, len)
+  if tcp_is_conn(obj) then
+    return tonumber(lib.tcpd_ffi_conn_read(obj, buf, len))
+  else
+    return tonumber(lib.tcpd_ffi_accept_read(obj, buf, len))
+  end
+end
+
+function pull.read(obj)
+  local available
+  if tcp_is_conn(obj) then
+    available = tonumber(lib.tcpd_ffi_conn_available(obj))
+  else
+    available = tonumber(lib.tcpd_ffi_accept_available(obj))
+  end
+
+  local buf = char_t(available > 0 and available or 1)
+  local n = pull.read_into(obj, buf, available)
+  if n < 0 then
+    return nil
+  end
+  return ffi.string(buf, n)
+end
+
+-- addr is a fan_pull_addr_t from udp_recv, or a udpd dest.
+function pull.udp_send(conn, data, addr)
+  udp_check(conn)
+  if type(addr) == "userdata" then
+    return conn:send(data, addr)
+  end
+
+  local n
+  if addr then
+    n = tonumber(lib.udpd_ffi_send(conn, data, #data, addr.data, addr.len))
+  else
+    n = tonumber(lib.udpd_ffi_send(conn, data, #data, nil, 0))
+  end
+  if n < 0 then
+    return n, ffi.string(ffi.C.strerror(ffi.errno()))
+  end
+  return n
+end
+
+function pull.udp_sendv(conn, bufs, addr)
+  udp_check(conn)
+  if type(addr) == "userdata" then
+    return conn:sendv(bufs, addr)
+  end
+
+  local iov, count = make_iovec(bufs)
+  local sent
+  if addr then
+    sent = lib.udpd_ffi_sendv(conn, iov, count, addr.data, addr.len)
+  else
+    sent = lib.udpd_ffi_sendv(conn, iov, count, nil, 0)
+  end
+  if sent < count then
+    return sent, ffi.string(ffi.C.strerror(ffi.errno()))
+  end
+  return sent
+end
+
+-- take the next datagram into a caller buffer, return the count (-1 if
+-- there is none), addr (a fan_pull_addr_t, optional) gets the sender.
+function pull.udp_recv_into(conn, buf, len, addr)
+  udp_check(conn)
+  if addr then
+    local addrlen = ffi.new("unsigned int [1]")
+    local n = tonumber(lib.udpd_ffi_recv(conn, buf, len, addr.data, addrlen))
+    addr.len = addrlen[0]
+    return n
+  end
+  return tonumber(lib.udpd_ffi_recv(conn, buf, len, nil, nil))
+end
+
+function pull.udp_recv(conn)
+  udp_check(conn)
+  local len = tonumber(lib.udpd_ffi_peek(conn))
+  if len < 0 then
+    return nil
+  end
+
+  local buf = char_t(len > 0 and len or 1)
+  local addr = addr_t()
+  local n = pull.udp_recv_into(conn, buf, len, addr)
+  return ffi.string(buf, n), addr
+end
+
+pull.new_addr = addr_t
+
+return pull
@@ -6,6 +6,9 @@ local bnot = bit.bnot
 local band, bor, bxor = bit.band, bit.bor, bit.bxor
 local lshift, rshift, rol = bit.lshift, bit.rshift, bit.rol
 
+-- checksums run the c kernels of the core module.
+local fan = require "fan"
+
 local stream_mt = {}
 stream_mt.__index = stream_mt
 
@@ -190,6 +193,180 @@ function stream_mt:GetBytes(len)
   return s
 end
 
+function stream_mt:GetU16BE()
+  local a, b = string.byte(self.data, self.offset, self.offset + 1)
+  self.offset = self.offset + 2
+  return lshift(a, 8) + b
+end
+
+function stream_mt:GetU32BE()
+  local a, b, c, d = string.byte(self.data, self.offset, self.offset + 3)
+  self.offset = self.offset + 4
+  return a * 2 ^ 24 + lshift(b, 16) + lshift(c, 8) + d
+end
+
+-- 64-bit values are numbers here, exact up to 2^53.
+function stream_mt:GetU64BE()
+  local hi = self:GetU32BE()
+  local lo = self:GetU32BE()
+  return hi * 2 ^ 32 + lo
+end
+
+function stream_mt:AddU16BE(u)
+  self.data = self.data .. string.format("%c%c", band(rshift(u, 8), 0xff), band(u, 0xff))
+end
+
+function stream_mt:AddU32BE(u)
+  local s =
+    string.format(
+    "%c%c%c%c",
+    band(rshift(u, 24), 0xff),
+    band(rshift(u, 16), 0xff),
+    band(rshift(u, 8), 0xff),
+    band(u, 0xff)
+  )
+  self.data = self.data .. s
+end
+
+function stream_mt:AddU64BE(u)
+  if u < 0 then
+    u = u + 2 ^ 64
+  end
+  local hi = math.floor(u / 2 ^ 32)
+  self:AddU32BE(hi % 2 ^ 32)
+  self:AddU32BE(u - hi * 2 ^ 32)
+end
+
+-- LEB128, nil (nothing read) if the value is not complete.
+function stream_mt:GetVarUInt()
+  local value = 0
+  local scale = 1
+  for i = 0, 9 do
+    local b = string.byte(self.data, self.offset + i)
+    if not b then
+      return nil
+    end
+    value = value + (b % 128) * scale
+    if b < 128 then
+      self.offset = self.offset + i + 1
+      return value
+    end
+    scale = scale * 128
+  end
+end
+
+function stream_mt:AddVarUInt(u)
+  if u < 0 then
+    u = u + 2 ^ 64
+  end
+  local t = {}
+  repeat
+    local b = u % 128
+    u = (u - b) / 128
+    table.insert(t, string.char(u > 0 and b + 128 or b))
+  until u == 0
+  self.data = self.data .. table.concat(t)
+end
+
+-- zigzag, -1 => 1, 1 => 2.
+function stream_mt:GetVarInt()
+  local u = self:GetVarUInt()
+  if u then
+    return u % 2 == 1 and -(u + 1) / 2 or u / 2
+  end
+end
+
+function stream_mt:AddVarInt(n)
+  self:AddVarUInt(n >= 0 and n * 2 or -n * 2 - 1)
+end
+
+-- strings can't be shared here, the slice is a copy.
+function stream_mt:slice(len)
+  local available = self:available()
+  len = len or available
+  if len > available then
+    return nil
+  end
+
+  local s = string.sub(self.data, self.offset, self.offset + len - 1)
+  self.offset = self.offset + len
+  return setmetatable({data = s, offset = 1, length = len, rw = "r"}, stream_mt)
+end
+
+function stream_mt:tostring_view()
+  return string.sub(self.data, self.offset)
+end
+
+function stream_mt:crc32c(len)
+  len = len or self:available()
+  if len <= self:available() then
+    return fan.crc32c(string.sub(self.data, self.offset, self.offset + len - 1))
+  end
+end
+
+function stream_mt:crc32(len)
+  len = len or self:available()
+  if len <= self:available() then
+    return fan.crc32(string.sub(self.data, self.offset, self.offset + len - 1))
+  end
+end
+
+function stream_mt:hash64(len, seed)
+  len = len or self:available()
+  if len <= self:available() then
+    return fan.hash64(string.sub(self.data, self.offset, self.offset + len - 1), seed)
+  end
+end
+
+-- width of the array elements, read with the single value apis.
+local array_widths = {U8 = 1, U16 = 2, U24 = 3, S24 = 3, U32 = 4, D64 = 8}
+
+-- each value to its bytes, the array is joined once instead of growing
+-- self.data value by value.
+local array_packers = {
+  U8 = function(u)
+    return string.char(band(u, 0xff))
+  end,
+  U16 = function(u)
+    return string.char(band(u, 0xff), band(rshift(u, 8), 0xff))
+  end,
+  U24 = function(u)
+    return string.char(band(u, 0xff), band(rshift(u, 8), 0xff), band(rshift(u, 16), 0xff))
+  end,
+  U32 = function(u)
+    return string.char(band(u, 0xff), band(rshift(u, 8), 0xff), band(rshift(u, 16), 0xff), band(rshift(u, 24), 0xff))
+  end,
+  D64 = function(d)
+    return string.pack("<d", d)
+  end
+}
+array_packers.S24 = array_packers.U24
+
+for name, width in pairs(array_widths) do
+  local get = stream_mt["Get" .. name]
+  local pack = array_packers[name]
+
+  stream_mt["Get" .. name .. "Array"] = function(self, count)
+    if count * width > self:available() then
+      return nil
+    end
+
+    local t = {}
+    for i = 1, count do
+      t[i] = get(self)
+    end
+    return t
+  end
+
+  stream_mt["Add" .. name .. "Array"] = function(self, t, count)
+    local parts = {}
+    for i = 1, count or #t do
+      parts[i] = pack(t[i])
+    end
+    self.data = self.data .. table.concat(parts)
+  end
+end
+
 function stream_mt:package()
   return self.data
 end
@@ -236,6 +413,20 @@ local function stream_mt_new(data)
   end
 end
 
+-- no mapping here, the range is read into a string.
+local function stream_mt_mmap(path, offset, length)
+  local f, err = io.open(path, "rb")
+  if not f then
+    return nil, err
+  end
+
+  f:seek("set", offset or 0)
+  local data = length and length > 0 and f:read(length) or f:read("*a")
+  f:close()
+  return stream_mt_new(data or "")
+end
+
 return {
-  ["new"] = stream_mt_new
+  ["new"] = stream_mt_new,
+  ["mmap"] = stream_mt_mmap
 }
@@ -1,19 +1,31 @@
 local tonumber = tonumber
 
 local ffi = require("ffi")
+local bit = require("bit")
 
 ffi.cdef [[
+typedef struct {
+  int refcount;
+  uint8_t *buffer;
+  size_t buflen;
+  void (*release)(uint8_t *buffer, size_t buflen);
+} BYTEARRAY_SHARE;
+
 typedef struct {
   size_t offset;
   size_t total;
+  size_t mark;
   uint8_t *buffer;
   size_t buflen;
   bool reading;
   bool wrapbuffer;
+  bool readonly;
+  BYTEARRAY_SHARE *share;
 } BYTEARRAY;
 
 void ffi_stream_new(BYTEARRAY *ba, const char *data, size_t len);
 void ffi_stream_gc(BYTEARRAY *ba);
+int ffi_stream_mmap(BYTEARRAY *ba, const char *path, size_t offset, size_t length, const char *advice);
 size_t ffi_stream_available(BYTEARRAY *ba);
 
 bool ffi_stream_mark(BYTEARRAY *ba);
@@ -28,6 +40,8 @@ bool ffi_stream_get_u24(BYTEARRAY *ba, uint32_t *result);
 bool ffi_stream_get_d64(BYTEARRAY *ba, double *result);
 void ffi_stream_get_string(BYTEARRAY *ba, uint8_t **buff, size_t *buflen);
 void ffi_stream_get_bytes(BYTEARRAY *ba, uint8_t **buff, size_t *buflen);
+bool ffi_stream_slice(BYTEARRAY *ba, BYTEARRAY *view, size_t len);
+void ffi_stream_view(BYTEARRAY *ba, uint8_t **buff, size_t *buflen);
 
 void ffi_stream_add_u8(BYTEARRAY *ba, uint8_t value);
 void ffi_stream_add_u16(BYTEARRAY *ba, uint16_t value);
@@ -37,19 +51,51 @@ void ffi_stream_add_d64(BYTEARRAY *ba, double value);
 void ffi_stream_add_string(BYTEARRAY *ba, const char *data, size_t len);
 void ffi_stream_add_bytes(BYTEARRAY *ba, const char *data, size_t len);
 
+bool ffi_stream_get_u16be(BYTEARRAY *ba, uint16_t *result);
+bool ffi_stream_get_u32be(BYTEARRAY *ba, uint32_t *result);
+bool ffi_stream_get_u64be(BYTEARRAY *ba, uint64_t *result);
+void ffi_stream_add_u16be(BYTEARRAY *ba, uint16_t value);
+void ffi_stream_add_u32be(BYTEARRAY *ba, uint32_t value);
+void ffi_stream_add_u64be(BYTEARRAY *ba, uint64_t value);
+
+bool ffi_stream_get_varint(BYTEARRAY *ba, uint64_t *result);
+void ffi_stream_add_varint(BYTEARRAY *ba, uint64_t u);
+bool ffi_stream_get_svarint(BYTEARRAY *ba, int64_t *result);
+void ffi_stream_add_svarint(BYTEARRAY *ba, int64_t value);
+
+bool ffi_stream_get_array(BYTEARRAY *ba, int kind, double *values, size_t count);
+bool ffi_stream_add_array(BYTEARRAY *ba, int kind, const double *values, size_t count);
+
+bool ffi_stream_crc32c(BYTEARRAY *ba, size_t len, uint32_t *result);
+bool ffi_stream_crc32(BYTEARRAY *ba, size_t len, uint32_t *result);
+bool ffi_stream_hash64(BYTEARRAY *ba, size_t len, uint64_t seed, uint64_t *result);
+
 void ffi_stream_package(BYTEARRAY *ba, uint8_t **buff, size_t *buflen);
 void ffi_stream_prepare_get(BYTEARRAY *ba);
 void ffi_stream_prepare_add(BYTEARRAY *ba);
 void ffi_stream_empty(BYTEARRAY *ba);
+
+char *strerror(int errnum);
 ]]
 
 --[[
 # macosx
-gcc -fPIC -dynamiclib -shared stream_ffi.c bytearray.c -o libstream_ffi.dylib
+gcc -fPIC -dynamiclib -shared stream_ffi.c bytearray.c checksum.c -o libstream_ffi.dylib
 ]]
 local stream_ffi = ffi.load("stream_ffi")
 local bytearray_t = ffi.typeof("BYTEARRAY")
 
+local ok, table_new = pcall(require, "table.new")
+if not ok then
+  table_new = function()
+    return {}
+  end
+end
+
+-- element kinds of ffi_stream_get_array/ffi_stream_add_array.
+local array_kinds = {U8 = 0, U16 = 1, U24 = 2, S24 = 3, U32 = 4, D64 = 5}
+local double_array_t = ffi.typeof("double [?]")
+
 local stream_mt = {}
 stream_mt.__index = stream_mt
 stream_mt.__gc = stream_ffi.ffi_stream_gc
@@ -60,6 +106,15 @@ function stream_mt.new(data)
   return ba
 end
 
+function stream_mt.mmap(path, offset, length, advice)
+  local ba = ffi.new(bytearray_t)
+  local err = stream_ffi.ffi_stream_mmap(ba, path, offset or 0, length or 0, advice)
+  if err ~= 0 then
+    return nil, ffi.string(ffi.C.strerror(err))
+  end
+  return ba
+end
+
 function stream_mt:available()
   return tonumber(stream_ffi.ffi_stream_available(self))
 end
@@ -152,9 +207,9 @@ function stream_mt:GetD64()
   end
 end
 
-function stream_mt:GetBytes()
+function stream_mt:GetBytes(len)
   local buff = ffi.new("uint8_t* [1]")
-  local buflen = ffi.new("size_t [1]")
+  local buflen = ffi.new("size_t [1]", len or 0)
   stream_ffi.ffi_stream_get_bytes(self, buff, buflen)
   if buff[0] ~= ffi.NULL and buflen[0] > 0 then
     return ffi.string(buff[0], buflen[0])
@@ -172,6 +227,94 @@ function stream_mt:GetString()
   end
 end
 
+function stream_mt:GetU16BE()
+  local uint16 = ffi.new("uint16_t [1]")
+  if stream_ffi.ffi_stream_get_u16be(self, uint16) then
+    return uint16[0]
+  end
+end
+
+function stream_mt:GetU32BE()
+  local uint32 = ffi.new("uint32_t [1]")
+  if stream_ffi.ffi_stream_get_u32be(self, uint32) then
+    return uint32[0]
+  end
+end
+
+-- 64-bit values are returned as numbers, exact up to 2^53.
+function stream_mt:GetU64BE()
+  local uint64 = ffi.new("uint64_t [1]")
+  if stream_ffi.ffi_stream_get_u64be(self, uint64) then
+    return tonumber(uint64[0])
+  end
+end
+
+function stream_mt:GetVarInt()
+  local int64 = ffi.new("int64_t [1]")
+  if stream_ffi.ffi_stream_get_svarint(self, int64) then
+    return tonumber(int64[0])
+  end
+end
+
+function stream_mt:GetVarUInt()
+  local uint64 = ffi.new("uint64_t [1]")
+  if stream_ffi.ffi_stream_get_varint(self, uint64) then
+    return tonumber(uint64[0])
+  end
+end
+
+function stream_mt:slice(len)
+  local view = ffi.new(bytearray_t)
+  if stream_ffi.ffi_stream_slice(self, view, len or self:available()) then
+    return view
+  end
+end
+
+function stream_mt:tostring_view()
+  local buff = ffi.new("uint8_t* [1]")
+  local buflen = ffi.new("size_t [1]")
+  stream_ffi.ffi_stream_view(self, buff, buflen)
+  if buff[0] ~= ffi.NULL and buflen[0] > 0 then
+    return ffi.string(buff[0], buflen[0])
+  else
+    return ""
+  end
+end
+
+function stream_mt:crc32c(len)
+  local uint32 = ffi.new("uint32_t [1]")
+  if stream_ffi.ffi_stream_crc32c(self, len or self:available(), uint32) then
+    return tonumber(uint32[0])
+  end
+end
+
+function stream_mt:crc32(len)
+  local uint32 = ffi.new("uint32_t [1]")
+  if stream_ffi.ffi_stream_crc32(self, len or self:available(), uint32) then
+    return tonumber(uint32[0])
+  end
+end
+
+-- a hash64 is a 16 digit hex string on luajit, as with the core stream,
+-- a number would drop its low bits.
+local function hex_to_uint64(hex)
+  if #hex == 0 or #hex > 16 or not hex:find("^%x+$") then
+    error("hex seed expected.", 3)
+  end
+  hex = string.rep("0", 16 - #hex) .. hex
+  return ffi.new("uint64_t", tonumber(hex:sub(1, 8), 16)) * 4294967296 + tonumber(hex:sub(9), 16)
+end
+
+function stream_mt:hash64(len, seed)
+  local uint64 = ffi.new("uint64_t [1]")
+  if type(seed) == "string" then
+    seed = hex_to_uint64(seed)
+  end
+  if stream_ffi.ffi_stream_hash64(self, len or self:available(), seed or 0, uint64) then
+    return bit.tohex(uint64[0], 16)
+  end
+end
+
 function stream_mt:AddU8(u)
   stream_ffi.ffi_stream_add_u8(self, u)
 end
@@ -200,6 +343,26 @@ function stream_mt:AddABCS32(u)
   stream_ffi.ffi_stream_add_u30(self, u)
 end
 
+function stream_mt:AddU16BE(u)
+  stream_ffi.ffi_stream_add_u16be(self, u)
+end
+
+function stream_mt:AddU32BE(u)
+  stream_ffi.ffi_stream_add_u32be(self, u)
+end
+
+function stream_mt:AddU64BE(u)
+  stream_ffi.ffi_stream_add_u64be(self, u)
+end
+
+function stream_mt:AddVarInt(u)
+  stream_ffi.ffi_stream_add_svarint(self, u)
+end
+
+function stream_mt:AddVarUInt(u)
+  stream_ffi.ffi_stream_add_varint(self, u)
+end
+
 function stream_mt:AddD64(u)
   stream_ffi.ffi_stream_add_d64(self, u)
 end
@@ -212,8 +375,31 @@ function stream_mt:AddString(u)
   stream_ffi.ffi_stream_add_string(self, u, #u)
 end
 
+for name, kind in pairs(array_kinds) do
+  stream_mt["Get" .. name .. "Array"] = function(self, count)
+    local values = double_array_t(count)
+    if stream_ffi.ffi_stream_get_array(self, kind, values, count) then
+      local t = table_new(count, 0)
+      for i = 1, count do
+        t[i] = values[i - 1]
+      end
+      return t
+    end
+  end
+
+  stream_mt["Add" .. name .. "Array"] = function(self, t, count)
+    count = count or #t
+    local values = double_array_t(count)
+    for i = 1, count do
+      values[i - 1] = t[i]
+    end
+    stream_ffi.ffi_stream_add_array(self, kind, values, count)
+  end
+end
+
 ffi.metatype(bytearray_t, stream_mt)
 
 return {
-  new = stream_mt.new
+  new = stream_mt.new,
+  mmap = stream_mt.mmap
 }
@@ -27,6 +27,54 @@ else
     end
 end
 
+-- ffi/bit streams run the format through string.unpack/string.pack.
+if not stream.compile_format then
+    if not string.pack then
+        pcall(require, "compat53")
+    end
+
+    local unpack = table.unpack or unpack
+    local formats = setmetatable({}, {__mode = "v"})
+
+    local format_mt = {}
+    format_mt.__index = format_mt
+
+    function format_mt:unpack(input)
+        local values = {pcall(string.unpack, self.fmt, input:tostring_view())}
+        if not values[1] then
+            return nil
+        end
+
+        local pos = table.remove(values)
+        if pos > 1 then
+            input:GetBytes(pos - 1)
+        end
+        return unpack(values, 2)
+    end
+
+    function format_mt:pack(output, ...)
+        output:AddBytes(string.pack(self.fmt, ...))
+    end
+
+    function format_mt:size()
+        local st, size = pcall(string.packsize, self.fmt)
+        if st then
+            return size
+        end
+    end
+
+    stream.compile_format = function(fmt)
+        local format = formats[fmt]
+        if not format then
+            -- raise on bad formats, variable strings have no size.
+            string.packsize((fmt:gsub("[sz]%d*", "")))
+            format = setmetatable({fmt = fmt}, format_mt)
+            formats[fmt] = format
+        end
+        return format
+    end
+end
+
 local test = stream.new()
 local mt = getmetatable(test)
 
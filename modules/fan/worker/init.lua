@@ -106,10 +106,19 @@ end
 
 local function new(funcmap, slavecount, max_job_count, url)
   local samehost = false
+  if not url and config.worker_using_shm then
+    url = "shm:"
+  end
+
   if not url then
     local fifoname = connector.tmpfifoname()
     url = "fifo:" .. fifoname
     samehost = true
+  elseif url == "shm:" then
+    -- one ring per slave, shared through fork.
+    url = string.format("shm:worker-%d", fan.getpid())
+    connector.prepare(url, slavecount)
+    samehost = true
   end
 
   local master = slavecount == 0
@@ -196,6 +205,12 @@ local function new(funcmap, slavecount, max_job_count, url)
         end
 
         local last_expect = 1
+        -- results are fed to the decoder as they arrive, a large result is
+        -- never held as a whole string.
+        local decoder = objectbuf.decoder and objectbuf.decoder()
+        local body_left
+        local decoded
+        local failure
 
         while true do
           local input = apt:receive(last_expect)
@@ -203,10 +218,55 @@ local function new(funcmap, slavecount, max_job_count, url)
             break
           end
 
-          local str, expect = input:GetString()
-          if str then
+          local args, expect
+          if decoder then
+            if not body_left then
+              input:mark()
+              body_left = input:GetU30()
+              if not body_left then
+                input:reset()
+                expect = input:available() + 1
+              end
+            end
+
+            if body_left then
+              local n = math.min(body_left, input:available())
+              -- a slice of the core stream is decoded in place.
+              local chunk = input:slice(n)
+              if type(chunk) ~= "userdata" then
+                chunk = chunk:tostring_view()
+              end
+              local done, obj = decoder:feed(chunk)
+              body_left = body_left - n
+              if done then
+                decoded = obj
+              elseif done == nil then
+                -- the task key is lost with the result, the stream can't be
+                -- trusted anymore: drop the slave, its waiters fail below.
+                failure = obj
+                apt:close()
+                break
+              end
+
+              if body_left == 0 then
+                args = decoded
+                body_left = nil
+                decoded = nil
+                decoder:reset()
+              else
+                expect = 1
+              end
+            end
+          else
+            local str
+            str, expect = input:GetString()
+            if str then
+              args = objectbuf.decode(str)
+            end
+          end
+
+          if args then
             last_expect = 1
-            local args = objectbuf.decode(str)
 
             if apt.task_map[args[1]] then
               local running = apt.task_map[args[1]]
@@ -220,16 +280,16 @@ local function new(funcmap, slavecount, max_job_count, url)
             end
 
             obj.loadbalance:telldone(apt)
-          else
+          elseif expect then
             -- print(pid, "not enough, expect", expect)
             last_expect = expect
           end
         end
 
         for task_key, co in pairs(apt.task_map) do
-          if coroutine.status(co) == "suspended" then
+          if type(co) == "thread" and coroutine.status(co) == "suspended" then
             apt.status = "dead"
-            assert(coroutine.resume(co, false, "slave dead."))
+            assert(coroutine.resume(co, false, failure or "slave dead."))
           end
         end
       end
@@ -266,12 +326,22 @@ local function new(funcmap, slavecount, max_job_count, url)
     -- local f1 = fan.open("/dev/null")
     -- local f2 = fan.open("/dev/null")
 
+    -- a shm channel is created before fork, it can't be opened again once
+    -- lost, the slave quits instead of reconnecting.
+    local reconnect = not url:find("^shm:")
+
     fan.loop(
       function()
         while true do
           while not cli do
             fan.sleep(0.1)
-            cli = connector.connect(url)
+            local err
+            cli, err = connector.connect(url, {index = slave_index})
+            if not cli and not reconnect then
+              print(err)
+              fan.loopbreak()
+              return
+            end
           end
 
           local last_expect = 1
@@ -325,6 +395,11 @@ local function new(funcmap, slavecount, max_job_count, url)
             cli = nil
           end
 
+          if not reconnect then
+            fan.loopbreak()
+            return
+          end
+
           fan.sleep(1)
         end
       end
@@ -4,36 +4,28 @@
 #include <stdlib.h>
 
 #define WRITE_VALUE(type)                                \
-  while (ba->total - ba->offset < sizeof(type))          \
+  if (ba->readonly)                                      \
   {                                                      \
-    if (!ba->wrapbuffer)                                 \
-    {                                                    \
-      ba->buflen += ba->buflen;                          \
-      ba->total = ba->buflen;                            \
-      ba->buffer = realloc(ba->buffer, ba->buflen);      \
-    }                                                    \
-    else                                                 \
-    {                                                    \
-      return false;                                      \
-    }                                                    \
+    return false;                                        \
+  }                                                      \
+  if (ba->total - ba->offset < sizeof(type) &&           \
+      !bytearray_reserve(ba, sizeof(type)))              \
+  {                                                      \
+    return false;                                        \
   }                                                      \
   memcpy(ba->buffer + ba->offset, &value, sizeof(type)); \
   ba->offset += sizeof(type);                            \
   return true;
 
 #define WRITE_STRING(type)                                     \
-  while (ba->total - ba->offset < length + sizeof(type))       \
+  if (ba->readonly)                                            \
+  {                                                            \
+    return false;                                              \
+  }                                                            \
+  if (ba->total - ba->offset < length + sizeof(type) &&        \
+      !bytearray_reserve(ba, length + sizeof(type)))           \
   {                                                            \
-    if (!ba->wrapbuffer)                                       \
-    {                                                          \
-      ba->buflen += ba->buflen;                                \
-      ba->total = ba->buflen;                                  \
-      ba->buffer = realloc(ba->buffer, ba->buflen);            \
-    }                                                          \
-    else                                                       \
-    {                                                          \
-      return false;                                            \
-    }                                                          \
+    return false;                                              \
   }                                                            \
   memcpy(ba->buffer + ba->offset, &length, sizeof(type));      \
   memcpy(ba->buffer + ba->offset + sizeof(type), str, length); \
@@ -66,28 +58,182 @@
   *count = readLen;                                             \
   return true;
 
+#if defined(__GNUC__) || defined(__clang__)
+#define BYTEARRAY_THREAD_LOCAL __thread
+#else
+#define BYTEARRAY_THREAD_LOCAL
+#endif
+
+// buffers up to BYTEARRAY_POOL_MAX are rounded up to a power of 2 and kept in
+// a free list per size on release, most of them only live for one callback.
+#define BYTEARRAY_POOL_MIN_SHIFT 6
+#define BYTEARRAY_POOL_MAX_SHIFT 16
+#define BYTEARRAY_POOL_MIN (1 << BYTEARRAY_POOL_MIN_SHIFT)
+#define BYTEARRAY_POOL_MAX (1 << BYTEARRAY_POOL_MAX_SHIFT)
+#define BYTEARRAY_POOL_CLASSES \
+  (BYTEARRAY_POOL_MAX_SHIFT - BYTEARRAY_POOL_MIN_SHIFT + 1)
+// buffers kept per size.
+#define BYTEARRAY_POOL_DEPTH 16
+
+typedef struct bytearray_pool_node
+{
+  struct bytearray_pool_node *next;
+} BYTEARRAY_POOL_NODE;
+
+static BYTEARRAY_THREAD_LOCAL BYTEARRAY_POOL_NODE
+    *bytearray_pool[BYTEARRAY_POOL_CLASSES];
+static BYTEARRAY_THREAD_LOCAL uint32_t
+    bytearray_pool_depth[BYTEARRAY_POOL_CLASSES];
+static BYTEARRAY_THREAD_LOCAL BYTEARRAY_STATS bytearray_stat;
+
+// size class of size, -1 if it's bigger than the pool.
+static int bytearray_class(size_t size)
+{
+  if (size > BYTEARRAY_POOL_MAX)
+  {
+    return -1;
+  }
+
+  int index = 0;
+  size_t class_size = BYTEARRAY_POOL_MIN;
+  while (class_size < size)
+  {
+    class_size <<= 1;
+    index++;
+  }
+  return index;
+}
+
+static size_t bytearray_class_size(size_t size)
+{
+  int index = bytearray_class(size);
+  return index < 0 ? size : (size_t)BYTEARRAY_POOL_MIN << index;
+}
+
+// size must be a value returned by bytearray_class_size.
+static uint8_t *bytearray_pool_get(size_t size)
+{
+  int index = bytearray_class(size);
+  if (index >= 0 && bytearray_pool[index])
+  {
+    BYTEARRAY_POOL_NODE *node = bytearray_pool[index];
+    bytearray_pool[index] = node->next;
+    bytearray_pool_depth[index]--;
+
+    bytearray_stat.pool_hit_count++;
+    bytearray_stat.pooled_count--;
+    bytearray_stat.pooled_bytes -= size;
+    return (uint8_t *)node;
+  }
+
+  bytearray_stat.alloc_count++;
+  return malloc(size);
+}
+
+static void bytearray_pool_put(uint8_t *buffer, size_t size)
+{
+  int index = bytearray_class(size);
+  if (index >= 0 && ((size_t)BYTEARRAY_POOL_MIN << index) == size &&
+      bytearray_pool_depth[index] < BYTEARRAY_POOL_DEPTH)
+  {
+    BYTEARRAY_POOL_NODE *node = (BYTEARRAY_POOL_NODE *)buffer;
+    node->next = bytearray_pool[index];
+    bytearray_pool[index] = node;
+    bytearray_pool_depth[index]++;
+
+    bytearray_stat.pooled_count++;
+    bytearray_stat.pooled_bytes += size;
+    return;
+  }
+
+  bytearray_stat.free_count++;
+  free(buffer);
+}
+
+void bytearray_stats(BYTEARRAY_STATS *stats)
+{
+  *stats = bytearray_stat;
+}
+
+static void bytearray_share_release(BYTEARRAY_SHARE *share)
+{
+  share->refcount--;
+  if (share->refcount == 0)
+  {
+    if (share->release)
+    {
+      share->release(share->buffer, share->buflen);
+    }
+    else
+    {
+      bytearray_pool_put(share->buffer, share->buflen);
+    }
+    free(share);
+  }
+}
+
+// take a private buffer before changing it in place, keeping count bytes,
+// the slices hold on to the old one.
+static bool bytearray_unshare(BYTEARRAY *ba, size_t count)
+{
+  BYTEARRAY_SHARE *share = ba->share;
+  if (share->refcount > 1)
+  {
+    uint8_t *buffer = bytearray_pool_get(ba->buflen);
+    if (!buffer)
+    {
+      return false;
+    }
+    memcpy(buffer, ba->buffer, count);
+    ba->buffer = buffer;
+  }
+
+  ba->share = NULL;
+  if (share->refcount > 1)
+  {
+    share->refcount--;
+  }
+  else
+  {
+    free(share);
+  }
+  return true;
+}
+
 bool bytearray_alloc(BYTEARRAY *ba, uint32_t length)
 {
   if (length == 0)
   {
     length = 64;
   }
-  ba->buffer = realloc(NULL, length);
+  length = bytearray_class_size(length);
+  ba->buffer = bytearray_pool_get(length);
   ba->offset = 0;
-  ba->total = length;
-  ba->buflen = length;
+  ba->total = ba->buffer ? length : 0;
+  ba->buflen = ba->total;
+  ba->mark = 0;
   ba->wrapbuffer = false;
   ba->reading = false;
+  ba->readonly = false;
+  ba->share = NULL;
 
-  return true;
+  return ba->buffer != NULL;
 }
 
 bool bytearray_dealloc(BYTEARRAY *ba)
 {
-  if (!ba->wrapbuffer)
+  if (ba->share)
   {
-    free(ba->buffer);
+    bytearray_share_release(ba->share);
+    ba->share = NULL;
     ba->buffer = NULL;
+    ba->buflen = 0;
+  }
+  else if (!ba->wrapbuffer && ba->buffer)
+  {
+    bytearray_pool_put(ba->buffer, ba->buflen);
+    ba->buffer = NULL;
+    ba->buflen = 0;
   }
 
   ba->offset = 0;
@@ -95,15 +241,148 @@ bool bytearray_dealloc(BYTEARRAY *ba)
   return true;
 }
 
+bool bytearray_reserve(BYTEARRAY *ba, size_t length)
+{
+  if (ba->total - ba->offset >= length)
+  {
+    return true;
+  }
+  if (ba->wrapbuffer || ba->readonly)
+  {
+    return false;
+  }
+
+  // grow at least twice, keeps appending many small pieces linear.
+  size_t size = ba->buflen * 2;
+  if (size < ba->offset + length)
+  {
+    size = ba->offset + length;
+  }
+  size = bytearray_class_size(size);
+
+  uint8_t *buffer = NULL;
+  if (ba->share)
+  {
+    // the old buffer stays with the slices.
+    buffer = bytearray_pool_get(size);
+    if (buffer)
+    {
+      memcpy(buffer, ba->buffer, ba->offset);
+      bytearray_share_release(ba->share);
+      ba->share = NULL;
+    }
+  }
+  else if (bytearray_class(size) >= 0)
+  {
+    buffer = bytearray_pool_get(size);
+    if (buffer && ba->buffer)
+    {
+      memcpy(buffer, ba->buffer, ba->buflen);
+      bytearray_pool_put(ba->buffer, ba->buflen);
+    }
+  }
+  else
+  {
+    buffer = realloc(ba->buffer, size);
+  }
+
+  if (!buffer)
+  {
+    return false;
+  }
+
+  bytearray_stat.grow_count++;
+  ba->buffer = buffer;
+  ba->buflen = size;
+  ba->total = size;
+  return true;
+}
+
+uint8_t *bytearray_write_space(BYTEARRAY *ba, size_t length)
+{
+  if (ba->readonly || !bytearray_reserve(ba, length))
+  {
+    return NULL;
+  }
+  return ba->buffer + ba->offset;
+}
+
 bool bytearray_wrap_buffer(BYTEARRAY *ba, uint8_t *buff, uint32_t length)
 {
   ba->buffer = buff;
   ba->total = length;
   ba->offset = 0;
   ba->buflen = length;
+  ba->mark = 0;
   ba->reading = true;
   ba->wrapbuffer = true;
+  ba->readonly = false;
+  ba->share = NULL;
+
+  return true;
+}
+
+bool bytearray_wrap_owned(BYTEARRAY *ba, uint8_t *buff, size_t length,
+                          uint8_t *base, size_t baselen,
+                          void (*release)(uint8_t *buffer, size_t buflen))
+{
+  BYTEARRAY_SHARE *share = malloc(sizeof(BYTEARRAY_SHARE));
+  if (!share)
+  {
+    return false;
+  }
+  share->refcount = 1;
+  share->buffer = base;
+  share->buflen = baselen;
+  share->release = release;
+
+  bytearray_wrap_buffer(ba, buff, 0);
+  ba->total = length;
+  ba->buflen = length;
+  ba->readonly = true;
+  ba->share = share;
+  return true;
+}
+
+bool bytearray_slice(BYTEARRAY *ba, BYTEARRAY *view, size_t length)
+{
+  if (ba == NULL || ba->buffer == NULL || !ba->reading ||
+      ba->total - ba->offset < length)
+  {
+    return false;
+  }
+
+  if (!ba->share)
+  {
+    // memory wrapped by the caller may go away under the slice.
+    if (ba->wrapbuffer)
+    {
+      return false;
+    }
+
+    ba->share = malloc(sizeof(BYTEARRAY_SHARE));
+    if (!ba->share)
+    {
+      return false;
+    }
+    ba->share->refcount = 1;
+    ba->share->buffer = ba->buffer;
+    ba->share->buflen = ba->buflen;
+    ba->share->release = NULL;
+  }
 
+  ba->share->refcount++;
+  view->buffer = ba->buffer + ba->offset;
+  view->offset = 0;
+  view->total = length;
+  view->buflen = length;
+  view->mark = 0;
+  view->reading = true;
+  view->wrapbuffer = true;
+  view->readonly = true;
+  view->share = ba->share;
+
+  ba->offset += length;
   return true;
 }
 
@@ -152,8 +431,12 @@ bool bytearray_reset(BYTEARRAY *ba)
 
 bool bytearray_empty(BYTEARRAY *ba)
 {
-  if (ba != NULL)
+  if (ba != NULL && !ba->readonly)
   {
+    if (ba->share && !bytearray_unshare(ba, 0))
+    {
+      return false;
+    }
     ba->offset = 0;
     ba->total = 0;
     return true;
@@ -163,11 +446,31 @@ bool bytearray_empty(BYTEARRAY *ba)
 
 bool bytearray_write_ready(BYTEARRAY *ba)
 {
-  if (ba == NULL || !ba->reading || ba->buffer == NULL)
+  if (ba == NULL || !ba->reading || ba->buffer == NULL || ba->readonly)
   {
     return false;
   }
-  if (ba->offset > 0)
+  if (ba->share)
+  {
+    // only the unread part is kept, copied from the shared buffer.
+    uint8_t *shared = ba->buffer;
+    size_t unreadleft = ba->total - ba->offset;
+    if (!bytearray_unshare(ba, 0))
+    {
+      return false;
+    }
+
+    if (ba->buffer != shared)
+    {
+      memcpy(ba->buffer, shared + ba->offset, unreadleft);
+    }
+    else
+    {
+      memmove(ba->buffer, shared + ba->offset, unreadleft);
+    }
+    ba->offset = unreadleft;
+  }
+  else if (ba->offset > 0)
   {
     size_t unreadleft = ba->total - ba->offset;
     uint8_t *buf = ba->buffer;
@@ -215,11 +518,13 @@ bool bytearray_write64d(BYTEARRAY *ba, const double value)
 bool bytearray_writebuffer(BYTEARRAY *ba, const void *buff,
                            const size_t length)
 {
-  if (ba->total - ba->offset < length)
+  if (ba->readonly)
   {
-    ba->total = length + ba->offset;
-    ba->buflen = ba->total;
-    ba->buffer = realloc(ba->buffer, ba->buflen);
+    return false;
+  }
+  if (ba->total - ba->offset < length && !bytearray_reserve(ba, length))
+  {
+    return false;
   }
   memcpy(ba->buffer + ba->offset, buff, length);
   ba->offset += length;
@@ -9,6 +9,16 @@
 #include <stdbool.h>
 #endif
 
+// buffer shared by a stream and its slices, freed with the last of them.
+typedef struct
+{
+  int refcount;
+  uint8_t *buffer;
+  size_t buflen;
+  // frees buffer if it's not from the pool, e.g. munmap.
+  void (*release)(uint8_t *buffer, size_t buflen);
+} BYTEARRAY_SHARE;
+
 typedef struct
 {
   size_t offset;
@@ -18,11 +28,46 @@ typedef struct
   size_t buflen;
   bool reading;
   bool wrapbuffer;
+  // slices can't be written.
+  bool readonly;
+  BYTEARRAY_SHARE *share;
 } BYTEARRAY;
 
+// allocation counters of the current thread.
+typedef struct
+{
+  // buffers from malloc.
+  size_t alloc_count;
+  // buffers reused from the pool.
+  size_t pool_hit_count;
+  // buffers grown on write or reserve.
+  size_t grow_count;
+  // buffers released to free.
+  size_t free_count;
+  // buffers kept in the pool right now.
+  size_t pooled_count;
+  size_t pooled_bytes;
+} BYTEARRAY_STATS;
+
 bool bytearray_alloc(BYTEARRAY *ba, uint32_t length);
 bool bytearray_dealloc(BYTEARRAY *ba);
 bool bytearray_wrap_buffer(BYTEARRAY *ba, uint8_t *buff, uint32_t length);
+// read-only wrap of buff inside base, release(base, baselen) is called once
+// ba and all its slices are gone.
+bool bytearray_wrap_owned(BYTEARRAY *ba, uint8_t *buff, size_t length,
+                          uint8_t *base, size_t baselen,
+                          void (*release)(uint8_t *buffer, size_t buflen));
+
+// make room for length more bytes to write.
+bool bytearray_reserve(BYTEARRAY *ba, size_t length);
+// room for length bytes at the write offset, NULL if it can't grow, the
+// caller fills it and moves the offset.
+uint8_t *bytearray_write_space(BYTEARRAY *ba, size_t length);
+void bytearray_stats(BYTEARRAY_STATS *stats);
+
+// move length bytes at the read offset to view without copying, view shares
+// the buffer and stays valid after ba is changed or released.
+bool bytearray_slice(BYTEARRAY *ba, BYTEARRAY *view, size_t length);
 
 bool bytearray_read_ready(BYTEARRAY *ba);
 bool bytearray_write_ready(BYTEARRAY *ba);
@@ -0,0 +1,287 @@
+#include "checksum.h"
+#include <memory.h>
+
+#if defined(__GNUC__) || defined(__clang__)
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CHECKSUM_SSE42 1
+#endif
+#endif
+
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78
+#define CRC32_POLY 0xedb88320
+
+// slicing-by-8 tables of the portable path, built on first use.
+static uint32_t crc32c_table[8][256];
+static uint32_t crc32_table[8][256];
+static volatile int crc_table_ready;
+
+static void crc_table_init(uint32_t table[8][256], uint32_t poly)
+{
+  uint32_t i = 0;
+  for (; i < 256; i++)
+  {
+    uint32_t crc = i;
+    int k = 0;
+    for (; k < 8; k++)
+    {
+      crc = (crc >> 1) ^ (poly & (0 - (crc & 1)));
+    }
+    table[0][i] = crc;
+  }
+
+  for (i = 0; i < 256; i++)
+  {
+    uint32_t crc = table[0][i];
+    int k = 1;
+    for (; k < 8; k++)
+    {
+      crc = table[0][crc & 0xff] ^ (crc >> 8);
+      table[k][i] = crc;
+    }
+  }
+}
+
+static void crc_tables(void)
+{
+  // racing threads build the same values.
+  if (!crc_table_ready)
+  {
+    crc_table_init(crc32c_table, CRC32C_POLY);
+    crc_table_init(crc32_table, CRC32_POLY);
+    crc_table_ready = 1;
+  }
+}
+
+static uint32_t crc_slice8(uint32_t table[8][256], uint32_t crc,
+                           const uint8_t *p, size_t len)
+{
+  while (len >= 8)
+  {
+    uint32_t lo = 0;
+    uint32_t hi = 0;
+    memcpy(&lo, p, 4);
+    memcpy(&hi, p + 4, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    lo = __builtin_bswap32(lo);
+    hi = __builtin_bswap32(hi);
+#endif
+    lo ^= crc;
+    crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^
+          table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+          table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^
+          table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+    p += 8;
+    len -= 8;
+  }
+
+  while (len--)
+  {
+    crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#ifdef CHECKSUM_SSE42
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len)
+{
+#if defined(__x86_64__)
+  uint64_t crc64 = crc;
+  while (len >= 8)
+  {
+    uint64_t v = 0;
+    memcpy(&v, p, 8);
+    crc64 = _mm_crc32_u64(crc64, v);
+    p += 8;
+    len -= 8;
+  }
+  crc = (uint32_t)crc64;
+#endif
+  while (len >= 4)
+  {
+    uint32_t v = 0;
+    memcpy(&v, p, 4);
+    crc = _mm_crc32_u32(crc, v);
+    p += 4;
+    len -= 4;
+  }
+  while (len--)
+  {
+    crc = _mm_crc32_u8(crc, *p++);
+  }
+  return crc;
+}
+
+static int crc32c_sse42_supported(void)
+{
+  static int supported = -1;
+  if (supported < 0)
+  {
+    __builtin_cpu_init();
+    supported = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+  }
+  return supported;
+}
+#endif
+
+uint32_t checksum_crc32c(uint32_t crc, const void *data, size_t len)
+{
+  const uint8_t *p = data;
+  crc = ~crc;
+
+#if defined(__ARM_FEATURE_CRC32)
+  while (len >= 8)
+  {
+    uint64_t v = 0;
+    memcpy(&v, p, 8);
+    crc = __crc32cd(crc, v);
+    p += 8;
+    len -= 8;
+  }
+  while (len--)
+  {
+    crc = __crc32cb(crc, *p++);
+  }
+  return ~crc;
+#else
+#ifdef CHECKSUM_SSE42
+  if (crc32c_sse42_supported())
+  {
+    return ~crc32c_sse42(crc, p, len);
+  }
+#endif
+  crc_tables();
+  return ~crc_slice8(crc32c_table, crc, p, len);
+#endif
+}
+
+uint32_t checksum_crc32(uint32_t crc, const void *data, size_t len)
+{
+  const uint8_t *p = data;
+  crc = ~crc;
+
+#if defined(__ARM_FEATURE_CRC32)
+  while (len >= 8)
+  {
+    uint64_t v = 0;
+    memcpy(&v, p, 8);
+    crc = __crc32d(crc, v);
+    p += 8;
+    len -= 8;
+  }
+  while (len--)
+  {
+    crc = __crc32b(crc, *p++);
+  }
+  return ~crc;
+#else
+  crc_tables();
+  return ~crc_slice8(crc32_table, crc, p, len);
+#endif
+}
+
+#define XXH_PRIME64_1 0x9e3779b185ebca87ULL
+#define XXH_PRIME64_2 0xc2b2ae3d27d4eb4fULL
+#define XXH_PRIME64_3 0x165667b19e3779f9ULL
+#define XXH_PRIME64_4 0x85ebca77c2b2ca63ULL
+#define XXH_PRIME64_5 0x27d4eb2f165667c5ULL
+
+#define XXH_ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+// little-endian reads, the hash is the same on every host.
+static uint64_t xxh_read64(const uint8_t *p)
+{
+  uint64_t v = 0;
+  int i = 0;
+  for (; i < 8; i++)
+  {
+    v |= (uint64_t)p[i] << (i * 8);
+  }
+  return v;
+}
+
+static uint32_t xxh_read32(const uint8_t *p)
+{
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+  acc += input * XXH_PRIME64_2;
+  acc = XXH_ROTL64(acc, 31);
+  return acc * XXH_PRIME64_1;
+}
+
+static uint64_t xxh_merge(uint64_t acc, uint64_t val)
+{
+  acc ^= xxh_round(0, val);
+  return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+uint64_t checksum_hash64(const void *data, size_t len, uint64_t seed)
+{
+  const uint8_t *p = data;
+  const uint8_t *end = p + len;
+  uint64_t h = 0;
+
+  if (len >= 32)
+  {
+    uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+    uint64_t v2 = seed + XXH_PRIME64_2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - XXH_PRIME64_1;
+
+    while (end - p >= 32)
+    {
+      v1 = xxh_round(v1, xxh_read64(p));
+      v2 = xxh_round(v2, xxh_read64(p + 8));
+      v3 = xxh_round(v3, xxh_read64(p + 16));
+      v4 = xxh_round(v4, xxh_read64(p + 24));
+      p += 32;
+    }
+
+    h = XXH_ROTL64(v1, 1) + XXH_ROTL64(v2, 7) + XXH_ROTL64(v3, 12) +
+        XXH_ROTL64(v4, 18);
+    h = xxh_merge(h, v1);
+    h = xxh_merge(h, v2);
+    h = xxh_merge(h, v3);
+    h = xxh_merge(h, v4);
+  }
+  else
+  {
+    h = seed + XXH_PRIME64_5;
+  }
+
+  h += (uint64_t)len;
+
+  while (end - p >= 8)
+  {
+    h ^= xxh_round(0, xxh_read64(p));
+    h = XXH_ROTL64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    p += 8;
+  }
+  if (end - p >= 4)
+  {
+    h ^= (uint64_t)xxh_read32(p) * XXH_PRIME64_1;
+    h = XXH_ROTL64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+    p += 4;
+  }
+  while (p < end)
+  {
+    h ^= (*p++) * XXH_PRIME64_5;
+    h = XXH_ROTL64(h, 11) * XXH_PRIME64_1;
+  }
+
+  h ^= h >> 33;
+  h *= XXH_PRIME64_2;
+  h ^= h >> 29;
+  h *= XXH_PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
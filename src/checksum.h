@@ -0,0 +1,15 @@
+#ifndef checksum_h
+#define checksum_h
+
+#include <inttypes.h>
+#include <stddef.h>
+
+// crc of data continued from crc, 0 to start, zlib compatible convention.
+// crc32c (castagnoli) uses sse4.2/armv8 crc instructions when available.
+uint32_t checksum_crc32c(uint32_t crc, const void *data, size_t len);
+uint32_t checksum_crc32(uint32_t crc, const void *data, size_t len);
+
+// xxhash64 of data.
+uint64_t checksum_hash64(const void *data, size_t len, uint64_t seed);
+
+#endif
@@ -0,0 +1,387 @@
+#include "codec.h"
+#include <memory.h>
+
+#if defined(__GNUC__) || defined(__clang__)
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#define CODEC_SSSE3 1
+#endif
+#endif
+
+static const char hex_upper[] = "0123456789ABCDEF";
+static const char hex_lower[] = "0123456789abcdef";
+
+static const char base64_std[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const char base64_url[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+// sextet of each char, -1 if invalid, built on first use.
+static int8_t base64_std_value[256];
+static int8_t base64_url_value[256];
+static volatile int base64_table_ready;
+
+static void base64_table_init(int8_t *table, const char *alphabet)
+{
+  int i = 0;
+  memset(table, -1, 256);
+  for (; i < 64; i++)
+  {
+    table[(uint8_t)alphabet[i]] = i;
+  }
+}
+
+static void base64_tables(void)
+{
+  // racing threads build the same values.
+  if (!base64_table_ready)
+  {
+    base64_table_init(base64_std_value, base64_std);
+    base64_table_init(base64_url_value, base64_url);
+    base64_table_ready = 1;
+  }
+}
+
+static inline int hex_value(uint8_t c)
+{
+  if ((unsigned)(c - '0') < 10)
+  {
+    return c - '0';
+  }
+  c |= 0x20;
+  if ((unsigned)(c - 'a') < 6)
+  {
+    return c - 'a' + 10;
+  }
+  return -1;
+}
+
+#ifdef CODEC_SSSE3
+static int codec_ssse3_supported(void)
+{
+  static int supported = -1;
+  if (supported < 0)
+  {
+    __builtin_cpu_init();
+    supported = __builtin_cpu_supports("ssse3") ? 1 : 0;
+  }
+  return supported;
+}
+
+// 0xff where lo <= c <= hi.
+#define CODEC_IN_RANGE(c, lo, hi)                                    \
+  _mm_cmpeq_epi8(_mm_min_epu8(_mm_sub_epi8(c, _mm_set1_epi8(lo)),    \
+                              _mm_set1_epi8((char)((hi) - (lo)))),   \
+                 _mm_sub_epi8(c, _mm_set1_epi8(lo)))
+
+// 16 bytes to 32 digits per round, return bytes consumed.
+__attribute__((target("ssse3"))) static size_t
+hex_encode_ssse3(const uint8_t *src, size_t len, char *dst, const char *digits)
+{
+  const __m128i lut = _mm_loadu_si128((const __m128i *)digits);
+  const __m128i mask = _mm_set1_epi8(0x0f);
+  size_t i = 0;
+
+  for (; i + 16 <= len; i += 16)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i hi = _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(v, 4), mask));
+    __m128i lo = _mm_shuffle_epi8(lut, _mm_and_si128(v, mask));
+    _mm_storeu_si128((__m128i *)(dst + i * 2), _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128((__m128i *)(dst + i * 2 + 16), _mm_unpackhi_epi8(hi, lo));
+  }
+  return i;
+}
+
+// nibbles of 16 digits, false if one is not a hex digit.
+__attribute__((target("ssse3"))) static inline bool
+hex_nibbles_ssse3(__m128i c, __m128i *result)
+{
+  __m128i digit = CODEC_IN_RANGE(c, '0', '9');
+  __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+  __m128i letter = CODEC_IN_RANGE(lower, 'a', 'f');
+
+  if (_mm_movemask_epi8(_mm_or_si128(digit, letter)) != 0xffff)
+  {
+    return false;
+  }
+
+  *result = _mm_or_si128(
+      _mm_and_si128(digit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+      _mm_and_si128(letter, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10))));
+  return true;
+}
+
+// 32 digits to 16 bytes per round, return bytes written, -1 if invalid.
+__attribute__((target("ssse3"))) static ptrdiff_t
+hex_decode_ssse3(const char *src, size_t count, uint8_t *dst)
+{
+  // high nibble * 16 + low nibble of each pair.
+  const __m128i weights = _mm_set1_epi16(0x0110);
+  size_t i = 0;
+
+  for (; i + 16 <= count; i += 16)
+  {
+    __m128i n0;
+    __m128i n1;
+    if (!hex_nibbles_ssse3(_mm_loadu_si128((const __m128i *)(src + i * 2)), &n0) ||
+        !hex_nibbles_ssse3(_mm_loadu_si128((const __m128i *)(src + i * 2 + 16)), &n1))
+    {
+      return -1;
+    }
+    __m128i b0 = _mm_maddubs_epi16(n0, weights);
+    __m128i b1 = _mm_maddubs_epi16(n1, weights);
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(b0, b1));
+  }
+  return (ptrdiff_t)i;
+}
+
+// 12 bytes to 16 chars per round, reads 16, return bytes consumed.
+__attribute__((target("ssse3"))) static size_t
+base64_encode_ssse3(const uint8_t *src, size_t len, char *dst, bool url)
+{
+  // added to the sextet by range: a-z, 0-9 (10 entries), 62, 63, A-Z.
+  const __m128i shift_lut = _mm_setr_epi8(
+      'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, '0' - 52, (url ? '-' : '+') - 62,
+      (url ? '_' : '/') - 63, 'A', 0, 0);
+  size_t i = 0;
+  size_t o = 0;
+
+  for (; i + 16 <= len; i += 12, o += 16)
+  {
+    __m128i in = _mm_loadu_si128((const __m128i *)(src + i));
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3,
+                                           4, 1, 2, 0, 1));
+
+    // split each 3 bytes into 4 sextets, one per byte.
+    __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    __m128i indices = _mm_or_si128(t1, t3);
+
+    __m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    __m128i upper = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+    range = _mm_or_si128(range, _mm_and_si128(upper, _mm_set1_epi8(13)));
+    __m128i out = _mm_add_epi8(_mm_shuffle_epi8(shift_lut, range), indices);
+    _mm_storeu_si128((__m128i *)(dst + o), out);
+  }
+  return i;
+}
+
+// 16 chars to 12 bytes per round, return chars consumed, -1 if invalid.
+__attribute__((target("ssse3"))) static ptrdiff_t
+base64_decode_ssse3(const char *src, size_t len, uint8_t *dst, bool url)
+{
+  size_t i = 0;
+  size_t o = 0;
+
+  for (; i + 16 <= len; i += 16, o += 12)
+  {
+    __m128i c = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i upper = CODEC_IN_RANGE(c, 'A', 'Z');
+    __m128i lower = CODEC_IN_RANGE(c, 'a', 'z');
+    __m128i digit = CODEC_IN_RANGE(c, '0', '9');
+    __m128i c62 = _mm_cmpeq_epi8(c, _mm_set1_epi8(url ? '-' : '+'));
+    __m128i c63 = _mm_cmpeq_epi8(c, _mm_set1_epi8(url ? '_' : '/'));
+
+    __m128i valid = _mm_or_si128(_mm_or_si128(upper, lower),
+                                 _mm_or_si128(digit, _mm_or_si128(c62, c63)));
+    if (_mm_movemask_epi8(valid) != 0xffff)
+    {
+      return -1;
+    }
+
+    __m128i shift = _mm_or_si128(
+        _mm_or_si128(_mm_and_si128(upper, _mm_set1_epi8(-'A')),
+                     _mm_and_si128(lower, _mm_set1_epi8(26 - 'a'))),
+        _mm_or_si128(
+            _mm_and_si128(digit, _mm_set1_epi8(52 - '0')),
+            _mm_or_si128(_mm_and_si128(c62, _mm_set1_epi8(62 - (url ? '-' : '+'))),
+                         _mm_and_si128(c63, _mm_set1_epi8(63 - (url ? '_' : '/'))))));
+    __m128i values = _mm_add_epi8(c, shift);
+
+    // merge 4 sextets into 3 bytes, big-endian within each group.
+    __m128i merged = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+    merged = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+    merged = _mm_shuffle_epi8(merged, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                                    14, 13, 12, -1, -1, -1, -1));
+    _mm_storel_epi64((__m128i *)(dst + o), merged);
+    uint32_t tail = (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(merged, 8));
+    memcpy(dst + o + 8, &tail, 4);
+  }
+  return (ptrdiff_t)i;
+}
+#endif
+
+size_t codec_hex_encode(const uint8_t *src, size_t len, char *dst, bool lower)
+{
+  const char *digits = lower ? hex_lower : hex_upper;
+  size_t i = 0;
+
+#ifdef CODEC_SSSE3
+  if (len >= 16 && codec_ssse3_supported())
+  {
+    i = hex_encode_ssse3(src, len, dst, digits);
+  }
+#endif
+
+  for (; i < len; i++)
+  {
+    dst[i * 2] = digits[src[i] >> 4];
+    dst[i * 2 + 1] = digits[src[i] & 0x0f];
+  }
+  return len * 2;
+}
+
+bool codec_hex_decode(const char *src, size_t len, uint8_t *dst,
+                      size_t *outlen)
+{
+  size_t count = len / 2;
+  size_t i = 0;
+
+#ifdef CODEC_SSSE3
+  if (count >= 16 && codec_ssse3_supported())
+  {
+    ptrdiff_t done = hex_decode_ssse3(src, count, dst);
+    if (done < 0)
+    {
+      return false;
+    }
+    i = (size_t)done;
+  }
+#endif
+
+  for (; i < count; i++)
+  {
+    int hi = hex_value(src[i * 2]);
+    int lo = hex_value(src[i * 2 + 1]);
+    if (hi < 0 || lo < 0)
+    {
+      return false;
+    }
+    dst[i] = (uint8_t)(hi << 4 | lo);
+  }
+
+  *outlen = count;
+  return true;
+}
+
+size_t codec_base64_encode(const uint8_t *src, size_t len, char *dst,
+                           bool url)
+{
+  const char *alphabet = url ? base64_url : base64_std;
+  size_t i = 0;
+  size_t o = 0;
+
+#ifdef CODEC_SSSE3
+  if (len >= 16 && codec_ssse3_supported())
+  {
+    i = base64_encode_ssse3(src, len, dst, url);
+    o = i / 3 * 4;
+  }
+#endif
+
+  for (; i + 3 <= len; i += 3, o += 4)
+  {
+    uint32_t v = (uint32_t)src[i] << 16 | (uint32_t)src[i + 1] << 8 | src[i + 2];
+    dst[o] = alphabet[v >> 18];
+    dst[o + 1] = alphabet[(v >> 12) & 0x3f];
+    dst[o + 2] = alphabet[(v >> 6) & 0x3f];
+    dst[o + 3] = alphabet[v & 0x3f];
+  }
+
+  if (i < len)
+  {
+    uint32_t v = (uint32_t)src[i] << 16;
+    if (i + 1 < len)
+    {
+      v |= (uint32_t)src[i + 1] << 8;
+    }
+    dst[o++] = alphabet[v >> 18];
+    dst[o++] = alphabet[(v >> 12) & 0x3f];
+    if (i + 1 < len)
+    {
+      dst[o++] = alphabet[(v >> 6) & 0x3f];
+    }
+    else if (!url)
+    {
+      dst[o++] = '=';
+    }
+    if (!url)
+    {
+      dst[o++] = '=';
+    }
+  }
+  return o;
+}
+
+bool codec_base64_decode(const char *src, size_t len, uint8_t *dst,
+                         size_t *outlen, bool url)
+{
+  const int8_t *table = NULL;
+  size_t i = 0;
+  size_t o = 0;
+
+  if (len % 4 == 0 && len > 0 && src[len - 1] == '=')
+  {
+    len -= src[len - 2] == '=' ? 2 : 1;
+  }
+  if (len % 4 == 1)
+  {
+    return false;
+  }
+
+  base64_tables();
+  table = url ? base64_url_value : base64_std_value;
+
+#ifdef CODEC_SSSE3
+  if (len >= 16 && codec_ssse3_supported())
+  {
+    ptrdiff_t done = base64_decode_ssse3(src, len, dst, url);
+    if (done < 0)
+    {
+      return false;
+    }
+    i = (size_t)done;
+    o = i / 4 * 3;
+  }
+#endif
+
+  for (; i + 4 <= len; i += 4, o += 3)
+  {
+    int a = table[(uint8_t)src[i]];
+    int b = table[(uint8_t)src[i + 1]];
+    int c = table[(uint8_t)src[i + 2]];
+    int d = table[(uint8_t)src[i + 3]];
+    if ((a | b | c | d) < 0)
+    {
+      return false;
+    }
+    uint32_t v = (uint32_t)a << 18 | (uint32_t)b << 12 | (uint32_t)c << 6 | d;
+    dst[o] = (uint8_t)(v >> 16);
+    dst[o + 1] = (uint8_t)(v >> 8);
+    dst[o + 2] = (uint8_t)v;
+  }
+
+  if (i < len)
+  {
+    int a = table[(uint8_t)src[i]];
+    int b = table[(uint8_t)src[i + 1]];
+    int c = i + 2 < len ? table[(uint8_t)src[i + 2]] : 0;
+    if ((a | b | c) < 0)
+    {
+      return false;
+    }
+    uint32_t v = (uint32_t)a << 18 | (uint32_t)b << 12 | (uint32_t)c << 6;
+    dst[o++] = (uint8_t)(v >> 16);
+    if (i + 2 < len)
+    {
+      dst[o++] = (uint8_t)(v >> 8);
+    }
+  }
+
+  *outlen = o;
+  return true;
+}
@@ -0,0 +1,32 @@
+#ifndef codec_h
+#define codec_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// output sizes, dst must hold that many bytes.
+#define CODEC_HEX_ENCODED_SIZE(len) ((len)*2)
+#define CODEC_HEX_DECODED_SIZE(len) ((len) / 2)
+#define CODEC_BASE64_ENCODED_SIZE(len) (((len) + 2) / 3 * 4)
+#define CODEC_BASE64_DECODED_SIZE(len) ((len) / 4 * 3 + 2)
+
+// the kernels use ssse3 when the cpu has it.
+
+// return bytes written.
+size_t codec_hex_encode(const uint8_t *src, size_t len, char *dst,
+                        bool lower);
+
+// a trailing odd digit is ignored, return false on invalid digits.
+bool codec_hex_decode(const char *src, size_t len, uint8_t *dst,
+                      size_t *outlen);
+
+// url uses the url-safe alphabet without padding, return bytes written.
+size_t codec_base64_encode(const uint8_t *src, size_t len, char *dst,
+                           bool url);
+
+// padding is optional, return false on invalid input.
+bool codec_base64_decode(const char *src, size_t len, uint8_t *dst,
+                         size_t *outlen, bool url);
+
+#endif
@@ -0,0 +1,261 @@
+#include "utlua.h"
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#define LUA_FDPASS_CHANNEL_TYPE "FDPASS_CHANNEL_TYPE"
+
+// payload sent along with each fd, e.g. the bytes already read from it.
+#define FDPASS_MAX_DATA 65536
+
+// messages handled per event at most.
+#define FDPASS_READ_BUDGET 64
+
+// a unix datagram socketpair created before fork, each process opens one side
+// and passes fds to the other with SCM_RIGHTS.
+typedef struct
+{
+  int fds[2];
+
+  // -1 until opened.
+  int side;
+  struct event *ev;
+
+  lua_State *mainthread;
+  int onFdRef;
+} FDPASS;
+
+static void fdpass_read_cb(evutil_socket_t fd, short what, void *arg)
+{
+  FDPASS *ch = (FDPASS *)arg;
+
+  char *buf = malloc(FDPASS_MAX_DATA + 1);
+  if (!buf)
+  {
+    return;
+  }
+
+  int count = 0;
+  for (; count < FDPASS_READ_BUDGET && ch->side >= 0; count++)
+  {
+    struct iovec iov = {buf, FDPASS_MAX_DATA + 1};
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t len = recvmsg(fd, &msg, 0);
+    if (len < 0)
+    {
+      break;
+    }
+
+    int passed = -1;
+    struct cmsghdr *cmsg = NULL;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+      {
+        memcpy(&passed, CMSG_DATA(cmsg), sizeof(int));
+        break;
+      }
+    }
+
+    if (passed < 0 || len < 1)
+    {
+      if (passed >= 0)
+      {
+        close(passed);
+      }
+      continue;
+    }
+
+    if (ch->onFdRef == LUA_NOREF)
+    {
+      close(passed);
+      continue;
+    }
+
+    lua_State *mainthread = ch->mainthread;
+    lua_lock(mainthread);
+    lua_State *co = lua_newthread(mainthread);
+    PUSH_REF(mainthread);
+    lua_unlock(mainthread);
+
+    lua_rawgeti(co, LUA_REGISTRYINDEX, ch->onFdRef);
+    lua_pushinteger(co, passed);
+    lua_pushlstring(co, buf + 1, len - 1);
+    FAN_RESUME(co, mainthread, 2);
+    POP_REF(mainthread);
+  }
+
+  free(buf);
+}
+
+LUA_API int luafan_fdpass_new(lua_State *L)
+{
+  FDPASS *ch = lua_newuserdata(L, sizeof(FDPASS));
+  memset(ch, 0, sizeof(FDPASS));
+  ch->fds[0] = ch->fds[1] = -1;
+  ch->side = -1;
+  ch->onFdRef = LUA_NOREF;
+  luaL_getmetatable(L, LUA_FDPASS_CHANNEL_TYPE);
+  lua_setmetatable(L, -2);
+
+  if (socketpair(AF_UNIX, SOCK_DGRAM, 0, ch->fds) == -1)
+  {
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(errno));
+    return 2;
+  }
+
+  evutil_make_socket_nonblocking(ch->fds[0]);
+  evutil_make_socket_nonblocking(ch->fds[1]);
+
+  return 1;
+}
+
+static FDPASS *fdpass_check_open(lua_State *L)
+{
+  FDPASS *ch = luaL_checkudata(L, 1, LUA_FDPASS_CHANNEL_TYPE);
+  if (ch->side < 0)
+  {
+    luaL_error(L, "fdpass channel not opened.");
+  }
+  return ch;
+}
+
+LUA_API int luafan_fdpass_open(lua_State *L)
+{
+  FDPASS *ch = luaL_checkudata(L, 1, LUA_FDPASS_CHANNEL_TYPE);
+  luaL_checktype(L, 2, LUA_TTABLE);
+
+  if (ch->fds[0] < 0 && ch->fds[1] < 0)
+  {
+    return luaL_error(L, "fdpass channel closed.");
+  }
+  if (ch->side >= 0)
+  {
+    return luaL_error(L, "fdpass channel already opened.");
+  }
+
+  lua_getfield(L, 2, "side");
+  int side = (int)luaL_checkinteger(L, -1);
+  lua_pop(L, 1);
+  luaL_argcheck(L, side == 0 || side == 1, 2, "side must be 0 or 1.");
+
+  event_mgr_init();
+
+  // the other end belongs to the other process.
+  close(ch->fds[1 - side]);
+  ch->fds[1 - side] = -1;
+
+  ch->side = side;
+  ch->mainthread = utlua_mainthread(L);
+  SET_FUNC_REF_FROM_TABLE(L, ch->onFdRef, 2, "onfd")
+
+  ch->ev = event_new(event_mgr_base(), ch->fds[side], EV_READ | EV_PERSIST,
+                     fdpass_read_cb, ch);
+  event_add(ch->ev, NULL);
+
+  return 0;
+}
+
+// the fd is closed in this process once it is sent.
+LUA_API int luafan_fdpass_send_fd(lua_State *L)
+{
+  FDPASS *ch = fdpass_check_open(L);
+  int fd = (int)luaL_checkinteger(L, 2);
+  size_t len = 0;
+  const char *data = luaL_optlstring(L, 3, "", &len);
+  luaL_argcheck(L, len <= FDPASS_MAX_DATA, 3, "data too long.");
+
+  // a datagram can't be empty on every platform, lead with one byte.
+  char tag = 1;
+  struct iovec iov[2] = {{&tag, 1}, {(void *)data, len}};
+  char control[CMSG_SPACE(sizeof(int))];
+  memset(control, 0, sizeof(control));
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  if (sendmsg(ch->fds[ch->side], &msg, 0) == -1)
+  {
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(errno));
+    return 2;
+  }
+
+  close(fd);
+  lua_pushboolean(L, true);
+  return 1;
+}
+
+LUA_API int luafan_fdpass_close(lua_State *L)
+{
+  FDPASS *ch = luaL_checkudata(L, 1, LUA_FDPASS_CHANNEL_TYPE);
+
+  CLEAR_REF(L, ch->onFdRef)
+
+  if (event_mgr_base_current() && ch->ev)
+  {
+    event_free(ch->ev);
+    ch->ev = NULL;
+  }
+
+  int i = 0;
+  for (i = 0; i < 2; i++)
+  {
+    if (ch->fds[i] >= 0)
+    {
+      close(ch->fds[i]);
+      ch->fds[i] = -1;
+    }
+  }
+  ch->side = -1;
+
+  return 0;
+}
+
+static const struct luaL_Reg fdpasslib[] = {
+    {"new", luafan_fdpass_new}, {NULL, NULL},
+};
+
+LUA_API int luaopen_fan_fdpass(lua_State *L)
+{
+  luaL_newmetatable(L, LUA_FDPASS_CHANNEL_TYPE);
+  lua_pushcfunction(L, &luafan_fdpass_open);
+  lua_setfield(L, -2, "open");
+
+  lua_pushcfunction(L, &luafan_fdpass_send_fd);
+  lua_setfield(L, -2, "send_fd");
+
+  lua_pushcfunction(L, &luafan_fdpass_close);
+  lua_setfield(L, -2, "close");
+
+  lua_pushstring(L, "__index");
+  lua_pushvalue(L, -2);
+  lua_rawset(L, -3);
+
+  lua_pushstring(L, "__gc");
+  lua_pushcfunction(L, &luafan_fdpass_close);
+  lua_rawset(L, -3);
+
+  lua_pop(L, 1);
+
+  lua_newtable(L);
+  luaL_register(L, "fdpass", fdpasslib);
+  return 1;
+}
@@ -6,6 +6,10 @@
 
 #define LUA_FIFO_CONNECTION_TYPE "FIFO_CONNECTION_TYPE"
 
+// bytes read per event before lua gets them, a busy fifo yields to the loop
+// after this.
+#define FIFO_DEFAULT_READ_BUDGET (4 * READ_BUFF_LEN)
+
 typedef struct
 {
   int socket;
@@ -18,6 +22,9 @@ typedef struct
 
   lua_State *mainthread;
 
+  char *read_buf;
+  size_t read_budget;
+
   struct event *read_ev;
   struct event *write_ev;
 } FIFO;
@@ -40,48 +47,50 @@ static void fifo_write_cb(evutil_socket_t fd, short event, void *arg)
   }
 }
 
-static void fifo_read_cb(evutil_socket_t fd, short event, void *arg)
+static void fifo_ondisconnected(FIFO *fifo, const char *reason)
 {
-  FIFO *fifo = (FIFO *)arg;
+  if (fifo->onDisconnectedRef != LUA_NOREF)
+  {
+    lua_State *mainthread = fifo->mainthread;
+    lua_lock(mainthread);
+    lua_State *co = lua_newthread(mainthread);
+    PUSH_REF(mainthread);
+    lua_unlock(mainthread);
 
-  char buf[READ_BUFF_LEN];
-  size_t len = read(fd, buf, READ_BUFF_LEN);
+    lua_rawgeti(co, LUA_REGISTRYINDEX, fifo->onDisconnectedRef);
+    lua_pushstring(co, reason);
 
-  if (len <= 0)
+    FAN_RESUME(co, mainthread, 1);
+    POP_REF(mainthread);
+  }
+  else
   {
-    if (len < 0 && (errno == EAGAIN || errno == EINTR))
-    {
-      printf("fifo_read_cb: %s\n", strerror(errno));
-      return;
-    }
-    if (fifo->onDisconnectedRef != LUA_NOREF)
-    {
-      lua_State *mainthread = fifo->mainthread;
-      lua_lock(mainthread);
-      lua_State *co = lua_newthread(mainthread);
-      PUSH_REF(mainthread);
-      lua_unlock(mainthread);
-
-      lua_rawgeti(co, LUA_REGISTRYINDEX, fifo->onDisconnectedRef);
+    printf("fifo_read_cb:%s: %s\n", fifo->name, reason);
+  }
+}
 
-      lua_pushstring(co, len < 0 && errno ? strerror(errno) : "pipe closed.");
+static void fifo_read_cb(evutil_socket_t fd, short event, void *arg)
+{
+  FIFO *fifo = (FIFO *)arg;
 
-      FAN_RESUME(co, mainthread, 1);
-      POP_REF(mainthread);
-    }
-    else
+  // drain until EAGAIN or the budget, lua gets it all in one call.
+  size_t total = 0;
+  ssize_t len = 0;
+  while (total < fifo->read_budget)
+  {
+    len = read(fd, fifo->read_buf + total, fifo->read_budget - total);
+    if (len <= 0)
     {
-      printf("fifo_read_cb:%s: %s\n", fifo->name, len < 0 && errno ? strerror(errno) : "pipe closed.");
+      break;
     }
-
-    // if (fifo->read_ev) {
-    //   event_free(fifo->read_ev);
-    //   fifo->read_ev = NULL;
-    // }
-    return;
+    total += len;
   }
 
-  if (fifo->onReadRef != LUA_NOREF)
+  // read errno before lua may change it.
+  int err = len < 0 ? errno : 0;
+  bool closed = len == 0 || (len < 0 && err != EAGAIN && err != EINTR);
+
+  if (total > 0 && fifo->onReadRef != LUA_NOREF)
   {
     lua_State *mainthread = fifo->mainthread;
     lua_lock(mainthread);
@@ -90,9 +99,25 @@ static void fifo_read_cb(evutil_socket_t fd, short event, void *arg)
     lua_unlock(mainthread);
 
     lua_rawgeti(co, LUA_REGISTRYINDEX, fifo->onReadRef);
-    lua_pushlstring(co, buf, len);
+    lua_pushlstring(co, fifo->read_buf, total);
     FAN_RESUME(co, mainthread, 1);
     POP_REF(mainthread);
+
+    if (!fifo->read_buf)
+    {
+      // closed during the callback.
+      return;
+    }
+  }
+
+  if (closed && total < fifo->read_budget)
+  {
+    fifo_ondisconnected(fifo, err ? strerror(err) : "pipe closed.");
+
+    // if (fifo->read_ev) {
+    //   event_free(fifo->read_ev);
+    //   fifo->read_ev = NULL;
+    // }
   }
 }
 
@@ -147,6 +172,11 @@ LUA_API int luafan_fifo_connect(lua_State *L)
   // fifo->write_ev = NULL;
   // fifo->name = NULL;
 
+  lua_getfield(L, 1, "read_budget");
+  lua_Integer read_budget = luaL_optinteger(L, -1, FIFO_DEFAULT_READ_BUDGET);
+  fifo->read_budget = read_budget > 0 ? read_budget : FIFO_DEFAULT_READ_BUDGET;
+  lua_pop(L, 1);
+
   lua_getfield(L, 1, "delete_on_close");
   fifo->delete_on_close = lua_toboolean(L, -1);
   lua_pop(L, 1);
@@ -209,6 +239,7 @@ LUA_API int luafan_fifo_connect(lua_State *L)
 
   if (fifo->onReadRef != LUA_NOREF)
   {
+    fifo->read_buf = malloc(fifo->read_budget);
     fifo->read_ev = event_new(event_mgr_base(), socket, EV_PERSIST | EV_READ,
                               fifo_read_cb, fifo);
     event_add(fifo->read_ev, NULL);
@@ -255,7 +286,7 @@ LUA_API int luafan_fifo_send(lua_State *L)
   const char *data = luaL_optlstring(L, 2, NULL, &data_len);
   if (data && data_len > 0)
   {
-    size_t len = write(fifo->socket, data, data_len);
+    ssize_t len = write(fifo->socket, data, data_len);
     if (len <= 0)
     {
       if (len < 0 && (errno == EAGAIN || errno == EINTR))
@@ -346,6 +377,9 @@ LUA_API int luafan_fifo_close(lua_State *L)
   free(fifo->name);
   fifo->name = NULL;
 
+  free(fifo->read_buf);
+  fifo->read_buf = NULL;
+
   return 0;
 }
 
@@ -99,9 +99,21 @@ extern void decrRef(lua_State *L);
 
 #endif
 
-#if TARGET_OS_IPHONE || defined(ANDROID) || defined(__ANDROID__)
+// dns cache, tls sessions, connection cache and psl shared by all the
+// transfers unless a call asks for share = false.
 static CURLSH *share_handle = NULL;
+
+#if LIBCURL_VERSION_NUM >= 0x073900
+#define HTTP_SHARE_CONNECT 1
 #endif
+#if LIBCURL_VERSION_NUM >= 0x073d00
+#define HTTP_SHARE_PSL 1
+#endif
+
+// finished transfers, and how they got their connection.
+static lua_Integer stat_requests;
+static lua_Integer stat_new_connections;
+static lua_Integer stat_reused_connections;
 
 #define CURL_TIMEOUT_DEFAULT 60
 
@@ -226,6 +238,20 @@ static void http_getpost_complete(ConnInfo *conn)
         lua_setfield(L, -2, "total_time");
     }
 
+    // new connections made for this transfer, 0 if one was reused.
+    long num_connects = 0;
+    if (curl_easy_getinfo(conn->easy, CURLINFO_NUM_CONNECTS, &num_connects) == CURLE_OK) {
+        lua_pushinteger(L, num_connects);
+        lua_setfield(L, -2, "num_connects");
+
+        stat_requests++;
+        stat_new_connections += num_connects;
+        if (num_connects == 0 && responseCode > 0)
+        {
+            stat_reused_connections++;
+        }
+    }
+
     bytearray_read_ready(&conn->input);
 
     if (conn->input.total > 0)
@@ -443,12 +469,8 @@ static int sock_cb(CURL *e, curl_socket_t s, int what, void *cbp, void *sockp)
 
 static size_t filldata(char *ptr, size_t size, size_t nmemb, ConnInfo *conn)
 {
-    int i = 0;
     //    fprintf(MSG_OUT, "filldata %zu %zu\n", size, nmemb);
-    for (; i < size; i++)
-    {
-        bytearray_writebuffer(&conn->input, ptr + i * nmemb, nmemb);
-    }
+    bytearray_writebuffer(&conn->input, ptr, size * nmemb);
     return size * nmemb;
 }
 
@@ -898,6 +920,13 @@ static int http_getpost(lua_State *L, int method)
             curl_easy_setopt(conn->easy, CURLOPT_DEBUGDATA, conn);
         }
 
+        lua_getfield(L, 1, "share");
+        if (share_handle && (lua_isnil(L, -1) || lua_toboolean(L, -1)))
+        {
+            curl_easy_setopt(conn->easy, CURLOPT_SHARE, share_handle);
+        }
+        lua_pop(L, 1);
+
         lua_pushliteral(L, "dns_servers");
         lua_gettable(L, 1);
         if (lua_isstring(L, -1))
@@ -1426,9 +1455,6 @@ static int http_getpost(lua_State *L, int method)
         curl_multi_setopt(multi, CURLMOPT_SOCKETDATA, NULL);
         curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, multi_timer_cb);
         curl_multi_setopt(multi, CURLMOPT_TIMERDATA, NULL);
-#if TARGET_OS_IPHONE || defined(ANDROID) || defined(__ANDROID__)
-        curl_multi_setopt(multi, CURLOPT_SHARE, share_handle);
-#endif
     }
 
     CURLMcode rc = curl_multi_add_handle(multi, conn->easy);
@@ -1651,6 +1677,88 @@ LUA_API int http_unescape(lua_State *L)
     return 1;
 }
 
+static int http_share_set(const char *name, int enable, curl_lock_data data)
+{
+    CURLSHcode code = curl_share_setopt(
+        share_handle, enable ? CURLSHOPT_SHARE : CURLSHOPT_UNSHARE, data);
+    if (code != CURLSHE_OK)
+    {
+        LOGE("http.share %s: %s", name, curl_share_strerror(code));
+    }
+    return code == CURLSHE_OK;
+}
+
+// http.share{dns=, ssl_session=, connect=, psl=}, keys not given are kept,
+// can't be changed while a transfer uses the share.
+LUA_API int http_share(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    if (!share_handle)
+    {
+        lua_pushnil(L);
+        lua_pushliteral(L, "share not available.");
+        return 2;
+    }
+
+    int ok = 1;
+
+    lua_getfield(L, 1, "dns");
+    if (!lua_isnil(L, -1))
+    {
+        ok &= http_share_set("dns", lua_toboolean(L, -1), CURL_LOCK_DATA_DNS);
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "ssl_session");
+    if (!lua_isnil(L, -1))
+    {
+        ok &= http_share_set("ssl_session", lua_toboolean(L, -1),
+                             CURL_LOCK_DATA_SSL_SESSION);
+    }
+    lua_pop(L, 1);
+
+#ifdef HTTP_SHARE_CONNECT
+    lua_getfield(L, 1, "connect");
+    if (!lua_isnil(L, -1))
+    {
+        ok &= http_share_set("connect", lua_toboolean(L, -1),
+                             CURL_LOCK_DATA_CONNECT);
+    }
+    lua_pop(L, 1);
+#endif
+
+#ifdef HTTP_SHARE_PSL
+    lua_getfield(L, 1, "psl");
+    if (!lua_isnil(L, -1))
+    {
+        ok &= http_share_set("psl", lua_toboolean(L, -1), CURL_LOCK_DATA_PSL);
+    }
+    lua_pop(L, 1);
+#endif
+
+    if (!ok)
+    {
+        lua_pushnil(L);
+        lua_pushliteral(L, "share option refused, a transfer may be using it.");
+        return 2;
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+LUA_API int http_stats(lua_State *L)
+{
+    lua_newtable(L);
+    lua_pushinteger(L, stat_requests);
+    lua_setfield(L, -2, "requests");
+    lua_pushinteger(L, stat_new_connections);
+    lua_setfield(L, -2, "new_connections");
+    lua_pushinteger(L, stat_reused_connections);
+    lua_setfield(L, -2, "reused_connections");
+    return 1;
+}
+
 static const luaL_Reg httplib[] = {{"get", http_get},
                                    {"post", http_post},
                                    {"put", http_put},
@@ -1662,6 +1770,8 @@ static const luaL_Reg httplib[] = {{"get", http_get},
                                    {"capath", http_capath},
                                    {"escape", http_escape},
                                    {"unescape", http_unescape},
+                                   {"share", http_share},
+                                   {"stats", http_stats},
                                    {NULL, NULL}};
 
 #if TARGET_OS_IPHONE || defined(ANDROID) || defined(__ANDROID__)
@@ -1786,20 +1896,31 @@ LUA_API int luaopen_fan_http_core(lua_State *L)
 {
     curl_global_init(CURL_GLOBAL_ALL);
 
-#if TARGET_OS_IPHONE || defined(ANDROID) || defined(__ANDROID__)
     if (!share_handle)
     {
         share_handle = curl_share_init();
+#if TARGET_OS_IPHONE || defined(ANDROID) || defined(__ANDROID__)
+        // the share may be used from several threads here, the loop thread
+        // is the only user elsewhere.
         curl_share_setopt(share_handle, CURLSHOPT_LOCKFUNC, lock_function);
         curl_share_setopt(share_handle, CURLSHOPT_UNLOCKFUNC, unlock_function);
-        curl_share_setopt(share_handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
 
         pthread_mutexattr_t a;
         pthread_mutexattr_init(&a);
         pthread_mutexattr_settype(&a, PTHREAD_MUTEX_RECURSIVE);
         pthread_mutex_init(&share_lock, &a);
-    }
 #endif
+        curl_share_setopt(share_handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(share_handle, CURLSHOPT_SHARE,
+                          CURL_LOCK_DATA_SSL_SESSION);
+#ifdef HTTP_SHARE_CONNECT
+        curl_share_setopt(share_handle, CURLSHOPT_SHARE,
+                          CURL_LOCK_DATA_CONNECT);
+#endif
+#ifdef HTTP_SHARE_PSL
+        curl_share_setopt(share_handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_PSL);
+#endif
+    }
     if (!timer_event)
     {
         timer_event = evtimer_new(event_mgr_base(), timer_cb, NULL);
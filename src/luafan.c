@@ -3,6 +3,9 @@
 #endif
 
 #include "utlua.h"
+#include "checksum.h"
+#include "codec.h"
+#include "stream.h"
 #include <fcntl.h>
 #include <signal.h>
 #include <sys/stat.h>
@@ -66,6 +69,7 @@ struct sleep_args
 {
   lua_State *L;
   int threadRef;
+  int selfRef;
   struct event clockevent;
 };
 
@@ -75,6 +79,7 @@ static void clock_handler(const int fd, const short which, void *arg)
 
   lua_State *L = args->L;
   int threadRef = args->threadRef;
+  int selfRef = args->selfRef;
   evtimer_del(&args->clockevent);
 
   lua_lock(L);
@@ -86,6 +91,7 @@ static void clock_handler(const int fd, const short which, void *arg)
   FAN_RESUME(co, NULL, 0);
 
   luaL_unref(L, LUA_REGISTRYINDEX, threadRef);
+  luaL_unref(L, LUA_REGISTRYINDEX, selfRef);
 }
 
 LUA_API int luafan_sleep(lua_State *L)
@@ -97,6 +103,9 @@ LUA_API int luafan_sleep(lua_State *L)
   memset(args, 0, sizeof(struct sleep_args));
 
   args->L = utlua_mainthread(L);
+  // luajit drops the yielding frame's stack, keep the pending event alive.
+  lua_pushvalue(L, -1);
+  args->selfRef = luaL_ref(L, LUA_REGISTRYINDEX);
   lua_pushthread(L);
   args->threadRef = luaL_ref(L, LUA_REGISTRYINDEX);
 
@@ -111,12 +120,26 @@ LUA_API int luafan_sleep(lua_State *L)
 // -- luafan_sleep end --
 
 // -- start hex2data data2hex --
-static unsigned char strToChar(char a, char b)
+// output written in place, a luaL_Buffer sized up front on 5.2+,
+// a scratch userdata copied to the result on 5.1.
+static char *codec_prepbuffer(lua_State *L, luaL_Buffer *b, size_t size)
 {
-  char encoder[3] = {'\0', '\0', '\0'};
-  encoder[0] = a;
-  encoder[1] = b;
-  return (char)strtol(encoder, NULL, 16);
+#if (LUA_VERSION_NUM >= 502)
+  return luaL_buffinitsize(L, b, size);
+#else
+  return (char *)lua_newuserdata(L, size > 0 ? size : 1);
+#endif
+}
+
+static void codec_pushresult(lua_State *L, luaL_Buffer *b, char *buff,
+                             size_t len)
+{
+#if (LUA_VERSION_NUM >= 502)
+  luaL_pushresultsize(b, len);
+#else
+  lua_pushlstring(L, buff, len);
+  lua_remove(L, -2);
+#endif
 }
 
 LUA_API int hex2data(lua_State *L)
@@ -128,21 +151,15 @@ LUA_API int hex2data(lua_State *L)
   size_t length = 0;
   const char *bytes = lua_tolstring(L, 1, &length);
 
-  char *r = (char *)malloc(length / 2 + 1);
-  char *index = r;
-
-  while ((*bytes) && (*(bytes + 1)))
+  luaL_Buffer b;
+  char *r = codec_prepbuffer(L, &b, CODEC_HEX_DECODED_SIZE(length));
+  size_t len = 0;
+  if (!codec_hex_decode(bytes, length, (uint8_t *)r, &len))
   {
-    *index = strToChar(*bytes, *(bytes + 1));
-    index++;
-    bytes += 2;
+    lua_pushnil(L);
+    return 1;
   }
-  *index = '\0';
-
-  lua_pushlstring(L, r, length / 2);
-
-  free(r);
-
+  codec_pushresult(L, &b, r, len);
   return 1;
 }
 
@@ -152,29 +169,79 @@ LUA_API int data2hex(lua_State *L)
   {
     return 0;
   }
-  static const char hexdigits[] = "0123456789ABCDEF";
   size_t len = 0;
   const char *data = lua_tolstring(L, 1, &len);
-  const size_t numBytes = len;
-  const char *bytes = data;
-  char *strbuf = (char *)malloc(numBytes * 2 + 1);
-  char *hex = strbuf;
-  int i = 0;
-  for (i = 0; i < numBytes; ++i)
+  bool lower = lua_toboolean(L, 2);
+
+  luaL_Buffer b;
+  char *hex = codec_prepbuffer(L, &b, CODEC_HEX_ENCODED_SIZE(len));
+  codec_pushresult(L, &b, hex,
+                   codec_hex_encode((const uint8_t *)data, len, hex, lower));
+  return 1;
+}
+// -- end hex2data data2hex --
+
+// -- start base64 --
+LUA_API int luafan_base64_encode(lua_State *L)
+{
+  size_t len = 0;
+  const char *data = luaL_checklstring(L, 1, &len);
+  bool url = lua_toboolean(L, 2);
+
+  luaL_Buffer b;
+  char *out = codec_prepbuffer(L, &b, CODEC_BASE64_ENCODED_SIZE(len));
+  codec_pushresult(
+      L, &b, out, codec_base64_encode((const uint8_t *)data, len, out, url));
+  return 1;
+}
+
+LUA_API int luafan_base64_decode(lua_State *L)
+{
+  size_t len = 0;
+  const char *data = luaL_checklstring(L, 1, &len);
+  bool url = lua_toboolean(L, 2);
+
+  luaL_Buffer b;
+  char *out = codec_prepbuffer(L, &b, CODEC_BASE64_DECODED_SIZE(len));
+  size_t outlen = 0;
+  if (!codec_base64_decode(data, len, (uint8_t *)out, &outlen, url))
   {
-    const unsigned char c = *(bytes++);
-    *hex++ = hexdigits[(c >> 4) & 0xF];
-    *hex++ = hexdigits[(c)&0xF];
+    lua_pushnil(L);
+    return 1;
   }
-  *hex = 0;
+  codec_pushresult(L, &b, out, outlen);
+  return 1;
+}
+// -- end base64 --
 
-  lua_pushlstring(L, strbuf, numBytes * 2);
+// -- start checksum --
+LUA_API int luafan_crc32c(lua_State *L)
+{
+  size_t len = 0;
+  const char *data = luaL_checklstring(L, 1, &len);
+  uint32_t crc = (uint32_t)luaL_optinteger(L, 2, 0);
+  lua_pushinteger(L, checksum_crc32c(crc, data, len));
+  return 1;
+}
 
-  free(strbuf);
+LUA_API int luafan_crc32(lua_State *L)
+{
+  size_t len = 0;
+  const char *data = luaL_checklstring(L, 1, &len);
+  uint32_t crc = (uint32_t)luaL_optinteger(L, 2, 0);
+  lua_pushinteger(L, checksum_crc32(crc, data, len));
+  return 1;
+}
 
+LUA_API int luafan_hash64(lua_State *L)
+{
+  size_t len = 0;
+  const char *data = luaL_checklstring(L, 1, &len);
+  uint64_t seed = stream_check_seed64(L, 2);
+  stream_push_hash64(L, checksum_hash64(data, len, seed));
   return 1;
 }
-// -- end hex2data data2hex --
+// -- end checksum --
 
 LUA_API int luafan_gettime(lua_State *L)
 {
@@ -221,6 +288,12 @@ static const struct luaL_Reg fanlib[] = {
 
     {"data2hex", data2hex},
     {"hex2data", hex2data},
+    {"base64_encode", luafan_base64_encode},
+    {"base64_decode", luafan_base64_decode},
+
+    {"crc32c", luafan_crc32c},
+    {"crc32", luafan_crc32},
+    {"hash64", luafan_hash64},
 
     {"fork", luafan_fork},
     {"getpid", luafan_getpid},
@@ -3,12 +3,15 @@
 #endif
 
 #include "utlua.h"
+#include "stream.h"
 
 #define HAS_NUMBER_MASK 1 << 7
 #define HAS_U30_MASK 1 << 6
 #define HAS_STRING_MASK 1 << 5
 #define HAS_FUNCTION_MASK 1 << 4
 #define HAS_TABLE_MASK 1 << 3
+// integers out of u30 range, zigzag varint64 instead of d64.
+#define HAS_VARINT_MASK 1 << 2
 /* if none of the above mask was set, that means it's boolean value. */
 #define TRUE_FALSE_MASK 1 << 0
 
@@ -46,9 +49,11 @@ void ffi_stream_add_u30(BYTEARRAY *ba, uint32_t u);
 void ffi_stream_add_d64(BYTEARRAY *ba, double value);
 void ffi_stream_add_string(BYTEARRAY *ba, const char *data, size_t len);
 void ffi_stream_add_bytes(BYTEARRAY *ba, const char *data, size_t len);
+void ffi_stream_add_svarint(BYTEARRAY *ba, int64_t value);
 
 bool ffi_stream_get_u30(BYTEARRAY *ba, uint32_t *result);
 bool ffi_stream_get_d64(BYTEARRAY *ba, double *result);
+bool ffi_stream_get_svarint(BYTEARRAY *ba, int64_t *result);
 void ffi_stream_get_string(BYTEARRAY *ba, uint8_t **buff, size_t *buflen);
 
 static void packer(lua_State *L, CTX *ctx, int obj_index);
@@ -244,304 +249,695 @@ static void ctx_init(CTX *ctx, lua_State *L)
   lua_rawseti(L, ctx->index, CTX_INDEX_FUNC_IDXS);
 }
 
-LUA_API int luafan_objectbuf_encode(lua_State *L)
+// encoder, values are deduplicated in c hash tables in a single walk of the
+// object, table entries are kept as value ids until all the indexes are known.
+#define ENC_VALUE_BOOLEAN 0
+#define ENC_VALUE_NUMBER 1
+#define ENC_VALUE_STRING 2
+#define ENC_VALUE_TABLE 3
+// functions, userdata ... not encoded, referenced as 0.
+#define ENC_VALUE_OTHER 4
+
+#define ENC_FALSE_ID 0
+#define ENC_TRUE_ID 1
+
+typedef struct
 {
-  int obj_index = 1;
-  int sym_idx = 0;
-  if (lua_isnoneornil(L, 1))
+  uint8_t type;
+  // number goes to the u30 section.
+  bool u30;
+  // number goes to the varint section.
+  bool varint;
+  bool isint;
+  // index taken from the symbol table.
+  bool sym;
+  uint32_t hash;
+  uint32_t index;
+
+  // table/string data pointer, number key bits.
+  const void *ptr;
+  uint64_t bits;
+  size_t len;
+  lua_Number number;
+
+  // slot in ENC.tables.
+  uint32_t table;
+} ENC_VALUE;
+
+typedef struct
+{
+  uint32_t key;
+  uint32_t value;
+  // lua_tonumber(key) if it's a positive integer, otherwise 0.
+  uint32_t num;
+  // key is a number, may be in the array part.
+  bool numkey;
+} ENC_PAIR;
+
+typedef struct
+{
+  ENC_PAIR *pairs;
+  uint32_t count;
+  uint32_t size;
+} ENC_TABLE;
+
+typedef struct
+{
+  ENC_VALUE *values;
+  uint32_t value_count;
+  uint32_t value_size;
+
+  // open addressing, value id + 1, 0 for empty.
+  uint32_t *slots;
+  uint32_t slot_size;
+  uint32_t slot_used;
+
+  ENC_TABLE *tables;
+  uint32_t table_count;
+  uint32_t table_size;
+
+  uint32_t number_count;
+  uint32_t u30_count;
+  uint32_t varint_count;
+  uint32_t string_count;
+
+  int sym_map_idx;
+  const char *error;
+} ENC;
+
+static uint32_t enc_hash_bits(uint64_t x)
+{
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  return (uint32_t)x;
+}
+
+static uint32_t enc_hash_string(const char *s, size_t len)
+{
+  uint32_t h = 2166136261u ^ (uint32_t)len;
+  size_t step = (len >> 5) + 1;
+  for (; len >= step; len -= step)
   {
-    luaL_error(L, "no argument.");
-    return 0;
+    h = (h ^ (uint8_t)s[len - 1]) * 16777619u;
   }
-  if (lua_istable(L, 2))
+  return h;
+}
+
+static bool enc_value_equal(const ENC_VALUE *a, const ENC_VALUE *b)
+{
+  if (a->type != b->type || a->hash != b->hash)
   {
-    sym_idx = 2;
+    return false;
   }
 
-  if (lua_isboolean(L, 1))
+  switch (a->type)
   {
-    int value = lua_toboolean(L, 1);
-    lua_pushstring(L, value ? "\x01" : "\x00");
-    return 1;
+  case ENC_VALUE_NUMBER:
+    return a->isint == b->isint && a->bits == b->bits;
+  case ENC_VALUE_STRING:
+    return a->len == b->len &&
+           (a->ptr == b->ptr || memcmp(a->ptr, b->ptr, a->len) == 0);
+  default:
+    return a->ptr == b->ptr;
   }
+}
 
-  CTX ctx = {0};
-  ctx_init(&ctx, L);
-
-  packer(L, &ctx, obj_index);
+static bool enc_slots_grow(ENC *enc)
+{
+  uint32_t size = enc->slot_size ? enc->slot_size * 2 : 256;
+  uint32_t *slots = calloc(size, sizeof(uint32_t));
+  if (!slots)
+  {
+    return false;
+  }
 
-  uint8_t flag = 0;
-  BYTEARRAY bodystream;
-  bytearray_alloc(&bodystream, 64);
-  bytearray_write8(&bodystream, flag); // place holder.
+  uint32_t i = 0;
+  for (; i < enc->slot_size; i++)
+  {
+    uint32_t id = enc->slots[i];
+    if (id)
+    {
+      uint32_t pos = enc->values[id - 1].hash & (size - 1);
+      while (slots[pos])
+      {
+        pos = (pos + 1) & (size - 1);
+      }
+      slots[pos] = id;
+    }
+  }
 
-  lua_newtable(L);
-  int index_map_idx = lua_gettop(L);
-  uint32_t index = 2;
+  free(enc->slots);
+  enc->slots = slots;
+  enc->slot_size = size;
+  return true;
+}
 
-  if (!sym_idx)
+static uint32_t enc_value_append(ENC *enc, const ENC_VALUE *value)
+{
+  if (enc->value_count == enc->value_size)
   {
-    lua_newtable(L);
+    uint32_t size = enc->value_size ? enc->value_size * 2 : 64;
+    ENC_VALUE *values = realloc(enc->values, size * sizeof(ENC_VALUE));
+    if (!values)
+    {
+      enc->error = "out of memory.";
+      return 0;
+    }
+    enc->values = values;
+    enc->value_size = size;
   }
-  else
-  {
-    lua_rawgeti(L, sym_idx, SYM_INDEX_INDEX);
-    index = lua_tointeger(L, -1);
-    lua_pop(L, 1);
 
-    lua_rawgeti(L, sym_idx, SYM_INDEX_MAP);
+  enc->values[enc->value_count] = *value;
+  return enc->value_count++;
+}
+
+static void enc_value_sym(lua_State *L, ENC *enc, int idx, ENC_VALUE *value)
+{
+  if (!enc->sym_map_idx)
+  {
+    return;
   }
-  int sym_map_idx = lua_gettop(L);
 
-  lua_pushboolean(L, false);
-  lua_pushinteger(L, FALSE_INDEX);
-  lua_rawset(L, index_map_idx);
+  lua_pushvalue(L, idx);
+  lua_rawget(L, enc->sym_map_idx);
+  if (!lua_isnil(L, -1))
+  {
+    value->sym = true;
+    value->index = lua_tointeger(L, -1);
+  }
+  lua_pop(L, 1);
+}
 
-  lua_pushboolean(L, true);
-  lua_pushinteger(L, TRUE_INDEX);
-  lua_rawset(L, index_map_idx);
+// return the id of the value at idx, *added is set if it's seen first time.
+static uint32_t enc_intern(lua_State *L, ENC *enc, int idx, bool *added)
+{
+  ENC_VALUE value;
+  memset(&value, 0, sizeof(value));
+  *added = false;
 
-  // ---------------------------------------------------------------------------
-  if (ctx.number_count > 0)
+  switch (lua_type(L, idx))
   {
-    flag |= HAS_NUMBER_MASK;
-    uint32_t realcount = 0;
+  case LUA_TBOOLEAN:
+    return lua_toboolean(L, idx) ? ENC_TRUE_ID : ENC_FALSE_ID;
+  case LUA_TNUMBER:
+  {
+    value.type = ENC_VALUE_NUMBER;
+    value.number = lua_tonumber(L, idx);
+    if (value.number != value.number)
+    {
+      enc->error = "table index is NaN";
+      return 0;
+    }
+    // same key as lua table does, 1 and 1.0 are the same number.
+#if (LUA_VERSION_NUM >= 503)
+    if (lua_isinteger(L, idx))
+    {
+      value.isint = true;
+      value.bits = (uint64_t)lua_tointeger(L, idx);
+    }
+    else
+#endif
+        if (floor(value.number) == value.number &&
+            value.number >= -9223372036854775808.0 &&
+            value.number < 9223372036854775808.0)
+    {
+      value.isint = true;
+      value.bits = (uint64_t)(int64_t)value.number;
+    }
+    else
+    {
+      memcpy(&value.bits, &value.number, sizeof(value.bits));
+    }
+    value.hash = enc_hash_bits(value.bits ^ value.isint);
+    value.u30 = !(floor(value.number) != value.number ||
+                  value.number >= MAX_U30 || value.number < 0);
+    value.varint = value.isint && !value.u30;
+    break;
+  }
+  case LUA_TSTRING:
+    value.type = ENC_VALUE_STRING;
+    value.ptr = lua_tolstring(L, idx, &value.len);
+    value.hash = enc_hash_string(value.ptr, value.len);
+    break;
+  case LUA_TTABLE:
+    value.type = ENC_VALUE_TABLE;
+    value.ptr = lua_topointer(L, idx);
+    value.hash = enc_hash_bits((uintptr_t)value.ptr);
+    break;
+  default:
+    // never shared, just resolve it from the symbol table.
+    value.type = ENC_VALUE_OTHER;
+    enc_value_sym(L, enc, idx, &value);
+    return enc_value_append(enc, &value);
+  }
 
-    BYTEARRAY d;
-    bytearray_alloc(&d, 0);
+  if (enc->slot_used * 2 >= enc->slot_size && !enc_slots_grow(enc))
+  {
+    enc->error = "out of memory.";
+    return 0;
+  }
 
-    lua_rawgeti(L, ctx.index, CTX_INDEX_NUMBERS);
-    int i = 1;
-    for (; i <= ctx.number_count; i++)
+  uint32_t mask = enc->slot_size - 1;
+  uint32_t pos = value.hash & mask;
+  while (enc->slots[pos])
+  {
+    uint32_t id = enc->slots[pos] - 1;
+    if (enc_value_equal(&enc->values[id], &value))
     {
-      lua_rawgeti(L, -1, i);
+      return id;
+    }
+    pos = (pos + 1) & mask;
+  }
 
-      lua_pushvalue(L, -1);
-      lua_rawget(L, sym_map_idx);
-      if (lua_isnil(L, -1))
-      {
-        lua_pop(L, 1);
-        ffi_stream_add_d64(&d, lua_tonumber(L, -1));
-        lua_pushinteger(L, index + (++realcount));
-        lua_rawset(L, index_map_idx);
-      }
-      else
+  if (value.type == ENC_VALUE_TABLE)
+  {
+    if (enc->table_count == enc->table_size)
+    {
+      uint32_t size = enc->table_size ? enc->table_size * 2 : 16;
+      ENC_TABLE *tables = realloc(enc->tables, size * sizeof(ENC_TABLE));
+      if (!tables)
       {
-        lua_pop(L, 2); // pop sym number idx & number
+        enc->error = "out of memory.";
+        return 0;
       }
+      enc->tables = tables;
+      enc->table_size = size;
     }
-    lua_pop(L, 1);
-
-    ffi_stream_add_u30(&bodystream, realcount);
-    bytearray_read_ready(&d);
-    bytearray_writebuffer(&bodystream, d.buffer, d.total);
-
-    bytearray_dealloc(&d);
-
-    index += realcount;
+    memset(&enc->tables[enc->table_count], 0, sizeof(ENC_TABLE));
+    value.table = enc->table_count++;
+  }
+  else if (value.type == ENC_VALUE_STRING)
+  {
+    enc->string_count++;
+  }
+  else if (value.u30)
+  {
+    enc->u30_count++;
+  }
+  else if (value.varint)
+  {
+    enc->varint_count++;
+  }
+  else
+  {
+    enc->number_count++;
   }
 
-  // ---------------------------------------------------------------------------
-  if (ctx.u30_count > 0)
+  enc_value_sym(L, enc, idx, &value);
+  uint32_t id = enc_value_append(enc, &value);
+  if (enc->error)
   {
-    flag |= HAS_U30_MASK;
-    uint32_t realcount = 0;
+    return 0;
+  }
 
-    BYTEARRAY d;
-    bytearray_alloc(&d, 0);
+  enc->slots[pos] = id + 1;
+  enc->slot_used++;
+  *added = true;
+  return id;
+}
 
-    lua_rawgeti(L, ctx.index, CTX_INDEX_U30S);
-    int i = 1;
-    for (; i <= ctx.u30_count; i++)
+static bool enc_table_push(ENC *enc, uint32_t table, const ENC_PAIR *pair)
+{
+  ENC_TABLE *t = &enc->tables[table];
+  if (t->count == t->size)
+  {
+    uint32_t size = t->size ? t->size * 2 : 8;
+    ENC_PAIR *pairs = realloc(t->pairs, size * sizeof(ENC_PAIR));
+    if (!pairs)
     {
-      lua_rawgeti(L, -1, i);
-
-      lua_pushvalue(L, -1);
-      lua_rawget(L, sym_map_idx);
-      if (lua_isnil(L, -1))
-      {
-        lua_pop(L, 1);
-        ffi_stream_add_u30(&d, lua_tointeger(L, -1));
-        lua_pushinteger(L, index + (++realcount));
-        lua_rawset(L, index_map_idx);
-      }
-      else
-      {
-        lua_pop(L, 2); // pop sym u30 idx & u30
-      }
+      enc->error = "out of memory.";
+      return false;
     }
-    lua_pop(L, 1);
+    t->pairs = pairs;
+    t->size = size;
+  }
 
-    ffi_stream_add_u30(&bodystream, realcount);
-    bytearray_read_ready(&d);
-    bytearray_writebuffer(&bodystream, d.buffer, d.total);
+  t->pairs[t->count++] = *pair;
+  return true;
+}
 
-    bytearray_dealloc(&d);
+// walk in the same order as packer(), so tables get the same indexes.
+static uint32_t enc_collect(lua_State *L, ENC *enc, int idx)
+{
+  bool added = false;
+  uint32_t id = enc_intern(L, enc, idx, &added);
+  if (!added || enc->values[id].type != ENC_VALUE_TABLE)
+  {
+    return id;
+  }
 
-    index += realcount;
+  if (!lua_checkstack(L, 4))
+  {
+    enc->error = "table nested too deep.";
+    return id;
   }
 
-  // ---------------------------------------------------------------------------
-  if (ctx.string_count > 0)
+  uint32_t table = enc->values[id].table;
+
+  lua_pushnil(L);
+  while (lua_next(L, idx) != 0)
   {
-    flag |= HAS_STRING_MASK;
-    uint32_t realcount = 0;
+    int value_idx = lua_gettop(L);
+    int key_idx = lua_gettop(L) - 1;
 
-    BYTEARRAY d;
-    bytearray_alloc(&d, 0);
+    ENC_PAIR pair;
+    pair.key = enc_collect(L, enc, key_idx);
+    pair.value = enc_collect(L, enc, value_idx);
 
-    lua_rawgeti(L, ctx.index, CTX_INDEX_STRINGS);
-    int i = 1;
-    for (; i <= ctx.string_count; i++)
+    int keytype = lua_type(L, key_idx);
+    pair.numkey = keytype == LUA_TNUMBER;
+    pair.num = 0;
+    if (keytype == LUA_TNUMBER || keytype == LUA_TSTRING)
     {
-      lua_rawgeti(L, -1, i);
-
-      lua_pushvalue(L, -1);
-      lua_rawget(L, sym_map_idx);
-      if (lua_isnil(L, -1))
-      {
-        lua_pop(L, 1);
-        size_t len;
-        const char *buf = lua_tolstring(L, -1, &len);
-        ffi_stream_add_string(&d, buf, len);
-        lua_pushinteger(L, index + (++realcount));
-        lua_rawset(L, index_map_idx);
-      }
-      else
+      // string keys like "1" are skipped the same way in the hash part.
+      lua_Number n = lua_tonumber(L, key_idx);
+      if (n > 0 && n <= UINT32_MAX && floor(n) == n)
       {
-        lua_pop(L, 2); // pop sym u30 idx & u30
+        pair.num = (uint32_t)n;
       }
     }
-    lua_pop(L, 1);
 
-    ffi_stream_add_u30(&bodystream, realcount);
-    bytearray_read_ready(&d);
-    bytearray_writebuffer(&bodystream, d.buffer, d.total);
+    if (enc->error || !enc_table_push(enc, table, &pair))
+    {
+      lua_pop(L, 2);
+      break;
+    }
+
+    lua_pop(L, 1);
+  }
 
-    bytearray_dealloc(&d);
+  return id;
+}
 
-    index += realcount;
+static void enc_free(ENC *enc)
+{
+  uint32_t i = 0;
+  for (; i < enc->table_count; i++)
+  {
+    free(enc->tables[i].pairs);
   }
-  // ---------------------------------------------------------------------------
-  if (ctx.table_count)
+  free(enc->tables);
+  free(enc->values);
+  free(enc->slots);
+}
+
+static uint32_t enc_u30_size(uint32_t u)
+{
+  uint32_t size = 1;
+  while (u >>= 7)
   {
-    flag |= HAS_TABLE_MASK;
-    ffi_stream_add_u30(&bodystream, ctx.table_count);
+    size++;
+  }
+  return size;
+}
 
-    lua_rawgeti(L, ctx.index, CTX_INDEX_TABLES);
-    int i = 1;
-    for (; i <= ctx.table_count; i++)
+// assign indexes to the non-symbol values of a section.
+static uint32_t enc_section_index(ENC *enc, uint8_t type, bool u30,
+                                  bool varint, uint32_t index)
+{
+  uint32_t realcount = 0;
+  uint32_t i = 0;
+  for (; i < enc->value_count; i++)
+  {
+    ENC_VALUE *value = &enc->values[i];
+    if (value->type == type && value->u30 == u30 && value->varint == varint &&
+        !value->sym)
     {
-      lua_rawgeti(L, -1, i);
-      lua_pushinteger(L, index + i);
-      lua_rawset(L, index_map_idx);
+      value->index = index + (++realcount);
     }
+  }
+  return realcount;
+}
 
-    for (i = 1; i <= ctx.table_count; i++)
+static bool enc_write_tables(ENC *enc, BYTEARRAY *bodystream)
+{
+  uint32_t maxcount = 0;
+  uint32_t i = 0;
+  for (; i < enc->table_count; i++)
+  {
+    if (enc->tables[i].count > maxcount)
     {
-      lua_rawgeti(L, -1, i);
-      int tb_idx = lua_gettop(L);
-
-      BYTEARRAY d;
-      bytearray_alloc(&d, 0);
-
-      int tb_count = 0;
-      while (true) {
-        lua_rawgeti(L, tb_idx, tb_count + 1);
-        if(lua_isnil(L, -1)) {
-          lua_pop(L, 1);
-          break;
-        }
-        tb_count++;
+      maxcount = enc->tables[i].count;
+    }
+  }
 
-        int value_idx = lua_gettop(L);
-        lua_pushvalue(L, value_idx);
-        lua_rawget(L, sym_map_idx);
-        if (lua_isnil(L, -1))
-        {
-          lua_pop(L, 1);
-          lua_pushvalue(L, value_idx);
-          lua_rawget(L, index_map_idx);
-        }
-        ffi_stream_add_u30(&d, lua_tointeger(L, -1));
-        lua_pop(L, 1);
+  // pair position + 1 of array keys.
+  uint32_t *array = malloc((maxcount ? maxcount : 1) * sizeof(uint32_t));
+  if (!array)
+  {
+    return false;
+  }
 
-        lua_pop(L, 1);
-      }
+  const ENC_VALUE *values = enc->values;
+  for (i = 0; i < enc->table_count; i++)
+  {
+    const ENC_TABLE *t = &enc->tables[i];
+    memset(array, 0, t->count * sizeof(uint32_t));
 
-      lua_pushnil(L);
-      while (lua_next(L, tb_idx) != 0)
+    uint32_t j = 0;
+    for (; j < t->count; j++)
+    {
+      const ENC_PAIR *pair = &t->pairs[j];
+      if (pair->numkey && pair->num > 0 && pair->num <= t->count)
       {
-        int value_idx = lua_gettop(L);
-        int key_idx = lua_gettop(L) - 1;
-
-        // ignore previously added array part.
-        lua_Number value = lua_tonumber(L, -2);
-        // suppose index no more than max int.
-        if (value == (int)value && value <= tb_count && value > 0) {
-          lua_pop(L, 1);
-          continue;
-        }
-
-        // d:AddU30(sym_map[k] or index_map[k])
-        lua_pushvalue(L, key_idx);
-        lua_rawget(L, sym_map_idx);
-        if (lua_isnil(L, -1))
-        {
-          lua_pop(L, 1);
-          lua_pushvalue(L, key_idx);
-          lua_rawget(L, index_map_idx);
-        }
-        ffi_stream_add_u30(&d, lua_tointeger(L, -1));
-        lua_pop(L, 1);
-
-        // d:AddU30(sym_map[v] or index_map[v])
-        lua_pushvalue(L, value_idx);
-        lua_rawget(L, sym_map_idx);
-        if (lua_isnil(L, -1))
-        {
-          lua_pop(L, 1);
-          lua_pushvalue(L, value_idx);
-          lua_rawget(L, index_map_idx);
-        }
-        ffi_stream_add_u30(&d, lua_tointeger(L, -1));
-        lua_pop(L, 1);
-
-        lua_pop(L, 1);
+        array[pair->num - 1] = j + 1;
       }
+    }
 
-      lua_pop(L, 1);
-
-      bytearray_read_ready(&d);
-
-      BYTEARRAY d2;
-      bytearray_alloc(&d2, 0);
-      ffi_stream_add_u30(&d2, tb_count);
-      bytearray_read_ready(&d2);
+    uint32_t tb_count = 0;
+    while (tb_count < t->count && array[tb_count])
+    {
+      tb_count++;
+    }
 
-      ffi_stream_add_u30(&bodystream, d.total + d2.total);
-      ffi_stream_add_bytes(&bodystream, (const char *)d2.buffer, d2.total);
-      ffi_stream_add_bytes(&bodystream, (const char *)d.buffer, d.total);
+    uint32_t len = enc_u30_size(tb_count);
+    for (j = 0; j < tb_count; j++)
+    {
+      len += enc_u30_size(values[t->pairs[array[j] - 1].value].index);
+    }
+    for (j = 0; j < t->count; j++)
+    {
+      const ENC_PAIR *pair = &t->pairs[j];
+      if (pair->num > 0 && pair->num <= tb_count)
+      {
+        continue;
+      }
+      len += enc_u30_size(values[pair->key].index);
+      len += enc_u30_size(values[pair->value].index);
+    }
 
-      bytearray_dealloc(&d2);
-      bytearray_dealloc(&d);
+    ffi_stream_add_u30(bodystream, len);
+    ffi_stream_add_u30(bodystream, tb_count);
+    for (j = 0; j < tb_count; j++)
+    {
+      ffi_stream_add_u30(bodystream,
+                         values[t->pairs[array[j] - 1].value].index);
+    }
+    for (j = 0; j < t->count; j++)
+    {
+      const ENC_PAIR *pair = &t->pairs[j];
+      if (pair->num > 0 && pair->num <= tb_count)
+      {
+        continue;
+      }
+      ffi_stream_add_u30(bodystream, values[pair->key].index);
+      ffi_stream_add_u30(bodystream, values[pair->value].index);
     }
-    lua_pop(L, 1);
   }
 
-  bytearray_read_ready(&bodystream);
-  *((uint8_t *)bodystream.buffer) = flag;
-  lua_pushlstring(L, (const char *)bodystream.buffer, bodystream.total);
-
-  bytearray_dealloc(&bodystream);
-  return 1;
+  free(array);
+  return true;
 }
 
-LUA_API int luafan_objectbuf_decode(lua_State *L)
+LUA_API int luafan_objectbuf_encode(lua_State *L)
 {
-  size_t len;
-  const char *buf = luaL_checklstring(L, 1, &len);
-  BYTEARRAY input;
+  int sym_idx = 0;
+  if (lua_isnoneornil(L, 1))
+  {
+    luaL_error(L, "no argument.");
+    return 0;
+  }
+  if (lua_istable(L, 2))
+  {
+    sym_idx = 2;
+  }
+
+  if (lua_isboolean(L, 1))
+  {
+    int value = lua_toboolean(L, 1);
+    lua_pushstring(L, value ? "\x01" : "\x00");
+    return 1;
+  }
+
+  ENC enc;
+  memset(&enc, 0, sizeof(enc));
+  uint32_t index = 2;
+
+  if (sym_idx)
+  {
+    lua_rawgeti(L, sym_idx, SYM_INDEX_INDEX);
+    index = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+
+    lua_rawgeti(L, sym_idx, SYM_INDEX_MAP);
+    enc.sym_map_idx = lua_gettop(L);
+  }
+
+  ENC_VALUE boolean;
+  memset(&boolean, 0, sizeof(boolean));
+  boolean.type = ENC_VALUE_BOOLEAN;
+
+  boolean.index = FALSE_INDEX;
+  lua_pushboolean(L, false);
+  enc_value_sym(L, &enc, lua_gettop(L), &boolean);
+  lua_pop(L, 1);
+  enc_value_append(&enc, &boolean);
+
+  boolean.sym = false;
+  boolean.index = TRUE_INDEX;
+  lua_pushboolean(L, true);
+  enc_value_sym(L, &enc, lua_gettop(L), &boolean);
+  lua_pop(L, 1);
+  enc_value_append(&enc, &boolean);
+
+  if (!enc.error)
+  {
+    enc_collect(L, &enc, 1);
+  }
+  if (enc.error)
+  {
+    const char *error = enc.error;
+    enc_free(&enc);
+    return luaL_error(L, "%s", error);
+  }
+
+  uint8_t flag = 0;
+  BYTEARRAY bodystream;
+  bytearray_alloc(&bodystream, 64);
+  bytearray_write8(&bodystream, flag); // place holder.
+
+  uint32_t i = 0;
+
+  // ---------------------------------------------------------------------------
+  if (enc.number_count > 0)
+  {
+    flag |= HAS_NUMBER_MASK;
+    uint32_t realcount =
+        enc_section_index(&enc, ENC_VALUE_NUMBER, false, false, index);
+
+    ffi_stream_add_u30(&bodystream, realcount);
+    for (i = 0; i < enc.value_count; i++)
+    {
+      const ENC_VALUE *value = &enc.values[i];
+      if (value->type == ENC_VALUE_NUMBER && !value->u30 && !value->varint &&
+          !value->sym)
+      {
+        ffi_stream_add_d64(&bodystream, value->number);
+      }
+    }
+
+    index += realcount;
+  }
+
+  // ---------------------------------------------------------------------------
+  if (enc.u30_count > 0)
+  {
+    flag |= HAS_U30_MASK;
+    uint32_t realcount =
+        enc_section_index(&enc, ENC_VALUE_NUMBER, true, false, index);
+
+    ffi_stream_add_u30(&bodystream, realcount);
+    for (i = 0; i < enc.value_count; i++)
+    {
+      const ENC_VALUE *value = &enc.values[i];
+      if (value->type == ENC_VALUE_NUMBER && value->u30 && !value->sym)
+      {
+        ffi_stream_add_u30(&bodystream, (uint32_t)value->number);
+      }
+    }
+
+    index += realcount;
+  }
+
+  // ---------------------------------------------------------------------------
+  if (enc.varint_count > 0)
+  {
+    flag |= HAS_VARINT_MASK;
+    uint32_t realcount =
+        enc_section_index(&enc, ENC_VALUE_NUMBER, false, true, index);
+
+    ffi_stream_add_u30(&bodystream, realcount);
+    for (i = 0; i < enc.value_count; i++)
+    {
+      const ENC_VALUE *value = &enc.values[i];
+      if (value->type == ENC_VALUE_NUMBER && value->varint && !value->sym)
+      {
+        ffi_stream_add_svarint(&bodystream, (int64_t)value->bits);
+      }
+    }
+
+    index += realcount;
+  }
+
+  // ---------------------------------------------------------------------------
+  if (enc.string_count > 0)
+  {
+    flag |= HAS_STRING_MASK;
+    uint32_t realcount =
+        enc_section_index(&enc, ENC_VALUE_STRING, false, false, index);
+
+    ffi_stream_add_u30(&bodystream, realcount);
+    for (i = 0; i < enc.value_count; i++)
+    {
+      const ENC_VALUE *value = &enc.values[i];
+      if (value->type == ENC_VALUE_STRING && !value->sym)
+      {
+        ffi_stream_add_string(&bodystream, value->ptr, value->len);
+      }
+    }
+
+    index += realcount;
+  }
+
+  // ---------------------------------------------------------------------------
+  if (enc.table_count)
+  {
+    flag |= HAS_TABLE_MASK;
+    ffi_stream_add_u30(&bodystream, enc.table_count);
+
+    for (i = 0; i < enc.value_count; i++)
+    {
+      ENC_VALUE *value = &enc.values[i];
+      if (value->type == ENC_VALUE_TABLE && !value->sym)
+      {
+        value->index = index + value->table + 1;
+      }
+    }
+
+    if (!enc_write_tables(&enc, &bodystream))
+    {
+      bytearray_dealloc(&bodystream);
+      enc_free(&enc);
+      return luaL_error(L, "out of memory.");
+    }
+  }
+
+  enc_free(&enc);
+
+  bytearray_read_ready(&bodystream);
+  *((uint8_t *)bodystream.buffer) = flag;
+  lua_pushlstring(L, (const char *)bodystream.buffer, bodystream.total);
+
+  bytearray_dealloc(&bodystream);
+  return 1;
+}
+
+LUA_API int luafan_objectbuf_decode(lua_State *L)
+{
+  size_t len;
+  const char *buf = luaL_checklstring(L, 1, &len);
+  BYTEARRAY input;
   bytearray_wrap_buffer(&input, (uint8_t *)buf, len); // will not change buf.
 
   int sym_idx = 0;
@@ -565,262 +961,1454 @@ LUA_API int luafan_objectbuf_decode(lua_State *L)
     break;
   }
 
-  lua_newtable(L);
-  int index_map_idx = lua_gettop(L);
+  lua_newtable(L);
+  int index_map_idx = lua_gettop(L);
+
+  uint32_t index = 2;
+
+  if (!sym_idx)
+  {
+    lua_newtable(L);
+  }
+  else
+  {
+    lua_rawgeti(L, sym_idx, SYM_INDEX_INDEX);
+    index = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+
+    lua_rawgeti(L, sym_idx, SYM_INDEX_MAP_VK);
+  }
+  int sym_map_vk_idx = lua_gettop(L);
+
+  int last_top = index + 1;
+
+  if (!sym_idx)
+  {
+    lua_pushboolean(L, false);
+    lua_rawseti(L, index_map_idx, FALSE_INDEX);
+    lua_pushboolean(L, true);
+    lua_rawseti(L, index_map_idx, TRUE_INDEX);
+  }
+
+  if (flag & HAS_NUMBER_MASK)
+  {
+    last_top = index + 1;
+    uint32_t count = 0;
+    if (!ffi_stream_get_u30(&input, &count))
+    {
+      lua_pushnil(L);
+      lua_pushliteral(L, "decode failed, can't get `number` count.");
+      return 2;
+    }
+    uint32_t i = 1;
+    for (; i <= count; i++)
+    {
+      double result = 0;
+      if (!ffi_stream_get_d64(&input, &result))
+      {
+        lua_pushnil(L);
+        lua_pushfstring(L, "decode failed, can't decode `number`, %d/%d", i, count);
+        return 2;
+      }
+      lua_pushnumber(L, result);
+      lua_rawseti(L, index_map_idx, ++index);
+    }
+  }
+
+  if (flag & HAS_U30_MASK)
+  {
+    last_top = index + 1;
+    uint32_t count = 0;
+    if (!ffi_stream_get_u30(&input, &count))
+    {
+      lua_pushnil(L);
+      lua_pushliteral(L, "decode failed.");
+      return 2;
+    }
+    uint32_t i = 1;
+    for (; i <= count; i++)
+    {
+      uint32_t count = 0;
+      if (!ffi_stream_get_u30(&input, &count))
+      {
+        lua_pushnil(L);
+        lua_pushliteral(L, "decode failed.");
+        return 2;
+      }
+      lua_pushinteger(L, count);
+      lua_rawseti(L, index_map_idx, ++index);
+    }
+  }
+
+  if (flag & HAS_VARINT_MASK)
+  {
+    last_top = index + 1;
+    uint32_t count = 0;
+    if (!ffi_stream_get_u30(&input, &count))
+    {
+      lua_pushnil(L);
+      lua_pushliteral(L, "decode failed.");
+      return 2;
+    }
+    uint32_t i = 1;
+    for (; i <= count; i++)
+    {
+      int64_t value = 0;
+      if (!ffi_stream_get_svarint(&input, &value))
+      {
+        lua_pushnil(L);
+        lua_pushliteral(L, "decode failed.");
+        return 2;
+      }
+      stream_push_int64(L, value);
+      lua_rawseti(L, index_map_idx, ++index);
+    }
+  }
+
+  if (flag & HAS_STRING_MASK)
+  {
+    last_top = index + 1;
+    uint32_t count = 0;
+    if (!ffi_stream_get_u30(&input, &count))
+    {
+      lua_pushnil(L);
+      lua_pushliteral(L, "decode failed.");
+      return 2;
+    }
+    uint32_t i = 1;
+    for (; i <= count; i++)
+    {
+      uint8_t *buff = NULL;
+      size_t buflen = 0;
+      ffi_stream_get_string(&input, &buff, &buflen);
+      if (!buff)
+      {
+        lua_pushnil(L);
+        lua_pushliteral(L, "decode failed.");
+        return 2;
+      }
+      lua_pushlstring(L, (const char *)buff, buflen);
+      lua_rawseti(L, index_map_idx, ++index);
+    }
+  }
+
+  if (flag & HAS_TABLE_MASK)
+  {
+    last_top = index + 1;
+    uint32_t count = 0;
+    if (!ffi_stream_get_u30(&input, &count))
+    {
+      lua_pushnil(L);
+      lua_pushliteral(L, "decode failed.");
+      return 2;
+    }
+    uint32_t i = 1;
+    for (; i <= count; i++)
+    {
+      lua_newtable(L);
+      lua_rawseti(L, index_map_idx, index + i);
+    }
+
+    i = 1;
+    for (; i <= count; i++)
+    {
+      uint8_t *buff = NULL;
+      size_t buflen = 0;
+      ffi_stream_get_string(&input, &buff, &buflen);
+      if (!buff)
+      {
+        lua_pushnil(L);
+        lua_pushliteral(L, "decode failed.");
+        return 2;
+      }
+      BYTEARRAY d = {0};
+      bytearray_wrap_buffer(&d, buff, buflen);
+
+      lua_rawgeti(L, index_map_idx, index + i);
+
+      uint32_t count = 0;
+      if (!ffi_stream_get_u30(&d, &count))
+      {
+        lua_pushnil(L);
+        lua_pushliteral(L, "'count' decode failed.");
+        return 2;
+      }
+
+      int j = 1;
+      for(; j <= count; j++) {
+        uint32_t vi = 0;
+        if (!ffi_stream_get_u30(&d, &vi))
+        {
+          lua_pushnil(L);
+          lua_pushliteral(L, "'i value' decode failed.");
+          return 2;
+        }
+
+        lua_rawgeti(L, sym_map_vk_idx, vi);
+        if (lua_isnil(L, -1))
+        {
+          lua_pop(L, 1);
+          lua_rawgeti(L, index_map_idx, vi);
+
+          if (lua_isnil(L, -1))
+          {
+            luaL_error(L, "vi=%d not found.", vi);
+          }
+        }
+
+        lua_rawseti(L, -2, j);
+      }
+
+      while (bytearray_read_available(&d) > 0)
+      {
+        uint32_t ki = 0;
+        if (!ffi_stream_get_u30(&d, &ki))
+        {
+          lua_pushnil(L);
+          lua_pushliteral(L, "decode failed.");
+          return 2;
+        }
+        uint32_t vi = 0;
+        if (!ffi_stream_get_u30(&d, &vi))
+        {
+          lua_pushnil(L);
+          lua_pushliteral(L, "decode failed.");
+          return 2;
+        }
+
+        lua_rawgeti(L, sym_map_vk_idx, ki);
+        if (lua_isnil(L, -1))
+        {
+          lua_pop(L, 1);
+          lua_rawgeti(L, index_map_idx, ki);
+
+          if (lua_isnil(L, -1))
+          {
+            luaL_error(L, "ki=%d not found.", ki);
+          }
+        }
+
+        lua_rawgeti(L, sym_map_vk_idx, vi);
+        if (lua_isnil(L, -1))
+        {
+          lua_pop(L, 1);
+          lua_rawgeti(L, index_map_idx, vi);
+
+          if (lua_isnil(L, -1))
+          {
+            luaL_error(L, "vi=%d not found.", vi);
+          }
+        }
+
+        lua_rawset(L, -3);
+      }
+      lua_pop(L, 1);
+    }
+  }
+
+  lua_rawgeti(L, sym_map_vk_idx, last_top);
+  if (lua_isnil(L, -1))
+  {
+    lua_rawgeti(L, index_map_idx, last_top);
+  }
+  // return sym_map_vk[last_top] or index_map[last_top]
+  // lua_pushvalue(L, index_map_idx);
+  // lua_pushinteger(L, last_top);
+  return 1;
+}
+
+// incremental decoder, fed with chunks of an encoded buffer, keeps the
+// decoded values in index_map and the state of the item being read.
+#define LUA_OBJECTBUF_DECODER_TYPE "OBJECTBUF_DECODER_TYPE"
+
+#define DEC_STATE_FLAG 0
+#define DEC_STATE_COUNT 1
+#define DEC_STATE_NUMBER 2
+#define DEC_STATE_U30 3
+#define DEC_STATE_STRING_LEN 4
+#define DEC_STATE_STRING 5
+#define DEC_STATE_TABLE_LEN 6
+#define DEC_STATE_TABLE_COUNT 7
+#define DEC_STATE_TABLE_ARRAY 8
+#define DEC_STATE_TABLE_KEY 9
+#define DEC_STATE_TABLE_VALUE 10
+#define DEC_STATE_DONE 11
+#define DEC_STATE_ERROR 12
+#define DEC_STATE_VARINT 13
+
+typedef struct
+{
+  int state;
+  uint8_t flag;
+  // section being read, one of HAS_*_MASK.
+  uint8_t section;
+  uint32_t count;
+  uint32_t item;
+
+  uint32_t index;
+  uint32_t last_top;
+
+  // u30/varint/d64 split across chunks.
+  uint32_t u30;
+  uint64_t varint;
+  uint8_t shift;
+  uint8_t d64[8];
+  uint8_t d64_len;
+
+  // string split across chunks.
+  char *str;
+  uint32_t str_len;
+  uint32_t str_read;
+
+  // table being read, body_left counts down the bytes of its body.
+  uint32_t table;
+  uint32_t body_left;
+  uint32_t array_count;
+  uint32_t array_item;
+  uint32_t key;
+
+  int indexMapRef;
+  int symRef;
+  char error[64];
+} OBJECTBUF_DECODER;
+
+static void decoder_reset(lua_State *L, OBJECTBUF_DECODER *dec)
+{
+  CLEAR_REF(L, dec->indexMapRef)
+  if (dec->str)
+  {
+    free(dec->str);
+    dec->str = NULL;
+  }
+
+  int symRef = dec->symRef;
+  memset(dec, 0, sizeof(OBJECTBUF_DECODER));
+  dec->state = DEC_STATE_FLAG;
+  dec->indexMapRef = LUA_NOREF;
+  dec->symRef = symRef;
+}
+
+static void decoder_fail(OBJECTBUF_DECODER *dec, const char *error)
+{
+  snprintf(dec->error, sizeof(dec->error), "%s", error);
+  dec->state = DEC_STATE_ERROR;
+}
+
+// read a u30 byte by byte, body is the byte budget of the current table body.
+static int decoder_u30(OBJECTBUF_DECODER *dec, const uint8_t **pos,
+                       const uint8_t *end, uint32_t *body, uint32_t *result)
+{
+  while (*pos < end)
+  {
+    if (body && *body == 0)
+    {
+      return -1;
+    }
+
+    uint8_t b = *((*pos)++);
+    if (body)
+    {
+      (*body)--;
+    }
+
+    dec->u30 |= ((uint32_t)(b & 127) << dec->shift);
+    dec->shift += 7;
+
+    if ((b & 128) == 0 || dec->shift > 30)
+    {
+      *result = dec->u30;
+      dec->u30 = 0;
+      dec->shift = 0;
+      return 1;
+    }
+  }
+
+  return (body && *body == 0) ? -1 : 0;
+}
+
+// read a varint64 byte by byte, at most 10 bytes.
+static int decoder_varint(OBJECTBUF_DECODER *dec, const uint8_t **pos,
+                          const uint8_t *end, uint64_t *result)
+{
+  while (*pos < end)
+  {
+    uint8_t b = *((*pos)++);
+    dec->varint |= ((uint64_t)(b & 127) << dec->shift);
+    dec->shift += 7;
+
+    if ((b & 128) == 0 || dec->shift > 63)
+    {
+      *result = dec->varint;
+      dec->varint = 0;
+      dec->shift = 0;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// move to the next section after `section`, or finish.
+static void decoder_next_section(OBJECTBUF_DECODER *dec, uint8_t section)
+{
+  static const uint8_t sections[] = {HAS_NUMBER_MASK, HAS_U30_MASK,
+                                     HAS_VARINT_MASK, HAS_STRING_MASK,
+                                     HAS_TABLE_MASK};
+  int i = 0;
+  if (section)
+  {
+    while (sections[i] != section)
+    {
+      i++;
+    }
+    i++;
+  }
+
+  for (; i < (int)sizeof(sections); i++)
+  {
+    if (dec->flag & sections[i])
+    {
+      dec->section = sections[i];
+      dec->last_top = dec->index + 1;
+      dec->state = DEC_STATE_COUNT;
+      return;
+    }
+  }
+
+  dec->state = DEC_STATE_DONE;
+}
+
+// push sym_map_vk[i] or index_map[i], nothing pushed if not found.
+static bool decoder_lookup(lua_State *L, int sym_map_vk_idx, int index_map_idx,
+                           uint32_t i)
+{
+  if (sym_map_vk_idx)
+  {
+    lua_rawgeti(L, sym_map_vk_idx, i);
+    if (!lua_isnil(L, -1))
+    {
+      return true;
+    }
+    lua_pop(L, 1);
+  }
+
+  lua_rawgeti(L, index_map_idx, i);
+  if (lua_isnil(L, -1))
+  {
+    lua_pop(L, 1);
+    return false;
+  }
+  return true;
+}
+
+static void decoder_next_item(OBJECTBUF_DECODER *dec, int state)
+{
+  if (++dec->item > dec->count)
+  {
+    decoder_next_section(dec, dec->section);
+  }
+  else
+  {
+    dec->state = state;
+  }
+}
+
+static void decoder_next_table(OBJECTBUF_DECODER *dec)
+{
+  if (++dec->table > dec->count)
+  {
+    decoder_next_section(dec, dec->section);
+  }
+  else
+  {
+    dec->state = DEC_STATE_TABLE_LEN;
+  }
+}
+
+static void decoder_run(lua_State *L, OBJECTBUF_DECODER *dec, int index_map_idx,
+                        int sym_map_vk_idx, const uint8_t **ppos,
+                        const uint8_t *end)
+{
+  const uint8_t *pos = *ppos;
+  uint32_t value = 0;
+  int ret = 0;
+
+  while (dec->state != DEC_STATE_DONE && dec->state != DEC_STATE_ERROR)
+  {
+    switch (dec->state)
+    {
+    case DEC_STATE_FLAG:
+      if (pos == end)
+      {
+        goto out;
+      }
+      dec->flag = *pos++;
+      if (dec->flag == 0 || dec->flag == 1)
+      {
+        dec->state = DEC_STATE_DONE;
+      }
+      else
+      {
+        dec->last_top = dec->index + 1;
+        decoder_next_section(dec, 0);
+      }
+      break;
+    case DEC_STATE_COUNT:
+      ret = decoder_u30(dec, &pos, end, NULL, &dec->count);
+      if (ret == 0)
+      {
+        goto out;
+      }
+      dec->item = 1;
+      if (dec->section == HAS_TABLE_MASK)
+      {
+        uint32_t i = 1;
+        for (; i <= dec->count; i++)
+        {
+          lua_newtable(L);
+          lua_rawseti(L, index_map_idx, dec->index + i);
+        }
+        dec->table = 1;
+        dec->state = DEC_STATE_TABLE_LEN;
+      }
+      else
+      {
+        dec->state = dec->section == HAS_NUMBER_MASK
+                         ? DEC_STATE_NUMBER
+                         : dec->section == HAS_U30_MASK
+                               ? DEC_STATE_U30
+                               : dec->section == HAS_VARINT_MASK
+                                     ? DEC_STATE_VARINT
+                                     : DEC_STATE_STRING_LEN;
+      }
+      if (dec->count == 0)
+      {
+        decoder_next_section(dec, dec->section);
+      }
+      break;
+    case DEC_STATE_NUMBER:
+    {
+      size_t n = sizeof(dec->d64) - dec->d64_len;
+      if ((size_t)(end - pos) < n)
+      {
+        n = end - pos;
+      }
+      memcpy(dec->d64 + dec->d64_len, pos, n);
+      pos += n;
+      dec->d64_len += n;
+      if (dec->d64_len < sizeof(dec->d64))
+      {
+        goto out;
+      }
+
+      double result = 0;
+      memcpy(&result, dec->d64, sizeof(result));
+      dec->d64_len = 0;
+      lua_pushnumber(L, result);
+      lua_rawseti(L, index_map_idx, ++dec->index);
+      decoder_next_item(dec, DEC_STATE_NUMBER);
+      break;
+    }
+    case DEC_STATE_U30:
+      ret = decoder_u30(dec, &pos, end, NULL, &value);
+      if (ret == 0)
+      {
+        goto out;
+      }
+      lua_pushinteger(L, value);
+      lua_rawseti(L, index_map_idx, ++dec->index);
+      decoder_next_item(dec, DEC_STATE_U30);
+      break;
+    case DEC_STATE_VARINT:
+    {
+      uint64_t u = 0;
+      ret = decoder_varint(dec, &pos, end, &u);
+      if (ret == 0)
+      {
+        goto out;
+      }
+      stream_push_int64(L, (int64_t)(u >> 1) ^ -(int64_t)(u & 1));
+      lua_rawseti(L, index_map_idx, ++dec->index);
+      decoder_next_item(dec, DEC_STATE_VARINT);
+      break;
+    }
+    case DEC_STATE_STRING_LEN:
+      ret = decoder_u30(dec, &pos, end, NULL, &dec->str_len);
+      if (ret == 0)
+      {
+        goto out;
+      }
+      dec->str_read = 0;
+      if ((size_t)(end - pos) >= dec->str_len)
+      {
+        // whole string in this chunk, no copy.
+        lua_pushlstring(L, (const char *)pos, dec->str_len);
+        lua_rawseti(L, index_map_idx, ++dec->index);
+        pos += dec->str_len;
+        decoder_next_item(dec, DEC_STATE_STRING_LEN);
+      }
+      else
+      {
+        dec->str = malloc(dec->str_len);
+        if (!dec->str)
+        {
+          decoder_fail(dec, "decode failed, out of memory.");
+          break;
+        }
+        dec->state = DEC_STATE_STRING;
+      }
+      break;
+    case DEC_STATE_STRING:
+    {
+      size_t n = dec->str_len - dec->str_read;
+      if ((size_t)(end - pos) < n)
+      {
+        n = end - pos;
+      }
+      memcpy(dec->str + dec->str_read, pos, n);
+      pos += n;
+      dec->str_read += n;
+      if (dec->str_read < dec->str_len)
+      {
+        goto out;
+      }
+
+      lua_pushlstring(L, dec->str, dec->str_len);
+      lua_rawseti(L, index_map_idx, ++dec->index);
+      free(dec->str);
+      dec->str = NULL;
+      decoder_next_item(dec, DEC_STATE_STRING_LEN);
+      break;
+    }
+    case DEC_STATE_TABLE_LEN:
+      ret = decoder_u30(dec, &pos, end, NULL, &dec->body_left);
+      if (ret == 0)
+      {
+        goto out;
+      }
+      dec->state = DEC_STATE_TABLE_COUNT;
+      if (dec->body_left == 0)
+      {
+        decoder_fail(dec, "'count' decode failed.");
+      }
+      break;
+    case DEC_STATE_TABLE_COUNT:
+      ret = decoder_u30(dec, &pos, end, &dec->body_left, &dec->array_count);
+      if (ret == 0)
+      {
+        goto out;
+      }
+      else if (ret < 0)
+      {
+        decoder_fail(dec, "'count' decode failed.");
+        break;
+      }
+      dec->array_item = 0;
+      dec->state = DEC_STATE_TABLE_ARRAY;
+      break;
+    case DEC_STATE_TABLE_ARRAY:
+      if (dec->array_item == dec->array_count)
+      {
+        if (dec->body_left == 0)
+        {
+          decoder_next_table(dec);
+        }
+        else
+        {
+          dec->state = DEC_STATE_TABLE_KEY;
+        }
+        break;
+      }
+      ret = decoder_u30(dec, &pos, end, &dec->body_left, &value);
+      if (ret == 0)
+      {
+        goto out;
+      }
+      else if (ret < 0)
+      {
+        decoder_fail(dec, "'i value' decode failed.");
+        break;
+      }
+
+      lua_rawgeti(L, index_map_idx, dec->index + dec->table);
+      if (!decoder_lookup(L, sym_map_vk_idx, index_map_idx, value))
+      {
+        lua_pop(L, 1);
+        char error[64];
+        snprintf(error, sizeof(error), "vi=%u not found.", value);
+        decoder_fail(dec, error);
+        break;
+      }
+      lua_rawseti(L, -2, ++dec->array_item);
+      lua_pop(L, 1);
+      break;
+    case DEC_STATE_TABLE_KEY:
+      ret = decoder_u30(dec, &pos, end, &dec->body_left, &dec->key);
+      if (ret == 0)
+      {
+        goto out;
+      }
+      dec->state = DEC_STATE_TABLE_VALUE;
+      if (ret < 0)
+      {
+        decoder_fail(dec, "decode failed.");
+      }
+      break;
+    case DEC_STATE_TABLE_VALUE:
+      ret = decoder_u30(dec, &pos, end, &dec->body_left, &value);
+      if (ret == 0)
+      {
+        goto out;
+      }
+      else if (ret < 0)
+      {
+        decoder_fail(dec, "decode failed.");
+        break;
+      }
+
+      lua_rawgeti(L, index_map_idx, dec->index + dec->table);
+      if (!decoder_lookup(L, sym_map_vk_idx, index_map_idx, dec->key))
+      {
+        lua_pop(L, 1);
+        char error[64];
+        snprintf(error, sizeof(error), "ki=%u not found.", dec->key);
+        decoder_fail(dec, error);
+        break;
+      }
+      if (!decoder_lookup(L, sym_map_vk_idx, index_map_idx, value))
+      {
+        lua_pop(L, 2);
+        char error[64];
+        snprintf(error, sizeof(error), "vi=%u not found.", value);
+        decoder_fail(dec, error);
+        break;
+      }
+      lua_rawset(L, -3);
+      lua_pop(L, 1);
+
+      if (dec->body_left == 0)
+      {
+        decoder_next_table(dec);
+      }
+      else
+      {
+        dec->state = DEC_STATE_TABLE_KEY;
+      }
+      break;
+    }
+  }
+
+out:
+  *ppos = pos;
+}
+
+LUA_API int luafan_objectbuf_decoder(lua_State *L)
+{
+  OBJECTBUF_DECODER *dec = lua_newuserdata(L, sizeof(OBJECTBUF_DECODER));
+  memset(dec, 0, sizeof(OBJECTBUF_DECODER));
+  dec->indexMapRef = LUA_NOREF;
+  dec->symRef = LUA_NOREF;
+  luaL_getmetatable(L, LUA_OBJECTBUF_DECODER_TYPE);
+  lua_setmetatable(L, -2);
+
+  if (lua_istable(L, 1))
+  {
+    lua_pushvalue(L, 1);
+    dec->symRef = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+
+  decoder_reset(L, dec);
+  return 1;
+}
+
+LUA_API int luafan_objectbuf_decoder_feed(lua_State *L)
+{
+  OBJECTBUF_DECODER *dec =
+      luaL_checkudata(L, 1, LUA_OBJECTBUF_DECODER_TYPE);
+  // a stream (e.g. a slice) is read in place, the rest is left in it.
+  BYTEARRAY *ba = stream_test(L, 2);
+  size_t len = 0;
+  const uint8_t *buf = NULL;
+  if (ba)
+  {
+    len = bytearray_read_available(ba);
+    buf = len > 0 ? ba->buffer + ba->offset : (const uint8_t *)"";
+  }
+  else
+  {
+    buf = (const uint8_t *)luaL_checklstring(L, 2, &len);
+  }
+  const uint8_t *pos = buf;
+
+  if (dec->state == DEC_STATE_ERROR)
+  {
+    lua_pushnil(L);
+    lua_pushstring(L, dec->error);
+    return 2;
+  }
+
+  int sym_map_vk_idx = 0;
+  if (dec->symRef != LUA_NOREF)
+  {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, dec->symRef);
+    lua_rawgeti(L, -1, SYM_INDEX_MAP_VK);
+    sym_map_vk_idx = lua_gettop(L);
+  }
+
+  if (dec->indexMapRef == LUA_NOREF)
+  {
+    lua_newtable(L);
+    if (sym_map_vk_idx)
+    {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, dec->symRef);
+      lua_rawgeti(L, -1, SYM_INDEX_INDEX);
+      dec->index = lua_tointeger(L, -1);
+      lua_pop(L, 2);
+    }
+    else
+    {
+      dec->index = 2;
+      lua_pushboolean(L, false);
+      lua_rawseti(L, -2, FALSE_INDEX);
+      lua_pushboolean(L, true);
+      lua_rawseti(L, -2, TRUE_INDEX);
+    }
+    lua_pushvalue(L, -1);
+    dec->indexMapRef = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  else
+  {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, dec->indexMapRef);
+  }
+  int index_map_idx = lua_gettop(L);
+
+  decoder_run(L, dec, index_map_idx, sym_map_vk_idx, &pos, buf + len);
+  if (ba)
+  {
+    bytearray_readbuffer(ba, NULL, pos - buf);
+  }
+
+  if (dec->state == DEC_STATE_ERROR)
+  {
+    CLEAR_REF(L, dec->indexMapRef)
+    lua_pushnil(L);
+    lua_pushstring(L, dec->error);
+    return 2;
+  }
+  else if (dec->state != DEC_STATE_DONE)
+  {
+    lua_pushboolean(L, false);
+    return 1;
+  }
+
+  lua_pushboolean(L, true);
+  if (dec->flag == 0 || dec->flag == 1)
+  {
+    lua_pushboolean(L, dec->flag);
+  }
+  else if (!decoder_lookup(L, sym_map_vk_idx, index_map_idx, dec->last_top))
+  {
+    lua_pushnil(L);
+  }
+
+  // ready for the next object.
+  decoder_reset(L, dec);
+
+  if (!ba && pos < buf + len)
+  {
+    lua_pushlstring(L, (const char *)pos, buf + len - pos);
+    return 3;
+  }
+  return 2;
+}
+
+LUA_API int luafan_objectbuf_decoder_reset(lua_State *L)
+{
+  OBJECTBUF_DECODER *dec =
+      luaL_checkudata(L, 1, LUA_OBJECTBUF_DECODER_TYPE);
+  decoder_reset(L, dec);
+  return 0;
+}
+
+LUA_API int luafan_objectbuf_decoder_gc(lua_State *L)
+{
+  OBJECTBUF_DECODER *dec =
+      luaL_checkudata(L, 1, LUA_OBJECTBUF_DECODER_TYPE);
+  decoder_reset(L, dec);
+  CLEAR_REF(L, dec->symRef)
+  return 0;
+}
+
+LUA_API int luafan_objectbuf_symbol(lua_State *L)
+{
+  if (lua_gettop(L) == 0)
+  {
+    luaL_error(L, "no argument.");
+  }
+
+  CTX ctx = {0};
+  ctx_init(&ctx, L);
+
+  packer(L, &ctx, 1);
+
+  lua_settop(L, ctx.index);
+  return 1;
+}
+
+// compiled codec for a fixed message shape, fields are written in the declared
+// order after a presence bitmap, with no keys and no index tables. encoded data
+// starts with a hash of the schema, so a peer with another schema is detected.
+#define LUA_OBJECTBUF_CODEC_TYPE "OBJECTBUF_CODEC_TYPE"
+
+#define SCHEMA_TYPE_BOOLEAN 1
+#define SCHEMA_TYPE_U30 2
+#define SCHEMA_TYPE_NUMBER 3
+#define SCHEMA_TYPE_STRING 4
+#define SCHEMA_TYPE_OBJECT 5
+#define SCHEMA_TYPE_SCHEMA 6
+
+typedef struct SCHEMA SCHEMA;
+
+typedef struct
+{
+  uint8_t type;
+  SCHEMA *schema;
+} SCHEMA_FIELD;
+
+struct SCHEMA
+{
+  uint32_t count;
+  // integer field names, for lua_createtable.
+  uint32_t array_count;
+  // field names by position.
+  int namesRef;
+  SCHEMA_FIELD *fields;
+};
+
+typedef struct
+{
+  SCHEMA *schema;
+  uint32_t tag;
+  char error[128];
+} OBJECTBUF_CODEC;
+
+static const char *schema_type_names[] = {NULL, "boolean", "u30", "number",
+                                          "string", "object"};
+
+static uint32_t schema_hash(uint32_t h, const char *data, size_t len)
+{
+  size_t i = 0;
+  for (; i < len; i++)
+  {
+    h = (h ^ (uint8_t)data[i]) * 16777619u;
+  }
+  return h;
+}
+
+static void schema_free(lua_State *L, SCHEMA *schema)
+{
+  if (!schema)
+  {
+    return;
+  }
+
+  uint32_t i = 0;
+  for (; i < schema->count; i++)
+  {
+    schema_free(L, schema->fields[i].schema);
+  }
+  CLEAR_REF(L, schema->namesRef)
+  free(schema->fields);
+  free(schema);
+}
+
+static void schema_field_name(lua_State *L, int names_idx, uint32_t i,
+                              char *buf, size_t len)
+{
+  lua_rawgeti(L, names_idx, i + 1);
+  if (lua_type(L, -1) == LUA_TSTRING)
+  {
+    snprintf(buf, len, "%s", lua_tostring(L, -1));
+  }
+  else
+  {
+    snprintf(buf, len, "[%d]", (int)lua_tointeger(L, -1));
+  }
+  lua_pop(L, 1);
+}
+
+static SCHEMA *schema_compile(lua_State *L, int idx, uint32_t *hash,
+                              char *error, size_t error_len)
+{
+  if (!lua_checkstack(L, 6))
+  {
+    snprintf(error, error_len, "schema nested too deep.");
+    return NULL;
+  }
+
+  SCHEMA *schema = calloc(1, sizeof(SCHEMA));
+  if (!schema)
+  {
+    snprintf(error, error_len, "out of memory.");
+    return NULL;
+  }
+  schema->namesRef = LUA_NOREF;
+  schema->count = lua_objlen(L, idx);
+  schema->fields = calloc(schema->count ? schema->count : 1,
+                          sizeof(SCHEMA_FIELD));
+  if (!schema->fields)
+  {
+    free(schema);
+    snprintf(error, error_len, "out of memory.");
+    return NULL;
+  }
+
+  lua_createtable(L, schema->count, 0);
+  int names_idx = lua_gettop(L);
+
+  *hash = schema_hash(*hash, "{", 1);
+
+  uint32_t i = 0;
+  for (; i < schema->count; i++)
+  {
+    lua_rawgeti(L, idx, i + 1);
+    int field_idx = lua_gettop(L);
+    if (!lua_istable(L, field_idx))
+    {
+      snprintf(error, error_len, "schema field %u should be {name, type}.",
+               i + 1);
+      goto failed;
+    }
+
+    lua_rawgeti(L, field_idx, 1);
+    int name_type = lua_type(L, -1);
+    if (name_type == LUA_TNUMBER)
+    {
+      schema->array_count++;
+      char buf[32];
+      int len = snprintf(buf, sizeof(buf), "[%d]", (int)lua_tointeger(L, -1));
+      *hash = schema_hash(*hash, buf, len);
+    }
+    else if (name_type == LUA_TSTRING)
+    {
+      size_t len = 0;
+      const char *name = lua_tolstring(L, -1, &len);
+      *hash = schema_hash(*hash, name, len);
+    }
+    else
+    {
+      snprintf(error, error_len,
+               "schema field %u name should be string or integer.", i + 1);
+      goto failed;
+    }
+    lua_rawseti(L, names_idx, i + 1);
+
+    SCHEMA_FIELD *field = &schema->fields[i];
+    lua_rawgeti(L, field_idx, 2);
+    if (lua_istable(L, -1))
+    {
+      field->type = SCHEMA_TYPE_SCHEMA;
+      field->schema =
+          schema_compile(L, lua_gettop(L), hash, error, error_len);
+      if (!field->schema)
+      {
+        goto failed;
+      }
+    }
+    else
+    {
+      const char *type = lua_tostring(L, -1);
+      int t = SCHEMA_TYPE_BOOLEAN;
+      for (; type && t <= SCHEMA_TYPE_OBJECT; t++)
+      {
+        if (strcmp(type, schema_type_names[t]) == 0)
+        {
+          break;
+        }
+      }
+      if (!type || t > SCHEMA_TYPE_OBJECT)
+      {
+        snprintf(error, error_len,
+                 "schema field %u type should be boolean, u30, number, "
+                 "string, object or a schema table.",
+                 i + 1);
+        goto failed;
+      }
+      field->type = t;
+      *hash = schema_hash(*hash, ":", 1);
+      *hash = schema_hash(*hash, type, strlen(type));
+    }
+    *hash = schema_hash(*hash, ";", 1);
+
+    lua_settop(L, names_idx);
+  }
+
+  *hash = schema_hash(*hash, "}", 1);
 
-  uint32_t index = 2;
+  schema->namesRef = luaL_ref(L, LUA_REGISTRYINDEX);
+  return schema;
 
-  if (!sym_idx)
-  {
-    lua_newtable(L);
-  }
-  else
-  {
-    lua_rawgeti(L, sym_idx, SYM_INDEX_INDEX);
-    index = lua_tointeger(L, -1);
-    lua_pop(L, 1);
+failed:
+  lua_settop(L, names_idx - 1);
+  schema_free(L, schema);
+  return NULL;
+}
 
-    lua_rawgeti(L, sym_idx, SYM_INDEX_MAP_VK);
+static bool schema_encode(lua_State *L, OBJECTBUF_CODEC *codec, SCHEMA *schema,
+                          int obj_idx, BYTEARRAY *ba)
+{
+  if (!lua_checkstack(L, 6))
+  {
+    snprintf(codec->error, sizeof(codec->error), "object nested too deep.");
+    return false;
   }
-  int sym_map_vk_idx = lua_gettop(L);
 
-  int last_top = index + 1;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, schema->namesRef);
+  int names_idx = lua_gettop(L);
 
-  if (!sym_idx)
+  // presence bitmap, filled while writing the fields.
+  size_t bitmap = ba->offset;
+  uint32_t i = 0;
+  for (; i < (schema->count + 7) / 8; i++)
   {
-    lua_pushboolean(L, false);
-    lua_rawseti(L, index_map_idx, FALSE_INDEX);
-    lua_pushboolean(L, true);
-    lua_rawseti(L, index_map_idx, TRUE_INDEX);
+    bytearray_write8(ba, 0);
   }
 
-  if (flag & HAS_NUMBER_MASK)
+  for (i = 0; i < schema->count; i++)
   {
-    last_top = index + 1;
-    uint32_t count = 0;
-    if (!ffi_stream_get_u30(&input, &count))
+    lua_rawgeti(L, names_idx, i + 1);
+    lua_rawget(L, obj_idx);
+    int value_idx = lua_gettop(L);
+    int type = lua_type(L, value_idx);
+    if (type == LUA_TNIL)
     {
-      lua_pushnil(L);
-      lua_pushliteral(L, "decode failed, can't get `number` count.");
-      return 2;
+      lua_pop(L, 1);
+      continue;
     }
-    uint32_t i = 1;
-    for (; i <= count; i++)
+    ba->buffer[bitmap + i / 8] |= 1 << (i % 8);
+
+    SCHEMA_FIELD *field = &schema->fields[i];
+    bool ok = true;
+    switch (field->type)
     {
-      double result = 0;
-      if (!ffi_stream_get_d64(&input, &result))
+    case SCHEMA_TYPE_BOOLEAN:
+      ok = type == LUA_TBOOLEAN;
+      if (ok)
       {
-        lua_pushnil(L);
-        lua_pushfstring(L, "decode failed, can't decode `number`, %d/%d", i, count);
-        return 2;
+        bytearray_write8(ba, lua_toboolean(L, value_idx));
       }
-      lua_pushnumber(L, result);
-      lua_rawseti(L, index_map_idx, ++index);
-    }
-  }
-
-  if (flag & HAS_U30_MASK)
-  {
-    last_top = index + 1;
-    uint32_t count = 0;
-    if (!ffi_stream_get_u30(&input, &count))
+      break;
+    case SCHEMA_TYPE_U30:
     {
-      lua_pushnil(L);
-      lua_pushliteral(L, "decode failed.");
-      return 2;
+      lua_Number n = lua_tonumber(L, value_idx);
+      ok = type == LUA_TNUMBER && floor(n) == n && n >= 0 && n < MAX_U30;
+      if (ok)
+      {
+        ffi_stream_add_u30(ba, (uint32_t)n);
+      }
+      break;
     }
-    uint32_t i = 1;
-    for (; i <= count; i++)
+    case SCHEMA_TYPE_NUMBER:
+      ok = type == LUA_TNUMBER;
+      if (ok)
+      {
+        ffi_stream_add_d64(ba, lua_tonumber(L, value_idx));
+      }
+      break;
+    case SCHEMA_TYPE_STRING:
+      ok = type == LUA_TSTRING;
+      if (ok)
+      {
+        size_t len = 0;
+        const char *str = lua_tolstring(L, value_idx, &len);
+        ffi_stream_add_string(ba, str, len);
+      }
+      break;
+    case SCHEMA_TYPE_OBJECT:
     {
-      uint32_t count = 0;
-      if (!ffi_stream_get_u30(&input, &count))
+      lua_pushcfunction(L, &luafan_objectbuf_encode);
+      lua_pushvalue(L, value_idx);
+      if (lua_pcall(L, 1, 1, 0) != 0)
       {
-        lua_pushnil(L);
-        lua_pushliteral(L, "decode failed.");
-        return 2;
+        char name[64];
+        schema_field_name(L, names_idx, i, name, sizeof(name));
+        snprintf(codec->error, sizeof(codec->error), "field %s: %s", name,
+                 lua_tostring(L, -1));
+        lua_settop(L, names_idx - 1);
+        return false;
       }
-      lua_pushinteger(L, count);
-      lua_rawseti(L, index_map_idx, ++index);
+      size_t len = 0;
+      const char *str = lua_tolstring(L, -1, &len);
+      ffi_stream_add_string(ba, str, len);
+      break;
+    }
+    case SCHEMA_TYPE_SCHEMA:
+      ok = type == LUA_TTABLE;
+      if (ok && !schema_encode(L, codec, field->schema, value_idx, ba))
+      {
+        lua_settop(L, names_idx - 1);
+        return false;
+      }
+      break;
+    }
+
+    if (!ok)
+    {
+      char name[64];
+      schema_field_name(L, names_idx, i, name, sizeof(name));
+      snprintf(codec->error, sizeof(codec->error),
+               "field %s expect %s, got %s.", name,
+               field->type == SCHEMA_TYPE_SCHEMA
+                   ? "table"
+                   : schema_type_names[field->type],
+               lua_typename(L, type));
+      lua_settop(L, names_idx - 1);
+      return false;
     }
+
+    lua_settop(L, names_idx);
   }
 
-  if (flag & HAS_STRING_MASK)
+  lua_pop(L, 1);
+  return true;
+}
+
+// push the decoded table on success.
+static bool schema_decode(lua_State *L, OBJECTBUF_CODEC *codec, SCHEMA *schema,
+                          BYTEARRAY *ba)
+{
+  if (!lua_checkstack(L, 6))
   {
-    last_top = index + 1;
-    uint32_t count = 0;
-    if (!ffi_stream_get_u30(&input, &count))
+    snprintf(codec->error, sizeof(codec->error), "data nested too deep.");
+    return false;
+  }
+
+  uint32_t bitmap_len = (schema->count + 7) / 8;
+  if (bytearray_read_available(ba) < bitmap_len)
+  {
+    snprintf(codec->error, sizeof(codec->error), "decode failed.");
+    return false;
+  }
+  const uint8_t *bitmap = ba->buffer + ba->offset;
+  bytearray_readbuffer(ba, NULL, bitmap_len);
+
+  lua_createtable(L, schema->array_count,
+                  schema->count - schema->array_count);
+  int obj_idx = lua_gettop(L);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, schema->namesRef);
+  int names_idx = lua_gettop(L);
+
+  uint32_t i = 0;
+  for (; i < schema->count; i++)
+  {
+    if (!(bitmap[i / 8] & (1 << (i % 8))))
     {
-      lua_pushnil(L);
-      lua_pushliteral(L, "decode failed.");
-      return 2;
+      continue;
     }
-    uint32_t i = 1;
-    for (; i <= count; i++)
+
+    lua_rawgeti(L, names_idx, i + 1);
+
+    bool ok = true;
+    switch (schema->fields[i].type)
     {
-      uint8_t *buff = NULL;
-      size_t buflen = 0;
-      ffi_stream_get_string(&input, &buff, &buflen);
-      if (!buff)
-      {
-        lua_pushnil(L);
-        lua_pushliteral(L, "decode failed.");
-        return 2;
-      }
-      lua_pushlstring(L, (const char *)buff, buflen);
-      lua_rawseti(L, index_map_idx, ++index);
+    case SCHEMA_TYPE_BOOLEAN:
+    {
+      uint8_t value = 0;
+      ok = bytearray_read8(ba, &value);
+      lua_pushboolean(L, value);
+      break;
     }
-  }
-
-  if (flag & HAS_TABLE_MASK)
-  {
-    last_top = index + 1;
-    uint32_t count = 0;
-    if (!ffi_stream_get_u30(&input, &count))
+    case SCHEMA_TYPE_U30:
     {
-      lua_pushnil(L);
-      lua_pushliteral(L, "decode failed.");
-      return 2;
+      uint32_t value = 0;
+      ok = ffi_stream_get_u30(ba, &value);
+      lua_pushinteger(L, value);
+      break;
     }
-    uint32_t i = 1;
-    for (; i <= count; i++)
+    case SCHEMA_TYPE_NUMBER:
     {
-      lua_newtable(L);
-      lua_rawseti(L, index_map_idx, index + i);
+      double value = 0;
+      ok = ffi_stream_get_d64(ba, &value);
+      lua_pushnumber(L, value);
+      break;
     }
-
-    i = 1;
-    for (; i <= count; i++)
+    case SCHEMA_TYPE_STRING:
+    case SCHEMA_TYPE_OBJECT:
     {
       uint8_t *buff = NULL;
       size_t buflen = 0;
-      ffi_stream_get_string(&input, &buff, &buflen);
-      if (!buff)
+      ffi_stream_get_string(ba, &buff, &buflen);
+      ok = buff != NULL;
+      if (!ok)
       {
-        lua_pushnil(L);
-        lua_pushliteral(L, "decode failed.");
-        return 2;
+        break;
+      }
+      if (schema->fields[i].type == SCHEMA_TYPE_STRING)
+      {
+        lua_pushlstring(L, (const char *)buff, buflen);
+        break;
       }
-      BYTEARRAY d = {0};
-      bytearray_wrap_buffer(&d, buff, buflen);
-
-      lua_rawgeti(L, index_map_idx, index + i);
 
-      uint32_t count = 0;
-      if (!ffi_stream_get_u30(&d, &count))
+      lua_pushcfunction(L, &luafan_objectbuf_decode);
+      lua_pushlstring(L, (const char *)buff, buflen);
+      if (lua_pcall(L, 1, 2, 0) != 0 || lua_isnil(L, -2))
       {
-        lua_pushnil(L);
-        lua_pushliteral(L, "'count' decode failed.");
-        return 2;
+        snprintf(codec->error, sizeof(codec->error), "%s",
+                 lua_isstring(L, -1) ? lua_tostring(L, -1) : "decode failed.");
+        lua_settop(L, obj_idx - 1);
+        return false;
+      }
+      lua_pop(L, 1);
+      break;
+    }
+    case SCHEMA_TYPE_SCHEMA:
+      if (!schema_decode(L, codec, schema->fields[i].schema, ba))
+      {
+        lua_settop(L, obj_idx - 1);
+        return false;
       }
+      break;
+    }
 
-      int j = 1;
-      for(; j <= count; j++) {
-        uint32_t vi = 0;
-        if (!ffi_stream_get_u30(&d, &vi))
-        {
-          lua_pushnil(L);
-          lua_pushliteral(L, "'i value' decode failed.");
-          return 2;
-        }
+    if (!ok)
+    {
+      snprintf(codec->error, sizeof(codec->error), "decode failed.");
+      lua_settop(L, obj_idx - 1);
+      return false;
+    }
 
-        lua_rawgeti(L, sym_map_vk_idx, vi);
-        if (lua_isnil(L, -1))
-        {
-          lua_pop(L, 1);
-          lua_rawgeti(L, index_map_idx, vi);
+    lua_rawset(L, obj_idx);
+  }
 
-          if (lua_isnil(L, -1))
-          {
-            luaL_error(L, "vi=%d not found.", vi);
-          }
-        }
+  lua_pop(L, 1);
+  return true;
+}
 
-        lua_rawseti(L, -2, j);
-      }
+LUA_API int luafan_objectbuf_compile(lua_State *L)
+{
+  luaL_checktype(L, 1, LUA_TTABLE);
 
-      while (bytearray_read_available(&d) > 0)
-      {
-        uint32_t ki = 0;
-        if (!ffi_stream_get_u30(&d, &ki))
-        {
-          lua_pushnil(L);
-          lua_pushliteral(L, "decode failed.");
-          return 2;
-        }
-        uint32_t vi = 0;
-        if (!ffi_stream_get_u30(&d, &vi))
-        {
-          lua_pushnil(L);
-          lua_pushliteral(L, "decode failed.");
-          return 2;
-        }
+  OBJECTBUF_CODEC *codec = lua_newuserdata(L, sizeof(OBJECTBUF_CODEC));
+  memset(codec, 0, sizeof(OBJECTBUF_CODEC));
+  luaL_getmetatable(L, LUA_OBJECTBUF_CODEC_TYPE);
+  lua_setmetatable(L, -2);
 
-        lua_rawgeti(L, sym_map_vk_idx, ki);
-        if (lua_isnil(L, -1))
-        {
-          lua_pop(L, 1);
-          lua_rawgeti(L, index_map_idx, ki);
+  uint32_t hash = 2166136261u;
+  codec->schema =
+      schema_compile(L, 1, &hash, codec->error, sizeof(codec->error));
+  if (!codec->schema)
+  {
+    return luaL_error(L, "%s", codec->error);
+  }
+  codec->tag = hash;
 
-          if (lua_isnil(L, -1))
-          {
-            luaL_error(L, "ki=%d not found.", ki);
-          }
-        }
+  return 1;
+}
 
-        lua_rawgeti(L, sym_map_vk_idx, vi);
-        if (lua_isnil(L, -1))
-        {
-          lua_pop(L, 1);
-          lua_rawgeti(L, index_map_idx, vi);
+LUA_API int luafan_objectbuf_codec_encode(lua_State *L)
+{
+  OBJECTBUF_CODEC *codec = luaL_checkudata(L, 1, LUA_OBJECTBUF_CODEC_TYPE);
+  luaL_checktype(L, 2, LUA_TTABLE);
 
-          if (lua_isnil(L, -1))
-          {
-            luaL_error(L, "vi=%d not found.", vi);
-          }
-        }
+  BYTEARRAY ba;
+  bytearray_alloc(&ba, 64);
 
-        lua_rawset(L, -3);
-      }
-      lua_pop(L, 1);
-    }
-  }
+  uint8_t tag[4] = {codec->tag & 0xff, (codec->tag >> 8) & 0xff,
+                    (codec->tag >> 16) & 0xff, (codec->tag >> 24) & 0xff};
+  bytearray_writebuffer(&ba, tag, sizeof(tag));
 
-  lua_rawgeti(L, sym_map_vk_idx, last_top);
-  if (lua_isnil(L, -1))
+  if (!schema_encode(L, codec, codec->schema, 2, &ba))
   {
-    lua_rawgeti(L, index_map_idx, last_top);
+    bytearray_dealloc(&ba);
+    return luaL_error(L, "%s", codec->error);
   }
-  // return sym_map_vk[last_top] or index_map[last_top]
-  // lua_pushvalue(L, index_map_idx);
-  // lua_pushinteger(L, last_top);
+
+  bytearray_read_ready(&ba);
+  lua_pushlstring(L, (const char *)ba.buffer, ba.total);
+  bytearray_dealloc(&ba);
   return 1;
 }
 
-LUA_API int luafan_objectbuf_symbol(lua_State *L)
+LUA_API int luafan_objectbuf_codec_decode(lua_State *L)
 {
-  if (lua_gettop(L) == 0)
+  OBJECTBUF_CODEC *codec = luaL_checkudata(L, 1, LUA_OBJECTBUF_CODEC_TYPE);
+  size_t len = 0;
+  const uint8_t *buf = (const uint8_t *)luaL_checklstring(L, 2, &len);
+
+  if (len < 4 || (buf[0] | (buf[1] << 8) | (buf[2] << 16) |
+                  ((uint32_t)buf[3] << 24)) != codec->tag)
   {
-    luaL_error(L, "no argument.");
+    lua_pushnil(L);
+    lua_pushliteral(L, "schema mismatch.");
+    return 2;
   }
 
-  CTX ctx = {0};
-  ctx_init(&ctx, L);
+  BYTEARRAY ba;
+  bytearray_wrap_buffer(&ba, (uint8_t *)buf + 4, len - 4); // will not change buf.
 
-  packer(L, &ctx, 1);
+  if (!schema_decode(L, codec, codec->schema, &ba))
+  {
+    lua_pushnil(L);
+    lua_pushstring(L, codec->error);
+    return 2;
+  }
 
-  lua_settop(L, ctx.index);
   return 1;
 }
 
+LUA_API int luafan_objectbuf_codec_gc(lua_State *L)
+{
+  OBJECTBUF_CODEC *codec = luaL_checkudata(L, 1, LUA_OBJECTBUF_CODEC_TYPE);
+  schema_free(L, codec->schema);
+  codec->schema = NULL;
+  return 0;
+}
+
 LUA_API int luaopen_fan_objectbuf_core(lua_State *L)
 {
   struct luaL_Reg objectbuflib[] = {
       {"encode", luafan_objectbuf_encode},
       {"decode", luafan_objectbuf_decode},
       {"symbol", luafan_objectbuf_symbol},
+      {"decoder", luafan_objectbuf_decoder},
+      {"compile", luafan_objectbuf_compile},
       {NULL, NULL},
   };
 
+  luaL_newmetatable(L, LUA_OBJECTBUF_CODEC_TYPE);
+  lua_pushcfunction(L, &luafan_objectbuf_codec_encode);
+  lua_setfield(L, -2, "encode");
+
+  lua_pushcfunction(L, &luafan_objectbuf_codec_decode);
+  lua_setfield(L, -2, "decode");
+
+  lua_pushstring(L, "__index");
+  lua_pushvalue(L, -2);
+  lua_rawset(L, -3);
+
+  lua_pushstring(L, "__gc");
+  lua_pushcfunction(L, &luafan_objectbuf_codec_gc);
+  lua_rawset(L, -3);
+
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, LUA_OBJECTBUF_DECODER_TYPE);
+  lua_pushcfunction(L, &luafan_objectbuf_decoder_feed);
+  lua_setfield(L, -2, "feed");
+
+  lua_pushcfunction(L, &luafan_objectbuf_decoder_reset);
+  lua_setfield(L, -2, "reset");
+
+  lua_pushstring(L, "__index");
+  lua_pushvalue(L, -2);
+  lua_rawset(L, -3);
+
+  lua_pushstring(L, "__gc");
+  lua_pushcfunction(L, &luafan_objectbuf_decoder_gc);
+  lua_rawset(L, -3);
+
+  lua_pop(L, 1);
+
   lua_newtable(L);
   luaL_register(L, NULL, objectbuflib);
   return 1;
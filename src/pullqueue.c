@@ -0,0 +1,156 @@
+#include "pullqueue.h"
+
+static TAILQ_HEAD(fan_pull_list, fan_pull) pull_queue =
+    TAILQ_HEAD_INITIALIZER(pull_queue);
+static int pull_count;
+static int pull_last_id;
+
+// onready runs once per loop iteration with ready objects, not per event.
+static lua_State *pull_mainthread;
+static int pull_onready_ref = LUA_NOREF;
+static struct event *pull_wakeup_ev;
+
+static void pull_wakeup_cb(evutil_socket_t fd, short what, void *arg)
+{
+  if (pull_onready_ref == LUA_NOREF || pull_count == 0)
+  {
+    return;
+  }
+
+  lua_State *mainthread = pull_mainthread;
+  lua_lock(mainthread);
+  lua_State *co = lua_newthread(mainthread);
+  PUSH_REF(mainthread);
+  lua_unlock(mainthread);
+
+  lua_rawgeti(co, LUA_REGISTRYINDEX, pull_onready_ref);
+  FAN_RESUME(co, mainthread, 0);
+  POP_REF(mainthread);
+
+  // ids left in the queue (onready took only some of them) would wait for
+  // the next fan_pull_ready otherwise, it only wakes up an empty queue.
+  if (pull_count > 0)
+  {
+    event_active(pull_wakeup_ev, EV_READ, 0);
+  }
+}
+
+int fan_pull_enable(FAN_PULL *pull)
+{
+  if (pull->id == 0)
+  {
+    pull_last_id = pull_last_id == INT_MAX ? 1 : pull_last_id + 1;
+    pull->id = pull_last_id;
+    pull->queued = false;
+  }
+  return pull->id;
+}
+
+void fan_pull_disable(FAN_PULL *pull)
+{
+  if (pull->queued)
+  {
+    TAILQ_REMOVE(&pull_queue, pull, next);
+    pull_count--;
+    pull->queued = false;
+  }
+  pull->id = 0;
+}
+
+void fan_pull_ready(FAN_PULL *pull)
+{
+  if (pull->id == 0 || pull->queued)
+  {
+    return;
+  }
+
+  TAILQ_INSERT_TAIL(&pull_queue, pull, next);
+  pull->queued = true;
+  pull_count++;
+
+  if (pull_count == 1 && pull_wakeup_ev)
+  {
+    event_active(pull_wakeup_ev, EV_READ, 0);
+  }
+}
+
+int fan_pull_next(void)
+{
+  FAN_PULL *pull = TAILQ_FIRST(&pull_queue);
+  if (!pull)
+  {
+    return 0;
+  }
+
+  TAILQ_REMOVE(&pull_queue, pull, next);
+  pull_count--;
+  pull->queued = false;
+  return pull->id;
+}
+
+int fan_pull_poll(int *ids, int max)
+{
+  int count = 0;
+  while (count < max)
+  {
+    int id = fan_pull_next();
+    if (id == 0)
+    {
+      break;
+    }
+    ids[count++] = id;
+  }
+  return count;
+}
+
+LUA_API int luafan_pull_onready(lua_State *L)
+{
+  CLEAR_REF(L, pull_onready_ref)
+  if (lua_isfunction(L, 1))
+  {
+    lua_pushvalue(L, 1);
+    pull_onready_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    pull_mainthread = utlua_mainthread(L);
+
+    if (!pull_wakeup_ev)
+    {
+      pull_wakeup_ev = event_new(event_mgr_base(), -1, 0, pull_wakeup_cb, NULL);
+    }
+    if (pull_count > 0)
+    {
+      event_active(pull_wakeup_ev, EV_READ, 0);
+    }
+  }
+  return 0;
+}
+
+LUA_API int luafan_pull_next(lua_State *L)
+{
+  int id = fan_pull_next();
+  if (id == 0)
+  {
+    return 0;
+  }
+  lua_pushinteger(L, id);
+  return 1;
+}
+
+LUA_API int luafan_pull_pending(lua_State *L)
+{
+  lua_pushinteger(L, pull_count);
+  return 1;
+}
+
+static const struct luaL_Reg pulllib[] = {
+    {"onready", luafan_pull_onready},
+    {"next", luafan_pull_next},
+    {"pending", luafan_pull_pending},
+    {NULL, NULL},
+};
+
+LUA_API int luaopen_fan_pull_core(lua_State *L)
+{
+  lua_newtable(L);
+  luaL_register(L, "pull", pulllib);
+  return 1;
+}
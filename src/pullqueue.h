@@ -0,0 +1,31 @@
+#ifndef pullqueue_h
+#define pullqueue_h
+
+#include "utlua.h"
+
+// an object in pull mode is queued when it has input or was closed, lua
+// takes ids from the queue instead of getting a callback per event.
+typedef struct fan_pull
+{
+  // 0 if pull mode is off.
+  int id;
+  bool queued;
+  TAILQ_ENTRY(fan_pull) next;
+} FAN_PULL;
+
+// give pull an id (kept if it has one), return the id.
+int fan_pull_enable(FAN_PULL *pull);
+
+// leave pull mode, taken out of the queue.
+void fan_pull_disable(FAN_PULL *pull);
+
+// queue pull if it's in pull mode and not queued yet.
+void fan_pull_ready(FAN_PULL *pull);
+
+// take the next ready id, 0 if the queue is empty.
+int fan_pull_next(void);
+
+// take up to max ready ids, return the count.
+int fan_pull_poll(int *ids, int max);
+
+#endif
@@ -0,0 +1,2535 @@
+#if defined(__APPLE__) && defined(__clang__)
+#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+#endif
+
+#include "timerwheel.h"
+#include "udpd.h"
+#include <math.h>
+#include <stddef.h>
+#include <sys/time.h>
+
+#if defined(__GNUC__) || defined(__clang__)
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RUDP_XOR_AVX2 1
+#endif
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#define LUA_RUDP_ENGINE_TYPE "RUDP_ENGINE_TYPE"
+#define LUA_RUDP_SESSION_TYPE "RUDP_SESSION_TYPE"
+
+// wire format, compatible with the lua connector:
+// <I4 output_index> <I2 count> <I2 package_index> [body]
+// a datagram of exactly RUDP_HEAD_SIZE bytes is the ack of that head.
+#define RUDP_HEAD_SIZE (4 + 2 + 2)
+
+// preserve first 4 bit.
+#define RUDP_MAX_OUTPUT_INDEX 0x0ffffff0
+#define RUDP_MAX_OUTPUT_INDEX_HALF (RUDP_MAX_OUTPUT_INDEX / 2)
+#define RUDP_WINDOW_CTRL 0x0ffffffe
+
+#define RUDP_MAX_PARTS 65535
+// default limit of a reassembled message, larger ones are dropped.
+#define RUDP_MAX_MESSAGE_SIZE (64 * 1024 * 1024)
+#define RUDP_CANCEL_BODY "N/A"
+
+// fec parity of a group of parts:
+// <I4 output_index | RUDP_FEC_FLAG> <I2 count> <I2 group + 1> [body]
+// body = xor of the group bodies padded to body_size, followed by
+// <I2 group_size> <I2 last_part_len>. the flag is in the reserved bits of
+// output_index, so receivers without fec (the lua connector too) drop it
+// as out of range, and never ack it.
+#define RUDP_FEC_FLAG 0x40000000
+#define RUDP_FEC_TRAILER_SIZE 4
+
+// udp header 8, ip header 20.
+#define RUDP_IP_UDP_HEAD_SIZE (8 + 20)
+
+#define RUDP_MIN_RTO 0.1
+#define RUDP_INITIAL_CWND 4
+#define RUDP_MIN_CWND 2
+
+// min_rtt older than this is replaced by the next sample.
+#define RUDP_MIN_RTT_WINDOW 10.0
+// delivery rate max filter length in round trips.
+#define RUDP_BW_ROUNDS 10
+// parts due within this are sent without waiting for the pacing timer.
+#define RUDP_PACING_SLACK 0.001
+
+#define RUDP_WHEEL_SLOTS 512
+
+enum
+{
+  RUDP_PART_PENDING = 0,
+  RUDP_PART_WAITING,
+  RUDP_PART_ACKED,
+};
+
+struct rudp_output;
+struct rudp_session;
+
+typedef struct
+{
+  // resend deadline while waiting for ack, must be the first member.
+  TIMERWHEEL_NODE timer;
+  struct rudp_output *output;
+
+  double sent_time;
+  // delivery count and time when the part was sent, for rate sampling.
+  double delivered_time;
+  uint64_t delivered;
+  uint8_t state;
+  bool resent;
+} RUDP_PART;
+
+typedef struct rudp_output
+{
+  TAILQ_ENTRY(rudp_output) next;
+  struct rudp_session *session;
+
+  uint32_t output_index;
+  uint32_t parts;
+  uint32_t acked;
+  uint32_t cursor; // no pending part before cursor.
+  bool cancel;
+
+  RUDP_PART *info;
+  const char *data;
+  size_t len;
+} RUDP_OUTPUT;
+
+// received parts by index, blocks of pointers allocated on demand so the
+// memory follows the data that arrived, not the count claimed by the head.
+#define RUDP_SPARSE_BLOCK 256
+
+typedef struct
+{
+  char ***blocks;
+  uint32_t size;
+} RUDP_SPARSE;
+
+typedef struct
+{
+  uint32_t output_index;
+  bool used;
+  bool done;
+  uint16_t count;
+  uint16_t received;
+  // size of the parts but the last one, as sent by the peer (its mtu may
+  // differ from ours), 0 until a full part or a parity arrives.
+  uint16_t part_size;
+  uint16_t last_len;
+  RUDP_SPARSE parts;
+
+  // fec parity by group, on the first parity package.
+  uint16_t fec;
+  RUDP_SPARSE parity;
+} RUDP_INCOMING;
+
+typedef struct
+{
+  lua_Number cwnd;
+  lua_Number ssthresh;
+
+  lua_Number srtt;
+  lua_Number rttvar;
+  lua_Number rto;
+  lua_Number min_rtt;
+  double min_rtt_time;
+  bool min_rtt_expired;
+
+  // losses of parts sent before this belong to the same loss episode.
+  double recovery_time;
+
+  // delivery rate estimation, in packets per second.
+  uint64_t delivered;
+  double delivered_time;
+  uint64_t next_round_delivered;
+  uint64_t round_count;
+  bool round_start;
+  double bw[RUDP_BW_ROUNDS];
+  double btl_bw;
+  lua_Number delivery_rate;
+
+  // cubic.
+  double w_max;
+  double w_est;
+  double epoch_start;
+  double origin;
+  double k;
+
+  // bbr.
+  int bbr_state;
+  double pacing_gain;
+  double cwnd_gain;
+  double full_bw;
+  int full_bw_count;
+  int cycle_index;
+  double cycle_start;
+  double probe_rtt_done;
+
+  lua_Number pacing_rate;
+  double next_send_time;
+} RUDP_CC;
+
+struct rudp_engine;
+
+typedef struct rudp_session
+{
+  struct rudp_engine *engine;
+  int selfRef;
+
+  TAILQ_ENTRY(rudp_session) next;
+  struct rudp_session *hash_next;
+
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+
+  uint32_t output_index;
+  uint32_t send_window;
+  uint32_t recv_window;
+
+  // parts per fec parity package, 0 disabled.
+  int fec;
+
+  bool recv_window_set;
+  bool window_sent;
+  bool paired;
+  bool suspended;
+  bool closed;
+
+  TAILQ_HEAD(, rudp_output) outputs;
+
+  // parts waiting for ack.
+  int waiting_count;
+
+  // ring of window_size + 1 slots, recv_head holds recv_window.
+  RUDP_INCOMING *incoming;
+  uint32_t recv_head;
+
+  RUDP_CC cc;
+  struct event *pacing_timer;
+
+  lua_Number latency;
+  lua_Number last_incoming_time;
+  lua_Number last_outgoing_time;
+  lua_Integer output_chain_count;
+  lua_Integer incoming_bytes_total;
+  lua_Integer outgoing_bytes_total;
+  lua_Integer udp_send_total;
+  lua_Integer udp_receive_total;
+  lua_Integer udp_resend_total;
+  lua_Integer udp_drop_total;
+  lua_Integer udp_loss_total;
+  lua_Integer udp_fec_send_total;
+  lua_Integer udp_fec_recover_total;
+  lua_Integer reuse;
+} RUDP_SESSION;
+
+// pluggable congestion control, selected by the `congestion` option.
+typedef struct
+{
+  const char *name;
+  void (*init)(RUDP_SESSION *session);
+  void (*on_ack)(RUDP_SESSION *session, const RUDP_PART *info, double now);
+  // called once per loss episode.
+  void (*on_loss)(RUDP_SESSION *session, const RUDP_PART *info, double now);
+  // return packets per second, 0 to disable pacing.
+  double (*pacing)(RUDP_SESSION *session);
+} RUDP_CC_OPS;
+
+TAILQ_HEAD(rudp_session_list, rudp_session);
+
+typedef struct rudp_engine
+{
+  lua_State *mainthread;
+
+  UDPD_CONN *conn;
+  int connRef;
+
+  int onReadRef;
+  int onAcceptRef;
+  int onSentRef;
+  int onTimeoutRef;
+
+  size_t body_size;
+  size_t max_message_size;
+  uint32_t window_size;
+  int waiting_count;
+  int none_paired_waiting_count;
+  int max_cwnd;
+  int waiting_capacity;
+  int fec;
+  char *fec_buf;
+  double timeout;
+  double check_interval;
+  bool accept;
+  bool pacing;
+  bool closed;
+
+  const RUDP_CC_OPS *cc;
+
+  // resend deadlines of all the waiting parts.
+  TIMERWHEEL wheel;
+  struct event *timer;
+
+  struct rudp_session_list sessions;
+  RUDP_SESSION **buckets;
+  size_t bucket_count;
+  size_t session_count;
+} RUDP_ENGINE;
+
+static lua_Integer rudp_send_total = 0;
+static lua_Integer rudp_receive_total = 0;
+static lua_Integer rudp_resend_total = 0;
+
+#define RUDP_FIELD_INTEGER 0
+#define RUDP_FIELD_NUMBER 1
+#define RUDP_FIELD_INT 2
+
+typedef struct
+{
+  const char *name;
+  size_t offset;
+  int type;
+} RUDP_FIELD;
+
+static const RUDP_FIELD rudp_session_fields[] = {
+    {"latency", offsetof(RUDP_SESSION, latency), RUDP_FIELD_NUMBER},
+    {"last_incoming_time", offsetof(RUDP_SESSION, last_incoming_time), RUDP_FIELD_NUMBER},
+    {"last_outgoing_time", offsetof(RUDP_SESSION, last_outgoing_time), RUDP_FIELD_NUMBER},
+    {"output_chain_count", offsetof(RUDP_SESSION, output_chain_count), RUDP_FIELD_INTEGER},
+    {"incoming_bytes_total", offsetof(RUDP_SESSION, incoming_bytes_total), RUDP_FIELD_INTEGER},
+    {"outgoing_bytes_total", offsetof(RUDP_SESSION, outgoing_bytes_total), RUDP_FIELD_INTEGER},
+    {"udp_send_total", offsetof(RUDP_SESSION, udp_send_total), RUDP_FIELD_INTEGER},
+    {"udp_receive_total", offsetof(RUDP_SESSION, udp_receive_total), RUDP_FIELD_INTEGER},
+    {"udp_resend_total", offsetof(RUDP_SESSION, udp_resend_total), RUDP_FIELD_INTEGER},
+    {"udp_drop_total", offsetof(RUDP_SESSION, udp_drop_total), RUDP_FIELD_INTEGER},
+    {"udp_loss_total", offsetof(RUDP_SESSION, udp_loss_total), RUDP_FIELD_INTEGER},
+    {"udp_fec_send_total", offsetof(RUDP_SESSION, udp_fec_send_total), RUDP_FIELD_INTEGER},
+    {"udp_fec_recover_total", offsetof(RUDP_SESSION, udp_fec_recover_total), RUDP_FIELD_INTEGER},
+    {"inflight", offsetof(RUDP_SESSION, waiting_count), RUDP_FIELD_INT},
+    {"cwnd", offsetof(RUDP_SESSION, cc.cwnd), RUDP_FIELD_NUMBER},
+    {"ssthresh", offsetof(RUDP_SESSION, cc.ssthresh), RUDP_FIELD_NUMBER},
+    {"srtt", offsetof(RUDP_SESSION, cc.srtt), RUDP_FIELD_NUMBER},
+    {"rttvar", offsetof(RUDP_SESSION, cc.rttvar), RUDP_FIELD_NUMBER},
+    {"rto", offsetof(RUDP_SESSION, cc.rto), RUDP_FIELD_NUMBER},
+    {"min_rtt", offsetof(RUDP_SESSION, cc.min_rtt), RUDP_FIELD_NUMBER},
+    {"delivery_rate", offsetof(RUDP_SESSION, cc.delivery_rate), RUDP_FIELD_NUMBER},
+    {"pacing_rate", offsetof(RUDP_SESSION, cc.pacing_rate), RUDP_FIELD_NUMBER},
+    {"reuse", offsetof(RUDP_SESSION, reuse), RUDP_FIELD_INTEGER},
+    {NULL, 0, 0},
+};
+
+static double rudp_gettime()
+{
+  struct timeval v;
+  gettimeofday(&v, NULL);
+  return v.tv_sec + v.tv_usec / 1000000.0;
+}
+
+static uint32_t rudp_distance(uint32_t index, uint32_t base)
+{
+  return index >= base ? index - base
+                       : index + (RUDP_MAX_OUTPUT_INDEX - 1) - base;
+}
+
+static uint32_t rudp_next_index(uint32_t index)
+{
+  index++;
+  return index >= RUDP_MAX_OUTPUT_INDEX ? 1 : index;
+}
+
+static void rudp_pack_head(uint8_t *head, uint32_t output_index,
+                           uint16_t count, uint16_t package_index)
+{
+  head[0] = output_index & 0xff;
+  head[1] = (output_index >> 8) & 0xff;
+  head[2] = (output_index >> 16) & 0xff;
+  head[3] = (output_index >> 24) & 0xff;
+  head[4] = count & 0xff;
+  head[5] = (count >> 8) & 0xff;
+  head[6] = package_index & 0xff;
+  head[7] = (package_index >> 8) & 0xff;
+}
+
+static void rudp_unpack_head(const uint8_t *head, uint32_t *output_index,
+                             uint16_t *count, uint16_t *package_index)
+{
+  *output_index = head[0] | head[1] << 8 | head[2] << 16 | (uint32_t)head[3] << 24;
+  *count = head[4] | head[5] << 8;
+  *package_index = head[6] | head[7] << 8;
+}
+
+#ifdef RUDP_XOR_AVX2
+static int rudp_avx2_supported(void)
+{
+  static int supported = -1;
+  if (supported < 0)
+  {
+    __builtin_cpu_init();
+    supported = __builtin_cpu_supports("avx2") ? 1 : 0;
+  }
+  return supported;
+}
+
+// 32 bytes per round, return bytes done.
+__attribute__((target("avx2"))) static size_t
+rudp_xor_avx2(char *dst, const char *src, size_t len)
+{
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32)
+  {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(a, b));
+  }
+  return i;
+}
+#endif
+
+// dst ^= src, the fec parity kernel.
+static void rudp_xor(char *dst, const char *src, size_t len)
+{
+  size_t i = 0;
+
+#ifdef RUDP_XOR_AVX2
+  if (len >= 32 && rudp_avx2_supported())
+  {
+    i = rudp_xor_avx2(dst, src, len);
+  }
+#endif
+
+#if defined(__SSE2__)
+  for (; i + 16 <= len; i += 16)
+  {
+    __m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(a, b));
+  }
+#elif defined(__ARM_NEON)
+  for (; i + 16 <= len; i += 16)
+  {
+    uint8x16_t a = vld1q_u8((const uint8_t *)dst + i);
+    uint8x16_t b = vld1q_u8((const uint8_t *)src + i);
+    vst1q_u8((uint8_t *)dst + i, veorq_u8(a, b));
+  }
+#endif
+
+  for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t))
+  {
+    uint64_t a;
+    uint64_t b;
+    memcpy(&a, dst + i, sizeof(a));
+    memcpy(&b, src + i, sizeof(b));
+    a ^= b;
+    memcpy(dst + i, &a, sizeof(a));
+  }
+
+  for (; i < len; i++)
+  {
+    dst[i] ^= src[i];
+  }
+}
+
+// ========== congestion control ==========
+
+static double rudp_packet_bytes(RUDP_ENGINE *engine)
+{
+  return engine->body_size + RUDP_HEAD_SIZE + RUDP_IP_UDP_HEAD_SIZE;
+}
+
+static void rudp_cc_set_cwnd(RUDP_SESSION *session, double cwnd)
+{
+  double max_cwnd = session->engine->max_cwnd;
+  session->cc.cwnd = cwnd < 1 ? 1 : (cwnd > max_cwnd ? max_cwnd : cwnd);
+}
+
+// pacing for window based algorithms: spread cwnd over one srtt.
+static double rudp_cc_window_pacing(RUDP_SESSION *session)
+{
+  RUDP_CC *cc = &session->cc;
+  if (cc->srtt <= 0)
+  {
+    return 0;
+  }
+
+  double gain = cc->cwnd < cc->ssthresh ? 2 : 1.25;
+  return gain * cc->cwnd / cc->srtt;
+}
+
+static void rudp_cc_fixed_init(RUDP_SESSION *session)
+{
+  session->cc.cwnd = session->engine->waiting_count;
+  session->cc.ssthresh = session->engine->waiting_count;
+}
+
+static void rudp_cc_fixed_on_ack(RUDP_SESSION *session, const RUDP_PART *info,
+                                 double now)
+{
+}
+
+static void rudp_cc_fixed_on_loss(RUDP_SESSION *session, const RUDP_PART *info,
+                                  double now)
+{
+}
+
+static const RUDP_CC_OPS rudp_cc_fixed = {
+    "fixed",
+    rudp_cc_fixed_init,
+    rudp_cc_fixed_on_ack,
+    rudp_cc_fixed_on_loss,
+    rudp_cc_window_pacing,
+};
+
+static void rudp_cc_newreno_init(RUDP_SESSION *session)
+{
+  rudp_cc_set_cwnd(session, RUDP_INITIAL_CWND);
+  session->cc.ssthresh = session->engine->max_cwnd;
+}
+
+static void rudp_cc_newreno_on_ack(RUDP_SESSION *session,
+                                   const RUDP_PART *info, double now)
+{
+  RUDP_CC *cc = &session->cc;
+  if (cc->cwnd < cc->ssthresh)
+  {
+    rudp_cc_set_cwnd(session, cc->cwnd + 1);
+  }
+  else
+  {
+    rudp_cc_set_cwnd(session, cc->cwnd + 1 / cc->cwnd);
+  }
+}
+
+static void rudp_cc_newreno_on_loss(RUDP_SESSION *session,
+                                    const RUDP_PART *info, double now)
+{
+  RUDP_CC *cc = &session->cc;
+  cc->ssthresh = cc->cwnd / 2 < RUDP_MIN_CWND ? RUDP_MIN_CWND : cc->cwnd / 2;
+
+  // a resent part lost again, the path is likely congested hard.
+  rudp_cc_set_cwnd(session, info->resent ? 1 : cc->ssthresh);
+}
+
+static const RUDP_CC_OPS rudp_cc_newreno = {
+    "newreno",
+    rudp_cc_newreno_init,
+    rudp_cc_newreno_on_ack,
+    rudp_cc_newreno_on_loss,
+    rudp_cc_window_pacing,
+};
+
+#define RUDP_CUBIC_C 0.4
+#define RUDP_CUBIC_BETA 0.7
+
+static void rudp_cc_cubic_init(RUDP_SESSION *session)
+{
+  rudp_cc_newreno_init(session);
+  session->cc.w_max = 0;
+  session->cc.epoch_start = 0;
+}
+
+static void rudp_cc_cubic_on_ack(RUDP_SESSION *session, const RUDP_PART *info,
+                                 double now)
+{
+  RUDP_CC *cc = &session->cc;
+  if (cc->cwnd < cc->ssthresh)
+  {
+    rudp_cc_set_cwnd(session, cc->cwnd + 1);
+    return;
+  }
+
+  if (cc->epoch_start <= 0)
+  {
+    cc->epoch_start = now;
+    cc->w_est = cc->cwnd;
+    if (cc->cwnd < cc->w_max)
+    {
+      cc->k = cbrt((cc->w_max - cc->cwnd) / RUDP_CUBIC_C);
+      cc->origin = cc->w_max;
+    }
+    else
+    {
+      cc->k = 0;
+      cc->origin = cc->cwnd;
+    }
+  }
+
+  double t = now - cc->epoch_start + cc->min_rtt;
+  double target = cc->origin + RUDP_CUBIC_C * pow(t - cc->k, 3);
+
+  // tcp friendly region.
+  cc->w_est += 3 * (1 - RUDP_CUBIC_BETA) / (1 + RUDP_CUBIC_BETA) / cc->cwnd;
+  if (cc->w_est > target)
+  {
+    target = cc->w_est;
+  }
+
+  if (target > cc->cwnd)
+  {
+    rudp_cc_set_cwnd(session, cc->cwnd + (target - cc->cwnd) / cc->cwnd);
+  }
+  else
+  {
+    rudp_cc_set_cwnd(session, cc->cwnd + 0.01 / cc->cwnd);
+  }
+}
+
+static void rudp_cc_cubic_on_loss(RUDP_SESSION *session, const RUDP_PART *info,
+                                  double now)
+{
+  RUDP_CC *cc = &session->cc;
+  cc->epoch_start = 0;
+
+  // fast convergence, release bandwidth to new flows.
+  if (cc->cwnd < cc->w_max)
+  {
+    cc->w_max = cc->cwnd * (1 + RUDP_CUBIC_BETA) / 2;
+  }
+  else
+  {
+    cc->w_max = cc->cwnd;
+  }
+
+  cc->ssthresh = cc->cwnd * RUDP_CUBIC_BETA;
+  if (cc->ssthresh < RUDP_MIN_CWND)
+  {
+    cc->ssthresh = RUDP_MIN_CWND;
+  }
+  rudp_cc_set_cwnd(session, info->resent ? 1 : cc->ssthresh);
+}
+
+static const RUDP_CC_OPS rudp_cc_cubic = {
+    "cubic",
+    rudp_cc_cubic_init,
+    rudp_cc_cubic_on_ack,
+    rudp_cc_cubic_on_loss,
+    rudp_cc_window_pacing,
+};
+
+// delay based, paced at the estimated bottleneck bandwidth with cwnd
+// bounded by bandwidth * min_rtt, losses don't shrink the window.
+enum
+{
+  RUDP_BBR_STARTUP = 0,
+  RUDP_BBR_DRAIN,
+  RUDP_BBR_PROBE_BW,
+  RUDP_BBR_PROBE_RTT,
+};
+
+#define RUDP_BBR_HIGH_GAIN 2.885
+#define RUDP_BBR_PROBE_RTT_DURATION 0.2
+
+static const double rudp_bbr_cycle_gains[] = {1.25, 0.75, 1, 1, 1, 1, 1, 1};
+
+#define RUDP_BBR_CYCLE_LEN \
+  (sizeof(rudp_bbr_cycle_gains) / sizeof(rudp_bbr_cycle_gains[0]))
+
+static void rudp_cc_bbr_init(RUDP_SESSION *session)
+{
+  RUDP_CC *cc = &session->cc;
+  rudp_cc_set_cwnd(session, RUDP_INITIAL_CWND);
+  cc->ssthresh = session->engine->max_cwnd;
+  cc->bbr_state = RUDP_BBR_STARTUP;
+  cc->pacing_gain = RUDP_BBR_HIGH_GAIN;
+  cc->cwnd_gain = RUDP_BBR_HIGH_GAIN;
+}
+
+static void rudp_cc_bbr_enter_probe_bw(RUDP_CC *cc, double now)
+{
+  cc->bbr_state = RUDP_BBR_PROBE_BW;
+  cc->cwnd_gain = 2;
+  // skip the drain phase of the cycle right after startup drain.
+  cc->cycle_index = 2;
+  cc->cycle_start = now;
+  cc->pacing_gain = rudp_bbr_cycle_gains[cc->cycle_index];
+}
+
+static void rudp_cc_bbr_on_ack(RUDP_SESSION *session, const RUDP_PART *info,
+                               double now)
+{
+  RUDP_CC *cc = &session->cc;
+  double bdp = cc->btl_bw * cc->min_rtt;
+
+  switch (cc->bbr_state)
+  {
+  case RUDP_BBR_STARTUP:
+    if (cc->round_start && cc->btl_bw > 0)
+    {
+      if (cc->btl_bw >= cc->full_bw * 1.25)
+      {
+        cc->full_bw = cc->btl_bw;
+        cc->full_bw_count = 0;
+      }
+      else if (++cc->full_bw_count >= 3)
+      {
+        cc->bbr_state = RUDP_BBR_DRAIN;
+        cc->pacing_gain = 1 / RUDP_BBR_HIGH_GAIN;
+      }
+    }
+    break;
+  case RUDP_BBR_DRAIN:
+    if (session->waiting_count <= bdp)
+    {
+      rudp_cc_bbr_enter_probe_bw(cc, now);
+    }
+    break;
+  case RUDP_BBR_PROBE_BW:
+    if (now - cc->cycle_start > cc->min_rtt)
+    {
+      cc->cycle_index = (cc->cycle_index + 1) % RUDP_BBR_CYCLE_LEN;
+      cc->cycle_start = now;
+      cc->pacing_gain = rudp_bbr_cycle_gains[cc->cycle_index];
+    }
+    break;
+  case RUDP_BBR_PROBE_RTT:
+    if (now >= cc->probe_rtt_done)
+    {
+      if (cc->full_bw_count >= 3)
+      {
+        rudp_cc_bbr_enter_probe_bw(cc, now);
+      }
+      else
+      {
+        cc->bbr_state = RUDP_BBR_STARTUP;
+        cc->pacing_gain = RUDP_BBR_HIGH_GAIN;
+        cc->cwnd_gain = RUDP_BBR_HIGH_GAIN;
+      }
+    }
+    break;
+  }
+
+  if (cc->min_rtt_expired && cc->bbr_state != RUDP_BBR_PROBE_RTT)
+  {
+    cc->bbr_state = RUDP_BBR_PROBE_RTT;
+    cc->pacing_gain = 1;
+    cc->probe_rtt_done = now + (cc->min_rtt > RUDP_BBR_PROBE_RTT_DURATION
+                                    ? cc->min_rtt
+                                    : RUDP_BBR_PROBE_RTT_DURATION);
+  }
+  cc->min_rtt_expired = false;
+
+  if (cc->bbr_state == RUDP_BBR_PROBE_RTT)
+  {
+    rudp_cc_set_cwnd(session, RUDP_INITIAL_CWND);
+  }
+  else if (bdp > 0)
+  {
+    double target = cc->cwnd_gain * bdp;
+    target = target < RUDP_INITIAL_CWND ? RUDP_INITIAL_CWND : target;
+    rudp_cc_set_cwnd(session, cc->cwnd + 1 < target ? cc->cwnd + 1 : target);
+  }
+  else
+  {
+    rudp_cc_set_cwnd(session, cc->cwnd + 1);
+  }
+}
+
+static void rudp_cc_bbr_on_loss(RUDP_SESSION *session, const RUDP_PART *info,
+                                double now)
+{
+}
+
+static double rudp_cc_bbr_pacing(RUDP_SESSION *session)
+{
+  RUDP_CC *cc = &session->cc;
+  if (cc->btl_bw <= 0)
+  {
+    return rudp_cc_window_pacing(session);
+  }
+  return cc->pacing_gain * cc->btl_bw;
+}
+
+static const RUDP_CC_OPS rudp_cc_bbr = {
+    "bbr",
+    rudp_cc_bbr_init,
+    rudp_cc_bbr_on_ack,
+    rudp_cc_bbr_on_loss,
+    rudp_cc_bbr_pacing,
+};
+
+static const RUDP_CC_OPS *rudp_cc_list[] = {
+    &rudp_cc_fixed,
+    &rudp_cc_newreno,
+    &rudp_cc_cubic,
+    &rudp_cc_bbr,
+    NULL,
+};
+
+static void rudp_cc_update_pacing(RUDP_SESSION *session)
+{
+  RUDP_ENGINE *engine = session->engine;
+  session->cc.pacing_rate =
+      engine->pacing ? engine->cc->pacing(session) * rudp_packet_bytes(engine)
+                     : 0;
+}
+
+static void rudp_cc_init(RUDP_SESSION *session)
+{
+  RUDP_CC *cc = &session->cc;
+  memset(cc, 0, sizeof(RUDP_CC));
+  cc->rto = session->engine->timeout;
+  session->engine->cc->init(session);
+}
+
+static void rudp_cc_rtt_sample(RUDP_SESSION *session, double rtt, double now)
+{
+  RUDP_ENGINE *engine = session->engine;
+  RUDP_CC *cc = &session->cc;
+
+  // rfc 6298.
+  if (cc->srtt <= 0)
+  {
+    cc->srtt = rtt;
+    cc->rttvar = rtt / 2;
+  }
+  else
+  {
+    cc->rttvar = 0.75 * cc->rttvar + 0.25 * fabs(cc->srtt - rtt);
+    cc->srtt = 0.875 * cc->srtt + 0.125 * rtt;
+  }
+
+  cc->rto = cc->srtt + 4 * cc->rttvar;
+  cc->rto = cc->rto < RUDP_MIN_RTO ? RUDP_MIN_RTO : cc->rto;
+  cc->rto = cc->rto > engine->timeout ? engine->timeout : cc->rto;
+
+  if (cc->min_rtt <= 0 || rtt <= cc->min_rtt)
+  {
+    cc->min_rtt = rtt;
+    cc->min_rtt_time = now;
+  }
+  else if (now - cc->min_rtt_time > RUDP_MIN_RTT_WINDOW)
+  {
+    cc->min_rtt = rtt;
+    cc->min_rtt_time = now;
+    cc->min_rtt_expired = true;
+  }
+
+  session->latency = rtt;
+}
+
+static void rudp_cc_rate_sample(RUDP_SESSION *session, const RUDP_PART *info,
+                                double now)
+{
+  RUDP_CC *cc = &session->cc;
+  cc->delivered++;
+  cc->delivered_time = now;
+
+  cc->round_start = false;
+  if (info->delivered >= cc->next_round_delivered)
+  {
+    cc->next_round_delivered = cc->delivered;
+    cc->round_count++;
+    cc->round_start = true;
+    cc->bw[cc->round_count % RUDP_BW_ROUNDS] = 0;
+  }
+
+  double interval = now - info->delivered_time;
+  if (info->delivered_time <= 0 || interval <= 0)
+  {
+    return;
+  }
+
+  double rate = (cc->delivered - info->delivered) / interval;
+  double *slot = &cc->bw[cc->round_count % RUDP_BW_ROUNDS];
+  if (rate > *slot)
+  {
+    *slot = rate;
+  }
+
+  int i = 0;
+  cc->btl_bw = 0;
+  for (i = 0; i < RUDP_BW_ROUNDS; i++)
+  {
+    if (cc->bw[i] > cc->btl_bw)
+    {
+      cc->btl_bw = cc->bw[i];
+    }
+  }
+  cc->delivery_rate = cc->btl_bw * rudp_packet_bytes(session->engine);
+}
+
+static void rudp_cc_on_ack(RUDP_SESSION *session, const RUDP_PART *info)
+{
+  double now = rudp_gettime();
+
+  // karn: the ack of a resent part can't tell which send it belongs to.
+  if (!info->resent)
+  {
+    rudp_cc_rtt_sample(session, now - info->sent_time, now);
+  }
+  rudp_cc_rate_sample(session, info, now);
+
+  session->engine->cc->on_ack(session, info, now);
+  rudp_cc_update_pacing(session);
+}
+
+static void rudp_cc_on_loss(RUDP_SESSION *session, const RUDP_PART *info,
+                            double now)
+{
+  RUDP_ENGINE *engine = session->engine;
+  RUDP_CC *cc = &session->cc;
+  session->udp_loss_total++;
+
+  if (info->sent_time < cc->recovery_time)
+  {
+    return;
+  }
+
+  cc->recovery_time = now;
+  cc->rto = cc->rto * 2 > engine->timeout ? engine->timeout : cc->rto * 2;
+
+  engine->cc->on_loss(session, info, now);
+  rudp_cc_update_pacing(session);
+}
+
+// ========== session lookup ==========
+
+static RUDP_SESSION *rudp_engine_lookup(RUDP_ENGINE *engine,
+                                        const struct sockaddr *addr)
+{
+  RUDP_SESSION *session =
+      engine->buckets[udpd_addr_hash(addr) % engine->bucket_count];
+  for (; session; session = session->hash_next)
+  {
+    if (udpd_addr_equal((struct sockaddr *)&session->addr, addr))
+    {
+      return session;
+    }
+  }
+  return NULL;
+}
+
+static void rudp_engine_rehash(RUDP_ENGINE *engine, size_t bucket_count)
+{
+  RUDP_SESSION **buckets = calloc(bucket_count, sizeof(RUDP_SESSION *));
+  RUDP_SESSION *session = NULL;
+  TAILQ_FOREACH(session, &engine->sessions, next)
+  {
+    size_t index = udpd_addr_hash((struct sockaddr *)&session->addr) % bucket_count;
+    session->hash_next = buckets[index];
+    buckets[index] = session;
+  }
+
+  free(engine->buckets);
+  engine->buckets = buckets;
+  engine->bucket_count = bucket_count;
+}
+
+static void rudp_engine_insert(RUDP_ENGINE *engine, RUDP_SESSION *session)
+{
+  TAILQ_INSERT_TAIL(&engine->sessions, session, next);
+  engine->session_count++;
+
+  if (engine->session_count > engine->bucket_count * 2)
+  {
+    rudp_engine_rehash(engine, engine->bucket_count * 4);
+  }
+  else
+  {
+    size_t index = udpd_addr_hash((struct sockaddr *)&session->addr) % engine->bucket_count;
+    session->hash_next = engine->buckets[index];
+    engine->buckets[index] = session;
+  }
+}
+
+static void rudp_engine_remove(RUDP_ENGINE *engine, RUDP_SESSION *session)
+{
+  RUDP_SESSION **pp =
+      &engine->buckets[udpd_addr_hash((struct sockaddr *)&session->addr) % engine->bucket_count];
+  for (; *pp; pp = &(*pp)->hash_next)
+  {
+    if (*pp == session)
+    {
+      *pp = session->hash_next;
+      break;
+    }
+  }
+
+  TAILQ_REMOVE(&engine->sessions, session, next);
+  engine->session_count--;
+}
+
+// ========== session state ==========
+
+static bool rudp_sparse_init(RUDP_SPARSE *sparse, uint32_t size)
+{
+  sparse->blocks =
+      calloc((size + RUDP_SPARSE_BLOCK - 1) / RUDP_SPARSE_BLOCK, sizeof(char **));
+  sparse->size = size;
+  return sparse->blocks != NULL;
+}
+
+static char *rudp_sparse_get(RUDP_SPARSE *sparse, uint32_t index)
+{
+  char **block = sparse->blocks[index / RUDP_SPARSE_BLOCK];
+  return block ? block[index % RUDP_SPARSE_BLOCK] : NULL;
+}
+
+// take the ownership of data.
+static bool rudp_sparse_set(RUDP_SPARSE *sparse, uint32_t index, char *data)
+{
+  char ***block = &sparse->blocks[index / RUDP_SPARSE_BLOCK];
+  if (!*block)
+  {
+    *block = calloc(RUDP_SPARSE_BLOCK, sizeof(char *));
+    if (!*block)
+    {
+      return false;
+    }
+  }
+  (*block)[index % RUDP_SPARSE_BLOCK] = data;
+  return true;
+}
+
+static void rudp_sparse_free(RUDP_SPARSE *sparse)
+{
+  if (!sparse->blocks)
+  {
+    return;
+  }
+
+  uint32_t i = 0;
+  for (; i < (sparse->size + RUDP_SPARSE_BLOCK - 1) / RUDP_SPARSE_BLOCK; i++)
+  {
+    char **block = sparse->blocks[i];
+    if (block)
+    {
+      uint32_t j = 0;
+      for (; j < RUDP_SPARSE_BLOCK; j++)
+      {
+        free(block[j]);
+      }
+      free(block);
+    }
+  }
+  free(sparse->blocks);
+  sparse->blocks = NULL;
+}
+
+static void rudp_incoming_reset(RUDP_INCOMING *slot)
+{
+  rudp_sparse_free(&slot->parts);
+  rudp_sparse_free(&slot->parity);
+  memset(slot, 0, sizeof(RUDP_INCOMING));
+}
+
+static void rudp_session_reset_incoming(RUDP_SESSION *session)
+{
+  uint32_t i = 0;
+  for (i = 0; i <= session->engine->window_size; i++)
+  {
+    rudp_incoming_reset(&session->incoming[i]);
+  }
+  session->recv_head = 0;
+}
+
+static void rudp_waiting_remove(RUDP_SESSION *session, RUDP_PART *info)
+{
+  if (info->timer.state == TIMERWHEEL_NODE_IDLE)
+  {
+    return;
+  }
+
+  timerwheel_cancel(&session->engine->wheel, &info->timer);
+  session->waiting_count--;
+}
+
+static void rudp_waiting_remove_output(RUDP_SESSION *session,
+                                       RUDP_OUTPUT *output)
+{
+  uint32_t part = 0;
+  for (part = 0; part < output->parts; part++)
+  {
+    if (output->info[part].state == RUDP_PART_WAITING)
+    {
+      rudp_waiting_remove(session, &output->info[part]);
+      output->info[part].state = RUDP_PART_PENDING;
+    }
+  }
+}
+
+static void rudp_session_release(RUDP_SESSION *session, lua_State *L)
+{
+  RUDP_ENGINE *engine = session->engine;
+  if (!engine)
+  {
+    return;
+  }
+
+  RUDP_OUTPUT *output = NULL;
+  while ((output = TAILQ_FIRST(&session->outputs)))
+  {
+    rudp_waiting_remove_output(session, output);
+    TAILQ_REMOVE(&session->outputs, output, next);
+    free(output);
+  }
+
+  rudp_session_reset_incoming(session);
+  free(session->incoming);
+  session->incoming = NULL;
+
+  if (session->pacing_timer)
+  {
+    if (event_mgr_base_current())
+    {
+      event_free(session->pacing_timer);
+    }
+    session->pacing_timer = NULL;
+  }
+
+  rudp_engine_remove(engine, session);
+
+  session->engine = NULL;
+  session->closed = true;
+
+  CLEAR_REF(L, session->selfRef)
+}
+
+static bool rudp_session_sendto(RUDP_SESSION *session, const uint8_t *head,
+                                const char *body, size_t bodylen)
+{
+  RUDP_ENGINE *engine = session->engine;
+  UDPD_CONN *conn = engine->conn;
+  if (!conn || !conn->socket_fd)
+  {
+    return false;
+  }
+
+  char buf[RUDP_HEAD_SIZE + 65536];
+  size_t len = RUDP_HEAD_SIZE + bodylen;
+  memcpy(buf, head, RUDP_HEAD_SIZE);
+  if (bodylen > 0)
+  {
+    memcpy(buf + RUDP_HEAD_SIZE, body, bodylen);
+  }
+
+  ssize_t ret = udpd_conn_sendto(conn, buf, len,
+                                 (struct sockaddr *)&session->addr,
+                                 session->addrlen);
+  if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS)
+  {
+    // e.g. resumed back in mobile device, reopen the socket.
+    udpd_conn_reconnect(conn, NULL);
+  }
+
+  session->last_outgoing_time = rudp_gettime();
+  session->outgoing_bytes_total += len;
+  session->udp_send_total++;
+  rudp_send_total++;
+
+  return ret >= 0;
+}
+
+static void rudp_engine_tick(evutil_socket_t fd, short what, void *arg);
+
+static void rudp_engine_schedule(RUDP_ENGINE *engine)
+{
+  if (engine->timer && engine->wheel.count > 0 &&
+      !evtimer_pending(engine->timer, NULL))
+  {
+    struct timeval t = {0};
+    d2tv(engine->wheel.tick, &t);
+    evtimer_add(engine->timer, &t);
+  }
+}
+
+static void rudp_session_send_window(RUDP_SESSION *session,
+                                     uint16_t package_index)
+{
+  uint8_t head[RUDP_HEAD_SIZE];
+  uint8_t body[4];
+  rudp_pack_head(head, RUDP_WINDOW_CTRL, 1, package_index);
+  body[0] = session->send_window & 0xff;
+  body[1] = (session->send_window >> 8) & 0xff;
+  body[2] = (session->send_window >> 16) & 0xff;
+  body[3] = (session->send_window >> 24) & 0xff;
+  rudp_session_sendto(session, head, (const char *)body, sizeof(body));
+}
+
+static void rudp_session_pace(RUDP_SESSION *session, size_t bodylen,
+                              double now)
+{
+  RUDP_CC *cc = &session->cc;
+  if (cc->pacing_rate > 0)
+  {
+    double bytes = bodylen + RUDP_HEAD_SIZE + RUDP_IP_UDP_HEAD_SIZE;
+    cc->next_send_time =
+        (cc->next_send_time > now ? cc->next_send_time : now) +
+        bytes / cc->pacing_rate;
+  }
+}
+
+// parity is sent once with the first send of the group, never resent.
+// a group of a single part (e.g. a single part message) gets none, its
+// parity would be the part itself.
+static void rudp_session_send_parity(RUDP_SESSION *session,
+                                     RUDP_OUTPUT *output, uint32_t group,
+                                     double now)
+{
+  RUDP_ENGINE *engine = session->engine;
+  uint32_t fec = session->fec;
+  uint32_t first = group * fec;
+  uint32_t last = first + fec < output->parts ? first + fec : output->parts;
+  if (last - first < 2)
+  {
+    return;
+  }
+
+  if (!engine->fec_buf)
+  {
+    engine->fec_buf = malloc(engine->body_size + RUDP_FEC_TRAILER_SIZE);
+    if (!engine->fec_buf)
+    {
+      return;
+    }
+  }
+
+  char *buf = engine->fec_buf;
+  size_t body_size = engine->body_size;
+  memset(buf, 0, body_size);
+
+  uint32_t part = first;
+  size_t len = 0;
+  for (; part < last; part++)
+  {
+    size_t offset = part * body_size;
+    len = output->len - offset > body_size ? body_size : output->len - offset;
+    rudp_xor(buf, output->data + offset, len);
+  }
+
+  uint8_t *trailer = (uint8_t *)buf + body_size;
+  trailer[0] = fec & 0xff;
+  trailer[1] = (fec >> 8) & 0xff;
+  trailer[2] = len & 0xff;
+  trailer[3] = (len >> 8) & 0xff;
+
+  uint8_t head[RUDP_HEAD_SIZE];
+  rudp_pack_head(head, output->output_index | RUDP_FEC_FLAG, output->parts,
+                 group + 1);
+  rudp_session_sendto(session, head, buf, body_size + RUDP_FEC_TRAILER_SIZE);
+  session->udp_fec_send_total++;
+
+  rudp_session_pace(session, body_size + RUDP_FEC_TRAILER_SIZE, now);
+}
+
+static void rudp_session_send_part(RUDP_SESSION *session, RUDP_OUTPUT *output,
+                                   uint32_t part, double now)
+{
+  RUDP_PART *info = &output->info[part];
+  RUDP_CC *cc = &session->cc;
+  size_t len = sizeof(RUDP_CANCEL_BODY) - 1;
+  uint8_t head[RUDP_HEAD_SIZE];
+  if (output->cancel)
+  {
+    rudp_pack_head(head, output->output_index, 0, 0);
+    rudp_session_sendto(session, head, RUDP_CANCEL_BODY,
+                        sizeof(RUDP_CANCEL_BODY) - 1);
+  }
+  else
+  {
+    size_t body_size = session->engine->body_size;
+    size_t offset = part * body_size;
+    len = output->len - offset > body_size ? body_size : output->len - offset;
+    rudp_pack_head(head, output->output_index, output->parts, part + 1);
+    rudp_session_sendto(session, head, output->data + offset, len);
+  }
+
+  // nothing in flight, rate samples start from now.
+  if (session->waiting_count == 0)
+  {
+    cc->delivered_time = now;
+  }
+
+  info->resent = info->sent_time > 0;
+  info->state = RUDP_PART_WAITING;
+  info->sent_time = now;
+  info->delivered = cc->delivered;
+  info->delivered_time = cc->delivered_time;
+
+  rudp_session_pace(session, len, now);
+
+  if (session->fec > 0 && output->parts > 1 && !output->cancel &&
+      !info->resent &&
+      ((part + 1) % session->fec == 0 || part + 1 == output->parts))
+  {
+    rudp_session_send_parity(session, output, part / session->fec, now);
+  }
+
+  info->output = output;
+  timerwheel_add(&session->engine->wheel, &info->timer, now + cc->rto);
+  rudp_engine_schedule(session->engine);
+  session->waiting_count++;
+}
+
+static void rudp_session_flush(RUDP_SESSION *session);
+
+static void rudp_session_pacing_cb(evutil_socket_t fd, short what, void *arg)
+{
+  rudp_session_flush((RUDP_SESSION *)arg);
+}
+
+// return true if the next part has to wait for the pacing timer.
+static bool rudp_session_paced(RUDP_SESSION *session, double now)
+{
+  RUDP_CC *cc = &session->cc;
+  if (cc->pacing_rate <= 0 || now >= cc->next_send_time - RUDP_PACING_SLACK)
+  {
+    return false;
+  }
+
+  if (!session->pacing_timer)
+  {
+    session->pacing_timer =
+        evtimer_new(event_mgr_base(), rudp_session_pacing_cb, session);
+  }
+
+  if (!evtimer_pending(session->pacing_timer, NULL))
+  {
+    struct timeval t = {0};
+    d2tv(cc->next_send_time - now, &t);
+    evtimer_add(session->pacing_timer, &t);
+  }
+
+  return true;
+}
+
+static void rudp_session_flush(RUDP_SESSION *session)
+{
+  RUDP_ENGINE *engine = session->engine;
+  if (!engine || session->suspended || !engine->conn ||
+      TAILQ_EMPTY(&session->outputs))
+  {
+    return;
+  }
+
+  if (!session->window_sent)
+  {
+    session->window_sent = true;
+    rudp_session_send_window(session, 1);
+  }
+
+  int limit = session->paired ? (int)session->cc.cwnd
+                              : engine->none_paired_waiting_count;
+  limit = limit < 1 ? 1 : limit;
+  limit = limit > engine->waiting_capacity ? engine->waiting_capacity : limit;
+
+  double now = rudp_gettime();
+  RUDP_OUTPUT *output = NULL;
+  TAILQ_FOREACH(output, &session->outputs, next)
+  {
+    if (session->waiting_count >= limit ||
+        rudp_distance(output->output_index, session->send_window) >
+            engine->window_size)
+    {
+      break;
+    }
+
+    for (; output->cursor < output->parts && session->waiting_count < limit;
+         output->cursor++)
+    {
+      if (output->info[output->cursor].state == RUDP_PART_PENDING)
+      {
+        if (rudp_session_paced(session, now))
+        {
+          return;
+        }
+        rudp_session_send_part(session, output, output->cursor, now);
+      }
+    }
+  }
+}
+
+static void rudp_session_send_ack(RUDP_SESSION *session, const uint8_t *head)
+{
+  rudp_session_sendto(session, head, NULL, 0);
+}
+
+// ========== lua callbacks ==========
+
+// return false if the session has gone during the callback.
+static bool rudp_session_callback(RUDP_SESSION *session, int ref,
+                                  const char *buf, size_t len,
+                                  lua_Integer output_index, bool *result)
+{
+  RUDP_ENGINE *engine = session->engine;
+  if (ref == LUA_NOREF)
+  {
+    return true;
+  }
+
+  lua_State *mainthread = engine->mainthread;
+  lua_lock(mainthread);
+  lua_State *co = lua_newthread(mainthread);
+  PUSH_REF(mainthread);
+  lua_unlock(mainthread);
+
+  int count = 1;
+  lua_rawgeti(co, LUA_REGISTRYINDEX, ref);
+  lua_rawgeti(co, LUA_REGISTRYINDEX, session->selfRef);
+  if (buf)
+  {
+    lua_pushlstring(co, buf, len);
+    count++;
+  }
+  else if (output_index)
+  {
+    lua_pushinteger(co, output_index);
+    count++;
+  }
+
+  int status = FAN_RESUME(co, mainthread, count);
+  if (result && status == LUA_OK && lua_gettop(co) > 0)
+  {
+    *result = lua_toboolean(co, -1);
+  }
+  POP_REF(mainthread);
+
+  return !session->closed;
+}
+
+// ========== receive ==========
+
+static void rudp_session_apply_recv_window(RUDP_SESSION *session)
+{
+  uint32_t ring = session->engine->window_size + 1;
+  while (session->incoming[session->recv_head].used &&
+         session->incoming[session->recv_head].done)
+  {
+    rudp_incoming_reset(&session->incoming[session->recv_head]);
+    session->recv_head = (session->recv_head + 1) % ring;
+    session->recv_window = rudp_next_index(session->recv_window);
+  }
+}
+
+static void rudp_session_onack(RUDP_SESSION *session, const uint8_t *head)
+{
+  uint32_t output_index = 0;
+  uint16_t count = 0;
+  uint16_t package_index = 0;
+  rudp_unpack_head(head, &output_index, &count, &package_index);
+
+  RUDP_OUTPUT *output = NULL;
+  TAILQ_FOREACH(output, &session->outputs, next)
+  {
+    if (output->output_index == output_index)
+    {
+      break;
+    }
+  }
+
+  if (!output)
+  {
+    return;
+  }
+
+  uint32_t part = 0;
+  if (output->cancel)
+  {
+    if (count != 0 || package_index != 0)
+    {
+      return;
+    }
+  }
+  else
+  {
+    if (count != output->parts || package_index < 1 ||
+        package_index > output->parts)
+    {
+      return;
+    }
+    part = package_index - 1;
+  }
+
+  RUDP_PART *info = &output->info[part];
+  if (info->state == RUDP_PART_WAITING)
+  {
+    rudp_waiting_remove(session, info);
+  }
+
+  if (info->state != RUDP_PART_ACKED)
+  {
+    // a part timed out but not resent yet is still a valid sample.
+    if (info->sent_time > 0)
+    {
+      rudp_cc_on_ack(session, info);
+    }
+    info->state = RUDP_PART_ACKED;
+    output->acked++;
+  }
+
+  if (output->acked == output->parts)
+  {
+    bool cancel = output->cancel;
+    rudp_waiting_remove_output(session, output);
+    TAILQ_REMOVE(&session->outputs, output, next);
+    free(output);
+    session->output_chain_count--;
+
+    RUDP_OUTPUT *head_output = TAILQ_FIRST(&session->outputs);
+    session->send_window =
+        head_output ? head_output->output_index : session->output_index;
+
+    if (!cancel &&
+        !rudp_session_callback(session, session->engine->onSentRef, NULL, 0,
+                               output_index, NULL))
+    {
+      return;
+    }
+  }
+
+  rudp_session_flush(session);
+}
+
+// smallest message size once the size of the full parts is known, the
+// exact size is checked when the last part is in.
+static bool rudp_incoming_fits(RUDP_ENGINE *engine, uint16_t count,
+                               size_t part_size)
+{
+  return (size_t)(count - 1) * part_size + 1 <= engine->max_message_size;
+}
+
+static bool rudp_incoming_set_part_size(RUDP_ENGINE *engine,
+                                        RUDP_INCOMING *slot, size_t size)
+{
+  if (slot->part_size)
+  {
+    return slot->part_size == size;
+  }
+
+  if (size > UINT16_MAX || !rudp_incoming_fits(engine, slot->count, size) ||
+      (slot->last_len && slot->last_len > size))
+  {
+    return false;
+  }
+
+  slot->part_size = size;
+  return true;
+}
+
+static bool rudp_incoming_has(RUDP_INCOMING *slot, uint16_t part)
+{
+  return rudp_sparse_get(&slot->parts, part) != NULL;
+}
+
+// take the ownership of data.
+static bool rudp_incoming_store(RUDP_INCOMING *slot, uint16_t part,
+                                char *data, size_t len)
+{
+  if (!rudp_sparse_set(&slot->parts, part, data))
+  {
+    free(data);
+    return false;
+  }
+
+  slot->received++;
+  if (part + 1 == slot->count)
+  {
+    slot->last_len = len;
+  }
+  return true;
+}
+
+// skip the message, as if the peer had cancelled it.
+static void rudp_incoming_drop(RUDP_SESSION *session, RUDP_INCOMING *slot,
+                               uint32_t output_index)
+{
+  rudp_incoming_reset(slot);
+  slot->output_index = output_index;
+  slot->used = true;
+  slot->done = true;
+  session->udp_drop_total++;
+  rudp_session_apply_recv_window(session);
+}
+
+// rebuild the only missing part of a group from its parity.
+static void rudp_session_fec_recover(RUDP_SESSION *session,
+                                     RUDP_INCOMING *slot, uint32_t group)
+{
+  const char *parity = slot->parity.blocks
+                           ? rudp_sparse_get(&slot->parity, group)
+                           : NULL;
+  if (!parity)
+  {
+    return;
+  }
+
+  uint32_t first = group * slot->fec;
+  uint32_t last = first + slot->fec < slot->count ? first + slot->fec
+                                                  : slot->count;
+  uint32_t missing = last;
+  uint32_t part = first;
+  for (; part < last; part++)
+  {
+    if (!rudp_incoming_has(slot, part))
+    {
+      if (missing != last)
+      {
+        return;
+      }
+      missing = part;
+    }
+  }
+
+  if (missing == last)
+  {
+    return;
+  }
+
+  size_t part_size = slot->part_size;
+  size_t len = missing + 1 == slot->count ? slot->last_len : part_size;
+  if (len == 0 || len > part_size)
+  {
+    return;
+  }
+
+  char *data = malloc(part_size);
+  if (!data)
+  {
+    return;
+  }
+  memcpy(data, parity, part_size);
+  for (part = first; part < last; part++)
+  {
+    if (part != missing)
+    {
+      rudp_xor(data, rudp_sparse_get(&slot->parts, part),
+               part + 1 == slot->count ? slot->last_len : part_size);
+    }
+  }
+
+  if (!rudp_incoming_store(slot, missing, data, len))
+  {
+    return;
+  }
+  session->udp_fec_recover_total++;
+
+  // ack the rebuilt part, so the sender doesn't wait for the timeout.
+  uint8_t head[RUDP_HEAD_SIZE];
+  rudp_pack_head(head, slot->output_index, slot->count, missing + 1);
+  rudp_session_send_ack(session, head);
+}
+
+// the parity body is as large as the full parts of the peer.
+static void rudp_session_onparity(RUDP_SESSION *session, RUDP_INCOMING *slot,
+                                  uint32_t group, const char *body,
+                                  size_t bodylen)
+{
+  if (bodylen <= RUDP_FEC_TRAILER_SIZE)
+  {
+    return;
+  }
+
+  size_t part_size = bodylen - RUDP_FEC_TRAILER_SIZE;
+  const uint8_t *trailer = (const uint8_t *)body + part_size;
+  uint16_t fec = trailer[0] | trailer[1] << 8;
+  uint16_t last_len = trailer[2] | trailer[3] << 8;
+  uint32_t groups = fec ? (slot->count + fec - 1) / fec : 0;
+  if (fec == 0 || group >= groups || (slot->fec && slot->fec != fec) ||
+      !rudp_incoming_set_part_size(session->engine, slot, part_size))
+  {
+    return;
+  }
+
+  if (!slot->parity.blocks)
+  {
+    if (!rudp_sparse_init(&slot->parity, groups))
+    {
+      return;
+    }
+    slot->fec = fec;
+  }
+
+  if (rudp_sparse_get(&slot->parity, group))
+  {
+    return;
+  }
+
+  if (group + 1 == groups && !rudp_incoming_has(slot, slot->count - 1))
+  {
+    if (last_len == 0 || last_len > part_size)
+    {
+      return;
+    }
+    slot->last_len = last_len;
+  }
+
+  char *data = malloc(part_size);
+  if (!data)
+  {
+    return;
+  }
+  memcpy(data, body, part_size);
+  if (!rudp_sparse_set(&slot->parity, group, data))
+  {
+    free(data);
+    return;
+  }
+
+  rudp_session_fec_recover(session, slot, group);
+}
+
+static void rudp_session_ondata(RUDP_SESSION *session, const uint8_t *head,
+                                const char *body, size_t bodylen)
+{
+  RUDP_ENGINE *engine = session->engine;
+
+  uint32_t output_index = 0;
+  uint16_t count = 0;
+  uint16_t package_index = 0;
+  rudp_unpack_head(head, &output_index, &count, &package_index);
+
+  if (output_index == RUDP_WINDOW_CTRL)
+  {
+    if (count == 1 && package_index == 1 && bodylen >= 4)
+    {
+      const uint8_t *p = (const uint8_t *)body;
+      uint32_t window = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+      if (!session->recv_window_set && window < RUDP_MAX_OUTPUT_INDEX)
+      {
+        rudp_session_reset_incoming(session);
+        session->recv_window = window;
+        session->recv_window_set = true;
+      }
+    }
+    else if (count == 1 && package_index == 2)
+    {
+      session->window_sent = false;
+      rudp_session_flush(session);
+    }
+    return;
+  }
+
+  bool parity = false;
+  if (output_index & RUDP_FEC_FLAG)
+  {
+    output_index &= ~RUDP_FEC_FLAG;
+    parity = true;
+  }
+
+  if (output_index >= RUDP_MAX_OUTPUT_INDEX)
+  {
+    return;
+  }
+
+  if (!session->recv_window_set)
+  {
+    rudp_session_send_window(session, 2);
+    return;
+  }
+
+  uint32_t distance = rudp_distance(output_index, session->recv_window);
+  bool package_outside = distance > engine->window_size;
+  bool future_package = distance < RUDP_MAX_OUTPUT_INDEX_HALF;
+
+  // don't send ack for future outside package, parity is never resent.
+  if (!parity && (!package_outside || !future_package))
+  {
+    rudp_session_send_ack(session, head);
+  }
+
+  if (package_outside)
+  {
+    session->udp_drop_total++;
+    return;
+  }
+
+  session->last_incoming_time = rudp_gettime();
+
+  RUDP_INCOMING *slot =
+      &session->incoming[(session->recv_head + distance) %
+                         (engine->window_size + 1)];
+
+  // cancel package.
+  if (count == 0 && package_index == 0)
+  {
+    rudp_incoming_reset(slot);
+    slot->output_index = output_index;
+    slot->used = true;
+    slot->done = true;
+    rudp_session_apply_recv_window(session);
+    return;
+  }
+
+  if (count == 0 || package_index < 1 ||
+      (parity && bodylen <= RUDP_FEC_TRAILER_SIZE))
+  {
+    return;
+  }
+
+  if (!slot->used)
+  {
+    // a full part tells the message size, drop it before storing anything.
+    size_t part_size = parity ? bodylen - RUDP_FEC_TRAILER_SIZE
+                              : (package_index < count ? bodylen : 0);
+    if (!rudp_incoming_fits(engine, count, part_size))
+    {
+      rudp_incoming_drop(session, slot, output_index);
+      return;
+    }
+
+    if (!rudp_sparse_init(&slot->parts, count))
+    {
+      return;
+    }
+    slot->output_index = output_index;
+    slot->count = count;
+    slot->used = true;
+  }
+  else if (slot->done || slot->output_index != output_index ||
+           slot->count != count)
+  {
+    // duplicated package.
+    return;
+  }
+
+  if (parity)
+  {
+    rudp_session_onparity(session, slot, package_index - 1, body, bodylen);
+  }
+  else
+  {
+    uint16_t part = package_index - 1;
+    if (package_index > count || rudp_incoming_has(slot, part))
+    {
+      return;
+    }
+
+    // parts are placed by index and length, the peer may use another mtu.
+    if (package_index < count && !slot->part_size &&
+        !rudp_incoming_fits(engine, count, bodylen))
+    {
+      rudp_incoming_drop(session, slot, output_index);
+      return;
+    }
+
+    bool valid = package_index < count
+                     ? rudp_incoming_set_part_size(engine, slot, bodylen)
+                     : !slot->part_size || bodylen <= slot->part_size;
+    if (!valid)
+    {
+      session->udp_drop_total++;
+      return;
+    }
+
+    char *data = malloc(bodylen);
+    if (!data)
+    {
+      return;
+    }
+    memcpy(data, body, bodylen);
+    if (!rudp_incoming_store(slot, part, data, bodylen))
+    {
+      return;
+    }
+    if (slot->fec)
+    {
+      rudp_session_fec_recover(session, slot, part / slot->fec);
+    }
+  }
+
+  if (slot->received == count)
+  {
+    size_t part_size = slot->part_size;
+    size_t len = (size_t)(count - 1) * part_size + slot->last_len;
+    char *buf = len <= engine->max_message_size ? malloc(len) : NULL;
+    if (!buf)
+    {
+      rudp_incoming_drop(session, slot, output_index);
+      return;
+    }
+
+    uint32_t part = 0;
+    for (; part < count; part++)
+    {
+      memcpy(buf + (size_t)part * part_size,
+             rudp_sparse_get(&slot->parts, part),
+             part + 1 == count ? slot->last_len : part_size);
+    }
+
+    // free the parts before the callback, the window may move over the slot.
+    rudp_sparse_free(&slot->parts);
+    rudp_sparse_free(&slot->parity);
+    slot->done = true;
+
+    rudp_session_apply_recv_window(session);
+
+    rudp_session_callback(session, engine->onReadRef, buf, len, 0, NULL);
+    free(buf);
+  }
+}
+
+static RUDP_SESSION *rudp_session_push(lua_State *L, RUDP_ENGINE *engine,
+                                       const struct sockaddr *addr,
+                                       socklen_t addrlen);
+
+static void rudp_engine_recv(void *ctx, const char *buf, size_t len,
+                             const struct sockaddr *addr, socklen_t addrlen)
+{
+  RUDP_ENGINE *engine = ctx;
+
+  rudp_receive_total++;
+
+  RUDP_SESSION *session = rudp_engine_lookup(engine, addr);
+  if (!session)
+  {
+    if (!engine->accept)
+    {
+      // connect() protection, only accept connected host/port.
+      return;
+    }
+
+    lua_State *mainthread = engine->mainthread;
+    lua_lock(mainthread);
+    session = rudp_session_push(mainthread, engine, addr, addrlen);
+    lua_pop(mainthread, 1);
+    lua_unlock(mainthread);
+
+    if (!rudp_session_callback(session, engine->onAcceptRef, NULL, 0, 0,
+                               NULL))
+    {
+      return;
+    }
+  }
+  else if (session->suspended)
+  {
+    session->suspended = false;
+    session->reuse++;
+
+    if (!rudp_session_callback(session, engine->onAcceptRef, NULL, 0, 0,
+                               NULL))
+    {
+      return;
+    }
+  }
+
+  session->paired = true;
+  session->udp_receive_total++;
+  session->incoming_bytes_total += len;
+
+  if (len == RUDP_HEAD_SIZE)
+  {
+    // single ack.
+    rudp_session_onack(session, (const uint8_t *)buf);
+  }
+  else if (len > RUDP_HEAD_SIZE)
+  {
+    rudp_session_ondata(session, (const uint8_t *)buf, buf + RUDP_HEAD_SIZE,
+                        len - RUDP_HEAD_SIZE);
+  }
+}
+
+// ========== timeout ==========
+
+// return false if the session has gone during a callback.
+static bool rudp_session_part_timeout(RUDP_SESSION *session,
+                                      RUDP_OUTPUT *output, uint32_t part,
+                                      double now)
+{
+  RUDP_ENGINE *engine = session->engine;
+
+  // the part has been taken off the wheel already.
+  session->waiting_count--;
+  rudp_cc_on_loss(session, &output->info[part], now);
+
+  bool resend = true;
+  if (!output->cancel && engine->onTimeoutRef != LUA_NOREF)
+  {
+    if (!rudp_session_callback(session, engine->onTimeoutRef, NULL, 0,
+                               output->output_index, &resend))
+    {
+      return false;
+    }
+  }
+
+  if (resend)
+  {
+    output->info[part].state = RUDP_PART_PENDING;
+    if (part < output->cursor)
+    {
+      output->cursor = part;
+    }
+    session->udp_resend_total++;
+    rudp_resend_total++;
+  }
+  else
+  {
+    // give up the package, tell the peer to skip it.
+    rudp_waiting_remove_output(session, output);
+    output->cancel = true;
+    output->parts = 1;
+    output->acked = 0;
+    output->cursor = 0;
+    memset(&output->info[0], 0, sizeof(RUDP_PART));
+  }
+
+  rudp_session_flush(session);
+  return true;
+}
+
+static void rudp_engine_tick(evutil_socket_t fd, short what, void *arg)
+{
+  RUDP_ENGINE *engine = (RUDP_ENGINE *)arg;
+  double now = rudp_gettime();
+
+  TIMERWHEEL_NODE expired;
+  timerwheel_list_init(&expired);
+  timerwheel_advance(&engine->wheel, now, &expired);
+
+  // parts of a session released during callbacks are unlinked from the
+  // expired list as well.
+  TIMERWHEEL_NODE *node = NULL;
+  while (!engine->closed && (node = timerwheel_pop(&expired)))
+  {
+    RUDP_PART *info = (RUDP_PART *)node;
+    RUDP_OUTPUT *output = info->output;
+    rudp_session_part_timeout(output->session, output, info - output->info,
+                              now);
+  }
+
+  rudp_engine_schedule(engine);
+}
+
+// ========== session api ==========
+
+static RUDP_SESSION *rudp_session_push(lua_State *L, RUDP_ENGINE *engine,
+                                       const struct sockaddr *addr,
+                                       socklen_t addrlen)
+{
+  RUDP_SESSION *session = lua_newuserdata(L, sizeof(RUDP_SESSION));
+  memset(session, 0, sizeof(RUDP_SESSION));
+  luaL_getmetatable(L, LUA_RUDP_SESSION_TYPE);
+  lua_setmetatable(L, -2);
+
+  lua_pushvalue(L, -1);
+  session->selfRef = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  session->engine = engine;
+  addrlen = addrlen < sizeof(session->addr) ? addrlen : sizeof(session->addr);
+  memcpy(&session->addr, addr, addrlen);
+  session->addrlen = addrlen;
+
+  uint32_t random_index = 0;
+  evutil_secure_rng_get_bytes(&random_index, sizeof(random_index));
+  session->output_index = 1 + random_index % (RUDP_MAX_OUTPUT_INDEX - 1);
+  session->send_window = session->output_index;
+  session->fec = engine->fec;
+  session->reuse = 1;
+
+  TAILQ_INIT(&session->outputs);
+
+  session->incoming = calloc(engine->window_size + 1, sizeof(RUDP_INCOMING));
+
+  rudp_engine_insert(engine, session);
+  rudp_cc_init(session);
+
+  return session;
+}
+
+LUA_API int rudp_session_send(lua_State *L)
+{
+  RUDP_SESSION *session = luaL_checkudata(L, 1, LUA_RUDP_SESSION_TYPE);
+  size_t len = 0;
+  const char *data = luaL_checklstring(L, 2, &len);
+
+  RUDP_ENGINE *engine = session->engine;
+  if (!engine || len == 0)
+  {
+    return 0;
+  }
+
+  if (len > engine->body_size * RUDP_MAX_PARTS)
+  {
+    lua_pushnil(L);
+    lua_pushfstring(L, "body size overlimit: %d", (int)len);
+    return 2;
+  }
+
+  uint32_t parts = (len + engine->body_size - 1) / engine->body_size;
+  RUDP_OUTPUT *output =
+      malloc(sizeof(RUDP_OUTPUT) + parts * sizeof(RUDP_PART) + len);
+  if (!output)
+  {
+    return 0;
+  }
+
+  output->info = (RUDP_PART *)(output + 1);
+  output->data = (const char *)(output->info + parts);
+  memcpy((char *)output->data, data, len);
+  memset(output->info, 0, parts * sizeof(RUDP_PART));
+  output->session = session;
+  output->len = len;
+  output->parts = parts;
+  output->acked = 0;
+  output->cursor = 0;
+  output->cancel = false;
+  output->output_index = session->output_index;
+
+  session->output_index = rudp_next_index(session->output_index);
+
+  TAILQ_INSERT_TAIL(&session->outputs, output, next);
+  session->output_chain_count++;
+
+  rudp_session_flush(session);
+
+  lua_pushinteger(L, output->output_index);
+  return 1;
+}
+
+LUA_API int rudp_session_cleanup(lua_State *L)
+{
+  RUDP_SESSION *session = luaL_checkudata(L, 1, LUA_RUDP_SESSION_TYPE);
+  if (session->engine)
+  {
+    session->suspended = true;
+    session->recv_window_set = false;
+    rudp_session_reset_incoming(session);
+  }
+  return 0;
+}
+
+LUA_API int rudp_session_close(lua_State *L)
+{
+  RUDP_SESSION *session = luaL_checkudata(L, 1, LUA_RUDP_SESSION_TYPE);
+  rudp_session_release(session, L);
+  return 0;
+}
+
+LUA_API int rudp_session_fec(lua_State *L)
+{
+  RUDP_SESSION *session = luaL_checkudata(L, 1, LUA_RUDP_SESSION_TYPE);
+  if (lua_gettop(L) > 1)
+  {
+    lua_Integer fec = luaL_checkinteger(L, 2);
+    session->fec = fec < 0 ? 0 : (fec > RUDP_MAX_PARTS ? RUDP_MAX_PARTS : fec);
+  }
+
+  lua_pushinteger(L, session->fec);
+  return 1;
+}
+
+LUA_API int rudp_session_dest(lua_State *L)
+{
+  RUDP_SESSION *session = luaL_checkudata(L, 1, LUA_RUDP_SESSION_TYPE);
+  udpd_dest_push(L, (struct sockaddr *)&session->addr, session->addrlen);
+  return 1;
+}
+
+static void rudp_push_field(lua_State *L, const void *base,
+                            const RUDP_FIELD *field)
+{
+  const char *p = (const char *)base + field->offset;
+  if (field->type == RUDP_FIELD_NUMBER)
+  {
+    lua_pushnumber(L, *(const lua_Number *)p);
+  }
+  else if (field->type == RUDP_FIELD_INT)
+  {
+    lua_pushinteger(L, *(const int *)p);
+  }
+  else
+  {
+    lua_pushinteger(L, *(const lua_Integer *)p);
+  }
+}
+
+LUA_API int rudp_session_stats(lua_State *L)
+{
+  RUDP_SESSION *session = luaL_checkudata(L, 1, LUA_RUDP_SESSION_TYPE);
+  lua_newtable(L);
+
+  const RUDP_FIELD *field = rudp_session_fields;
+  for (; field->name; field++)
+  {
+    rudp_push_field(L, session, field);
+    lua_setfield(L, -2, field->name);
+  }
+
+  return 1;
+}
+
+LUA_API int rudp_session_index(lua_State *L)
+{
+  RUDP_SESSION *session = luaL_checkudata(L, 1, LUA_RUDP_SESSION_TYPE);
+
+  lua_getmetatable(L, 1);
+  lua_pushvalue(L, 2);
+  lua_rawget(L, -2);
+  if (!lua_isnil(L, -1))
+  {
+    return 1;
+  }
+
+  const char *key = lua_tostring(L, 2);
+  const RUDP_FIELD *field = rudp_session_fields;
+  for (; key && field->name; field++)
+  {
+    if (strcmp(field->name, key) == 0)
+    {
+      rudp_push_field(L, session, field);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+LUA_API int rudp_session_tostring(lua_State *L)
+{
+  RUDP_SESSION *session = luaL_checkudata(L, 1, LUA_RUDP_SESSION_TYPE);
+
+  char buf[INET6_ADDRSTRLEN] = {0};
+  udpd_addr_ntop((struct sockaddr *)&session->addr, buf, sizeof(buf));
+  lua_pushfstring(L, "<rudp session %s:%d>", buf,
+                  udpd_addr_port((struct sockaddr *)&session->addr));
+  return 1;
+}
+
+// ========== engine api ==========
+
+static void rudp_engine_detach(RUDP_ENGINE *engine, lua_State *L)
+{
+  if (engine->timer)
+  {
+    if (event_mgr_base_current())
+    {
+      event_free(engine->timer);
+    }
+    engine->timer = NULL;
+  }
+
+  if (engine->conn)
+  {
+    udpd_conn_set_recv_hook(engine->conn, NULL, NULL);
+    engine->conn = NULL;
+  }
+
+  CLEAR_REF(L, engine->connRef)
+}
+
+LUA_API int rudp_engine_attach(lua_State *L)
+{
+  RUDP_ENGINE *engine = luaL_checkudata(L, 1, LUA_RUDP_ENGINE_TYPE);
+  UDPD_CONN *conn = luaL_checkudata(L, 2, LUA_UDPD_CONNECTION_TYPE);
+
+  if (engine->closed)
+  {
+    return luaL_error(L, "engine closed.");
+  }
+
+  rudp_engine_detach(engine, L);
+
+  lua_pushvalue(L, 2);
+  engine->connRef = luaL_ref(L, LUA_REGISTRYINDEX);
+  engine->conn = conn;
+  udpd_conn_set_recv_hook(conn, rudp_engine_recv, engine);
+
+  engine->timer = evtimer_new(event_mgr_base(), rudp_engine_tick, engine);
+  rudp_engine_schedule(engine);
+
+  // flush packages queued while detached.
+  RUDP_SESSION *session = NULL;
+  TAILQ_FOREACH(session, &engine->sessions, next)
+  {
+    rudp_session_flush(session);
+  }
+
+  return 0;
+}
+
+LUA_API int rudp_engine_detach_api(lua_State *L)
+{
+  RUDP_ENGINE *engine = luaL_checkudata(L, 1, LUA_RUDP_ENGINE_TYPE);
+  rudp_engine_detach(engine, L);
+  return 0;
+}
+
+LUA_API int rudp_engine_session(lua_State *L)
+{
+  RUDP_ENGINE *engine = luaL_checkudata(L, 1, LUA_RUDP_ENGINE_TYPE);
+  UDPD_DEST *dest = luaL_checkudata(L, 2, LUA_UDPD_DEST_TYPE);
+
+  if (engine->closed)
+  {
+    return luaL_error(L, "engine closed.");
+  }
+
+  RUDP_SESSION *session =
+      rudp_engine_lookup(engine, (struct sockaddr *)&dest->si_client);
+  if (session)
+  {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, session->selfRef);
+  }
+  else
+  {
+    rudp_session_push(L, engine, (struct sockaddr *)&dest->si_client,
+                      dest->client_len);
+  }
+
+  return 1;
+}
+
+LUA_API int rudp_engine_close(lua_State *L)
+{
+  RUDP_ENGINE *engine = luaL_checkudata(L, 1, LUA_RUDP_ENGINE_TYPE);
+
+  rudp_engine_detach(engine, L);
+
+  RUDP_SESSION *session = NULL;
+  while ((session = TAILQ_FIRST(&engine->sessions)))
+  {
+    rudp_session_release(session, L);
+  }
+
+  if (engine->buckets)
+  {
+    free(engine->buckets);
+    engine->buckets = NULL;
+  }
+
+  if (engine->fec_buf)
+  {
+    free(engine->fec_buf);
+    engine->fec_buf = NULL;
+  }
+
+  timerwheel_destroy(&engine->wheel);
+
+  CLEAR_REF(L, engine->onReadRef)
+  CLEAR_REF(L, engine->onAcceptRef)
+  CLEAR_REF(L, engine->onSentRef)
+  CLEAR_REF(L, engine->onTimeoutRef)
+
+  engine->closed = true;
+  return 0;
+}
+
+LUA_API int rudp_engine_tostring(lua_State *L)
+{
+  RUDP_ENGINE *engine = luaL_checkudata(L, 1, LUA_RUDP_ENGINE_TYPE);
+  lua_pushfstring(L, "<rudp engine sessions: %d>", (int)engine->session_count);
+  return 1;
+}
+
+#define GET_NUMBER_FROM_TABLE(L, REF, IDX, KEY, DEFAULT) \
+  {                                                      \
+    lua_getfield(L, IDX, KEY);                           \
+    REF = luaL_optnumber(L, -1, DEFAULT);                \
+    lua_pop(L, 1);                                       \
+  }
+
+LUA_API int rudp_new(lua_State *L)
+{
+  event_mgr_init();
+
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 1);
+
+  RUDP_ENGINE *engine = lua_newuserdata(L, sizeof(RUDP_ENGINE));
+  memset(engine, 0, sizeof(RUDP_ENGINE));
+  luaL_getmetatable(L, LUA_RUDP_ENGINE_TYPE);
+  lua_setmetatable(L, -2);
+
+  engine->mainthread = utlua_mainthread(L);
+  engine->connRef = LUA_NOREF;
+
+  SET_FUNC_REF_FROM_TABLE(L, engine->onReadRef, 1, "onread")
+  SET_FUNC_REF_FROM_TABLE(L, engine->onAcceptRef, 1, "onaccept")
+  SET_FUNC_REF_FROM_TABLE(L, engine->onSentRef, 1, "onsent")
+  SET_FUNC_REF_FROM_TABLE(L, engine->onTimeoutRef, 1, "ontimeout")
+
+  lua_Number mtu = 0;
+  lua_Number window_size = 0;
+  lua_Number waiting_count = 0;
+  lua_Number none_paired_waiting_count = 0;
+  lua_Number max_cwnd = 0;
+  lua_Number fec = 0;
+  lua_Number max_message_size = 0;
+  GET_NUMBER_FROM_TABLE(L, mtu, 1, "mtu", 576)
+  GET_NUMBER_FROM_TABLE(L, window_size, 1, "window_size", 10)
+  GET_NUMBER_FROM_TABLE(L, waiting_count, 1, "waiting_count", 10)
+  GET_NUMBER_FROM_TABLE(L, none_paired_waiting_count, 1,
+                        "none_paired_waiting_count", 1)
+  GET_NUMBER_FROM_TABLE(L, engine->timeout, 1, "timeout", 2)
+  GET_NUMBER_FROM_TABLE(L, engine->check_interval, 1,
+                        "check_timeout_duration", 0.01)
+  GET_NUMBER_FROM_TABLE(L, max_cwnd, 1, "max_cwnd", 256)
+  GET_NUMBER_FROM_TABLE(L, fec, 1, "fec", 0)
+  GET_NUMBER_FROM_TABLE(L, max_message_size, 1, "max_message_size",
+                        RUDP_MAX_MESSAGE_SIZE)
+
+  lua_getfield(L, 1, "congestion");
+  const char *congestion = luaL_optstring(L, -1, "fixed");
+  const RUDP_CC_OPS **ops = rudp_cc_list;
+  for (; *ops; ops++)
+  {
+    if (strcmp((*ops)->name, congestion) == 0)
+    {
+      engine->cc = *ops;
+      break;
+    }
+  }
+  if (!engine->cc)
+  {
+    return luaL_error(L, "unknown congestion: %s", congestion);
+  }
+  lua_pop(L, 1);
+
+  // pacing is on by default for the adaptive algorithms.
+  lua_getfield(L, 1, "pacing");
+  engine->pacing =
+      lua_isnil(L, -1) ? engine->cc != &rudp_cc_fixed : lua_toboolean(L, -1);
+  lua_pop(L, 1);
+
+  lua_getfield(L, 1, "accept");
+  engine->accept = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+
+  if (mtu < RUDP_IP_UDP_HEAD_SIZE + RUDP_HEAD_SIZE + 1 || mtu > 65535)
+  {
+    return luaL_error(L, "invalid mtu: %f", mtu);
+  }
+
+  engine->body_size = (size_t)mtu - RUDP_IP_UDP_HEAD_SIZE - RUDP_HEAD_SIZE;
+  engine->max_message_size =
+      max_message_size < 1 ? 1 : (size_t)max_message_size;
+  engine->window_size = window_size < 1 ? 1 : (uint32_t)window_size;
+  engine->waiting_count = waiting_count < 1 ? 1 : (int)waiting_count;
+  engine->none_paired_waiting_count =
+      none_paired_waiting_count < 1 ? 1 : (int)none_paired_waiting_count;
+  engine->max_cwnd = engine->cc == &rudp_cc_fixed
+                         ? engine->waiting_count
+                         : (max_cwnd < RUDP_MIN_CWND ? RUDP_MIN_CWND
+                                                     : (int)max_cwnd);
+
+  engine->fec = fec < 1 ? 0 : (fec > RUDP_MAX_PARTS ? RUDP_MAX_PARTS : (int)fec);
+
+  engine->waiting_capacity = engine->max_cwnd;
+  if (engine->none_paired_waiting_count > engine->waiting_capacity)
+  {
+    engine->waiting_capacity = engine->none_paired_waiting_count;
+  }
+
+  if (engine->check_interval <= 0)
+  {
+    engine->check_interval = 0.01;
+  }
+  timerwheel_init(&engine->wheel, engine->check_interval, RUDP_WHEEL_SLOTS,
+                  rudp_gettime());
+
+  TAILQ_INIT(&engine->sessions);
+  engine->bucket_count = 64;
+  engine->buckets = calloc(engine->bucket_count, sizeof(RUDP_SESSION *));
+
+  return 1;
+}
+
+LUA_API int rudp_totals(lua_State *L)
+{
+  lua_newtable(L);
+  lua_pushinteger(L, rudp_send_total);
+  lua_setfield(L, -2, "udp_send_total");
+  lua_pushinteger(L, rudp_receive_total);
+  lua_setfield(L, -2, "udp_receive_total");
+  lua_pushinteger(L, rudp_resend_total);
+  lua_setfield(L, -2, "udp_resend_total");
+  return 1;
+}
+
+// xor of the strings, each padded with zeros to the longest.
+LUA_API int rudp_parity(lua_State *L)
+{
+  luaL_checktype(L, 1, LUA_TTABLE);
+  size_t count = lua_objlen(L, 1);
+  size_t size = 0;
+  size_t i = 1;
+  for (; i <= count; i++)
+  {
+    lua_rawgeti(L, 1, i);
+    size_t len = 0;
+    if (!lua_isstring(L, -1))
+    {
+      return luaL_error(L, "parity: item %d is not a string", (int)i);
+    }
+    lua_tolstring(L, -1, &len);
+    size = len > size ? len : size;
+    lua_pop(L, 1);
+  }
+
+  // written in place on 5.2+, a scratch userdata copied out on 5.1.
+#if (LUA_VERSION_NUM >= 502)
+  luaL_Buffer b;
+  char *buf = luaL_buffinitsize(L, &b, size);
+#else
+  char *buf = lua_newuserdata(L, size > 0 ? size : 1);
+#endif
+  memset(buf, 0, size);
+  for (i = 1; i <= count; i++)
+  {
+    lua_rawgeti(L, 1, i);
+    size_t len = 0;
+    const char *data = lua_tolstring(L, -1, &len);
+    rudp_xor(buf, data, len);
+    lua_pop(L, 1);
+  }
+#if (LUA_VERSION_NUM >= 502)
+  luaL_pushresultsize(&b, size);
+#else
+  lua_pushlstring(L, buf, size);
+#endif
+  return 1;
+}
+
+static const struct luaL_Reg rudplib[] = {
+    {"new", rudp_new},
+    {"totals", rudp_totals},
+    {"parity", rudp_parity},
+    {NULL, NULL},
+};
+
+static const struct luaL_Reg rudp_engine_mt[] = {
+    {"attach", rudp_engine_attach},
+    {"detach", rudp_engine_detach_api},
+    {"session", rudp_engine_session},
+    {"close", rudp_engine_close},
+    {"__gc", rudp_engine_close},
+    {"__tostring", rudp_engine_tostring},
+    {NULL, NULL},
+};
+
+static const struct luaL_Reg rudp_session_mt[] = {
+    {"send", rudp_session_send},
+    {"cleanup", rudp_session_cleanup},
+    {"close", rudp_session_close},
+    {"dest", rudp_session_dest},
+    {"fec", rudp_session_fec},
+    {"stats", rudp_session_stats},
+    {"__index", rudp_session_index},
+    {"__tostring", rudp_session_tostring},
+    {NULL, NULL},
+};
+
+LUA_API int luaopen_fan_rudp(lua_State *L)
+{
+  luaL_newmetatable(L, LUA_RUDP_ENGINE_TYPE);
+  luaL_register(L, NULL, rudp_engine_mt);
+
+  lua_pushstring(L, "__index");
+  lua_pushvalue(L, -2);
+  lua_rawset(L, -3);
+
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, LUA_RUDP_SESSION_TYPE);
+  luaL_register(L, NULL, rudp_session_mt);
+  lua_pop(L, 1);
+
+  lua_newtable(L);
+  luaL_register(L, "rudp", rudplib);
+  return 1;
+}
@@ -0,0 +1,679 @@
+#include "stream.h"
+#include <sys/mman.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#define SHM_HAS_EVENTFD 1
+#else
+#define SHM_HAS_EVENTFD 0
+#endif
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define LUA_SHM_CHANNEL_TYPE "SHM_CHANNEL_TYPE"
+
+#define SHM_DEFAULT_SIZE (1024 * 1024)
+#define SHM_MIN_SIZE 4096
+
+// bytes handed to lua per wakeup, the rest waits for the next loop.
+#define SHM_READ_BUDGET (4 * 1024 * 1024)
+
+// single producer single consumer byte ring, ring[i] is written by side i.
+// head/tail only grow, the offset is head & (size - 1).
+typedef struct
+{
+  uint64_t head;
+  char pad0[56];
+  uint64_t tail;
+  char pad1[56];
+
+  // set by a side before it waits, the other side notifies only if set.
+  int reader_waiting;
+  int writer_waiting;
+  int closed;
+  char pad2[52];
+} SHM_RING;
+
+typedef struct
+{
+  uint64_t size;
+  int opened[2];
+  char pad[48];
+  SHM_RING ring[2];
+} SHM_HEADER;
+
+typedef struct
+{
+  SHM_HEADER *header;
+  char *data[2];
+  size_t map_len;
+  uint64_t size;
+  int memfd;
+
+  // wake fds of each side, eventfd uses the same fd for both ends.
+  int notify[2][2];
+
+  // a stream socketpair nobody writes to, the kernel closes the end of a
+  // process that exits or crashes, the other side reads eof.
+  int alive[2];
+  struct event *alive_ev;
+  bool peer_gone;
+
+  // -1 until opened.
+  int side;
+  struct event *ev;
+  bool send_requested;
+  bool disconnected;
+
+  lua_State *mainthread;
+  // onread gets this stream with the bytes added, instead of a string.
+  BYTEARRAY *stream;
+  int streamRef;
+  int onReadRef;
+  int onSendReadyRef;
+  int onDisconnectedRef;
+} SHM_CHANNEL;
+
+static void shm_notify(SHM_CHANNEL *ch, int side)
+{
+#if SHM_HAS_EVENTFD
+  eventfd_write(ch->notify[side][1], 1);
+#else
+  char c = 0;
+  if (write(ch->notify[side][1], &c, 1) < 0)
+  {
+    // the pipe is full, a wakeup is pending anyway.
+  }
+#endif
+}
+
+static void shm_drain_notify(SHM_CHANNEL *ch)
+{
+#if SHM_HAS_EVENTFD
+  eventfd_t value = 0;
+  eventfd_read(ch->notify[ch->side][0], &value);
+#else
+  char buf[64];
+  while (read(ch->notify[ch->side][0], buf, sizeof(buf)) > 0)
+  {
+  }
+#endif
+}
+
+static int shm_notify_init(int fds[2])
+{
+#if SHM_HAS_EVENTFD
+  int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  fds[0] = fds[1] = fd;
+  return fd;
+#else
+  if (pipe(fds) == -1)
+  {
+    return -1;
+  }
+  fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+  fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+  return fds[0];
+#endif
+}
+
+static void shm_notify_close(int fds[2])
+{
+  if (fds[0] >= 0)
+  {
+    close(fds[0]);
+  }
+  if (fds[1] >= 0 && fds[1] != fds[0])
+  {
+    close(fds[1]);
+  }
+  fds[0] = fds[1] = -1;
+}
+
+// backing memory, a memfd if possible so the fd can be passed around.
+static void *shm_map(size_t len, int *memfd)
+{
+  *memfd = -1;
+#if defined(__linux__) && defined(SYS_memfd_create)
+  int fd = (int)syscall(SYS_memfd_create, "fan.shm", 1 /* MFD_CLOEXEC */);
+  if (fd >= 0)
+  {
+    if (ftruncate(fd, len) == 0)
+    {
+      void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (p != MAP_FAILED)
+      {
+        *memfd = fd;
+        return p;
+      }
+    }
+    close(fd);
+  }
+#endif
+
+  // shared with the children forked after this.
+  void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                 -1, 0);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+static uint64_t shm_ring_free(SHM_CHANNEL *ch, SHM_RING *ring)
+{
+  uint64_t head = ring->head;
+  uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  return ch->size - (head - tail);
+}
+
+static size_t shm_ring_write(SHM_CHANNEL *ch, const char *buf, size_t len)
+{
+  SHM_RING *ring = &ch->header->ring[ch->side];
+  char *data = ch->data[ch->side];
+
+  uint64_t space = shm_ring_free(ch, ring);
+  if (len > space)
+  {
+    len = space;
+  }
+
+  if (len > 0)
+  {
+    uint64_t head = ring->head;
+    size_t offset = head & (ch->size - 1);
+    size_t first = ch->size - offset < len ? ch->size - offset : len;
+    memcpy(data + offset, buf, first);
+    memcpy(data, buf + first, len - first);
+    __atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+
+    // pairs with the reader setting reader_waiting then rechecking head.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&ring->reader_waiting, 0, __ATOMIC_SEQ_CST))
+    {
+      shm_notify(ch, 1 - ch->side);
+    }
+  }
+
+  return len;
+}
+
+static void shm_channel_ondisconnected(SHM_CHANNEL *ch, const char *reason)
+{
+  ch->disconnected = true;
+
+  if (ch->onDisconnectedRef != LUA_NOREF)
+  {
+    lua_State *mainthread = ch->mainthread;
+    lua_lock(mainthread);
+    lua_State *co = lua_newthread(mainthread);
+    PUSH_REF(mainthread);
+    lua_unlock(mainthread);
+
+    lua_rawgeti(co, LUA_REGISTRYINDEX, ch->onDisconnectedRef);
+    lua_pushstring(co, reason);
+    FAN_RESUME(co, mainthread, 1);
+    POP_REF(mainthread);
+  }
+}
+
+// return false if the channel was closed during the callback.
+static bool shm_channel_read(SHM_CHANNEL *ch, bool *more)
+{
+  int peer = 1 - ch->side;
+  SHM_RING *ring = &ch->header->ring[peer];
+  char *data = ch->data[peer];
+
+  uint64_t tail = ring->tail;
+  uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  uint64_t len = head - tail;
+  if (len == 0)
+  {
+    *more = false;
+    return true;
+  }
+
+  *more = len > SHM_READ_BUDGET;
+  if (*more)
+  {
+    len = SHM_READ_BUDGET;
+  }
+
+  if (ch->onReadRef != LUA_NOREF)
+  {
+    lua_State *mainthread = ch->mainthread;
+    lua_lock(mainthread);
+    lua_State *co = lua_newthread(mainthread);
+    PUSH_REF(mainthread);
+    lua_unlock(mainthread);
+
+    lua_rawgeti(co, LUA_REGISTRYINDEX, ch->onReadRef);
+
+    // a wrapped region is joined, lua gets all the bytes in one call.
+    size_t offset = tail & (ch->size - 1);
+    size_t first = ch->size - offset < len ? ch->size - offset : len;
+    if (ch->stream)
+    {
+      bytearray_write_ready(ch->stream);
+      bytearray_writebuffer(ch->stream, data + offset, first);
+      bytearray_writebuffer(ch->stream, data, len - first);
+      bytearray_read_ready(ch->stream);
+      lua_rawgeti(co, LUA_REGISTRYINDEX, ch->streamRef);
+    }
+    else
+    {
+      lua_pushlstring(co, data + offset, first);
+      if (first < len)
+      {
+        lua_pushlstring(co, data, len - first);
+        lua_concat(co, 2);
+      }
+    }
+
+    // the bytes are copied, give the space back before lua runs.
+    __atomic_store_n(&ring->tail, tail + len, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&ring->writer_waiting, 0, __ATOMIC_SEQ_CST))
+    {
+      shm_notify(ch, peer);
+    }
+
+    FAN_RESUME(co, mainthread, 1);
+    POP_REF(mainthread);
+
+    return ch->header != NULL;
+  }
+
+  __atomic_store_n(&ring->tail, tail + len, __ATOMIC_RELEASE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_exchange_n(&ring->writer_waiting, 0, __ATOMIC_SEQ_CST))
+  {
+    shm_notify(ch, peer);
+  }
+  return true;
+}
+
+static bool shm_peer_closed(SHM_CHANNEL *ch)
+{
+  return ch->peer_gone ||
+         __atomic_load_n(&ch->header->ring[1 - ch->side].closed,
+                         __ATOMIC_ACQUIRE);
+}
+
+static void shm_alive_cb(evutil_socket_t fd, short what, void *arg)
+{
+  SHM_CHANNEL *ch = (SHM_CHANNEL *)arg;
+
+  char buf[64];
+  ssize_t len = recv(fd, buf, sizeof(buf), 0);
+  if (len > 0 || (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                              errno == EINTR)))
+  {
+    return;
+  }
+
+  // the peer is gone, what it wrote is still read before ondisconnected.
+  event_del(ch->alive_ev);
+  ch->peer_gone = true;
+  event_active(ch->ev, EV_READ, 1);
+}
+
+static void shm_channel_cb(evutil_socket_t fd, short what, void *arg)
+{
+  SHM_CHANNEL *ch = (SHM_CHANNEL *)arg;
+  int peer = 1 - ch->side;
+
+  shm_drain_notify(ch);
+
+  bool more = false;
+  if (!shm_channel_read(ch, &more))
+  {
+    return;
+  }
+
+  SHM_RING *in = &ch->header->ring[peer];
+  if (!more)
+  {
+    // wait for the peer, recheck in case it wrote before the flag was seen.
+    __atomic_store_n(&in->reader_waiting, 1, __ATOMIC_SEQ_CST);
+    more = __atomic_load_n(&in->head, __ATOMIC_SEQ_CST) != in->tail;
+  }
+
+  if (ch->send_requested)
+  {
+    SHM_RING *out = &ch->header->ring[ch->side];
+    if (shm_ring_free(ch, out) == 0)
+    {
+      __atomic_store_n(&out->writer_waiting, 1, __ATOMIC_SEQ_CST);
+    }
+
+    if (shm_ring_free(ch, out) > 0 && ch->onSendReadyRef != LUA_NOREF)
+    {
+      ch->send_requested = false;
+
+      lua_State *mainthread = ch->mainthread;
+      lua_lock(mainthread);
+      lua_State *co = lua_newthread(mainthread);
+      PUSH_REF(mainthread);
+      lua_unlock(mainthread);
+
+      lua_rawgeti(co, LUA_REGISTRYINDEX, ch->onSendReadyRef);
+      FAN_RESUME(co, mainthread, 0);
+      POP_REF(mainthread);
+
+      if (!ch->header)
+      {
+        return;
+      }
+    }
+  }
+
+  if (more)
+  {
+    // fairness, the rest is read on the next loop.
+    event_active(ch->ev, EV_READ, 1);
+  }
+  else if (!ch->disconnected && shm_peer_closed(ch))
+  {
+    shm_channel_ondisconnected(ch, "peer closed.");
+  }
+}
+
+LUA_API int luafan_shm_new(lua_State *L)
+{
+  lua_Integer size = SHM_DEFAULT_SIZE;
+  if (lua_istable(L, 1))
+  {
+    lua_getfield(L, 1, "size");
+    size = luaL_optinteger(L, -1, SHM_DEFAULT_SIZE);
+    lua_pop(L, 1);
+  }
+
+  // power of 2, so offsets are a mask.
+  uint64_t ring_size = SHM_MIN_SIZE;
+  while (ring_size < (uint64_t)size)
+  {
+    ring_size <<= 1;
+  }
+
+  SHM_CHANNEL *ch = lua_newuserdata(L, sizeof(SHM_CHANNEL));
+  memset(ch, 0, sizeof(SHM_CHANNEL));
+  ch->memfd = -1;
+  ch->notify[0][0] = ch->notify[0][1] = -1;
+  ch->notify[1][0] = ch->notify[1][1] = -1;
+  ch->alive[0] = ch->alive[1] = -1;
+  ch->side = -1;
+  ch->streamRef = LUA_NOREF;
+  ch->onReadRef = LUA_NOREF;
+  ch->onSendReadyRef = LUA_NOREF;
+  ch->onDisconnectedRef = LUA_NOREF;
+  luaL_getmetatable(L, LUA_SHM_CHANNEL_TYPE);
+  lua_setmetatable(L, -2);
+
+  size_t header_len = (sizeof(SHM_HEADER) + SHM_MIN_SIZE - 1) &
+                      ~(size_t)(SHM_MIN_SIZE - 1);
+  ch->map_len = header_len + 2 * ring_size;
+  ch->header = shm_map(ch->map_len, &ch->memfd);
+  if (!ch->header)
+  {
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(errno));
+    return 2;
+  }
+
+  ch->size = ring_size;
+  ch->header->size = ring_size;
+  ch->data[0] = (char *)ch->header + header_len;
+  ch->data[1] = ch->data[0] + ring_size;
+
+  if (shm_notify_init(ch->notify[0]) == -1 ||
+      shm_notify_init(ch->notify[1]) == -1 ||
+      socketpair(AF_UNIX, SOCK_STREAM, 0, ch->alive) == -1)
+  {
+    int err = errno;
+    munmap(ch->header, ch->map_len);
+    ch->header = NULL;
+    shm_notify_close(ch->notify[0]);
+    shm_notify_close(ch->notify[1]);
+    ch->alive[0] = ch->alive[1] = -1;
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(err));
+    return 2;
+  }
+
+  evutil_make_socket_nonblocking(ch->alive[0]);
+  evutil_make_socket_nonblocking(ch->alive[1]);
+
+  return 1;
+}
+
+static SHM_CHANNEL *shm_check_open(lua_State *L)
+{
+  SHM_CHANNEL *ch = luaL_checkudata(L, 1, LUA_SHM_CHANNEL_TYPE);
+  if (!ch->header || ch->side < 0)
+  {
+    luaL_error(L, "shm channel not opened.");
+  }
+  return ch;
+}
+
+LUA_API int luafan_shm_open(lua_State *L)
+{
+  SHM_CHANNEL *ch = luaL_checkudata(L, 1, LUA_SHM_CHANNEL_TYPE);
+  luaL_checktype(L, 2, LUA_TTABLE);
+
+  if (!ch->header)
+  {
+    return luaL_error(L, "shm channel closed.");
+  }
+  if (ch->side >= 0)
+  {
+    return luaL_error(L, "shm channel already opened.");
+  }
+
+  lua_getfield(L, 2, "side");
+  int side = (int)luaL_checkinteger(L, -1);
+  lua_pop(L, 1);
+  luaL_argcheck(L, side == 0 || side == 1, 2, "side must be 0 or 1.");
+
+  lua_getfield(L, 2, "stream");
+  if (!lua_isnil(L, -1))
+  {
+    ch->stream = stream_test(L, -1);
+    luaL_argcheck(L, ch->stream != NULL && !ch->stream->readonly, 2,
+                  "stream must be a writable fan.stream.");
+    ch->streamRef = luaL_ref(L, LUA_REGISTRYINDEX);
+  }
+  else
+  {
+    lua_pop(L, 1);
+  }
+
+  event_mgr_init();
+
+  ch->side = side;
+  ch->mainthread = utlua_mainthread(L);
+  SET_FUNC_REF_FROM_TABLE(L, ch->onReadRef, 2, "onread")
+  SET_FUNC_REF_FROM_TABLE(L, ch->onSendReadyRef, 2, "onsendready")
+  SET_FUNC_REF_FROM_TABLE(L, ch->onDisconnectedRef, 2, "ondisconnected")
+
+  // pipe ends this side never uses.
+  int peer = 1 - side;
+  if (ch->notify[peer][0] != ch->notify[peer][1])
+  {
+    close(ch->notify[peer][0]);
+    ch->notify[peer][0] = -1;
+    close(ch->notify[side][1]);
+    ch->notify[side][1] = -1;
+  }
+
+  ch->ev = event_new(event_mgr_base(), ch->notify[side][0],
+                     EV_READ | EV_PERSIST, shm_channel_cb, ch);
+  event_add(ch->ev, NULL);
+
+  close(ch->alive[peer]);
+  ch->alive[peer] = -1;
+  ch->alive_ev = event_new(event_mgr_base(), ch->alive[side],
+                           EV_READ | EV_PERSIST, shm_alive_cb, ch);
+  event_add(ch->alive_ev, NULL);
+
+  __atomic_store_n(&ch->header->opened[side], 1, __ATOMIC_SEQ_CST);
+
+  // pick up what the peer wrote before this side was opened.
+  event_active(ch->ev, EV_READ, 1);
+
+  return 0;
+}
+
+LUA_API int luafan_shm_send(lua_State *L)
+{
+  SHM_CHANNEL *ch = shm_check_open(L);
+  size_t len = 0;
+  const char *data = luaL_checklstring(L, 2, &len);
+
+  if (ch->disconnected || shm_peer_closed(ch))
+  {
+    lua_pushnil(L);
+    lua_pushliteral(L, "peer closed.");
+    return 2;
+  }
+
+  lua_pushinteger(L, shm_ring_write(ch, data, len));
+  return 1;
+}
+
+LUA_API int luafan_shm_send_request(lua_State *L)
+{
+  SHM_CHANNEL *ch = shm_check_open(L);
+
+  if (ch->onSendReadyRef == LUA_NOREF)
+  {
+    return luaL_error(L, "onsendready not defined.");
+  }
+
+  ch->send_requested = true;
+  event_active(ch->ev, EV_READ, 1);
+  return 0;
+}
+
+LUA_API int luafan_shm_stats(lua_State *L)
+{
+  SHM_CHANNEL *ch = luaL_checkudata(L, 1, LUA_SHM_CHANNEL_TYPE);
+
+  lua_newtable(L);
+  lua_pushinteger(L, ch->size);
+  lua_setfield(L, -2, "size");
+  lua_pushinteger(L, ch->side);
+  lua_setfield(L, -2, "side");
+  lua_pushboolean(L, ch->memfd >= 0);
+  lua_setfield(L, -2, "memfd");
+
+  if (ch->header && ch->side >= 0)
+  {
+    SHM_RING *out = &ch->header->ring[ch->side];
+    SHM_RING *in = &ch->header->ring[1 - ch->side];
+    lua_pushinteger(L, ch->size - shm_ring_free(ch, out));
+    lua_setfield(L, -2, "send_pending");
+    lua_pushinteger(L, __atomic_load_n(&in->head, __ATOMIC_ACQUIRE) - in->tail);
+    lua_setfield(L, -2, "recv_pending");
+    lua_pushinteger(L, out->head);
+    lua_setfield(L, -2, "send_total");
+    lua_pushinteger(L, in->tail);
+    lua_setfield(L, -2, "recv_total");
+  }
+
+  return 1;
+}
+
+LUA_API int luafan_shm_close(lua_State *L)
+{
+  SHM_CHANNEL *ch = luaL_checkudata(L, 1, LUA_SHM_CHANNEL_TYPE);
+
+  CLEAR_REF(L, ch->streamRef)
+  ch->stream = NULL;
+  CLEAR_REF(L, ch->onReadRef)
+  CLEAR_REF(L, ch->onSendReadyRef)
+  CLEAR_REF(L, ch->onDisconnectedRef)
+
+  if (event_mgr_base_current() && ch->ev)
+  {
+    event_free(ch->ev);
+    ch->ev = NULL;
+  }
+  if (event_mgr_base_current() && ch->alive_ev)
+  {
+    event_free(ch->alive_ev);
+    ch->alive_ev = NULL;
+  }
+
+  if (ch->header)
+  {
+    if (ch->side >= 0)
+    {
+      __atomic_store_n(&ch->header->ring[ch->side].closed, 1,
+                       __ATOMIC_RELEASE);
+      shm_notify(ch, 1 - ch->side);
+    }
+
+    munmap(ch->header, ch->map_len);
+    ch->header = NULL;
+  }
+
+  shm_notify_close(ch->notify[0]);
+  shm_notify_close(ch->notify[1]);
+
+  int i = 0;
+  for (i = 0; i < 2; i++)
+  {
+    if (ch->alive[i] >= 0)
+    {
+      close(ch->alive[i]);
+      ch->alive[i] = -1;
+    }
+  }
+
+  if (ch->memfd >= 0)
+  {
+    close(ch->memfd);
+    ch->memfd = -1;
+  }
+
+  return 0;
+}
+
+static const struct luaL_Reg shmlib[] = {
+    {"new", luafan_shm_new}, {NULL, NULL},
+};
+
+LUA_API int luaopen_fan_shm(lua_State *L)
+{
+  luaL_newmetatable(L, LUA_SHM_CHANNEL_TYPE);
+  lua_pushcfunction(L, &luafan_shm_open);
+  lua_setfield(L, -2, "open");
+
+  lua_pushcfunction(L, &luafan_shm_send);
+  lua_setfield(L, -2, "send");
+
+  lua_pushcfunction(L, &luafan_shm_send_request);
+  lua_setfield(L, -2, "send_req");
+
+  lua_pushcfunction(L, &luafan_shm_stats);
+  lua_setfield(L, -2, "stats");
+
+  lua_pushcfunction(L, &luafan_shm_close);
+  lua_setfield(L, -2, "close");
+
+  lua_pushstring(L, "__index");
+  lua_pushvalue(L, -2);
+  lua_rawset(L, -3);
+
+  lua_pushstring(L, "__gc");
+  lua_pushcfunction(L, &luafan_shm_close);
+  lua_rawset(L, -3);
+
+  lua_pop(L, 1);
+
+  lua_newtable(L);
+  luaL_register(L, "shm", shmlib);
+  return 1;
+}
@@ -2,9 +2,7 @@
 #pragma clang diagnostic ignored "-Wdeprecated-declarations"
 #endif
 
-#include "utlua.h"
-
-#define LUA_STREAM_TYPE "<fan.stream available=%d>"
+#include "stream.h"
 
 #include "stream_ffi.c"
 
@@ -21,6 +19,28 @@ LUA_API int luafan_stream_new(lua_State *L)
   return 1;
 }
 
+LUA_API int luafan_stream_mmap(lua_State *L)
+{
+  const char *path = luaL_checkstring(L, 1);
+  size_t offset = luaL_optinteger(L, 2, 0);
+  size_t length = luaL_optinteger(L, 3, 0);
+  const char *advice = luaL_optstring(L, 4, NULL);
+
+  BYTEARRAY *ba = (BYTEARRAY *)lua_newuserdata(L, sizeof(BYTEARRAY));
+  memset(ba, 0, sizeof(BYTEARRAY));
+  luaL_getmetatable(L, LUA_STREAM_TYPE);
+  lua_setmetatable(L, -2);
+
+  int err = ffi_stream_mmap(ba, path, offset, length, advice);
+  if (err)
+  {
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(err));
+    return 2;
+  }
+  return 1;
+}
+
 LUA_API int luafan_stream_gc(lua_State *L)
 {
   BYTEARRAY *ba = (BYTEARRAY *)luaL_checkudata(L, 1, LUA_STREAM_TYPE);
@@ -184,6 +204,119 @@ LUA_API int luafan_stream_add_d64(lua_State *L)
   return 0;
 }
 
+LUA_API int luafan_stream_get_u16be(lua_State *L)
+{
+  BYTEARRAY *ba = (BYTEARRAY *)luaL_checkudata(L, 1, LUA_STREAM_TYPE);
+  uint16_t result = 0;
+  if (ffi_stream_get_u16be(ba, &result))
+  {
+    lua_pushinteger(L, result);
+    return 1;
+  }
+  else
+  {
+    return 0;
+  }
+}
+
+LUA_API int luafan_stream_add_u16be(lua_State *L)
+{
+  BYTEARRAY *ba = (BYTEARRAY *)luaL_checkudata(L, 1, LUA_STREAM_TYPE);
+  uint16_t value = luaL_checkinteger(L, 2);
+  ffi_stream_add_u16be(ba, value);
+  return 0;
+}
+
+LUA_API int luafan_stream_get_u32be(lua_State *L)
+{
+  BYTEARRAY *ba = (BYTEARRAY *)luaL_checkudata(L, 1, LUA_STREAM_TYPE);
+  uint32_t result = 0;
+  if (ffi_stream_get_u32be(ba, &result))
+  {
+    lua_pushinteger(L, result);
+    return 1;
+  }
+  else
+  {
+    return 0;
+  }
+}
+
+LUA_API int luafan_stream_add_u32be(lua_State *L)
+{
+  BYTEARRAY *ba = (BYTEARRAY *)luaL_checkudata(L, 1, LUA_STREAM_TYPE);
+  uint32_t value = (uint32_t)stream_check_int64(L, 2);
+  ffi_stream_add_u32be(ba, value);
+  return 0;
+}
+
+LUA_API int luafan_stream_get_u64be(lua_State *L)
+{
+  BYTEARRAY *ba = (BYTEARRAY *)luaL_checkudata(L, 1, LUA_STREAM_TYPE);
+  uint64_t result = 0;
+  if (ffi_stream_get_u64be(ba, &result))
+  {
+    stream_push_uint64(L, result);
+    return 1;
+  }
+  else
+  {
+    return 0;
+  }
+}
+
+LUA_API int luafan_stream_add_u64be(lua_State *L)
+{
+  BYTEARRAY *ba = (BYTEARRAY *)luaL_checkudata(L, 1, LUA_STREAM_TYPE);
+  uint64_t value = stream_check_uint64(L, 2);
+  ffi_stream_add_u64be(ba, value);
+  return 0;
+}
+
+LUA_API int luafan_stream_get_varint(lua_State *L)
+{
+  BYTEARRAY *ba = (BYTEARRAY *)luaL_checkudata(L, 1, LUA_STREAM_TYPE);
+  int64_t result = 0;
+  if (ffi_stream_get_svarint(ba, &result))
+  {
+    stream_push_int64(L, result);
+    return 1;
+  }
+  else
+  {
+    return 0;
+  }
+}
+
+LUA_API int luafan_stream_add_varint(lua_State *L)
+{
+  BYTEARRAY *ba = (BYTEARRAY *)luaL_checkudata(L, 1, LUA_STREAM_TYPE);
+  ffi_stream_add_svarint(ba, stream_check_int64(L, 2));
+  return 0;
+}
+
+LUA_API int luafan_stream_get_varuint(lua_State *L)
+{
+  BYTEARRAY *ba = (BYTEARRAY *)luaL_checkudata(L, 1, LUA_STREAM_TYPE);
+  uint64_t result = 0;
+  if (ffi_stream_get_varint(ba, &result))
+  {
+    stream_push_uint64(L, result);
+    return 1;
+  }
+  else
+  {
+    return 0;
+  }
+}
+
+LUA_API int luafan_stream_add_varuint(lua_State *L)
+{
+  BYTEARRAY *ba = (BYTEARRAY *)luaL_checkudata(L, 1, LUA_STREAM_TYPE);
+  ffi_stream_add_varint(ba, stream_check_uint64(L, 2));
+  return 0;
+}
+
 LUA_API int luafan_stream_get_string(lua_State *L)
 {
   BYTEARRAY *ba = (BYTEARRAY *)luaL_checkudata(L, 1, LUA_STREAM_TYPE);
@@ -248,6 +381,222 @@ LUA_API int luafan_stream_get_bytes(lua_State *L)
   }
 }
 
+LUA_API int luafan_stream_slice(lua_State *L)
+{
+  BYTEARRAY *ba = (BYTEARRAY *)luaL_checkudata(L, 1, LUA_STREAM_TYPE);
+  size_t len = luaL_optinteger(L, 2, bytearray_read_available(ba));
+
+  BYTEARRAY *view = (BYTEARRAY *)lua_newuserdata(L, sizeof(BYTEARRAY));
+  memset(view, 0, sizeof(BYTEARRAY));
+  luaL_getmetatable(L, LUA_STREAM_TYPE);
+  lua_setmetatable(L, -2);
+
+  if (ffi_stream_slice(ba, view, len))
+  {
+    return 1;
+  }
+  else
+  {
+    return 0;
+  }
+}
+
+LUA_API int luafan_stream_tostring_view(lua_State *L)
+{
+  BYTEARRAY *ba = (BYTEARRAY *)luaL_checkudata(L, 1, LUA_STREAM_TYPE);
+  uint8_t *buff = NULL;
+  size_t buflen = 0;
+  ffi_stream_view(ba, &buff, &buflen);
+  lua_pushlstring(L, buff ? (char *)buff : "", buflen);
+  return 1;
+}
+
+LUA_API int luafan_stream_crc32c(lua_State *L)
+{
+  BYTEARRAY *ba = (BYTEARRAY *)luaL_checkudata(L, 1, LUA_STREAM_TYPE);
+  size_t len = luaL_optinteger(L, 2, bytearray_read_available(ba));
+  uint32_t result = 0;
+  if (ffi_stream_crc32c(ba, len, &result))
+  {
+    lua_pushinteger(L, result);
+    return 1;
+  }
+  else
+  {
+    return 0;
+  }
+}
+
+LUA_API int luafan_stream_crc32(lua_State *L)
+{
+  BYTEARRAY *ba = (BYTEARRAY *)luaL_checkudata(L, 1, LUA_STREAM_TYPE);
+  size_t len = luaL_optinteger(L, 2, bytearray_read_available(ba));
+  uint32_t result = 0;
+  if (ffi_stream_crc32(ba, len, &result))
+  {
+    lua_pushinteger(L, result);
+    return 1;
+  }
+  else
+  {
+    return 0;
+  }
+}
+
+LUA_API int luafan_stream_hash64(lua_State *L)
+{
+  BYTEARRAY *ba = (BYTEARRAY *)luaL_checkudata(L, 1, LUA_STREAM_TYPE);
+  size_t len = luaL_optinteger(L, 2, bytearray_read_available(ba));
+  uint64_t seed = stream_check_seed64(L, 3);
+  uint64_t result = 0;
+  if (ffi_stream_hash64(ba, len, seed, &result))
+  {
+    stream_push_hash64(L, result);
+    return 1;
+  }
+  else
+  {
+    return 0;
+  }
+}
+
+#define STREAM_GET_ARRAY_LOOP(push, expr) \
+  for (i = 0; i < count; i++)             \
+  {                                       \
+    push(L, expr);                        \
+    lua_rawseti(L, -2, i + 1);            \
+  }
+
+// read count elements into a new table, nothing if not enough data.
+static int stream_get_array(lua_State *L, int kind)
+{
+  BYTEARRAY *ba = (BYTEARRAY *)luaL_checkudata(L, 1, LUA_STREAM_TYPE);
+  lua_Integer n = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, n >= 0 && n <= INT_MAX, 2, "invalid count.");
+  size_t count = n;
+
+  const uint8_t *p = stream_array_data(ba, kind, count);
+  if (!p)
+  {
+    return 0;
+  }
+
+  lua_createtable(L, (int)count, 0);
+  size_t i = 0;
+  switch (kind)
+  {
+  case STREAM_ARRAY_U8:
+    STREAM_GET_ARRAY_LOOP(lua_pushinteger, p[i])
+    break;
+  case STREAM_ARRAY_U16:
+  {
+    uint16_t v;
+    STREAM_GET_ARRAY_LOOP(lua_pushinteger, (memcpy(&v, p + i * 2, 2), v))
+    break;
+  }
+  case STREAM_ARRAY_U24:
+    STREAM_GET_ARRAY_LOOP(lua_pushinteger, stream_array_u24(p + i * 3))
+    break;
+  case STREAM_ARRAY_S24:
+    STREAM_GET_ARRAY_LOOP(lua_pushinteger, stream_array_s24(p + i * 3))
+    break;
+  case STREAM_ARRAY_U32:
+  {
+    uint32_t v;
+    STREAM_GET_ARRAY_LOOP(lua_pushinteger, (memcpy(&v, p + i * 4, 4), v))
+    break;
+  }
+  case STREAM_ARRAY_D64:
+  {
+    double v;
+    STREAM_GET_ARRAY_LOOP(lua_pushnumber, (memcpy(&v, p + i * 8, 8), v))
+    break;
+  }
+  }
+
+  ba->offset += count * stream_array_width[kind];
+  return 1;
+}
+
+// write t[1..count] (count defaults to #t) in one reserve.
+static int stream_add_array(lua_State *L, int kind)
+{
+  BYTEARRAY *ba = (BYTEARRAY *)luaL_checkudata(L, 1, LUA_STREAM_TYPE);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_Integer n = luaL_optinteger(L, 3, lua_objlen(L, 2));
+  luaL_argcheck(L, n >= 0 && n <= INT_MAX, 3, "invalid count.");
+  size_t count = n;
+
+  size_t width = stream_array_width[kind];
+  uint8_t *p = bytearray_write_space(ba, count * width);
+  if (!p)
+  {
+    return 0;
+  }
+
+  size_t i = 0;
+  for (i = 0; i < count; i++)
+  {
+    lua_rawgeti(L, 2, i + 1);
+    if (!lua_isnumber(L, -1))
+    {
+      return luaL_error(L, "number expected at index %d.", (int)i + 1);
+    }
+    double d = lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    uint8_t *q = p + i * width;
+    if (kind == STREAM_ARRAY_D64)
+    {
+      memcpy(q, &d, 8);
+      continue;
+    }
+
+    uint32_t v = (uint32_t)(int64_t)d;
+    switch (kind)
+    {
+    case STREAM_ARRAY_U8:
+      *q = (uint8_t)v;
+      break;
+    case STREAM_ARRAY_U16:
+    {
+      uint16_t u = (uint16_t)v;
+      memcpy(q, &u, 2);
+      break;
+    }
+    case STREAM_ARRAY_U24:
+    case STREAM_ARRAY_S24:
+      q[0] = v & 0xff;
+      q[1] = (v >> 8) & 0xff;
+      q[2] = (v >> 16) & 0xff;
+      break;
+    case STREAM_ARRAY_U32:
+      memcpy(q, &v, 4);
+      break;
+    }
+  }
+
+  ba->offset += count * width;
+  return 0;
+}
+
+#define STREAM_ARRAY_API(name, kind)                         \
+  LUA_API int luafan_stream_get_##name##_array(lua_State *L) \
+  {                                                          \
+    return stream_get_array(L, kind);                        \
+  }                                                          \
+  LUA_API int luafan_stream_add_##name##_array(lua_State *L) \
+  {                                                          \
+    return stream_add_array(L, kind);                        \
+  }
+
+STREAM_ARRAY_API(u8, STREAM_ARRAY_U8)
+STREAM_ARRAY_API(u16, STREAM_ARRAY_U16)
+STREAM_ARRAY_API(u24, STREAM_ARRAY_U24)
+STREAM_ARRAY_API(s24, STREAM_ARRAY_S24)
+STREAM_ARRAY_API(u32, STREAM_ARRAY_U32)
+STREAM_ARRAY_API(d64, STREAM_ARRAY_D64)
+
 LUA_API int luafan_stream_add_string(lua_State *L)
 {
   BYTEARRAY *ba = (BYTEARRAY *)luaL_checkudata(L, 1, LUA_STREAM_TYPE);
@@ -312,8 +661,49 @@ LUA_API int luafan_stream_tostring(lua_State *L)
   return 1;
 }
 
+LUA_API int luafan_stream_alloc_stats(lua_State *L)
+{
+  BYTEARRAY_STATS stats;
+  bytearray_stats(&stats);
+
+  lua_newtable(L);
+  lua_pushinteger(L, stats.alloc_count);
+  lua_setfield(L, -2, "alloc_count");
+  lua_pushinteger(L, stats.pool_hit_count);
+  lua_setfield(L, -2, "pool_hit_count");
+  lua_pushinteger(L, stats.grow_count);
+  lua_setfield(L, -2, "grow_count");
+  lua_pushinteger(L, stats.free_count);
+  lua_setfield(L, -2, "free_count");
+  lua_pushinteger(L, stats.pooled_count);
+  lua_setfield(L, -2, "pooled_count");
+  lua_pushinteger(L, stats.pooled_bytes);
+  lua_setfield(L, -2, "pooled_bytes");
+  return 1;
+}
+
+BYTEARRAY *stream_test(lua_State *L, int idx)
+{
+  void *p = lua_touserdata(L, idx);
+  if (p && lua_getmetatable(L, idx))
+  {
+    luaL_getmetatable(L, LUA_STREAM_TYPE);
+    bool same = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+    if (same)
+    {
+      return p;
+    }
+  }
+  return NULL;
+}
+
 static const struct luaL_Reg streamlib[] = {
-    {"new", luafan_stream_new}, {NULL, NULL},
+    {"new", luafan_stream_new},
+    {"alloc_stats", luafan_stream_alloc_stats},
+    {"mmap", luafan_stream_mmap},
+    {"compile_format", luafan_stream_compile_format},
+    {NULL, NULL},
 };
 
 static const struct luaL_Reg streammtlib[] = {
@@ -348,9 +738,42 @@ static const struct luaL_Reg streammtlib[] = {
     {"AddBytes", luafan_stream_add_bytes},
     {"AddString", luafan_stream_add_string},
 
+    {"GetU16BE", luafan_stream_get_u16be},
+    {"GetU32BE", luafan_stream_get_u32be},
+    {"GetU64BE", luafan_stream_get_u64be},
+    {"AddU16BE", luafan_stream_add_u16be},
+    {"AddU32BE", luafan_stream_add_u32be},
+    {"AddU64BE", luafan_stream_add_u64be},
+
+    {"GetVarInt", luafan_stream_get_varint},
+    {"AddVarInt", luafan_stream_add_varint},
+    {"GetVarUInt", luafan_stream_get_varuint},
+    {"AddVarUInt", luafan_stream_add_varuint},
+
+    {"GetU8Array", luafan_stream_get_u8_array},
+    {"GetU16Array", luafan_stream_get_u16_array},
+    {"GetU24Array", luafan_stream_get_u24_array},
+    {"GetS24Array", luafan_stream_get_s24_array},
+    {"GetU32Array", luafan_stream_get_u32_array},
+    {"GetD64Array", luafan_stream_get_d64_array},
+
+    {"AddU8Array", luafan_stream_add_u8_array},
+    {"AddU16Array", luafan_stream_add_u16_array},
+    {"AddU24Array", luafan_stream_add_u24_array},
+    {"AddS24Array", luafan_stream_add_s24_array},
+    {"AddU32Array", luafan_stream_add_u32_array},
+    {"AddD64Array", luafan_stream_add_d64_array},
+
     {"mark", luafan_stream_mark},
     {"reset", luafan_stream_reset},
 
+    {"slice", luafan_stream_slice},
+    {"tostring_view", luafan_stream_tostring_view},
+
+    {"crc32c", luafan_stream_crc32c},
+    {"crc32", luafan_stream_crc32},
+    {"hash64", luafan_stream_hash64},
+
     {"package", luafan_stream_package},
     {NULL, NULL},
 };
@@ -374,6 +797,8 @@ LUA_API int luaopen_fan_stream_core(lua_State *L)
 
   lua_pop(L, 1);
 
+  stream_format_init(L);
+
   lua_newtable(L);
   luaL_register(L, "stream", streamlib);
   return 1;
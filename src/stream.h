@@ -0,0 +1,65 @@
+#ifndef stream_h
+#define stream_h
+
+#include "utlua.h"
+
+#define LUA_STREAM_TYPE "<fan.stream available=%d>"
+
+// 64-bit values are integers on lua 5.3+, numbers (53-bit exact) before.
+#if (LUA_VERSION_NUM >= 503)
+#define stream_push_int64(L, v) lua_pushinteger(L, (lua_Integer)(v))
+#define stream_push_uint64(L, v) lua_pushinteger(L, (lua_Integer)(v))
+#define stream_check_int64(L, idx) ((int64_t)luaL_checkinteger(L, idx))
+#define stream_check_uint64(L, idx) ((uint64_t)luaL_checkinteger(L, idx))
+#else
+#define stream_push_int64(L, v) lua_pushnumber(L, (lua_Number)(v))
+#define stream_push_uint64(L, v) lua_pushnumber(L, (lua_Number)(v))
+#define stream_check_int64(L, idx) ((int64_t)luaL_checknumber(L, idx))
+
+static inline uint64_t stream_check_uint64(lua_State *L, int idx)
+{
+  lua_Number n = luaL_checknumber(L, idx);
+  return n >= 9223372036854775808.0 ? (uint64_t)n : (uint64_t)(int64_t)n;
+}
+#endif
+
+// a 64-bit hash is an integer on lua 5.3+, a 16 digit lowercase hex string
+// before, a number would drop its low bits. a seed is read from either.
+#if (LUA_VERSION_NUM >= 503)
+#define stream_push_hash64(L, v) lua_pushinteger(L, (lua_Integer)(v))
+#else
+static inline void stream_push_hash64(lua_State *L, uint64_t v)
+{
+  char hex[17];
+  snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)v);
+  lua_pushlstring(L, hex, 16);
+}
+#endif
+
+static inline uint64_t stream_check_seed64(lua_State *L, int idx)
+{
+  if (lua_isnoneornil(L, idx))
+  {
+    return 0;
+  }
+  if (lua_type(L, idx) == LUA_TSTRING)
+  {
+    size_t len = 0;
+    const char *hex = lua_tolstring(L, idx, &len);
+    char *end = NULL;
+    unsigned long long v = strtoull(hex, &end, 16);
+    luaL_argcheck(L, len > 0 && len <= 16 && end == hex + len, idx,
+                  "hex seed expected.");
+    return (uint64_t)v;
+  }
+  return stream_check_uint64(L, idx);
+}
+
+// return the stream at idx, NULL if it's not a stream.
+BYTEARRAY *stream_test(lua_State *L, int idx);
+
+// stream.compile_format(fmt), in streamformat.c.
+LUA_API int luafan_stream_compile_format(lua_State *L);
+void stream_format_init(lua_State *L);
+
+#endif
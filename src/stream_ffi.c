@@ -1,4 +1,11 @@
 #include "bytearray.h"
+#include "checksum.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 void ffi_stream_new(BYTEARRAY *ba, const char *data, size_t len)
 {
@@ -153,6 +160,18 @@ void ffi_stream_get_bytes(BYTEARRAY *ba, uint8_t **buff, size_t *buflen)
   bytearray_readbuffer(ba, NULL, len);
 }
 
+bool ffi_stream_slice(BYTEARRAY *ba, BYTEARRAY *view, size_t len)
+{
+  return bytearray_slice(ba, view, len);
+}
+
+// readable data, not consumed.
+void ffi_stream_view(BYTEARRAY *ba, uint8_t **buff, size_t *buflen)
+{
+  *buff = ba->buffer ? ba->buffer + ba->offset : NULL;
+  *buflen = bytearray_read_available(ba);
+}
+
 // ========== ADD ==========
 void ffi_stream_add_u8(BYTEARRAY *ba, uint8_t value)
 {
@@ -198,6 +217,400 @@ void ffi_stream_add_bytes(BYTEARRAY *ba, const char *data, size_t len)
   bytearray_writebuffer(ba, data, len);
 }
 
+// ========== BIG-ENDIAN ==========
+#if defined(__GNUC__) || defined(__clang__)
+#define STREAM_BSWAP16(x) __builtin_bswap16(x)
+#define STREAM_BSWAP32(x) __builtin_bswap32(x)
+#define STREAM_BSWAP64(x) __builtin_bswap64(x)
+#else
+#define STREAM_BSWAP16(x) ((uint16_t)((x) << 8 | (x) >> 8))
+#define STREAM_BSWAP32(x)                                              \
+  ((((x)&0xff) << 24) | (((x)&0xff00) << 8) | (((x) >> 8) & 0xff00) | \
+   ((x) >> 24))
+#define STREAM_BSWAP64(x)                               \
+  (((uint64_t)STREAM_BSWAP32((uint32_t)(x)) << 32) |    \
+   STREAM_BSWAP32((uint32_t)((x) >> 32)))
+#endif
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define STREAM_BE16(x) (x)
+#define STREAM_BE32(x) (x)
+#define STREAM_BE64(x) (x)
+#else
+#define STREAM_BE16(x) STREAM_BSWAP16(x)
+#define STREAM_BE32(x) STREAM_BSWAP32(x)
+#define STREAM_BE64(x) STREAM_BSWAP64(x)
+#endif
+
+bool ffi_stream_get_u16be(BYTEARRAY *ba, uint16_t *result)
+{
+  uint16_t value = 0;
+  if (!bytearray_read16(ba, &value))
+  {
+    return false;
+  }
+  *result = STREAM_BE16(value);
+  return true;
+}
+
+bool ffi_stream_get_u32be(BYTEARRAY *ba, uint32_t *result)
+{
+  uint32_t value = 0;
+  if (!bytearray_read32(ba, &value))
+  {
+    return false;
+  }
+  *result = STREAM_BE32(value);
+  return true;
+}
+
+bool ffi_stream_get_u64be(BYTEARRAY *ba, uint64_t *result)
+{
+  uint64_t value = 0;
+  if (!bytearray_read64(ba, &value))
+  {
+    return false;
+  }
+  *result = STREAM_BE64(value);
+  return true;
+}
+
+void ffi_stream_add_u16be(BYTEARRAY *ba, uint16_t value)
+{
+  bytearray_write16(ba, STREAM_BE16(value));
+}
+
+void ffi_stream_add_u32be(BYTEARRAY *ba, uint32_t value)
+{
+  bytearray_write32(ba, STREAM_BE32(value));
+}
+
+void ffi_stream_add_u64be(BYTEARRAY *ba, uint64_t value)
+{
+  bytearray_write64(ba, STREAM_BE64(value));
+}
+
+// ========== VARINT ==========
+// LEB128, 7 bits per byte with the high bit set if more bytes follow, the
+// offset is kept if the value is not complete.
+bool ffi_stream_get_varint(BYTEARRAY *ba, uint64_t *result)
+{
+  size_t available = bytearray_read_available(ba);
+  const uint8_t *p = ba->buffer + ba->offset;
+  uint64_t value = 0;
+  size_t i = 0;
+
+  for (; i < available && i < 10; i++)
+  {
+    value |= (uint64_t)(p[i] & 127) << (i * 7);
+    if ((p[i] & 128) == 0)
+    {
+      ba->offset += i + 1;
+      *result = value;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void ffi_stream_add_varint(BYTEARRAY *ba, uint64_t u)
+{
+  uint8_t buf[10];
+  size_t len = 0;
+  do
+  {
+    buf[len++] = ((u & ~0x7fULL) != 0 ? 0x80 : 0) | (u & 0x7f);
+    u >>= 7;
+  } while (u != 0);
+  bytearray_writebuffer(ba, buf, len);
+}
+
+// zigzag keeps small negative values short, -1 => 1, 1 => 2.
+bool ffi_stream_get_svarint(BYTEARRAY *ba, int64_t *result)
+{
+  uint64_t u = 0;
+  if (!ffi_stream_get_varint(ba, &u))
+  {
+    return false;
+  }
+  *result = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+  return true;
+}
+
+void ffi_stream_add_svarint(BYTEARRAY *ba, int64_t value)
+{
+  ffi_stream_add_varint(ba, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+// ========== ARRAY ==========
+// element kinds of the array apis, keep in sync with ffi.lua.
+#define STREAM_ARRAY_U8 0
+#define STREAM_ARRAY_U16 1
+#define STREAM_ARRAY_U24 2
+#define STREAM_ARRAY_S24 3
+#define STREAM_ARRAY_U32 4
+#define STREAM_ARRAY_D64 5
+
+static const size_t stream_array_width[] = {1, 2, 3, 3, 4, 8};
+
+// data of count elements at the read offset, NULL if not enough.
+static const uint8_t *stream_array_data(BYTEARRAY *ba, int kind, size_t count)
+{
+  if (kind < STREAM_ARRAY_U8 || kind > STREAM_ARRAY_D64 ||
+      count > bytearray_read_available(ba) / stream_array_width[kind])
+  {
+    return NULL;
+  }
+  return ba->buffer ? ba->buffer + ba->offset : (const uint8_t *)"";
+}
+
+static inline uint32_t stream_array_u24(const uint8_t *p)
+{
+  return p[2] << 16 | p[1] << 8 | p[0];
+}
+
+static inline int32_t stream_array_s24(const uint8_t *p)
+{
+  uint32_t u = stream_array_u24(p);
+  return (u & 0x800000) ? (int32_t)(u | 0xff000000) : (int32_t)u;
+}
+
+// one loop per kind, so the width conversion vectorizes.
+bool ffi_stream_get_array(BYTEARRAY *ba, int kind, double *values,
+                          size_t count)
+{
+  const uint8_t *p = stream_array_data(ba, kind, count);
+  if (!p)
+  {
+    return false;
+  }
+
+  size_t i = 0;
+  switch (kind)
+  {
+  case STREAM_ARRAY_U8:
+    for (i = 0; i < count; i++)
+    {
+      values[i] = p[i];
+    }
+    break;
+  case STREAM_ARRAY_U16:
+    for (i = 0; i < count; i++)
+    {
+      uint16_t v;
+      memcpy(&v, p + i * 2, 2);
+      values[i] = v;
+    }
+    break;
+  case STREAM_ARRAY_U24:
+    for (i = 0; i < count; i++)
+    {
+      values[i] = stream_array_u24(p + i * 3);
+    }
+    break;
+  case STREAM_ARRAY_S24:
+    for (i = 0; i < count; i++)
+    {
+      values[i] = stream_array_s24(p + i * 3);
+    }
+    break;
+  case STREAM_ARRAY_U32:
+    for (i = 0; i < count; i++)
+    {
+      uint32_t v;
+      memcpy(&v, p + i * 4, 4);
+      values[i] = v;
+    }
+    break;
+  case STREAM_ARRAY_D64:
+    memcpy(values, p, count * 8);
+    break;
+  }
+
+  ba->offset += count * stream_array_width[kind];
+  return true;
+}
+
+bool ffi_stream_add_array(BYTEARRAY *ba, int kind, const double *values,
+                          size_t count)
+{
+  if (kind < STREAM_ARRAY_U8 || kind > STREAM_ARRAY_D64)
+  {
+    return false;
+  }
+  size_t width = stream_array_width[kind];
+  uint8_t *p = bytearray_write_space(ba, count * width);
+  if (!p)
+  {
+    return false;
+  }
+
+  size_t i = 0;
+  switch (kind)
+  {
+  case STREAM_ARRAY_U8:
+    for (i = 0; i < count; i++)
+    {
+      p[i] = (uint8_t)(int64_t)values[i];
+    }
+    break;
+  case STREAM_ARRAY_U16:
+    for (i = 0; i < count; i++)
+    {
+      uint16_t v = (uint16_t)(int64_t)values[i];
+      memcpy(p + i * 2, &v, 2);
+    }
+    break;
+  case STREAM_ARRAY_U24:
+  case STREAM_ARRAY_S24:
+    for (i = 0; i < count; i++)
+    {
+      uint32_t v = (uint32_t)(int64_t)values[i];
+      p[i * 3] = v & 0xff;
+      p[i * 3 + 1] = (v >> 8) & 0xff;
+      p[i * 3 + 2] = (v >> 16) & 0xff;
+    }
+    break;
+  case STREAM_ARRAY_U32:
+    for (i = 0; i < count; i++)
+    {
+      uint32_t v = (uint32_t)(int64_t)values[i];
+      memcpy(p + i * 4, &v, 4);
+    }
+    break;
+  case STREAM_ARRAY_D64:
+    memcpy(p, values, count * 8);
+    break;
+  }
+
+  ba->offset += count * width;
+  return true;
+}
+
+// ========== MMAP ==========
+static void stream_munmap(uint8_t *buffer, size_t buflen)
+{
+  munmap(buffer, buflen);
+}
+
+// map length bytes (0 for the rest of the file) of path at offset as a
+// read-only stream, advice is NULL or normal/sequential/willneed/random.
+// return 0 or errno.
+int ffi_stream_mmap(BYTEARRAY *ba, const char *path, size_t offset,
+                    size_t length, const char *advice)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+  {
+    return errno;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0)
+  {
+    int err = errno;
+    close(fd);
+    return err;
+  }
+
+  size_t size = (size_t)st.st_size;
+  if (offset > size || (length > 0 && length > size - offset))
+  {
+    close(fd);
+    return EINVAL;
+  }
+  if (length == 0)
+  {
+    length = size - offset;
+  }
+
+  if (length == 0)
+  {
+    close(fd);
+    bytearray_wrap_buffer(ba, (uint8_t *)"", 0);
+    ba->readonly = true;
+    return 0;
+  }
+
+  // the mapping starts at a page boundary.
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t start = offset - offset % page;
+  size_t maplen = length + (offset - start);
+
+  void *p = mmap(NULL, maplen, PROT_READ, MAP_PRIVATE, fd, (off_t)start);
+  int err = errno;
+  close(fd);
+  if (p == MAP_FAILED)
+  {
+    return err;
+  }
+
+  if (advice)
+  {
+    int adv = strcmp(advice, "sequential") == 0
+                  ? MADV_SEQUENTIAL
+                  : strcmp(advice, "willneed") == 0
+                        ? MADV_WILLNEED
+                        : strcmp(advice, "random") == 0 ? MADV_RANDOM
+                                                        : MADV_NORMAL;
+    madvise(p, maplen, adv);
+  }
+
+  if (!bytearray_wrap_owned(ba, (uint8_t *)p + (offset - start), length,
+                            (uint8_t *)p, maplen, stream_munmap))
+  {
+    munmap(p, maplen);
+    return ENOMEM;
+  }
+  return 0;
+}
+
+// ========== CHECKSUM ==========
+// the next len readable bytes, not consumed, NULL if not enough data.
+static const uint8_t *stream_checksum_data(BYTEARRAY *ba, size_t len)
+{
+  if (len > bytearray_read_available(ba))
+  {
+    return NULL;
+  }
+  return ba->buffer ? ba->buffer + ba->offset : (const uint8_t *)"";
+}
+
+bool ffi_stream_crc32c(BYTEARRAY *ba, size_t len, uint32_t *result)
+{
+  const uint8_t *data = stream_checksum_data(ba, len);
+  if (!data)
+  {
+    return false;
+  }
+  *result = checksum_crc32c(0, data, len);
+  return true;
+}
+
+bool ffi_stream_crc32(BYTEARRAY *ba, size_t len, uint32_t *result)
+{
+  const uint8_t *data = stream_checksum_data(ba, len);
+  if (!data)
+  {
+    return false;
+  }
+  *result = checksum_crc32(0, data, len);
+  return true;
+}
+
+bool ffi_stream_hash64(BYTEARRAY *ba, size_t len, uint64_t seed,
+                       uint64_t *result)
+{
+  const uint8_t *data = stream_checksum_data(ba, len);
+  if (!data)
+  {
+    return false;
+  }
+  *result = checksum_hash64(data, len, seed);
+  return true;
+}
+
 // ========== Others ==========
 void ffi_stream_package(BYTEARRAY *ba, uint8_t **buff, size_t *buflen)
 {
@@ -0,0 +1,721 @@
+#include "streamchain.h"
+
+// pieces smaller than this are copied to evbuffer instead of referenced.
+#define STREAM_CHAIN_REFERENCE_MIN 1024
+
+static STREAM_SEGMENT *chain_segment_new(size_t size)
+{
+  STREAM_SEGMENT *seg = malloc(sizeof(STREAM_SEGMENT) + size);
+  if (seg)
+  {
+    seg->next = NULL;
+    seg->refcount = 1;
+    seg->size = size;
+    seg->len = 0;
+  }
+  return seg;
+}
+
+static void chain_segment_release(STREAM_SEGMENT *seg)
+{
+  if (--seg->refcount == 0)
+  {
+    free(seg);
+  }
+}
+
+static void chain_segment_cleanup(const void *data, size_t datalen,
+                                  void *extra)
+{
+  chain_segment_release((STREAM_SEGMENT *)extra);
+}
+
+// step over consumed segments, release the ones before the read position.
+static void chain_normalize(STREAM_CHAIN *chain)
+{
+  while (chain->rseg && chain->roffset == chain->rseg->len &&
+         chain->rseg->next)
+  {
+    chain->rseg = chain->rseg->next;
+    chain->roffset = 0;
+  }
+
+  if (chain->marked)
+  {
+    return;
+  }
+
+  while (chain->head && chain->head != chain->rseg)
+  {
+    STREAM_SEGMENT *next = chain->head->next;
+    chain_segment_release(chain->head);
+    chain->head = next;
+  }
+
+  // all read, write the only segment from start again if nobody shares it.
+  if (chain->available == 0 && chain->rseg && chain->rseg->refcount == 1)
+  {
+    chain->rseg->len = 0;
+    chain->roffset = 0;
+  }
+}
+
+static bool chain_write(STREAM_CHAIN *chain, const void *data, size_t len)
+{
+  const uint8_t *pos = data;
+  while (len > 0)
+  {
+    STREAM_SEGMENT *tail = chain->tail;
+    if (!tail || tail->len == tail->size)
+    {
+      STREAM_SEGMENT *seg = chain_segment_new(STREAM_CHAIN_SEGMENT_SIZE);
+      if (!seg)
+      {
+        return false;
+      }
+      if (tail)
+      {
+        tail->next = seg;
+      }
+      else
+      {
+        chain->head = seg;
+        chain->rseg = seg;
+        chain->roffset = 0;
+      }
+      chain->tail = tail = seg;
+    }
+
+    size_t n = tail->size - tail->len;
+    if (n > len)
+    {
+      n = len;
+    }
+    memcpy(tail->data + tail->len, pos, n);
+    tail->len += n;
+    chain->available += n;
+    pos += n;
+    len -= n;
+  }
+
+  return true;
+}
+
+// copy len bytes after skip from the read position, nothing consumed.
+static bool chain_peek(STREAM_CHAIN *chain, size_t skip, void *out, size_t len)
+{
+  if (chain->available < skip + len)
+  {
+    return false;
+  }
+
+  uint8_t *pos = out;
+  STREAM_SEGMENT *seg = chain->rseg;
+  size_t offset = chain->roffset;
+  while (len > 0)
+  {
+    size_t part = seg->len - offset;
+    if (part <= skip)
+    {
+      skip -= part;
+      seg = seg->next;
+      offset = 0;
+      continue;
+    }
+    offset += skip;
+    part -= skip;
+    skip = 0;
+
+    size_t n = part < len ? part : len;
+    memcpy(pos, seg->data + offset, n);
+    pos += n;
+    offset += n;
+    len -= n;
+  }
+
+  return true;
+}
+
+// consume len bytes, copied to out if it's not NULL.
+static bool chain_read(STREAM_CHAIN *chain, void *out, size_t len)
+{
+  if (chain->available < len)
+  {
+    return false;
+  }
+
+  uint8_t *pos = out;
+  chain->available -= len;
+  if (chain->marked)
+  {
+    chain->mark_consumed += len;
+  }
+
+  while (len > 0)
+  {
+    STREAM_SEGMENT *seg = chain->rseg;
+    size_t part = seg->len - chain->roffset;
+    if (part == 0)
+    {
+      chain->rseg = seg->next;
+      chain->roffset = 0;
+      continue;
+    }
+
+    size_t n = part < len ? part : len;
+    if (pos)
+    {
+      memcpy(pos, seg->data + chain->roffset, n);
+      pos += n;
+    }
+    chain->roffset += n;
+    len -= n;
+  }
+
+  chain_normalize(chain);
+  return true;
+}
+
+// push len bytes as a string and consume them.
+static void chain_push_bytes(lua_State *L, STREAM_CHAIN *chain, size_t len)
+{
+  chain_normalize(chain);
+  STREAM_SEGMENT *seg = chain->rseg;
+  if (seg->len - chain->roffset >= len)
+  {
+    // fast path, no copy before lua_pushlstring.
+    lua_pushlstring(L, (const char *)seg->data + chain->roffset, len);
+    chain_read(chain, NULL, len);
+    return;
+  }
+
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  size_t offset = chain->roffset;
+  size_t left = len;
+  while (left > 0)
+  {
+    size_t n = seg->len - offset;
+    if (n > left)
+    {
+      n = left;
+    }
+    luaL_addlstring(&b, (const char *)seg->data + offset, n);
+    left -= n;
+    seg = seg->next;
+    offset = 0;
+  }
+  chain_read(chain, NULL, len);
+  luaL_pushresult(&b);
+}
+
+// decode a u30 at the read position, return its size, 0 if incomplete.
+static size_t chain_peek_u30(STREAM_CHAIN *chain, uint32_t *result)
+{
+  uint8_t buf[5];
+  size_t len = chain->available < sizeof(buf) ? chain->available : sizeof(buf);
+  chain_peek(chain, 0, buf, len);
+
+  uint32_t value = 0;
+  uint8_t shift = 0;
+  size_t i = 0;
+  for (; i < len; i++)
+  {
+    value |= ((uint32_t)(buf[i] & 127) << shift);
+    shift += 7;
+
+    if ((buf[i] & 128) == 0 || shift > 30)
+    {
+      *result = value;
+      return i + 1;
+    }
+  }
+
+  return 0;
+}
+
+static void chain_clear(STREAM_CHAIN *chain)
+{
+  STREAM_SEGMENT *seg = chain->head;
+  while (seg)
+  {
+    STREAM_SEGMENT *next = seg->next;
+    chain_segment_release(seg);
+    seg = next;
+  }
+  memset(chain, 0, sizeof(STREAM_CHAIN));
+}
+
+STREAM_CHAIN *stream_chain_test(lua_State *L, int idx)
+{
+  void *p = lua_touserdata(L, idx);
+  if (p && lua_getmetatable(L, idx))
+  {
+    luaL_getmetatable(L, LUA_STREAM_CHAIN_TYPE);
+    bool same = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+    if (same)
+    {
+      return p;
+    }
+  }
+  return NULL;
+}
+
+size_t stream_chain_drain(STREAM_CHAIN *chain, struct evbuffer *output)
+{
+  size_t total = 0;
+  while (chain->available > 0)
+  {
+    STREAM_SEGMENT *seg = chain->rseg;
+    size_t part = seg->len - chain->roffset;
+    if (part == 0)
+    {
+      chain->rseg = seg->next;
+      chain->roffset = 0;
+      continue;
+    }
+
+    const uint8_t *data = seg->data + chain->roffset;
+    if (part < STREAM_CHAIN_REFERENCE_MIN)
+    {
+      if (evbuffer_add(output, data, part) != 0)
+      {
+        break;
+      }
+    }
+    else
+    {
+      seg->refcount++;
+      if (evbuffer_add_reference(output, data, part, chain_segment_cleanup,
+                                 seg) != 0)
+      {
+        seg->refcount--;
+        break;
+      }
+    }
+
+    chain->roffset += part;
+    chain->available -= part;
+    if (chain->marked)
+    {
+      chain->mark_consumed += part;
+    }
+    total += part;
+  }
+
+  chain_normalize(chain);
+  return total;
+}
+
+LUA_API int luafan_stream_chain_new(lua_State *L)
+{
+  size_t len = 0;
+  const char *data = luaL_optlstring(L, 1, NULL, &len);
+
+  STREAM_CHAIN *chain = lua_newuserdata(L, sizeof(STREAM_CHAIN));
+  memset(chain, 0, sizeof(STREAM_CHAIN));
+  luaL_getmetatable(L, LUA_STREAM_CHAIN_TYPE);
+  lua_setmetatable(L, -2);
+
+  if (data && len > 0 && !chain_write(chain, data, len))
+  {
+    return luaL_error(L, "out of memory.");
+  }
+  return 1;
+}
+
+#define CHECK_CHAIN(L) \
+  STREAM_CHAIN *chain = luaL_checkudata(L, 1, LUA_STREAM_CHAIN_TYPE);
+
+#define CHAIN_WRITE(L, data, len)               \
+  if (!chain_write(chain, data, len))           \
+  {                                             \
+    return luaL_error(L, "out of memory.");     \
+  }
+
+LUA_API int luafan_stream_chain_gc(lua_State *L)
+{
+  CHECK_CHAIN(L)
+  chain_clear(chain);
+  return 0;
+}
+
+LUA_API int luafan_stream_chain_tostring(lua_State *L)
+{
+  CHECK_CHAIN(L)
+  lua_pushfstring(L, "<fan.stream.chain available=%d>", (int)chain->available);
+  return 1;
+}
+
+LUA_API int luafan_stream_chain_available(lua_State *L)
+{
+  CHECK_CHAIN(L)
+  lua_pushinteger(L, chain->available);
+  return 1;
+}
+
+LUA_API int luafan_stream_chain_empty(lua_State *L)
+{
+  CHECK_CHAIN(L)
+  chain_clear(chain);
+  lua_pushboolean(L, true);
+  return 1;
+}
+
+// reads and writes can be mixed on a chain, kept for api compatibility.
+LUA_API int luafan_stream_chain_prepare_get(lua_State *L)
+{
+  luaL_checkudata(L, 1, LUA_STREAM_CHAIN_TYPE);
+  lua_pushboolean(L, true);
+  return 1;
+}
+
+LUA_API int luafan_stream_chain_prepare_add(lua_State *L)
+{
+  CHECK_CHAIN(L)
+  chain->marked = false;
+  chain->mark_consumed = 0;
+  chain_normalize(chain);
+  lua_pushboolean(L, true);
+  return 1;
+}
+
+LUA_API int luafan_stream_chain_mark(lua_State *L)
+{
+  CHECK_CHAIN(L)
+  chain->marked = false;
+  chain_normalize(chain);
+
+  chain->marked = true;
+  chain->mark_seg = chain->rseg;
+  chain->mark_offset = chain->roffset;
+  chain->mark_consumed = 0;
+  lua_pushboolean(L, true);
+  return 1;
+}
+
+LUA_API int luafan_stream_chain_reset(lua_State *L)
+{
+  CHECK_CHAIN(L)
+  if (!chain->marked)
+  {
+    return 0;
+  }
+
+  chain->rseg = chain->mark_seg;
+  chain->roffset = chain->mark_offset;
+  chain->available += chain->mark_consumed;
+  chain->mark_consumed = 0;
+  lua_pushboolean(L, true);
+  return 1;
+}
+
+#define CHAIN_GET_VALUE(type, push)     \
+  CHECK_CHAIN(L)                        \
+  type value;                           \
+  if (!chain_read(chain, &value, sizeof(value))) \
+  {                                     \
+    return 0;                           \
+  }                                     \
+  push(L, value);                       \
+  return 1;
+
+LUA_API int luafan_stream_chain_get_u8(lua_State *L)
+{
+  CHAIN_GET_VALUE(uint8_t, lua_pushinteger)
+}
+
+LUA_API int luafan_stream_chain_get_u16(lua_State *L)
+{
+  CHAIN_GET_VALUE(uint16_t, lua_pushinteger)
+}
+
+LUA_API int luafan_stream_chain_get_u32(lua_State *L)
+{
+  CHAIN_GET_VALUE(uint32_t, lua_pushinteger)
+}
+
+LUA_API int luafan_stream_chain_get_d64(lua_State *L)
+{
+  CHAIN_GET_VALUE(double, lua_pushnumber)
+}
+
+LUA_API int luafan_stream_chain_get_u24(lua_State *L)
+{
+  CHECK_CHAIN(L)
+  uint8_t value[3];
+  if (!chain_read(chain, value, sizeof(value)))
+  {
+    return 0;
+  }
+  lua_pushinteger(L, value[2] << 16 | value[1] << 8 | value[0]);
+  return 1;
+}
+
+LUA_API int luafan_stream_chain_get_s24(lua_State *L)
+{
+  CHECK_CHAIN(L)
+  uint8_t value[3];
+  if (!chain_read(chain, value, sizeof(value)))
+  {
+    return 0;
+  }
+
+  int32_t result = value[2] << 16 | value[1] << 8 | value[0];
+  if (value[2] & 0x80)
+  {
+    result = -1 - (result ^ 0xffffff);
+  }
+  lua_pushinteger(L, result);
+  return 1;
+}
+
+LUA_API int luafan_stream_chain_get_u30(lua_State *L)
+{
+  CHECK_CHAIN(L)
+  uint32_t value = 0;
+  size_t len = chain_peek_u30(chain, &value);
+  if (len == 0)
+  {
+    return 0;
+  }
+  chain_read(chain, NULL, len);
+  lua_pushinteger(L, value);
+  return 1;
+}
+
+LUA_API int luafan_stream_chain_get_bytes(lua_State *L)
+{
+  CHECK_CHAIN(L)
+  size_t len = luaL_optinteger(L, 2, -1);
+  if (len == 0)
+  {
+    return 0;
+  }
+  if (len > chain->available)
+  {
+    len = chain->available;
+  }
+  if (len == 0)
+  {
+    return 0;
+  }
+
+  chain_push_bytes(L, chain, len);
+  return 1;
+}
+
+LUA_API int luafan_stream_chain_get_string(lua_State *L)
+{
+  CHECK_CHAIN(L)
+  uint32_t len = 0;
+  size_t head = chain_peek_u30(chain, &len);
+  if (head == 0)
+  {
+    lua_pushnil(L);
+    lua_pushinteger(L, chain->available + 1);
+    return 2;
+  }
+  if (chain->available - head < len)
+  {
+    lua_pushnil(L);
+    lua_pushinteger(L, head + len);
+    return 2;
+  }
+
+  chain_read(chain, NULL, head);
+  if (len == 0)
+  {
+    lua_pushliteral(L, "");
+  }
+  else
+  {
+    chain_push_bytes(L, chain, len);
+  }
+  return 1;
+}
+
+LUA_API int luafan_stream_chain_add_u8(lua_State *L)
+{
+  CHECK_CHAIN(L)
+  uint8_t value = luaL_checkinteger(L, 2);
+  CHAIN_WRITE(L, &value, sizeof(value))
+  return 0;
+}
+
+LUA_API int luafan_stream_chain_add_u16(lua_State *L)
+{
+  CHECK_CHAIN(L)
+  uint16_t value = luaL_checkinteger(L, 2);
+  CHAIN_WRITE(L, &value, sizeof(value))
+  return 0;
+}
+
+LUA_API int luafan_stream_chain_add_u24(lua_State *L)
+{
+  CHECK_CHAIN(L)
+  uint32_t u = luaL_checkinteger(L, 2);
+  uint8_t value[3] = {u & 0xff, (u >> 8) & 0xff, (u >> 16) & 0xff};
+  CHAIN_WRITE(L, value, sizeof(value))
+  return 0;
+}
+
+LUA_API int luafan_stream_chain_add_u30(lua_State *L)
+{
+  CHECK_CHAIN(L)
+  uint32_t u = luaL_checkinteger(L, 2);
+  uint8_t value[5];
+  size_t len = 0;
+  do
+  {
+    value[len++] = ((u & ~0x7f) != 0 ? 0x80 : 0) | (u & 0x7F);
+    u = u >> 7;
+  } while (u != 0);
+  CHAIN_WRITE(L, value, len)
+  return 0;
+}
+
+LUA_API int luafan_stream_chain_add_d64(lua_State *L)
+{
+  CHECK_CHAIN(L)
+  double value = luaL_checknumber(L, 2);
+  CHAIN_WRITE(L, &value, sizeof(value))
+  return 0;
+}
+
+LUA_API int luafan_stream_chain_add_bytes(lua_State *L)
+{
+  CHECK_CHAIN(L)
+  size_t len = 0;
+  const char *data = luaL_checklstring(L, 2, &len);
+  CHAIN_WRITE(L, data, len)
+  return 0;
+}
+
+LUA_API int luafan_stream_chain_add_string(lua_State *L)
+{
+  CHECK_CHAIN(L)
+  size_t len = 0;
+  const char *data = luaL_checklstring(L, 2, &len);
+
+  uint32_t u = len;
+  uint8_t value[5];
+  size_t ulen = 0;
+  do
+  {
+    value[ulen++] = ((u & ~0x7f) != 0 ? 0x80 : 0) | (u & 0x7F);
+    u = u >> 7;
+  } while (u != 0);
+  CHAIN_WRITE(L, value, ulen)
+  CHAIN_WRITE(L, data, len)
+  return 0;
+}
+
+// flatten the readable data, nothing consumed.
+LUA_API int luafan_stream_chain_package(lua_State *L)
+{
+  CHECK_CHAIN(L)
+  chain_normalize(chain);
+
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  STREAM_SEGMENT *seg = chain->rseg;
+  size_t offset = chain->roffset;
+  for (; seg; seg = seg->next)
+  {
+    luaL_addlstring(&b, (const char *)seg->data + offset, seg->len - offset);
+    offset = 0;
+  }
+  luaL_pushresult(&b);
+  return 1;
+}
+
+// count of segments holding readable data.
+LUA_API int luafan_stream_chain_segments(lua_State *L)
+{
+  CHECK_CHAIN(L)
+  chain_normalize(chain);
+
+  int count = 0;
+  STREAM_SEGMENT *seg = chain->rseg;
+  size_t offset = chain->roffset;
+  for (; seg; seg = seg->next)
+  {
+    if (seg->len > offset)
+    {
+      count++;
+    }
+    offset = 0;
+  }
+  lua_pushinteger(L, count);
+  return 1;
+}
+
+static const struct luaL_Reg streamchainlib[] = {
+    {"new", luafan_stream_chain_new}, {NULL, NULL},
+};
+
+static const struct luaL_Reg streamchainmtlib[] = {
+    {"prepare_get", luafan_stream_chain_prepare_get},
+    {"prepare_add", luafan_stream_chain_prepare_add},
+    {"empty", luafan_stream_chain_empty},
+    {"available", luafan_stream_chain_available},
+    {"segments", luafan_stream_chain_segments},
+    {"GetU8", luafan_stream_chain_get_u8},
+    {"GetS24", luafan_stream_chain_get_s24},
+    {"GetU24", luafan_stream_chain_get_u24},
+    {"GetU16", luafan_stream_chain_get_u16},
+    {"GetU32", luafan_stream_chain_get_u32},
+
+    {"GetU30", luafan_stream_chain_get_u30},
+    {"GetABCS32", luafan_stream_chain_get_u30},
+    {"GetABCU32", luafan_stream_chain_get_u30},
+
+    {"GetD64", luafan_stream_chain_get_d64},
+    {"GetBytes", luafan_stream_chain_get_bytes},
+    {"GetString", luafan_stream_chain_get_string},
+
+    {"AddU8", luafan_stream_chain_add_u8},
+    {"AddU16", luafan_stream_chain_add_u16},
+    {"AddS24", luafan_stream_chain_add_u24},
+    {"AddU24", luafan_stream_chain_add_u24},
+
+    {"AddU30", luafan_stream_chain_add_u30},
+    {"AddABCU32", luafan_stream_chain_add_u30},
+    {"AddABCS32", luafan_stream_chain_add_u30},
+
+    {"AddD64", luafan_stream_chain_add_d64},
+    {"AddBytes", luafan_stream_chain_add_bytes},
+    {"AddString", luafan_stream_chain_add_string},
+
+    {"mark", luafan_stream_chain_mark},
+    {"reset", luafan_stream_chain_reset},
+
+    {"package", luafan_stream_chain_package},
+    {NULL, NULL},
+};
+
+LUA_API int luaopen_fan_stream_chain(lua_State *L)
+{
+  luaL_newmetatable(L, LUA_STREAM_CHAIN_TYPE);
+  luaL_register(L, NULL, streamchainmtlib);
+
+  lua_pushstring(L, "__index");
+  lua_pushvalue(L, -2);
+  lua_rawset(L, -3);
+
+  lua_pushstring(L, "__tostring");
+  lua_pushcfunction(L, &luafan_stream_chain_tostring);
+  lua_rawset(L, -3);
+
+  lua_pushstring(L, "__gc");
+  lua_pushcfunction(L, &luafan_stream_chain_gc);
+  lua_rawset(L, -3);
+
+  lua_pop(L, 1);
+
+  lua_newtable(L);
+  luaL_register(L, NULL, streamchainlib);
+  return 1;
+}
@@ -0,0 +1,46 @@
+#ifndef streamchain_h
+#define streamchain_h
+
+#include "utlua.h"
+
+#define LUA_STREAM_CHAIN_TYPE "STREAM_CHAIN_TYPE"
+
+// payload of a new segment, bigger pieces are split.
+#define STREAM_CHAIN_SEGMENT_SIZE 16384
+
+// a segment is shared with evbuffers on send, freed on last release.
+typedef struct stream_segment
+{
+  struct stream_segment *next;
+  int refcount;
+  size_t size;
+  // bytes written.
+  size_t len;
+  uint8_t data[];
+} STREAM_SEGMENT;
+
+// queue of segments, data is added at tail and read from the read position,
+// segments before it are released unless pinned by mark().
+typedef struct
+{
+  STREAM_SEGMENT *head;
+  STREAM_SEGMENT *tail;
+
+  STREAM_SEGMENT *rseg;
+  size_t roffset;
+  size_t available;
+
+  bool marked;
+  STREAM_SEGMENT *mark_seg;
+  size_t mark_offset;
+  // bytes read since mark, given back on reset.
+  size_t mark_consumed;
+} STREAM_CHAIN;
+
+// return the chain at idx, NULL if it's not a chain.
+STREAM_CHAIN *stream_chain_test(lua_State *L, int idx);
+
+// move all the readable data to output without copying, return bytes moved.
+size_t stream_chain_drain(STREAM_CHAIN *chain, struct evbuffer *output);
+
+#endif
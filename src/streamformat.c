@@ -0,0 +1,498 @@
+#include "stream.h"
+
+#define LUA_STREAM_FORMAT_TYPE "STREAM_FORMAT_TYPE"
+#define LUA_STREAM_FORMAT_CACHE "STREAM_FORMAT_CACHE"
+
+#define FORMAT_OP_INT 0
+#define FORMAT_OP_FLOAT 1
+#define FORMAT_OP_DOUBLE 2
+// c[n], n bytes as is.
+#define FORMAT_OP_FIXED 3
+// s[n], string after an n bytes length.
+#define FORMAT_OP_LSTRING 4
+// z, zero-terminated string.
+#define FORMAT_OP_ZSTRING 5
+// x, one zero byte, no value.
+#define FORMAT_OP_PADDING 6
+
+typedef struct
+{
+  uint8_t kind;
+  bool little;
+  bool sign;
+  // bytes of int/float/fixed, bytes of the length of lstring.
+  uint32_t size;
+} FORMAT_OP;
+
+// a string.pack format parsed once, ops are run against the stream buffer.
+typedef struct
+{
+  int count;
+  // values read or written.
+  int values;
+  // bytes of the record, the minimum if it's not fixed.
+  size_t size;
+  bool fixed;
+  FORMAT_OP ops[];
+} STREAM_FORMAT;
+
+static bool format_little_native(void)
+{
+  uint16_t one = 1;
+  return *(uint8_t *)&one == 1;
+}
+
+static uint32_t format_read_size(const char **p, const char *end,
+                                 uint32_t dft)
+{
+  if (*p >= end || !isdigit((uint8_t)**p))
+  {
+    return dft;
+  }
+
+  uint32_t n = 0;
+  while (*p < end && isdigit((uint8_t)**p) && n < 100000000)
+  {
+    n = n * 10 + (*((*p)++) - '0');
+  }
+  return n;
+}
+
+// parse fmt to format->ops, return the error message on failure.
+static const char *format_parse(STREAM_FORMAT *format, const char *fmt,
+                                size_t len)
+{
+  const char *p = fmt;
+  const char *end = fmt + len;
+  bool little = format_little_native();
+
+  while (p < end)
+  {
+    char c = *p++;
+    FORMAT_OP op = {FORMAT_OP_INT, little, false, 0};
+
+    switch (c)
+    {
+    case ' ':
+      continue;
+    case '<':
+      little = true;
+      continue;
+    case '>':
+      little = false;
+      continue;
+    case '=':
+      little = format_little_native();
+      continue;
+    case 'b':
+    case 'B':
+      op.size = 1;
+      break;
+    case 'h':
+    case 'H':
+      op.size = 2;
+      break;
+    case 'i':
+    case 'I':
+      op.size = format_read_size(&p, end, 4);
+      break;
+    case 'l':
+    case 'L':
+    case 'j':
+    case 'J':
+    case 'T':
+      op.size = 8;
+      break;
+    case 'f':
+      op.kind = FORMAT_OP_FLOAT;
+      op.size = 4;
+      break;
+    case 'd':
+    case 'n':
+      op.kind = FORMAT_OP_DOUBLE;
+      op.size = 8;
+      break;
+    case 'c':
+      op.kind = FORMAT_OP_FIXED;
+      op.size = format_read_size(&p, end, 0);
+      if (op.size == 0)
+      {
+        return "missing size for format option 'c'.";
+      }
+      break;
+    case 's':
+      op.kind = FORMAT_OP_LSTRING;
+      op.size = format_read_size(&p, end, 8);
+      break;
+    case 'z':
+      op.kind = FORMAT_OP_ZSTRING;
+      break;
+    case 'x':
+      op.kind = FORMAT_OP_PADDING;
+      op.size = 1;
+      break;
+    default:
+      return "invalid format option.";
+    }
+
+    if ((op.kind == FORMAT_OP_INT || op.kind == FORMAT_OP_LSTRING) &&
+        (op.size < 1 || op.size > 8))
+    {
+      return "integral size out of limits [1,8].";
+    }
+
+    op.sign = c == 'b' || c == 'h' || c == 'i' || c == 'l' || c == 'j';
+    op.little = little;
+    format->ops[format->count++] = op;
+
+    if (op.kind != FORMAT_OP_PADDING)
+    {
+      format->values++;
+    }
+    if (op.kind == FORMAT_OP_LSTRING || op.kind == FORMAT_OP_ZSTRING)
+    {
+      format->fixed = false;
+    }
+    format->size += op.kind == FORMAT_OP_ZSTRING ? 1 : op.size;
+  }
+
+  return NULL;
+}
+
+static uint64_t format_get_uint(const uint8_t *p, uint32_t size, bool little)
+{
+  uint64_t value = 0;
+  uint32_t i = 0;
+  for (; i < size; i++)
+  {
+    value |= (uint64_t)p[little ? i : size - 1 - i] << (i * 8);
+  }
+  return value;
+}
+
+static void format_put_uint(uint8_t *p, uint64_t value, uint32_t size,
+                            bool little)
+{
+  uint32_t i = 0;
+  for (; i < size; i++)
+  {
+    p[little ? i : size - 1 - i] = (value >> (i * 8)) & 0xff;
+  }
+}
+
+LUA_API int luafan_stream_compile_format(lua_State *L)
+{
+  size_t len = 0;
+  const char *fmt = luaL_checklstring(L, 1, &len);
+
+  lua_getfield(L, LUA_REGISTRYINDEX, LUA_STREAM_FORMAT_CACHE);
+  lua_pushvalue(L, 1);
+  lua_rawget(L, -2);
+  if (!lua_isnil(L, -1))
+  {
+    return 1;
+  }
+  lua_pop(L, 1);
+
+  STREAM_FORMAT *format = lua_newuserdata(
+      L, sizeof(STREAM_FORMAT) + (len ? len : 1) * sizeof(FORMAT_OP));
+  memset(format, 0, sizeof(STREAM_FORMAT));
+  format->fixed = true;
+  luaL_getmetatable(L, LUA_STREAM_FORMAT_TYPE);
+  lua_setmetatable(L, -2);
+
+  const char *error = format_parse(format, fmt, len);
+  if (error)
+  {
+    return luaL_error(L, "%s", error);
+  }
+
+  lua_pushvalue(L, 1);
+  lua_pushvalue(L, -2);
+  lua_rawset(L, -4);
+  return 1;
+}
+
+// read a whole record, nothing is read if the data is not complete.
+LUA_API int luafan_stream_format_unpack(lua_State *L)
+{
+  STREAM_FORMAT *format = luaL_checkudata(L, 1, LUA_STREAM_FORMAT_TYPE);
+  BYTEARRAY *ba = (BYTEARRAY *)luaL_checkudata(L, 2, LUA_STREAM_TYPE);
+  luaL_checkstack(L, format->values, "too many results.");
+
+  size_t available = bytearray_read_available(ba);
+  if (available < format->size)
+  {
+    return 0;
+  }
+
+  int top = lua_gettop(L);
+  const uint8_t *p = ba->buffer + ba->offset;
+  const uint8_t *end = p + available;
+
+  int i = 0;
+  for (; i < format->count; i++)
+  {
+    const FORMAT_OP *op = &format->ops[i];
+    size_t size = op->kind == FORMAT_OP_ZSTRING ? 0 : op->size;
+    if ((size_t)(end - p) < size)
+    {
+      lua_settop(L, top);
+      return 0;
+    }
+
+    switch (op->kind)
+    {
+    case FORMAT_OP_INT:
+    {
+      uint64_t u = format_get_uint(p, op->size, op->little);
+      if (op->sign)
+      {
+        if (op->size < 8 && (u >> (op->size * 8 - 1)))
+        {
+          u |= ~0ULL << (op->size * 8);
+        }
+        stream_push_int64(L, (int64_t)u);
+      }
+      else
+      {
+        stream_push_uint64(L, u);
+      }
+      break;
+    }
+    case FORMAT_OP_FLOAT:
+    {
+      uint32_t u = (uint32_t)format_get_uint(p, 4, op->little);
+      float f;
+      memcpy(&f, &u, 4);
+      lua_pushnumber(L, f);
+      break;
+    }
+    case FORMAT_OP_DOUBLE:
+    {
+      uint64_t u = format_get_uint(p, 8, op->little);
+      double d;
+      memcpy(&d, &u, 8);
+      lua_pushnumber(L, d);
+      break;
+    }
+    case FORMAT_OP_FIXED:
+      lua_pushlstring(L, (const char *)p, op->size);
+      break;
+    case FORMAT_OP_LSTRING:
+    {
+      uint64_t n = format_get_uint(p, op->size, op->little);
+      if ((uint64_t)(end - p - size) < n)
+      {
+        lua_settop(L, top);
+        return 0;
+      }
+      lua_pushlstring(L, (const char *)p + size, n);
+      size += n;
+      break;
+    }
+    case FORMAT_OP_ZSTRING:
+    {
+      const uint8_t *zero = memchr(p, 0, end - p);
+      if (!zero)
+      {
+        lua_settop(L, top);
+        return 0;
+      }
+      lua_pushlstring(L, (const char *)p, zero - p);
+      size = zero - p + 1;
+      break;
+    }
+    default:
+      break;
+    }
+
+    p += size;
+  }
+
+  ba->offset = p - ba->buffer;
+  return format->values;
+}
+
+// write a whole record from the arguments after the stream.
+LUA_API int luafan_stream_format_pack(lua_State *L)
+{
+  STREAM_FORMAT *format = luaL_checkudata(L, 1, LUA_STREAM_FORMAT_TYPE);
+  BYTEARRAY *ba = (BYTEARRAY *)luaL_checkudata(L, 2, LUA_STREAM_TYPE);
+
+  // check the arguments and get the size first, written in one reserve.
+  size_t total = 0;
+  int arg = 3;
+  int i = 0;
+  for (; i < format->count; i++)
+  {
+    const FORMAT_OP *op = &format->ops[i];
+    size_t len = 0;
+    switch (op->kind)
+    {
+    case FORMAT_OP_INT:
+      // same range checks as string.pack.
+      if (op->size < 8)
+      {
+        int64_t n = stream_check_int64(L, arg);
+        if (op->sign)
+        {
+          int64_t lim = (int64_t)1 << (op->size * 8 - 1);
+          luaL_argcheck(L, -lim <= n && n < lim, arg, "integer overflow");
+        }
+        else
+        {
+          luaL_argcheck(L, (uint64_t)n < ((uint64_t)1 << (op->size * 8)), arg,
+                        "unsigned overflow");
+        }
+      }
+      else
+      {
+        luaL_checknumber(L, arg);
+      }
+      arg++;
+      total += op->size;
+      break;
+    case FORMAT_OP_FLOAT:
+    case FORMAT_OP_DOUBLE:
+      luaL_checknumber(L, arg++);
+      total += op->size;
+      break;
+    case FORMAT_OP_FIXED:
+      luaL_checklstring(L, arg, &len);
+      luaL_argcheck(L, len <= op->size, arg, "string longer than given size.");
+      arg++;
+      total += op->size;
+      break;
+    case FORMAT_OP_LSTRING:
+      luaL_checklstring(L, arg, &len);
+      luaL_argcheck(L,
+                    op->size >= 8 || len < ((uint64_t)1 << (op->size * 8)),
+                    arg, "string length does not fit in given size.");
+      arg++;
+      total += op->size + len;
+      break;
+    case FORMAT_OP_ZSTRING:
+    {
+      const char *s = luaL_checklstring(L, arg, &len);
+      luaL_argcheck(L, strlen(s) == len, arg, "string contains zeros.");
+      arg++;
+      total += len + 1;
+      break;
+    }
+    default:
+      total += op->size;
+      break;
+    }
+  }
+
+  uint8_t *p = bytearray_write_space(ba, total);
+  if (!p)
+  {
+    return 0;
+  }
+
+  arg = 3;
+  for (i = 0; i < format->count; i++)
+  {
+    const FORMAT_OP *op = &format->ops[i];
+    size_t len = 0;
+    switch (op->kind)
+    {
+    case FORMAT_OP_INT:
+    {
+      uint64_t u = op->sign ? (uint64_t)stream_check_int64(L, arg)
+                            : stream_check_uint64(L, arg);
+      arg++;
+      format_put_uint(p, u, op->size, op->little);
+      p += op->size;
+      break;
+    }
+    case FORMAT_OP_FLOAT:
+    {
+      float f = (float)lua_tonumber(L, arg++);
+      uint32_t u;
+      memcpy(&u, &f, 4);
+      format_put_uint(p, u, 4, op->little);
+      p += 4;
+      break;
+    }
+    case FORMAT_OP_DOUBLE:
+    {
+      double d = lua_tonumber(L, arg++);
+      uint64_t u;
+      memcpy(&u, &d, 8);
+      format_put_uint(p, u, 8, op->little);
+      p += 8;
+      break;
+    }
+    case FORMAT_OP_FIXED:
+    {
+      const char *s = lua_tolstring(L, arg++, &len);
+      memcpy(p, s, len);
+      memset(p + len, 0, op->size - len);
+      p += op->size;
+      break;
+    }
+    case FORMAT_OP_LSTRING:
+    {
+      const char *s = lua_tolstring(L, arg++, &len);
+      format_put_uint(p, len, op->size, op->little);
+      memcpy(p + op->size, s, len);
+      p += op->size + len;
+      break;
+    }
+    case FORMAT_OP_ZSTRING:
+    {
+      const char *s = lua_tolstring(L, arg++, &len);
+      memcpy(p, s, len + 1);
+      p += len + 1;
+      break;
+    }
+    default:
+      *p++ = 0;
+      break;
+    }
+  }
+
+  ba->offset += total;
+  return 0;
+}
+
+LUA_API int luafan_stream_format_size(lua_State *L)
+{
+  STREAM_FORMAT *format = luaL_checkudata(L, 1, LUA_STREAM_FORMAT_TYPE);
+  if (format->fixed)
+  {
+    lua_pushinteger(L, format->size);
+    return 1;
+  }
+  return 0;
+}
+
+void stream_format_init(lua_State *L)
+{
+  luaL_newmetatable(L, LUA_STREAM_FORMAT_TYPE);
+  lua_pushcfunction(L, &luafan_stream_format_unpack);
+  lua_setfield(L, -2, "unpack");
+
+  lua_pushcfunction(L, &luafan_stream_format_pack);
+  lua_setfield(L, -2, "pack");
+
+  lua_pushcfunction(L, &luafan_stream_format_size);
+  lua_setfield(L, -2, "size");
+
+  lua_pushstring(L, "__index");
+  lua_pushvalue(L, -2);
+  lua_rawset(L, -3);
+
+  lua_pop(L, 1);
+
+  // formats compiled, dropped when not used.
+  lua_newtable(L);
+  lua_newtable(L);
+  lua_pushliteral(L, "v");
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);
+  lua_setfield(L, LUA_REGISTRYINDEX, LUA_STREAM_FORMAT_CACHE);
+}
@@ -1,5 +1,8 @@
 
 #include "utlua.h"
+#include "pullqueue.h"
+#include "streamchain.h"
+#include <sys/uio.h>
 #ifdef __linux__
 #include <limits.h>
 #include <linux/netfilter_ipv4.h>
@@ -50,6 +53,8 @@ typedef struct
 
   lua_Number read_timeout;
   lua_Number write_timeout;
+
+  FAN_PULL pull;
 } Conn;
 
 #if FAN_HAS_OPENSSL
@@ -94,6 +99,8 @@ typedef struct
   int port;
 
   int onDisconnectedRef;
+
+  FAN_PULL pull;
 } ACCEPT;
 
 #define TCPD_ACCEPT_UNREF(accept)                          \
@@ -102,6 +109,8 @@ typedef struct
   CLEAR_REF(accept->mainthread, accept->onDisconnectedRef) \
   CLEAR_REF(accept->mainthread, accept->selfRef)
 
+#include "tcpd_ffi.h"
+
 LUA_API int lua_tcpd_server_close(lua_State *L)
 {
   SERVER *serv = luaL_checkudata(L, 1, LUA_TCPD_SERVER_TYPE);
@@ -181,6 +190,7 @@ static void tcpd_accept_eventcb(struct bufferevent *bev, short events,
     }
     bufferevent_free(bev);
     accept->buf = NULL;
+    fan_pull_ready(&accept->pull);
 
     if (accept->onDisconnectedRef != LUA_NOREF)
     {
@@ -229,14 +239,27 @@ static void tcpd_accept_readcb(struct bufferevent *bev, void *ctx)
 {
   ACCEPT *accept = (ACCEPT *)ctx;
 
-  char buf[BUFLEN];
-  int n;
+  // pull mode, input stays in the bufferevent until lua reads it.
+  if (accept->pull.id)
+  {
+    fan_pull_ready(&accept->pull);
+    return;
+  }
+
   BYTEARRAY ba = {0};
-  bytearray_alloc(&ba, BUFLEN * 2);
   struct evbuffer *input = bufferevent_get_input(bev);
-  while ((n = evbuffer_remove(input, buf, sizeof(buf))) > 0)
+  size_t len = evbuffer_get_length(input);
+  if (!bytearray_alloc(&ba, len))
   {
-    bytearray_writebuffer(&ba, buf, n);
+    // out of memory, drop the connection rather than lose the input.
+    EVUTIL_SET_SOCKET_ERROR(ENOMEM);
+    tcpd_accept_eventcb(bev, BEV_EVENT_READING | BEV_EVENT_ERROR, accept);
+    return;
+  }
+  int n = evbuffer_remove(input, ba.buffer, len);
+  if (n > 0)
+  {
+    ba.offset = n;
   }
   bytearray_read_ready(&ba);
 
@@ -278,6 +301,75 @@ static void tcpd_accept_writecb(struct bufferevent *bev, void *ctx)
   }
 }
 
+// push a new accept object owning fd, serv is NULL for a passed in fd.
+static ACCEPT *tcpd_accept_push(lua_State *co, lua_State *mainthread,
+                                struct event_base *base, evutil_socket_t fd,
+                                const struct sockaddr *addr, SERVER *serv)
+{
+  ACCEPT *accept = lua_newuserdata(co, sizeof(ACCEPT));
+  memset(accept, 0, sizeof(ACCEPT));
+  accept->buf = NULL;
+  accept->mainthread = mainthread;
+  accept->selfRef = LUA_NOREF;
+  accept->onReadRef = LUA_NOREF;
+  accept->onSendReadyRef = LUA_NOREF;
+  accept->onDisconnectedRef = LUA_NOREF;
+
+  luaL_getmetatable(co, LUA_TCPD_ACCEPT_TYPE);
+  lua_setmetatable(co, -2);
+
+  struct bufferevent *bev;
+
+#if FAN_HAS_OPENSSL
+  if (serv && serv->ssl && serv->ctx)
+  {
+    bev = bufferevent_openssl_socket_new(
+        base, fd, SSL_new(serv->ctx), BUFFEREVENT_SSL_ACCEPTING,
+        BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);
+  }
+  else
+  {
+#endif
+    bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);
+#if FAN_HAS_OPENSSL
+  }
+#endif
+
+  bufferevent_setcb(bev, tcpd_accept_readcb, tcpd_accept_writecb,
+                    tcpd_accept_eventcb, accept);
+  bufferevent_enable(bev, EV_READ | EV_WRITE);
+
+  if (serv && serv->send_buffer_size)
+  {
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &serv->send_buffer_size,
+               sizeof(serv->send_buffer_size));
+  }
+  if (serv && serv->receive_buffer_size)
+  {
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &serv->receive_buffer_size,
+               sizeof(serv->receive_buffer_size));
+  }
+
+  memset(accept->ip, 0, INET6_ADDRSTRLEN);
+  if (addr->sa_family == AF_INET)
+  {
+    struct sockaddr_in *addr_in = (struct sockaddr_in *)addr;
+    inet_ntop(addr_in->sin_family, (void *)&(addr_in->sin_addr), accept->ip,
+              INET_ADDRSTRLEN);
+    accept->port = ntohs(addr_in->sin_port);
+  }
+  else if (addr->sa_family == AF_INET6)
+  {
+    struct sockaddr_in6 *addr_in = (struct sockaddr_in6 *)addr;
+    inet_ntop(addr_in->sin6_family, (void *)&(addr_in->sin6_addr), accept->ip,
+              INET6_ADDRSTRLEN);
+    accept->port = ntohs(addr_in->sin6_port);
+  }
+
+  accept->buf = bev;
+  return accept;
+}
+
 void connlistener_cb(struct evconnlistener *listener, evutil_socket_t fd,
                      struct sockaddr *addr, int socklen, void *arg)
 {
@@ -292,74 +384,44 @@ void connlistener_cb(struct evconnlistener *listener, evutil_socket_t fd,
     lua_unlock(mainthread);
 
     lua_rawgeti(co, LUA_REGISTRYINDEX, serv->onAcceptRef);
+    tcpd_accept_push(co, mainthread, evconnlistener_get_base(listener), fd,
+                     addr, serv);
 
-    ACCEPT *accept = lua_newuserdata(co, sizeof(ACCEPT));
-    memset(accept, 0, sizeof(ACCEPT));
-    accept->buf = NULL;
-    accept->mainthread = mainthread;
-    accept->selfRef = LUA_NOREF;
-    accept->onReadRef = LUA_NOREF;
-    accept->onSendReadyRef = LUA_NOREF;
-    accept->onDisconnectedRef = LUA_NOREF;
-
-    luaL_getmetatable(co, LUA_TCPD_ACCEPT_TYPE);
-    lua_setmetatable(co, -2);
-
-    struct event_base *base = evconnlistener_get_base(listener);
-
-    struct bufferevent *bev;
-
-#if FAN_HAS_OPENSSL
-    if (serv->ssl && serv->ctx)
-    {
-      bev = bufferevent_openssl_socket_new(
-          base, fd, SSL_new(serv->ctx), BUFFEREVENT_SSL_ACCEPTING,
-          BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);
-    }
-    else
-    {
-#endif
-      bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);
-#if FAN_HAS_OPENSSL
-    }
-#endif
+    FAN_RESUME(co, mainthread, 1);
+    POP_REF(mainthread);
+  }
+}
 
-    bufferevent_setcb(bev, tcpd_accept_readcb, tcpd_accept_writecb,
-                      tcpd_accept_eventcb, accept);
-    bufferevent_enable(bev, EV_READ | EV_WRITE);
+// wrap a connected socket passed from another process as an accept object,
+// buffered bytes are delivered to onread first.
+LUA_API int tcpd_accept_fd(lua_State *L)
+{
+  int fd = (int)luaL_checkinteger(L, 1);
+  size_t len = 0;
+  const char *buffered = luaL_optlstring(L, 2, NULL, &len);
 
-    if (serv->send_buffer_size)
-    {
-      setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &serv->send_buffer_size,
-                 sizeof(serv->send_buffer_size));
-    }
-    if (serv->receive_buffer_size)
-    {
-      setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &serv->receive_buffer_size,
-                 sizeof(serv->receive_buffer_size));
-    }
+  event_mgr_init();
 
-    memset(accept->ip, 0, INET6_ADDRSTRLEN);
-    if (addr->sa_family == AF_INET)
-    {
-      struct sockaddr_in *addr_in = (struct sockaddr_in *)addr;
-      inet_ntop(addr_in->sin_family, (void *)&(addr_in->sin_addr), accept->ip,
-                INET_ADDRSTRLEN);
-      accept->port = ntohs(addr_in->sin_port);
-    }
-    else
-    {
-      struct sockaddr_in6 *addr_in = (struct sockaddr_in6 *)addr;
-      inet_ntop(addr_in->sin6_family, (void *)&(addr_in->sin6_addr), accept->ip,
-                INET6_ADDRSTRLEN);
-      accept->port = ntohs(addr_in->sin6_port);
-    }
+  struct sockaddr_storage ss;
+  socklen_t sslen = sizeof(ss);
+  memset(&ss, 0, sizeof(ss));
+  if (getpeername(fd, (struct sockaddr *)&ss, &sslen) == -1)
+  {
+    lua_pushnil(L);
+    lua_pushfstring(L, "getpeername: %s", strerror(errno));
+    return 2;
+  }
 
-    accept->buf = bev;
+  evutil_make_socket_nonblocking(fd);
 
-    FAN_RESUME(co, mainthread, 1);
-    POP_REF(mainthread);
+  ACCEPT *accept = tcpd_accept_push(L, utlua_mainthread(L), event_mgr_base(),
+                                    fd, (struct sockaddr *)&ss, NULL);
+  if (buffered && len > 0)
+  {
+    evbuffer_add(bufferevent_get_input(accept->buf), buffered, len);
   }
+
+  return 1;
 }
 
 LUA_API int tcpd_accept_bind(lua_State *L)
@@ -376,6 +438,12 @@ LUA_API int tcpd_accept_bind(lua_State *L)
   SET_FUNC_REF_FROM_TABLE(L, accept->onSendReadyRef, 2, "onsendready")
   SET_FUNC_REF_FROM_TABLE(L, accept->onDisconnectedRef, 2, "ondisconnected")
 
+  // bytes of a passed in fd that were read before it was passed.
+  if (accept->buf && evbuffer_get_length(bufferevent_get_input(accept->buf)))
+  {
+    bufferevent_trigger(accept->buf, EV_READ, BEV_TRIG_DEFER_CALLBACKS);
+  }
+
   lua_pushstring(L, accept->ip);
   lua_pushinteger(L, accept->port);
 
@@ -579,18 +647,33 @@ LUA_API int tcpd_bind(lua_State *L)
   }
 }
 
+static void tcpd_conn_eventcb(struct bufferevent *bev, short events,
+                              void *arg);
+
 static void tcpd_conn_readcb(struct bufferevent *bev, void *ctx)
 {
   Conn *conn = (Conn *)ctx;
 
-  char buf[BUFLEN];
-  int n;
+  if (conn->pull.id)
+  {
+    fan_pull_ready(&conn->pull);
+    return;
+  }
+
   BYTEARRAY ba;
-  bytearray_alloc(&ba, BUFLEN * 2);
   struct evbuffer *input = bufferevent_get_input(bev);
-  while ((n = evbuffer_remove(input, buf, sizeof(buf))) > 0)
+  size_t len = evbuffer_get_length(input);
+  if (!bytearray_alloc(&ba, len))
+  {
+    // out of memory, drop the connection rather than lose the input.
+    EVUTIL_SET_SOCKET_ERROR(ENOMEM);
+    tcpd_conn_eventcb(bev, BEV_EVENT_READING | BEV_EVENT_ERROR, conn);
+    return;
+  }
+  int n = evbuffer_remove(input, ba.buffer, len);
+  if (n > 0)
   {
-    bytearray_writebuffer(&ba, buf, n);
+    ba.offset = n;
   }
   bytearray_read_ready(&ba);
 
@@ -668,6 +751,7 @@ static void tcpd_conn_eventcb(struct bufferevent *bev, short events,
 #endif
     bufferevent_free(bev);
     conn->buf = NULL;
+    fan_pull_ready(&conn->pull);
 
     if (conn->onDisconnectedRef != LUA_NOREF)
     {
@@ -1050,8 +1134,10 @@ LUA_API int tcpd_connect(lua_State *L)
   return 1;
 }
 
-static const luaL_Reg tcpdlib[] = {
-    {"bind", tcpd_bind}, {"connect", tcpd_connect}, {NULL, NULL}};
+static const luaL_Reg tcpdlib[] = {{"bind", tcpd_bind},
+                                   {"connect", tcpd_connect},
+                                   {"accept_fd", tcpd_accept_fd},
+                                   {NULL, NULL}};
 
 LUA_API int tcpd_conn_close(lua_State *L)
 {
@@ -1061,6 +1147,7 @@ LUA_API int tcpd_conn_close(lua_State *L)
     bufferevent_free(conn->buf);
     conn->buf = NULL;
   }
+  fan_pull_disable(&conn->pull);
 
   CLEAR_REF(L, conn->onReadRef)
   CLEAR_REF(L, conn->onSendReadyRef)
@@ -1187,12 +1274,79 @@ LUA_API int tcpd_accept_close(lua_State *L)
     bufferevent_free(accept->buf);
     accept->buf = NULL;
   }
+  fan_pull_disable(&accept->pull);
   TCPD_ACCEPT_UNREF(accept)
   return 0;
 }
 
 LUA_API int lua_tcpd_accept_gc(lua_State *L) { return tcpd_accept_close(L); }
 
+// take the socket out of this accept object to pass it to another process,
+// return the fd (owned by the caller now) and the bytes not read by lua yet.
+LUA_API int tcpd_accept_detach_fd(lua_State *L)
+{
+  ACCEPT *accept = luaL_checkudata(L, 1, LUA_TCPD_ACCEPT_TYPE);
+  if (!accept->buf)
+  {
+    lua_pushnil(L);
+    lua_pushliteral(L, "not connected.");
+    return 2;
+  }
+
+#if FAN_HAS_OPENSSL
+  if (bufferevent_openssl_get_ssl(accept->buf))
+  {
+    lua_pushnil(L);
+    lua_pushliteral(L, "ssl session can't be detached.");
+    return 2;
+  }
+#endif
+
+  // pending output goes out before the socket changes hands, if the socket
+  // can't take it all now, the connection is kept and the caller retries
+  // later (e.g. from onsendready).
+  evutil_socket_t sock = bufferevent_getfd(accept->buf);
+  struct evbuffer *output = bufferevent_get_output(accept->buf);
+  while (evbuffer_get_length(output) > 0)
+  {
+    if (evbuffer_write(output, sock) <= 0 && errno != EINTR)
+    {
+      break;
+    }
+  }
+
+  if (evbuffer_get_length(output) > 0)
+  {
+    lua_pushnil(L);
+    lua_pushliteral(L, "output pending.");
+    return 2;
+  }
+
+  evutil_socket_t fd = dup(sock);
+  if (fd == -1)
+  {
+    lua_pushnil(L);
+    lua_pushstring(L, strerror(errno));
+    return 2;
+  }
+
+  struct evbuffer *input = bufferevent_get_input(accept->buf);
+  size_t len = evbuffer_get_length(input);
+
+  lua_pushinteger(L, fd);
+  lua_pushlstring(L, (const char *)evbuffer_pullup(input, len), len);
+
+  if (event_mgr_base_current())
+  {
+    bufferevent_free(accept->buf);
+  }
+  accept->buf = NULL;
+  fan_pull_disable(&accept->pull);
+  TCPD_ACCEPT_UNREF(accept)
+
+  return 2;
+}
+
 LUA_API int tcpd_accept_read_pause(lua_State *L)
 {
   ACCEPT *accept = luaL_checkudata(L, 1, LUA_TCPD_ACCEPT_TYPE);
@@ -1236,39 +1390,28 @@ LUA_API int tcpd_conn_read_resume(lua_State *L)
 LUA_API int tcpd_conn_send(lua_State *L)
 {
   Conn *conn = luaL_checkudata(L, 1, LUA_TCPD_CONNECTION_TYPE);
+  // a stream chain hands its segments to the output without flattening.
+  STREAM_CHAIN *chain = stream_chain_test(L, 2);
   size_t len = 0;
-  const char *data = luaL_checklstring(L, 2, &len);
+  const char *data = chain ? NULL : luaL_checklstring(L, 2, &len);
+  if (chain)
+  {
+    len = chain->available;
+  }
 
-  if (data && len > 0 && conn->buf)
+  if (len > 0 && conn->buf)
   {
-    if (conn->read_timeout > 0)
+    if (chain)
     {
-      struct timeval tv1;
-      d2tv(conn->read_timeout, &tv1);
-      if (conn->write_timeout > 0)
-      {
-        struct timeval tv2;
-        d2tv(conn->write_timeout, &tv2);
-        bufferevent_set_timeouts(conn->buf, &tv1, &tv2);
-      }
-      else
-      {
-        bufferevent_set_timeouts(conn->buf, &tv1, NULL);
-      }
+      tcpd_conn_apply_timeouts(conn);
+      stream_chain_drain(chain, bufferevent_get_output(conn->buf));
+      lua_pushinteger(
+          L, evbuffer_get_length(bufferevent_get_output(conn->buf)));
     }
     else
     {
-      if (conn->write_timeout > 0)
-      {
-        struct timeval tv2;
-        d2tv(conn->write_timeout, &tv2);
-        bufferevent_set_timeouts(conn->buf, NULL, &tv2);
-      }
+      lua_pushinteger(L, tcpd_ffi_conn_send(conn, data, len));
     }
-    bufferevent_write(conn->buf, data, len);
-
-    size_t total = evbuffer_get_length(bufferevent_get_output(conn->buf));
-    lua_pushinteger(L, total);
   }
   else
   {
@@ -1278,6 +1421,80 @@ LUA_API int tcpd_conn_send(lua_State *L)
   return 1;
 }
 
+// strings of the table at idx as iovecs, on a scratch userdata.
+static struct iovec *tcpd_check_iovec(lua_State *L, int idx, int *count)
+{
+  luaL_checktype(L, idx, LUA_TTABLE);
+  *count = (int)lua_objlen(L, idx);
+  struct iovec *iov = lua_newuserdata(L, sizeof(struct iovec) * (*count + 1));
+  int i = 0;
+  for (; i < *count; i++)
+  {
+    lua_rawgeti(L, idx, i + 1);
+    // only strings, a number would be converted to a string nothing keeps.
+    if (lua_type(L, -1) != LUA_TSTRING)
+    {
+      luaL_error(L, "sendv: buf #%d is not a string.", i + 1);
+    }
+    size_t len = 0;
+    const char *data = lua_tolstring(L, -1, &len);
+    lua_pop(L, 1);
+    // the strings stay referenced by the table while the iovecs are used.
+    iov[i].iov_base = (void *)data;
+    iov[i].iov_len = len;
+  }
+  return iov;
+}
+
+LUA_API int tcpd_conn_sendv(lua_State *L)
+{
+  Conn *conn = luaL_checkudata(L, 1, LUA_TCPD_CONNECTION_TYPE);
+  int count = 0;
+  struct iovec *iov = tcpd_check_iovec(L, 2, &count);
+  lua_pushinteger(L, tcpd_ffi_conn_sendv(conn, iov, count));
+  return 1;
+}
+
+// pull mode input, nil once disconnected.
+static int tcpd_push_input(lua_State *L, struct bufferevent *bev)
+{
+  if (!bev)
+  {
+    return 0;
+  }
+
+  struct evbuffer *input = bufferevent_get_input(bev);
+  size_t len = evbuffer_get_length(input);
+  lua_pushlstring(L, len > 0 ? (const char *)evbuffer_pullup(input, len) : "",
+                  len);
+  evbuffer_drain(input, len);
+  return 1;
+}
+
+LUA_API int tcpd_conn_read(lua_State *L)
+{
+  Conn *conn = luaL_checkudata(L, 1, LUA_TCPD_CONNECTION_TYPE);
+  return tcpd_push_input(L, conn->buf);
+}
+
+// pull(true) returns the id of the object in the fan.pull queue.
+LUA_API int tcpd_conn_pull(lua_State *L)
+{
+  Conn *conn = luaL_checkudata(L, 1, LUA_TCPD_CONNECTION_TYPE);
+  if (lua_isnone(L, 2) || lua_toboolean(L, 2))
+  {
+    lua_pushinteger(L, fan_pull_enable(&conn->pull));
+    if (conn->buf &&
+        evbuffer_get_length(bufferevent_get_input(conn->buf)) > 0)
+    {
+      fan_pull_ready(&conn->pull);
+    }
+    return 1;
+  }
+  fan_pull_disable(&conn->pull);
+  return 0;
+}
+
 LUA_API int tcpd_conn_reconnect(lua_State *L)
 {
   Conn *conn = luaL_checkudata(L, 1, LUA_TCPD_CONNECTION_TYPE);
@@ -1296,14 +1513,26 @@ LUA_API int tcpd_accept_flush(lua_State *L)
 LUA_API int tcpd_accept_send(lua_State *L)
 {
   ACCEPT *accept = luaL_checkudata(L, 1, LUA_TCPD_ACCEPT_TYPE);
+  STREAM_CHAIN *chain = stream_chain_test(L, 2);
   size_t len = 0;
-  const char *data = luaL_checklstring(L, 2, &len);
+  const char *data = chain ? NULL : luaL_checklstring(L, 2, &len);
+  if (chain)
+  {
+    len = chain->available;
+  }
 
-  if (data && len > 0 && accept->buf)
+  if (len > 0 && accept->buf)
   {
-    bufferevent_write(accept->buf, data, len);
-    size_t total = evbuffer_get_length(bufferevent_get_output(accept->buf));
-    lua_pushinteger(L, total);
+    if (chain)
+    {
+      stream_chain_drain(chain, bufferevent_get_output(accept->buf));
+      lua_pushinteger(
+          L, evbuffer_get_length(bufferevent_get_output(accept->buf)));
+    }
+    else
+    {
+      lua_pushinteger(L, tcpd_ffi_accept_send(accept, data, len));
+    }
   }
   else
   {
@@ -1313,6 +1542,38 @@ LUA_API int tcpd_accept_send(lua_State *L)
   return 1;
 }
 
+LUA_API int tcpd_accept_sendv(lua_State *L)
+{
+  ACCEPT *accept = luaL_checkudata(L, 1, LUA_TCPD_ACCEPT_TYPE);
+  int count = 0;
+  struct iovec *iov = tcpd_check_iovec(L, 2, &count);
+  lua_pushinteger(L, tcpd_ffi_accept_sendv(accept, iov, count));
+  return 1;
+}
+
+LUA_API int tcpd_accept_read(lua_State *L)
+{
+  ACCEPT *accept = luaL_checkudata(L, 1, LUA_TCPD_ACCEPT_TYPE);
+  return tcpd_push_input(L, accept->buf);
+}
+
+LUA_API int tcpd_accept_pull(lua_State *L)
+{
+  ACCEPT *accept = luaL_checkudata(L, 1, LUA_TCPD_ACCEPT_TYPE);
+  if (lua_isnone(L, 2) || lua_toboolean(L, 2))
+  {
+    lua_pushinteger(L, fan_pull_enable(&accept->pull));
+    if (accept->buf &&
+        evbuffer_get_length(bufferevent_get_input(accept->buf)) > 0)
+    {
+      fan_pull_ready(&accept->pull);
+    }
+    return 1;
+  }
+  fan_pull_disable(&accept->pull);
+  return 0;
+}
+
 LUA_API int luaopen_fan_tcpd(lua_State *L)
 {
 #if FAN_HAS_OPENSSL
@@ -1324,6 +1585,15 @@ LUA_API int luaopen_fan_tcpd(lua_State *L)
   lua_pushcfunction(L, &tcpd_conn_send);
   lua_setfield(L, -2, "send");
 
+  lua_pushcfunction(L, &tcpd_conn_sendv);
+  lua_setfield(L, -2, "sendv");
+
+  lua_pushcfunction(L, &tcpd_conn_read);
+  lua_setfield(L, -2, "read");
+
+  lua_pushcfunction(L, &tcpd_conn_pull);
+  lua_setfield(L, -2, "pull");
+
   lua_pushcfunction(L, &tcpd_conn_read_pause);
   lua_setfield(L, -2, "pause_read");
 
@@ -1350,6 +1620,15 @@ LUA_API int luaopen_fan_tcpd(lua_State *L)
   lua_pushcfunction(L, &tcpd_accept_send);
   lua_setfield(L, -2, "send");
 
+  lua_pushcfunction(L, &tcpd_accept_sendv);
+  lua_setfield(L, -2, "sendv");
+
+  lua_pushcfunction(L, &tcpd_accept_read);
+  lua_setfield(L, -2, "read");
+
+  lua_pushcfunction(L, &tcpd_accept_pull);
+  lua_setfield(L, -2, "pull");
+
   lua_pushcfunction(L, &tcpd_accept_flush);
   lua_setfield(L, -2, "flush");
 
@@ -1371,6 +1650,9 @@ LUA_API int luaopen_fan_tcpd(lua_State *L)
   lua_pushcfunction(L, &tcpd_accept_getsockname);
   lua_setfield(L, -2, "getsockname");
 
+  lua_pushcfunction(L, &tcpd_accept_detach_fd);
+  lua_setfield(L, -2, "detach_fd");
+
 #ifdef __linux__
   lua_pushcfunction(L, &tcpd_accept_original_dst);
   lua_setfield(L, -2, "original_dst");
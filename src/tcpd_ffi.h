@@ -0,0 +1,113 @@
+#ifndef tcpd_ffi_h
+#define tcpd_ffi_h
+
+// plain c entry points on tcpd objects, callable from luajit ffi without
+// going through the lua c api, the lua methods use them too. included by
+// tcpd.c only, after Conn and ACCEPT are defined.
+
+static void tcpd_conn_apply_timeouts(Conn *conn)
+{
+  struct timeval tv1;
+  struct timeval tv2;
+  if (conn->read_timeout > 0)
+  {
+    d2tv(conn->read_timeout, &tv1);
+  }
+  if (conn->write_timeout > 0)
+  {
+    d2tv(conn->write_timeout, &tv2);
+  }
+
+  if (conn->read_timeout > 0 || conn->write_timeout > 0)
+  {
+    bufferevent_set_timeouts(conn->buf,
+                             conn->read_timeout > 0 ? &tv1 : NULL,
+                             conn->write_timeout > 0 ? &tv2 : NULL);
+  }
+}
+
+// queue data on the output, return the output length, -1 if not connected.
+static ssize_t tcpd_bev_sendv(struct bufferevent *bev, const struct iovec *iov,
+                              int count)
+{
+  if (!bev)
+  {
+    return -1;
+  }
+
+  struct evbuffer *output = bufferevent_get_output(bev);
+  int i = 0;
+  for (; i < count; i++)
+  {
+    if (iov[i].iov_len > 0)
+    {
+      evbuffer_add(output, iov[i].iov_base, iov[i].iov_len);
+    }
+  }
+  return (ssize_t)evbuffer_get_length(output);
+}
+
+// copy up to len bytes of input into buf, return the count, 0 if there is
+// no input, -1 once disconnected.
+static ssize_t tcpd_bev_read(struct bufferevent *bev, char *buf, size_t len)
+{
+  if (!bev)
+  {
+    return -1;
+  }
+  return evbuffer_remove(bufferevent_get_input(bev), buf, len);
+}
+
+static size_t tcpd_bev_available(struct bufferevent *bev)
+{
+  return bev ? evbuffer_get_length(bufferevent_get_input(bev)) : 0;
+}
+
+ssize_t tcpd_ffi_conn_sendv(Conn *conn, const struct iovec *iov, int count)
+{
+  if (conn->buf)
+  {
+    tcpd_conn_apply_timeouts(conn);
+  }
+  return tcpd_bev_sendv(conn->buf, iov, count);
+}
+
+ssize_t tcpd_ffi_conn_send(Conn *conn, const char *data, size_t len)
+{
+  struct iovec iov = {(void *)data, len};
+  return tcpd_ffi_conn_sendv(conn, &iov, 1);
+}
+
+ssize_t tcpd_ffi_conn_read(Conn *conn, char *buf, size_t len)
+{
+  return tcpd_bev_read(conn->buf, buf, len);
+}
+
+size_t tcpd_ffi_conn_available(Conn *conn)
+{
+  return tcpd_bev_available(conn->buf);
+}
+
+ssize_t tcpd_ffi_accept_sendv(ACCEPT *accept, const struct iovec *iov,
+                              int count)
+{
+  return tcpd_bev_sendv(accept->buf, iov, count);
+}
+
+ssize_t tcpd_ffi_accept_send(ACCEPT *accept, const char *data, size_t len)
+{
+  struct iovec iov = {(void *)data, len};
+  return tcpd_bev_sendv(accept->buf, &iov, 1);
+}
+
+ssize_t tcpd_ffi_accept_read(ACCEPT *accept, char *buf, size_t len)
+{
+  return tcpd_bev_read(accept->buf, buf, len);
+}
+
+size_t tcpd_ffi_accept_available(ACCEPT *accept)
+{
+  return tcpd_bev_available(accept->buf);
+}
+
+#endif
@@ -0,0 +1,459 @@
+#if defined(__APPLE__) && defined(__clang__)
+#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+#endif
+
+#include "timerwheel.h"
+#include <sys/time.h>
+
+#define LUA_TIMERWHEEL_TYPE "TIMERWHEEL_TYPE"
+
+#define TIMERWHEEL_DEFAULT_TICK 0.1
+#define TIMERWHEEL_DEFAULT_SLOTS 512
+
+// ========== wheel ==========
+
+void timerwheel_list_init(TIMERWHEEL_NODE *head)
+{
+  head->prev = head;
+  head->next = head;
+  head->state = TIMERWHEEL_NODE_IDLE;
+}
+
+static void timerwheel_list_append(TIMERWHEEL_NODE *head,
+                                   TIMERWHEEL_NODE *node)
+{
+  node->prev = head->prev;
+  node->next = head;
+  head->prev->next = node;
+  head->prev = node;
+}
+
+static void timerwheel_list_unlink(TIMERWHEEL_NODE *node)
+{
+  node->prev->next = node->next;
+  node->next->prev = node->prev;
+  node->prev = NULL;
+  node->next = NULL;
+}
+
+int timerwheel_init(TIMERWHEEL *wheel, double tick, size_t slot_count,
+                    double now)
+{
+  memset(wheel, 0, sizeof(TIMERWHEEL));
+  wheel->slots = malloc(slot_count * sizeof(TIMERWHEEL_NODE));
+  if (!wheel->slots)
+  {
+    return 0;
+  }
+
+  size_t i = 0;
+  for (i = 0; i < slot_count; i++)
+  {
+    timerwheel_list_init(&wheel->slots[i]);
+  }
+
+  wheel->tick = tick;
+  wheel->start = now;
+  wheel->slot_count = slot_count;
+  return 1;
+}
+
+void timerwheel_destroy(TIMERWHEEL *wheel)
+{
+  if (!wheel->slots)
+  {
+    return;
+  }
+
+  size_t i = 0;
+  for (i = 0; i < wheel->slot_count; i++)
+  {
+    TIMERWHEEL_NODE *head = &wheel->slots[i];
+    while (head->next != head)
+    {
+      TIMERWHEEL_NODE *node = head->next;
+      timerwheel_list_unlink(node);
+      node->state = TIMERWHEEL_NODE_IDLE;
+    }
+  }
+
+  free(wheel->slots);
+  wheel->slots = NULL;
+  wheel->count = 0;
+}
+
+void timerwheel_cancel(TIMERWHEEL *wheel, TIMERWHEEL_NODE *node)
+{
+  if (node->state == TIMERWHEEL_NODE_IDLE)
+  {
+    return;
+  }
+
+  if (node->state == TIMERWHEEL_NODE_WHEEL)
+  {
+    wheel->count--;
+  }
+
+  timerwheel_list_unlink(node);
+  node->state = TIMERWHEEL_NODE_IDLE;
+}
+
+void timerwheel_add(TIMERWHEEL *wheel, TIMERWHEEL_NODE *node, double deadline)
+{
+  timerwheel_cancel(wheel, node);
+
+  double ticks = ceil((deadline - wheel->start) / wheel->tick);
+  uint64_t expire = ticks > 0 ? (uint64_t)ticks : 0;
+  if (expire <= wheel->current)
+  {
+    expire = wheel->current + 1;
+  }
+
+  node->expire = expire;
+  node->state = TIMERWHEEL_NODE_WHEEL;
+  timerwheel_list_append(&wheel->slots[expire % wheel->slot_count], node);
+  wheel->count++;
+}
+
+static void timerwheel_collect(TIMERWHEEL *wheel, TIMERWHEEL_NODE *head,
+                               uint64_t current, TIMERWHEEL_NODE *expired)
+{
+  TIMERWHEEL_NODE *node = head->next;
+  while (node != head)
+  {
+    TIMERWHEEL_NODE *next = node->next;
+    if (node->expire <= current)
+    {
+      timerwheel_list_unlink(node);
+      node->state = TIMERWHEEL_NODE_EXPIRED;
+      timerwheel_list_append(expired, node);
+      wheel->count--;
+    }
+    node = next;
+  }
+}
+
+void timerwheel_advance(TIMERWHEEL *wheel, double now,
+                        TIMERWHEEL_NODE *expired)
+{
+  double ticks = floor((now - wheel->start) / wheel->tick);
+  uint64_t target = ticks > 0 ? (uint64_t)ticks : 0;
+  if (target <= wheel->current)
+  {
+    return;
+  }
+
+  // a full turn visits every slot, no need to go round again.
+  uint64_t steps = target - wheel->current;
+  if (steps > wheel->slot_count)
+  {
+    steps = wheel->slot_count;
+  }
+
+  uint64_t tick = target - steps + 1;
+  for (; tick <= target && wheel->count > 0; tick++)
+  {
+    timerwheel_collect(wheel, &wheel->slots[tick % wheel->slot_count], target,
+                       expired);
+  }
+
+  wheel->current = target;
+}
+
+TIMERWHEEL_NODE *timerwheel_pop(TIMERWHEEL_NODE *expired)
+{
+  if (expired->next == expired)
+  {
+    return NULL;
+  }
+
+  TIMERWHEEL_NODE *node = expired->next;
+  timerwheel_list_unlink(node);
+  node->state = TIMERWHEEL_NODE_IDLE;
+  return node;
+}
+
+// ========== lua api ==========
+
+typedef struct
+{
+  TIMERWHEEL_NODE node;
+  int keyRef;
+} TIMERWHEEL_ENTRY;
+
+typedef struct
+{
+  TIMERWHEEL wheel;
+
+  lua_State *mainthread;
+  int onExpireRef;
+
+  // key => lightuserdata entry.
+  int entriesRef;
+
+  struct event *timer;
+} LUA_TIMERWHEEL;
+
+static double timerwheel_gettime()
+{
+  struct timeval v;
+  gettimeofday(&v, NULL);
+  return v.tv_sec + v.tv_usec / 1000000.0;
+}
+
+static void timerwheel_schedule(LUA_TIMERWHEEL *tw)
+{
+  if (tw->wheel.count > 0 && !evtimer_pending(tw->timer, NULL))
+  {
+    struct timeval t = {0};
+    d2tv(tw->wheel.tick, &t);
+    evtimer_add(tw->timer, &t);
+  }
+}
+
+static void timerwheel_entry_free(lua_State *L, LUA_TIMERWHEEL *tw,
+                                  TIMERWHEEL_ENTRY *entry)
+{
+  lua_rawgeti(L, LUA_REGISTRYINDEX, tw->entriesRef);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, entry->keyRef);
+  lua_pushnil(L);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+
+  luaL_unref(L, LUA_REGISTRYINDEX, entry->keyRef);
+  free(entry);
+}
+
+static void timerwheel_tick_cb(evutil_socket_t fd, short what, void *arg)
+{
+  LUA_TIMERWHEEL *tw = (LUA_TIMERWHEEL *)arg;
+
+  TIMERWHEEL_NODE expired;
+  timerwheel_list_init(&expired);
+  timerwheel_advance(&tw->wheel, timerwheel_gettime(), &expired);
+
+  if (expired.next != &expired)
+  {
+    lua_State *mainthread = tw->mainthread;
+    lua_lock(mainthread);
+    lua_State *co = lua_newthread(mainthread);
+    PUSH_REF(mainthread);
+    lua_unlock(mainthread);
+
+    lua_rawgeti(co, LUA_REGISTRYINDEX, tw->onExpireRef);
+    lua_newtable(co);
+
+    // all the keys expired in this tick go to one callback.
+    int i = 1;
+    TIMERWHEEL_NODE *node = NULL;
+    while ((node = timerwheel_pop(&expired)))
+    {
+      TIMERWHEEL_ENTRY *entry = (TIMERWHEEL_ENTRY *)node;
+      lua_rawgeti(co, LUA_REGISTRYINDEX, entry->keyRef);
+      lua_rawseti(co, -2, i++);
+      timerwheel_entry_free(co, tw, entry);
+    }
+
+    if (tw->onExpireRef != LUA_NOREF)
+    {
+      FAN_RESUME(co, mainthread, 1);
+    }
+    POP_REF(mainthread);
+  }
+
+  // the callback may have closed the wheel.
+  if (tw->timer)
+  {
+    timerwheel_schedule(tw);
+  }
+}
+
+LUA_API int luatimerwheel_new(lua_State *L)
+{
+  event_mgr_init();
+
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 1);
+
+  lua_getfield(L, 1, "tick");
+  double tick = luaL_optnumber(L, -1, TIMERWHEEL_DEFAULT_TICK);
+  lua_pop(L, 1);
+
+  lua_getfield(L, 1, "slots");
+  lua_Integer slots = luaL_optinteger(L, -1, TIMERWHEEL_DEFAULT_SLOTS);
+  lua_pop(L, 1);
+
+  if (tick <= 0 || slots <= 0)
+  {
+    return luaL_error(L, "invalid tick or slots.");
+  }
+
+  LUA_TIMERWHEEL *tw = lua_newuserdata(L, sizeof(LUA_TIMERWHEEL));
+  memset(tw, 0, sizeof(LUA_TIMERWHEEL));
+  tw->onExpireRef = LUA_NOREF;
+  tw->entriesRef = LUA_NOREF;
+  luaL_getmetatable(L, LUA_TIMERWHEEL_TYPE);
+  lua_setmetatable(L, -2);
+
+  if (!timerwheel_init(&tw->wheel, tick, slots, timerwheel_gettime()))
+  {
+    return luaL_error(L, "no memory.");
+  }
+
+  tw->mainthread = utlua_mainthread(L);
+  SET_FUNC_REF_FROM_TABLE(L, tw->onExpireRef, 1, "onexpire")
+
+  lua_newtable(L);
+  tw->entriesRef = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  tw->timer = evtimer_new(event_mgr_base(), timerwheel_tick_cb, tw);
+
+  return 1;
+}
+
+static TIMERWHEEL_ENTRY *timerwheel_lookup(lua_State *L, LUA_TIMERWHEEL *tw,
+                                           int idx)
+{
+  lua_rawgeti(L, LUA_REGISTRYINDEX, tw->entriesRef);
+  lua_pushvalue(L, idx);
+  lua_rawget(L, -2);
+  TIMERWHEEL_ENTRY *entry = lua_touserdata(L, -1);
+  lua_pop(L, 2);
+  return entry;
+}
+
+LUA_API int luatimerwheel_add(lua_State *L)
+{
+  LUA_TIMERWHEEL *tw = luaL_checkudata(L, 1, LUA_TIMERWHEEL_TYPE);
+  luaL_checkany(L, 2);
+  double timeout = luaL_checknumber(L, 3);
+
+  if (!tw->timer)
+  {
+    return luaL_error(L, "timerwheel closed.");
+  }
+
+  if (lua_isnil(L, 2))
+  {
+    return luaL_error(L, "key can't be nil.");
+  }
+
+  TIMERWHEEL_ENTRY *entry = timerwheel_lookup(L, tw, 2);
+  if (!entry)
+  {
+    entry = calloc(1, sizeof(TIMERWHEEL_ENTRY));
+    if (!entry)
+    {
+      return luaL_error(L, "no memory.");
+    }
+
+    lua_pushvalue(L, 2);
+    entry->keyRef = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, tw->entriesRef);
+    lua_pushvalue(L, 2);
+    lua_pushlightuserdata(L, entry);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+  }
+
+  timerwheel_add(&tw->wheel, &entry->node, timerwheel_gettime() + timeout);
+  timerwheel_schedule(tw);
+
+  return 0;
+}
+
+LUA_API int luatimerwheel_cancel(lua_State *L)
+{
+  LUA_TIMERWHEEL *tw = luaL_checkudata(L, 1, LUA_TIMERWHEEL_TYPE);
+  luaL_checkany(L, 2);
+
+  TIMERWHEEL_ENTRY *entry = tw->timer ? timerwheel_lookup(L, tw, 2) : NULL;
+  if (entry)
+  {
+    timerwheel_cancel(&tw->wheel, &entry->node);
+    timerwheel_entry_free(L, tw, entry);
+  }
+
+  lua_pushboolean(L, entry != NULL);
+  return 1;
+}
+
+LUA_API int luatimerwheel_count(lua_State *L)
+{
+  LUA_TIMERWHEEL *tw = luaL_checkudata(L, 1, LUA_TIMERWHEEL_TYPE);
+  lua_pushinteger(L, tw->wheel.count);
+  return 1;
+}
+
+LUA_API int luatimerwheel_close(lua_State *L)
+{
+  LUA_TIMERWHEEL *tw = luaL_checkudata(L, 1, LUA_TIMERWHEEL_TYPE);
+
+  if (tw->timer)
+  {
+    if (event_mgr_base_current())
+    {
+      event_free(tw->timer);
+    }
+    tw->timer = NULL;
+  }
+
+  // unlink the nodes before the entries are freed.
+  timerwheel_destroy(&tw->wheel);
+
+  if (tw->entriesRef != LUA_NOREF)
+  {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, tw->entriesRef);
+    lua_pushnil(L);
+    while (lua_next(L, -2))
+    {
+      TIMERWHEEL_ENTRY *entry = lua_touserdata(L, -1);
+      luaL_unref(L, LUA_REGISTRYINDEX, entry->keyRef);
+      free(entry);
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+  }
+
+  CLEAR_REF(L, tw->entriesRef)
+  CLEAR_REF(L, tw->onExpireRef)
+
+  return 0;
+}
+
+static const luaL_Reg timerwheellib[] = {
+    {"new", luatimerwheel_new},
+    {NULL, NULL},
+};
+
+LUA_API int luaopen_fan_timerwheel(lua_State *L)
+{
+  luaL_newmetatable(L, LUA_TIMERWHEEL_TYPE);
+
+  lua_pushcfunction(L, &luatimerwheel_add);
+  lua_setfield(L, -2, "add");
+
+  lua_pushcfunction(L, &luatimerwheel_cancel);
+  lua_setfield(L, -2, "cancel");
+
+  lua_pushcfunction(L, &luatimerwheel_count);
+  lua_setfield(L, -2, "count");
+
+  lua_pushcfunction(L, &luatimerwheel_close);
+  lua_setfield(L, -2, "close");
+
+  lua_pushstring(L, "__index");
+  lua_pushvalue(L, -2);
+  lua_rawset(L, -3);
+
+  lua_pushstring(L, "__gc");
+  lua_pushcfunction(L, &luatimerwheel_close);
+  lua_rawset(L, -3);
+
+  lua_pop(L, 1);
+
+  lua_newtable(L);
+  luaL_register(L, "timerwheel", timerwheellib);
+  return 1;
+}
@@ -0,0 +1,54 @@
+#ifndef timerwheel_h
+#define timerwheel_h
+
+#include "utlua.h"
+
+// hashed timing wheel, O(1) add/cancel, expiries are collected per tick.
+// nodes are intrusive, embed one in the object that owns the deadline.
+
+enum
+{
+  TIMERWHEEL_NODE_IDLE = 0,
+  TIMERWHEEL_NODE_WHEEL,
+  TIMERWHEEL_NODE_EXPIRED,
+};
+
+typedef struct timerwheel_node
+{
+  struct timerwheel_node *prev;
+  struct timerwheel_node *next;
+  uint64_t expire;
+  int state;
+} TIMERWHEEL_NODE;
+
+typedef struct
+{
+  double tick;
+  double start;
+  uint64_t current;
+
+  size_t slot_count;
+  TIMERWHEEL_NODE *slots;
+
+  // nodes in the wheel, expired nodes not included.
+  size_t count;
+} TIMERWHEEL;
+
+int timerwheel_init(TIMERWHEEL *wheel, double tick, size_t slot_count,
+                    double now);
+void timerwheel_destroy(TIMERWHEEL *wheel);
+
+// (re)schedule node at deadline, fired on the first tick after it.
+void timerwheel_add(TIMERWHEEL *wheel, TIMERWHEEL_NODE *node, double deadline);
+// unlink node from the wheel or from an expired list.
+void timerwheel_cancel(TIMERWHEEL *wheel, TIMERWHEEL_NODE *node);
+
+// move all nodes due at now into the expired list head.
+void timerwheel_advance(TIMERWHEEL *wheel, double now,
+                        TIMERWHEEL_NODE *expired);
+
+void timerwheel_list_init(TIMERWHEEL_NODE *head);
+// take the first node of an expired list, NULL if empty.
+TIMERWHEEL_NODE *timerwheel_pop(TIMERWHEEL_NODE *expired);
+
+#endif
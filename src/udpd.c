@@ -1,41 +1,721 @@
 
-#include "utlua.h"
+#include "udpd.h"
 #include <net/if.h>
+#include <sys/uio.h>
 
-#define LUA_UDPD_CONNECTION_TYPE "UDPD_CONNECTION_TYPE"
-#define LUA_UDPD_DEST_TYPE "LUA_UDPD_DEST_TYPE"
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include <linux/filter.h>
+#include <netinet/udp.h>
 
-typedef struct
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+#ifndef SO_TXTIME
+#define SO_TXTIME 61
+#endif
+
+#ifndef SCM_TXTIME
+#define SCM_TXTIME SO_TXTIME
+#endif
+
+#ifndef SO_TIMESTAMPING
+#define SO_TIMESTAMPING 37
+#endif
+
+#ifndef SCM_TIMESTAMPING
+#define SCM_TIMESTAMPING SO_TIMESTAMPING
+#endif
+
+#ifndef SO_EE_ORIGIN_TIMESTAMPING
+#define SO_EE_ORIGIN_TIMESTAMPING 4
+#endif
+
+#ifndef SO_EE_ORIGIN_TXTIME
+#define SO_EE_ORIGIN_TXTIME 6
+#endif
+
+// flags of linux/net_tstamp.h, an enum there.
+#define UDPD_TIMESTAMPING_TX_SOFTWARE (1 << 1)
+#define UDPD_TIMESTAMPING_SOFTWARE (1 << 4)
+#define UDPD_TIMESTAMPING_OPT_ID (1 << 7)
+#define UDPD_TIMESTAMPING_OPT_TSONLY (1 << 11)
+#define UDPD_TXTIME_REPORT_ERRORS (1 << 1)
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+#ifndef CLOCK_TAI
+#define CLOCK_TAI 11
+#endif
+
+// same layout as struct sock_txtime of linux/net_tstamp.h.
+struct udpd_sock_txtime
 {
-  struct event reconnect_clock;
+  clockid_t clockid;
+  uint32_t flags;
+};
 
-  lua_State *L;
-  int selfRef;
+// same layout as struct scm_timestamping, ts[0] is the software stamp.
+struct udpd_scm_timestamping
+{
+  struct timespec ts[3];
+};
+
+#define UDPD_HAS_SEGMENT_OFFLOAD 1
+#define UDPD_HAS_TXTIME 1
+#define UDPD_HAS_REUSEPORT_CBPF 1
+#else
+#define UDPD_HAS_SEGMENT_OFFLOAD 0
+#define UDPD_HAS_TXTIME 0
+#define UDPD_HAS_REUSEPORT_CBPF 0
+#endif
+
+// kernel limits for one UDP_SEGMENT super-buffer.
+#define UDPD_MAX_SEGMENTS 64
+#define UDPD_MAX_SEGMENT_BYTES 65507
+
+#define UDPD_DEST_CACHE_SIZE 4096
+
+#define UDPD_DEFAULT_READ_BUDGET 64
+
+#define UDPD_DEFAULT_PULL_CAPACITY 1024
+
+// datagrams due within this are sent on the current pacing tick.
+#define UDPD_PACE_SLACK 0.0002
+
+// launch times kept for the tx timestamps to match, and how often send_at
+// reads the error queue (nothing else does on a socket without onread).
+#define UDPD_TXTIME_WINDOW 1024
+#define UDPD_TXTIME_DRAIN_EVERY 64
+
+typedef UDPD_CONN Conn;
+typedef UDPD_DEST Dest;
+
+// ========== address helpers ==========
+
+// ipv4 peers on a dual stack socket come as ::ffff:a.b.c.d, turn them back
+// to sockaddr_in so the same peer has one dest on every socket.
+static void udpd_addr_normalize(struct sockaddr_storage *ss, socklen_t *len)
+{
+  if (ss->ss_family != AF_INET6)
+  {
+    return;
+  }
+
+  struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)ss;
+  if (!IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr))
+  {
+    return;
+  }
+
+  struct sockaddr_in in;
+  memset(&in, 0, sizeof(in));
+  in.sin_family = AF_INET;
+  in.sin_port = in6->sin6_port;
+  memcpy(&in.sin_addr, &in6->sin6_addr.s6_addr[12], sizeof(in.sin_addr));
+
+  memset(ss, 0, sizeof(struct sockaddr_storage));
+  memcpy(ss, &in, sizeof(in));
+  *len = sizeof(in);
+}
+
+size_t udpd_addr_hash(const struct sockaddr *addr)
+{
+  const uint8_t *p = NULL;
+  size_t len = 0;
+  uint16_t port = 0;
 
-  lua_State *mainthread;
+  if (addr->sa_family == AF_INET6)
+  {
+    const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+    p = (const uint8_t *)&in6->sin6_addr;
+    len = sizeof(in6->sin6_addr);
+    port = in6->sin6_port;
+  }
+  else
+  {
+    const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+    p = (const uint8_t *)&in->sin_addr;
+    len = sizeof(in->sin_addr);
+    port = in->sin_port;
+  }
 
-  int onReadRef;
-  int onSendReadyRef;
+  // fnv-1a
+  uint32_t h = 2166136261u;
+  size_t i = 0;
+  for (i = 0; i < len; i++)
+  {
+    h = (h ^ p[i]) * 16777619u;
+  }
+  h = (h ^ (port & 0xff)) * 16777619u;
+  h = (h ^ (port >> 8)) * 16777619u;
+  return h;
+}
 
-  char *host;
-  char *bind_host;
-  int port;
-  int bind_port;
-  int socket_fd;
-  struct sockaddr addr;
-  socklen_t addrlen;
+bool udpd_addr_equal(const struct sockaddr *a, const struct sockaddr *b)
+{
+  if (a->sa_family != b->sa_family)
+  {
+    return false;
+  }
 
-    int interface;
+  if (a->sa_family == AF_INET6)
+  {
+    const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *)a;
+    const struct sockaddr_in6 *b6 = (const struct sockaddr_in6 *)b;
+    return a6->sin6_port == b6->sin6_port &&
+           a6->sin6_scope_id == b6->sin6_scope_id &&
+           memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr)) == 0;
+  }
+
+  const struct sockaddr_in *a4 = (const struct sockaddr_in *)a;
+  const struct sockaddr_in *b4 = (const struct sockaddr_in *)b;
+  return a4->sin_port == b4->sin_port &&
+         a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+}
+
+const char *udpd_addr_ntop(const struct sockaddr *addr, char *buf,
+                           size_t size)
+{
+  if (addr->sa_family == AF_INET6)
+  {
+    return inet_ntop(AF_INET6,
+                     (void *)&((const struct sockaddr_in6 *)addr)->sin6_addr,
+                     buf, size);
+  }
 
-  struct event *read_ev;
-  struct event *write_ev;
-} Conn;
+  return inet_ntop(AF_INET,
+                   (void *)&((const struct sockaddr_in *)addr)->sin_addr, buf,
+                   size);
+}
 
-typedef struct
+int udpd_addr_port(const struct sockaddr *addr)
 {
-  struct sockaddr_in si_client;
-  socklen_t client_len;
-} Dest;
+  if (addr->sa_family == AF_INET6)
+  {
+    return ntohs(((const struct sockaddr_in6 *)addr)->sin6_port);
+  }
+
+  return ntohs(((const struct sockaddr_in *)addr)->sin_port);
+}
+
+// map an ipv4 destination for a dual stack socket.
+static const struct sockaddr *udpd_conn_addr(Conn *conn,
+                                             const struct sockaddr *addr,
+                                             socklen_t *addrlen,
+                                             struct sockaddr_in6 *mapped)
+{
+  if (conn->family != AF_INET6 || addr->sa_family != AF_INET)
+  {
+    return addr;
+  }
+
+  const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+  memset(mapped, 0, sizeof(struct sockaddr_in6));
+  mapped->sin6_family = AF_INET6;
+  mapped->sin6_port = in->sin_port;
+  mapped->sin6_addr.s6_addr[10] = 0xff;
+  mapped->sin6_addr.s6_addr[11] = 0xff;
+  memcpy(&mapped->sin6_addr.s6_addr[12], &in->sin_addr, sizeof(in->sin_addr));
+
+  *addrlen = sizeof(struct sockaddr_in6);
+  return (const struct sockaddr *)mapped;
+}
+
+ssize_t udpd_conn_sendto(UDPD_CONN *conn, const char *buf, size_t len,
+                         const struct sockaddr *addr, socklen_t addrlen)
+{
+  struct sockaddr_in6 mapped;
+  addr = udpd_conn_addr(conn, addr, &addrlen, &mapped);
+  return sendto(conn->socket_fd, buf, len, 0, addr, addrlen);
+}
+
+// ========== interned dests ==========
+
+static TAILQ_HEAD(udpd_dest_lru, udpd_dest) udpd_dest_lru =
+    TAILQ_HEAD_INITIALIZER(udpd_dest_lru);
+static Dest **udpd_dest_buckets = NULL;
+static size_t udpd_dest_bucket_count = 0;
+static size_t udpd_dest_count = 0;
+static size_t udpd_dest_cache_size = UDPD_DEST_CACHE_SIZE;
+
+static void udpd_dest_rehash(size_t bucket_count)
+{
+  Dest **buckets = calloc(bucket_count, sizeof(Dest *));
+  Dest *dest = NULL;
+  TAILQ_FOREACH(dest, &udpd_dest_lru, lru)
+  {
+    size_t index = dest->hash % bucket_count;
+    dest->hash_next = buckets[index];
+    buckets[index] = dest;
+  }
+
+  free(udpd_dest_buckets);
+  udpd_dest_buckets = buckets;
+  udpd_dest_bucket_count = bucket_count;
+}
+
+static void udpd_dest_evict(lua_State *L, Dest *dest)
+{
+  Dest **pp = &udpd_dest_buckets[dest->hash % udpd_dest_bucket_count];
+  for (; *pp; pp = &(*pp)->hash_next)
+  {
+    if (*pp == dest)
+    {
+      *pp = dest->hash_next;
+      break;
+    }
+  }
+
+  TAILQ_REMOVE(&udpd_dest_lru, dest, lru);
+  udpd_dest_count--;
+
+  dest->hash_next = NULL;
+  // the userdata lives on while lua holds it, a new one is interned for
+  // the next packet from this peer.
+  CLEAR_REF(L, dest->ref)
+}
+
+static void udpd_dest_trim(lua_State *L)
+{
+  while (udpd_dest_count > udpd_dest_cache_size)
+  {
+    udpd_dest_evict(L, TAILQ_LAST(&udpd_dest_lru, udpd_dest_lru));
+  }
+}
+
+UDPD_DEST *udpd_dest_push(lua_State *L, const struct sockaddr *addr,
+                          socklen_t addrlen)
+{
+  struct sockaddr_storage ss;
+  memset(&ss, 0, sizeof(ss));
+  memcpy(&ss, addr, addrlen < sizeof(ss) ? addrlen : sizeof(ss));
+  addrlen = addrlen < sizeof(ss) ? addrlen : sizeof(ss);
+  udpd_addr_normalize(&ss, &addrlen);
+
+  size_t hash = udpd_addr_hash((struct sockaddr *)&ss);
+
+  Dest *dest = NULL;
+  if (udpd_dest_buckets)
+  {
+    dest = udpd_dest_buckets[hash % udpd_dest_bucket_count];
+    for (; dest; dest = dest->hash_next)
+    {
+      if (dest->hash == hash &&
+          udpd_addr_equal((struct sockaddr *)&dest->si_client,
+                          (struct sockaddr *)&ss))
+      {
+        break;
+      }
+    }
+  }
+
+  if (dest)
+  {
+    if (dest != TAILQ_FIRST(&udpd_dest_lru))
+    {
+      TAILQ_REMOVE(&udpd_dest_lru, dest, lru);
+      TAILQ_INSERT_HEAD(&udpd_dest_lru, dest, lru);
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, dest->ref);
+    return dest;
+  }
+
+  dest = lua_newuserdata(L, sizeof(Dest));
+  luaL_getmetatable(L, LUA_UDPD_DEST_TYPE);
+  lua_setmetatable(L, -2);
+
+  memset(dest, 0, sizeof(Dest));
+  memcpy(&dest->si_client, &ss, sizeof(ss));
+  dest->client_len = addrlen;
+  dest->hash = hash;
+  dest->ref = LUA_NOREF;
+
+  if (udpd_dest_cache_size == 0)
+  {
+    return dest;
+  }
+
+  if (!udpd_dest_buckets)
+  {
+    udpd_dest_rehash(64);
+  }
+
+  lua_pushvalue(L, -1);
+  dest->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  TAILQ_INSERT_HEAD(&udpd_dest_lru, dest, lru);
+  udpd_dest_count++;
+
+  if (udpd_dest_count > udpd_dest_bucket_count * 2)
+  {
+    udpd_dest_rehash(udpd_dest_bucket_count * 4);
+  }
+  else
+  {
+    size_t index = hash % udpd_dest_bucket_count;
+    dest->hash_next = udpd_dest_buckets[index];
+    udpd_dest_buckets[index] = dest;
+  }
+
+  udpd_dest_trim(L);
+
+  return dest;
+}
+
+LUA_API int udpd_dest_cache(lua_State *L)
+{
+  if (lua_gettop(L) > 0)
+  {
+    lua_Integer size = luaL_checkinteger(L, 1);
+    udpd_dest_cache_size = size < 0 ? 0 : (size_t)size;
+    udpd_dest_trim(L);
+  }
+
+  lua_pushinteger(L, udpd_dest_count);
+  lua_pushinteger(L, udpd_dest_cache_size);
+  return 2;
+}
+
+// ========== paced send ==========
+
+static double udpd_gettime()
+{
+  struct timeval v;
+  gettimeofday(&v, NULL);
+  return v.tv_sec + v.tv_usec / 1000000.0;
+}
+
+static void udpd_pace_record(Conn *conn, double time, double now)
+{
+  double lateness = now > time ? now - time : 0;
+  conn->pace_stats.paced_total++;
+  conn->pace_stats.lateness_sum += lateness;
+  if (lateness > conn->pace_stats.lateness_max)
+  {
+    conn->pace_stats.lateness_max = lateness;
+  }
+}
+
+static void udpd_pace_flush(Conn *conn);
+
+static void udpd_pace_cb(evutil_socket_t fd, short what, void *arg)
+{
+  udpd_pace_flush((Conn *)arg);
+}
+
+// send the due datagrams, then arm the timer for the next one.
+static void udpd_pace_flush(Conn *conn)
+{
+  double now = udpd_gettime();
+  UDPD_PACE_PACKET *packet = NULL;
+  while ((packet = TAILQ_FIRST(&conn->pace_queue)) &&
+         packet->time <= now + UDPD_PACE_SLACK)
+  {
+    TAILQ_REMOVE(&conn->pace_queue, packet, next);
+    conn->pace_count--;
+
+    if (conn->socket_fd &&
+        udpd_conn_sendto(conn, packet->data, packet->len,
+                         (struct sockaddr *)&packet->addr,
+                         packet->addrlen) >= 0)
+    {
+      udpd_pace_record(conn, packet->time, now);
+    }
+    else
+    {
+      conn->pace_stats.error_total++;
+    }
+    free(packet);
+  }
+
+  if (packet)
+  {
+    if (!conn->pace_ev)
+    {
+      conn->pace_ev = evtimer_new(event_mgr_base(), udpd_pace_cb, conn);
+    }
+
+    struct timeval t = {0};
+    d2tv(packet->time - now, &t);
+    evtimer_add(conn->pace_ev, &t);
+  }
+}
+
+static void udpd_pace_push(Conn *conn, UDPD_PACE_PACKET *packet)
+{
+  // send_at times mostly grow, so search from the tail.
+  UDPD_PACE_PACKET *prev = TAILQ_LAST(&conn->pace_queue, udpd_pace_list);
+  while (prev && prev->time > packet->time)
+  {
+    prev = TAILQ_PREV(prev, udpd_pace_list, next);
+  }
+
+  if (prev)
+  {
+    TAILQ_INSERT_AFTER(&conn->pace_queue, prev, packet, next);
+  }
+  else
+  {
+    TAILQ_INSERT_HEAD(&conn->pace_queue, packet, next);
+  }
+  conn->pace_count++;
+
+  if (packet == TAILQ_FIRST(&conn->pace_queue))
+  {
+    udpd_pace_flush(conn);
+  }
+}
+
+static void udpd_pace_clear(Conn *conn)
+{
+  if (event_mgr_base_current() && conn->pace_ev)
+  {
+    event_free(conn->pace_ev);
+    conn->pace_ev = NULL;
+  }
+
+  UDPD_PACE_PACKET *packet = NULL;
+  while ((packet = TAILQ_FIRST(&conn->pace_queue)))
+  {
+    TAILQ_REMOVE(&conn->pace_queue, packet, next);
+    free(packet);
+  }
+  conn->pace_count = 0;
+
+  free(conn->txtime_requested);
+  conn->txtime_requested = NULL;
+  conn->txtime_report = 0;
+}
+
+#if UDPD_HAS_TXTIME
+// hand the datagram to the kernel with a launch time delay seconds from now.
+static ssize_t udpd_send_txtime(Conn *conn, const char *buf, size_t len,
+                                const struct sockaddr *addr,
+                                socklen_t addrlen, double delay)
+{
+  struct sockaddr_in6 mapped;
+  addr = udpd_conn_addr(conn, addr, &addrlen, &mapped);
+
+  struct timespec ts;
+  clock_gettime(conn->txtime_clock, &ts);
+  uint64_t txtime = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  if (delay > 0)
+  {
+    txtime += (uint64_t)(delay * 1000000000.0);
+  }
+
+  struct iovec iov = {(void *)buf, len};
+  char control[CMSG_SPACE(sizeof(uint64_t)) + CMSG_SPACE(sizeof(uint32_t))];
+  memset(control, 0, sizeof(control));
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = (void *)addr;
+  msg.msg_namelen = addrlen;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_TXTIME;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+  memcpy(CMSG_DATA(cmsg), &txtime, sizeof(txtime));
+
+  if (!conn->txtime_report)
+  {
+    msg.msg_controllen = CMSG_SPACE(sizeof(uint64_t));
+    return sendmsg(conn->socket_fd, &msg, 0);
+  }
+
+  // ask for a tx timestamp of this datagram only, other sends don't take a
+  // timestamp key.
+  uint32_t flags = UDPD_TIMESTAMPING_TX_SOFTWARE;
+  cmsg = CMSG_NXTHDR(&msg, cmsg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SO_TIMESTAMPING;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(uint32_t));
+  memcpy(CMSG_DATA(cmsg), &flags, sizeof(flags));
+
+  ssize_t ret = sendmsg(conn->socket_fd, &msg, 0);
+  if (ret < 0 && errno == EINVAL)
+  {
+    // kernels before 4.13 refuse the timestamp cmsg, go on without reports.
+    conn->txtime_report = 0;
+    msg.msg_controllen = CMSG_SPACE(sizeof(uint64_t));
+    return sendmsg(conn->socket_fd, &msg, 0);
+  }
+
+  if (ret >= 0)
+  {
+    conn->txtime_requested[conn->txtime_key % UDPD_TXTIME_WINDOW] = txtime;
+    conn->txtime_key++;
+  }
+  return ret;
+}
+
+static int64_t udpd_timespec_ns(const struct timespec *ts)
+{
+  return (int64_t)ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+// read the tx timestamps and the drop reports of the SO_TXTIME datagrams
+// from the error queue into pace_stats.
+static void udpd_txtime_drain(Conn *conn)
+{
+  if (!conn->txtime_report || !conn->socket_fd)
+  {
+    return;
+  }
+
+  // the timestamps are CLOCK_REALTIME, the launch times txtime_clock.
+  struct timespec real;
+  struct timespec clock;
+  clock_gettime(CLOCK_REALTIME, &real);
+  clock_gettime(conn->txtime_clock, &clock);
+  int64_t offset = udpd_timespec_ns(&real) - udpd_timespec_ns(&clock);
+
+  char buf[64];
+  char control[512];
+  for (;;)
+  {
+    struct iovec iov = {buf, sizeof(buf)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(conn->socket_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+    {
+      break;
+    }
+
+    struct sock_extended_err err;
+    struct udpd_scm_timestamping tss;
+    int has_err = 0;
+    int has_tss = 0;
+
+    struct cmsghdr *cmsg = NULL;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+      if (cmsg->cmsg_level == SOL_SOCKET &&
+          cmsg->cmsg_type == SCM_TIMESTAMPING)
+      {
+        memcpy(&tss, CMSG_DATA(cmsg), sizeof(tss));
+        has_tss = 1;
+      }
+      else if ((cmsg->cmsg_level == IPPROTO_IP &&
+                cmsg->cmsg_type == IP_RECVERR) ||
+               (cmsg->cmsg_level == IPPROTO_IPV6 &&
+                cmsg->cmsg_type == IPV6_RECVERR))
+      {
+        memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+        has_err = 1;
+      }
+    }
+
+    if (!has_err)
+    {
+      continue;
+    }
+
+    if (err.ee_origin == SO_EE_ORIGIN_TXTIME)
+    {
+      // the qdisc dropped it: launch time passed or not valid.
+      conn->pace_stats.txtime_dropped++;
+      continue;
+    }
+
+    // ee_data is the timestamp key, the launch time is gone once the window
+    // moved past it.
+    uint32_t age = conn->txtime_key - err.ee_data;
+    if (err.ee_origin != SO_EE_ORIGIN_TIMESTAMPING || !has_tss || age == 0 ||
+        age > UDPD_TXTIME_WINDOW ||
+        (tss.ts[0].tv_sec == 0 && tss.ts[0].tv_nsec == 0))
+    {
+      continue;
+    }
+
+    // negative when the datagram left early: no pacing qdisc on the device.
+    int64_t achieved = udpd_timespec_ns(&tss.ts[0]) - offset;
+    int64_t requested =
+        conn->txtime_requested[err.ee_data % UDPD_TXTIME_WINDOW];
+    double lateness = (achieved - requested) / 1000000000.0;
+
+    UDPD_PACE_STATS *stats = &conn->pace_stats;
+    stats->lateness_sum += lateness;
+    if (lateness > stats->lateness_max)
+    {
+      stats->lateness_max = lateness;
+    }
+    stats->txtime_reported++;
+  }
+}
+#endif
+
+// ========== pull mode ==========
+
+static void udpd_pull_hook(void *ctx, const char *buf, size_t len,
+                           const struct sockaddr *addr, socklen_t addrlen)
+{
+  Conn *conn = (Conn *)ctx;
+  if (conn->pull_count >= conn->pull_capacity)
+  {
+    conn->pull_dropped++;
+    return;
+  }
+
+  UDPD_PULL_PACKET *packet = malloc(sizeof(UDPD_PULL_PACKET) + len);
+  if (!packet)
+  {
+    conn->pull_dropped++;
+    return;
+  }
+  memcpy(&packet->addr, addr, addrlen);
+  packet->addrlen = addrlen;
+  packet->len = len;
+  memcpy(packet->data, buf, len);
+
+  TAILQ_INSERT_TAIL(&conn->pull_queue, packet, next);
+  conn->pull_count++;
+  fan_pull_ready(&conn->pull);
+}
+
+static UDPD_PULL_PACKET *udpd_pull_take(Conn *conn)
+{
+  UDPD_PULL_PACKET *packet = TAILQ_FIRST(&conn->pull_queue);
+  if (packet)
+  {
+    TAILQ_REMOVE(&conn->pull_queue, packet, next);
+    conn->pull_count--;
+  }
+  return packet;
+}
+
+static void udpd_pull_clear(Conn *conn)
+{
+  UDPD_PULL_PACKET *packet = NULL;
+  while ((packet = udpd_pull_take(conn)))
+  {
+    free(packet);
+  }
+  fan_pull_disable(&conn->pull);
+}
 
 LUA_API int lua_udpd_conn_gc(lua_State *L)
 {
@@ -52,8 +732,12 @@ LUA_API int lua_udpd_conn_gc(lua_State *L)
   }
 
   CLEAR_REF(L, conn->onReadRef)
+  CLEAR_REF(L, conn->onReadvRef)
   CLEAR_REF(L, conn->onSendReadyRef)
 
+  udpd_pace_clear(conn);
+  udpd_pull_clear(conn);
+
   if (event_mgr_base_current() && conn->read_ev)
   {
     event_free(conn->read_ev);
@@ -77,6 +761,52 @@ LUA_API int lua_udpd_conn_gc(lua_State *L)
 
 #define BUFLEN 65536
 
+#if UDPD_HAS_REUSEPORT_CBPF
+// pick socket hash(source address, source port) % group of the reuseport
+// group, so one peer always lands on the same socket (and worker).
+static int udpd_attach_reuseport_cbpf(int fd, int group)
+{
+  struct sock_filter code[] = {
+      // ip version.
+      BPF_STMT(BPF_LD | BPF_B | BPF_ABS, SKF_NET_OFF),
+      BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 4),
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 6, 5, 0),
+
+      // ipv4, source address ^ source port, ip options not expected.
+      BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12),
+      BPF_STMT(BPF_MISC | BPF_TAX, 0),
+      BPF_STMT(BPF_LD | BPF_H | BPF_ABS, SKF_NET_OFF + 20),
+      BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+      BPF_STMT(BPF_JMP | BPF_JA, 13),
+
+      // ipv6, the words of the source address ^ source port.
+      BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 8),
+      BPF_STMT(BPF_MISC | BPF_TAX, 0),
+      BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12),
+      BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+      BPF_STMT(BPF_MISC | BPF_TAX, 0),
+      BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 16),
+      BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+      BPF_STMT(BPF_MISC | BPF_TAX, 0),
+      BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 20),
+      BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+      BPF_STMT(BPF_MISC | BPF_TAX, 0),
+      BPF_STMT(BPF_LD | BPF_H | BPF_ABS, SKF_NET_OFF + 40),
+      BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+
+      // mix and select.
+      BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 0x9e3779b1),
+      BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+      BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (uint32_t)group),
+      BPF_STMT(BPF_RET | BPF_A, 0),
+  };
+
+  struct sock_fprog prog = {sizeof(code) / sizeof(code[0]), code};
+  return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+                    sizeof(prog));
+}
+#endif
+
 static void udpd_writecb(evutil_socket_t fd, short what, void *arg)
 {
   Conn *conn = (Conn *)arg;
@@ -95,39 +825,166 @@ static void udpd_writecb(evutil_socket_t fd, short what, void *arg)
   }
 }
 
-static void udpd_readcb(evutil_socket_t fd, short what, void *arg)
+static void udpd_onread(Conn *conn, const char *buf, size_t len,
+                        struct sockaddr_storage *si_client,
+                        socklen_t client_len)
 {
-  Conn *conn = (Conn *)arg;
+  lua_State *mainthread = conn->mainthread;
+  lua_lock(mainthread);
+  lua_State *co = lua_newthread(mainthread);
+  PUSH_REF(mainthread);
+  lua_unlock(mainthread);
+
+  lua_rawgeti(co, LUA_REGISTRYINDEX, conn->onReadRef);
+  lua_pushlstring(co, buf, len);
+  udpd_dest_push(co, (struct sockaddr *)si_client, client_len);
+
+  FAN_RESUME(co, mainthread, 2);
+  POP_REF(mainthread);
+}
+
+static ssize_t udpd_recv(Conn *conn, char *buf,
+                         struct sockaddr_storage *si_client,
+                         socklen_t *client_len, int *segment_size)
+{
+  ssize_t len = 0;
+  *client_len = sizeof(struct sockaddr_storage);
+  *segment_size = 0;
+
+#if UDPD_HAS_SEGMENT_OFFLOAD
+  if (conn->gro)
+  {
+    struct iovec iov = {buf, BUFLEN};
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = si_client;
+    msg.msg_namelen = *client_len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    len = recvmsg(conn->socket_fd, &msg, 0);
+    *client_len = msg.msg_namelen;
+
+    struct cmsghdr *cmsg = NULL;
+    for (cmsg = CMSG_FIRSTHDR(&msg); len >= 0 && cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+      if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+      {
+        memcpy(segment_size, CMSG_DATA(cmsg), sizeof(int));
+        break;
+      }
+    }
+  }
+  else
+#endif
+  {
+    len = recvfrom(conn->socket_fd, buf, BUFLEN, 0,
+                   (struct sockaddr *)si_client, client_len);
+  }
 
-  struct sockaddr_in si_client;
-  socklen_t client_len = sizeof(si_client);
+  return len;
+}
 
+// read until EAGAIN or read_budget datagrams, so a busy socket can't starve
+// the loop. with co, datagrams are collected for one onreadv call, return the
+// count collected.
+static int udpd_drain(Conn *conn, lua_State *co)
+{
+  struct sockaddr_storage si_client;
+  socklen_t client_len = 0;
+  int segment_size = 0;
   char buf[BUFLEN];
-  ssize_t len = recvfrom(conn->socket_fd, buf, BUFLEN, 0,
-                         (struct sockaddr *)&si_client, &client_len);
-  if (len >= 0)
+
+  int count = 0;
+  int batch = 0;
+  while (count < conn->read_budget && conn->socket_fd)
   {
-    if (conn->onReadRef != LUA_NOREF)
+    ssize_t len =
+        udpd_recv(conn, buf, &si_client, &client_len, &segment_size);
+    if (len < 0)
+    {
+      break;
+    }
+
+    if (!conn->recv_hook && !co && conn->onReadRef == LUA_NOREF)
+    {
+      count++;
+      continue;
+    }
+
+    udpd_addr_normalize(&si_client, &client_len);
+    conn->recv_bytes += len;
+
+    // a coalesced GRO buffer holds equal sized datagrams, the last one may be
+    // shorter, split it back so lua sees the original datagrams.
+    ssize_t segment = (segment_size > 0 && segment_size < len) ? segment_size : len;
+    ssize_t offset = 0;
+    do
     {
-      lua_State *mainthread = conn->mainthread;
-      lua_lock(mainthread);
-      lua_State *co = lua_newthread(mainthread);
-      PUSH_REF(mainthread);
-      lua_unlock(mainthread);
+      ssize_t chunk = len - offset > segment ? segment : len - offset;
+      conn->recv_total++;
+      count++;
+      if (conn->recv_hook)
+      {
+        conn->recv_hook(conn->recv_hook_ctx, buf + offset, chunk,
+                        (struct sockaddr *)&si_client, client_len);
+      }
+      else if (co)
+      {
+        batch++;
+        lua_pushlstring(co, buf + offset, chunk);
+        lua_rawseti(co, -3, batch);
+        udpd_dest_push(co, (struct sockaddr *)&si_client, client_len);
+        lua_rawseti(co, -2, batch);
+      }
+      else
+      {
+        udpd_onread(conn, buf + offset, chunk, &si_client, client_len);
+      }
+      offset += chunk;
+      // the callback may have closed (or collected) the conn, the socket is
+      // gone then.
+    } while (offset < len && conn->socket_fd &&
+             (conn->recv_hook || co || conn->onReadRef != LUA_NOREF));
+  }
 
-      lua_rawgeti(co, LUA_REGISTRYINDEX, conn->onReadRef);
-      lua_pushlstring(co, (const char *)buf, len);
+  return batch;
+}
 
-      Dest *dest = lua_newuserdata(co, sizeof(Dest));
-      luaL_getmetatable(co, LUA_UDPD_DEST_TYPE);
-      lua_setmetatable(co, -2);
+static void udpd_readcb(evutil_socket_t fd, short what, void *arg)
+{
+  Conn *conn = (Conn *)arg;
+
+#if UDPD_HAS_TXTIME
+  // a pending error queue keeps the socket readable.
+  udpd_txtime_drain(conn);
+#endif
 
-      memcpy(&dest->si_client, &si_client, sizeof(si_client));
-      dest->client_len = client_len;
+  if (conn->onReadvRef != LUA_NOREF && !conn->recv_hook)
+  {
+    lua_State *mainthread = conn->mainthread;
+    lua_lock(mainthread);
+    lua_State *co = lua_newthread(mainthread);
+    PUSH_REF(mainthread);
+    lua_unlock(mainthread);
 
+    lua_rawgeti(co, LUA_REGISTRYINDEX, conn->onReadvRef);
+    lua_newtable(co);
+    lua_newtable(co);
+
+    if (udpd_drain(conn, co) > 0)
+    {
       FAN_RESUME(co, mainthread, 2);
-      POP_REF(mainthread);
     }
+    POP_REF(mainthread);
+  }
+  else
+  {
+    udpd_drain(conn, NULL);
   }
 }
 
@@ -145,6 +1002,33 @@ static int setnonblock(int fd)
   return 0;
 }
 
+static void udpd_conn_update_read_event(Conn *conn)
+{
+  if (conn->recv_hook || conn->onReadRef != LUA_NOREF ||
+      conn->onReadvRef != LUA_NOREF)
+  {
+    if (!conn->read_ev && conn->socket_fd)
+    {
+      conn->read_ev = event_new(event_mgr_base(), conn->socket_fd,
+                                EV_PERSIST | EV_READ, udpd_readcb, conn);
+      event_add(conn->read_ev, NULL);
+    }
+  }
+  else if (conn->read_ev)
+  {
+    event_free(conn->read_ev);
+    conn->read_ev = NULL;
+  }
+}
+
+void udpd_conn_set_recv_hook(UDPD_CONN *conn, udpd_recv_hook hook, void *ctx)
+{
+  conn->recv_hook = hook;
+  conn->recv_hook_ctx = ctx;
+
+  udpd_conn_update_read_event(conn);
+}
+
 static int luaudpd_reconnect(Conn *conn, lua_State *L)
 {
   if (conn->socket_fd)
@@ -163,90 +1047,228 @@ static int luaudpd_reconnect(Conn *conn, lua_State *L)
     conn->read_ev = NULL;
   }
 
+  struct sockaddr_storage bind_addr;
+  socklen_t bind_addrlen = 0;
+  memset(&bind_addr, 0, sizeof(bind_addr));
+
+  if (conn->bind_host)
+  {
+    char portbuf[6];
+    evutil_snprintf(portbuf, sizeof(portbuf), "%d", conn->bind_port);
+
+    struct evutil_addrinfo hints = {0};
+    struct evutil_addrinfo *answer = NULL;
+    hints.ai_family = conn->host ? conn->addr.ss_family : AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_protocol = IPPROTO_UDP;
+    hints.ai_flags = EVUTIL_AI_ADDRCONFIG | EVUTIL_AI_PASSIVE;
+    int err = evutil_getaddrinfo(conn->bind_host, portbuf, &hints, &answer);
+    if (err != 0)
+    {
+      if (L)
+      {
+        luaL_error(L, "invaild address %s:%d", conn->bind_host, conn->bind_port);
+      }
+      return 0;
+    }
+
+    memcpy(&bind_addr, answer->ai_addr, answer->ai_addrlen);
+    bind_addrlen = answer->ai_addrlen;
+    evutil_freeaddrinfo(answer);
+  }
+
+  // the family follows the peer for connect, otherwise try dual stack.
+  int family = AF_INET6;
+  if (bind_addrlen)
+  {
+    family = bind_addr.ss_family;
+  }
+  else if (conn->host)
+  {
+    family = conn->addr.ss_family;
+  }
+
   int socket_fd = 0;
-  if ((socket_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
+  if ((socket_fd = socket(family, SOCK_DGRAM, IPPROTO_UDP)) == -1)
   {
-    return 0;
+    if (family != AF_INET6 || bind_addrlen || conn->host)
+    {
+      return 0;
+    }
+
+    // no ipv6 on this host.
+    family = AF_INET;
+    if ((socket_fd = socket(family, SOCK_DGRAM, IPPROTO_UDP)) == -1)
+    {
+      return 0;
+    }
   }
 
   int value = 1;
   if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value)) ==
       -1)
   {
+    EVUTIL_CLOSESOCKET(socket_fd);
     return 0;
   }
 
   if (setsockopt(socket_fd, SOL_SOCKET, SO_BROADCAST, &value, sizeof(value)) ==
       -1)
   {
+    EVUTIL_CLOSESOCKET(socket_fd);
     return 0;
   }
 
-#ifdef IP_BOUND_IF
+  if (conn->reuseport)
+  {
+#ifdef SO_REUSEPORT
+    if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &value,
+                   sizeof(value)) == -1)
+#endif
+    {
+      EVUTIL_CLOSESOCKET(socket_fd);
+      if (L)
+      {
+        luaL_error(L, "SO_REUSEPORT not supported.");
+      }
+      return 0;
+    }
+  }
+
+  if (family == AF_INET6)
+  {
+    int v6only = 0;
+    setsockopt(socket_fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+  }
+
+#if UDPD_HAS_SEGMENT_OFFLOAD
+  if (conn->gso)
+  {
+    // probe only, the segment size is given per sendmsg.
+    int gso_size = 0;
+    if (setsockopt(socket_fd, SOL_UDP, UDP_SEGMENT, &gso_size,
+                   sizeof(gso_size)) == -1)
+    {
+      conn->gso = 0;
+    }
+  }
+
+  if (conn->gro)
+  {
+    if (setsockopt(socket_fd, SOL_UDP, UDP_GRO, &value, sizeof(value)) == -1)
+    {
+      conn->gro = 0;
+    }
+  }
+#else
+  conn->gso = 0;
+  conn->gro = 0;
+#endif
+
+#if UDPD_HAS_TXTIME
+  if (conn->txtime)
+  {
+    // no deadline mode, late datagrams go out at once, the qdisc reports
+    // the ones it drops to the error queue.
+    struct udpd_sock_txtime conf = {conn->txtime_clock,
+                                    UDPD_TXTIME_REPORT_ERRORS};
+    if (setsockopt(socket_fd, SOL_SOCKET, SO_TXTIME, &conf, sizeof(conf)) ==
+        -1)
+    {
+      conn->txtime = 0;
+    }
+  }
+
+  if (conn->txtime)
+  {
+    // software tx timestamps keyed by send, without the payload, so
+    // send_at_stats can tell when the datagrams actually left.
+    int flags = UDPD_TIMESTAMPING_SOFTWARE | UDPD_TIMESTAMPING_OPT_ID |
+                UDPD_TIMESTAMPING_OPT_TSONLY;
+    conn->txtime_key = 0;
+    conn->txtime_report = setsockopt(socket_fd, SOL_SOCKET, SO_TIMESTAMPING,
+                                     &flags, sizeof(flags)) == 0;
+    if (conn->txtime_report && !conn->txtime_requested)
+    {
+      conn->txtime_requested =
+          malloc(sizeof(uint64_t) * UDPD_TXTIME_WINDOW);
+      conn->txtime_report = conn->txtime_requested != NULL;
+    }
+  }
+#else
+  conn->txtime = 0;
+#endif
+
     if (conn->interface) {
-        setsockopt(socket_fd, IPPROTO_IP, IP_BOUND_IF, &conn->interface, sizeof(conn->interface));
-    }
+#ifdef IP_BOUND_IF
+        if (family == AF_INET) {
+            setsockopt(socket_fd, IPPROTO_IP, IP_BOUND_IF, &conn->interface, sizeof(conn->interface));
+        }
+#endif
+#ifdef IPV6_BOUND_IF
+        if (family == AF_INET6) {
+            setsockopt(socket_fd, IPPROTO_IPV6, IPV6_BOUND_IF, &conn->interface, sizeof(conn->interface));
+        }
 #endif
+    }
 
-  if (conn->bind_host)
+  if (!bind_addrlen)
   {
-    char portbuf[6];
-    evutil_snprintf(portbuf, sizeof(portbuf), "%d", conn->bind_port);
-
-    struct evutil_addrinfo hints = {0};
-    struct evutil_addrinfo *answer = NULL;
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_DGRAM;
-    hints.ai_protocol = IPPROTO_UDP;
-    hints.ai_flags = EVUTIL_AI_ADDRCONFIG;
-    int err = evutil_getaddrinfo(conn->bind_host, portbuf, &hints, &answer);
-    if (err < 0)
+    if (family == AF_INET6)
     {
-      luaL_error(L, "invaild address %s:%d", conn->bind_host, conn->bind_port);
+      struct sockaddr_in6 *addr = (struct sockaddr_in6 *)&bind_addr;
+      addr->sin6_family = AF_INET6;
+      addr->sin6_port = htons(conn->bind_port);
+      addr->sin6_addr = in6addr_any;
+      bind_addrlen = sizeof(struct sockaddr_in6);
     }
-
-    struct sockaddr *addr = answer->ai_addr;
-
-    // printf("binding fd=%d %s:%d\n", socket_fd, conn->bind_host,
-    // conn->bind_port);
-
-    int ret =
-        bind(socket_fd, (const struct sockaddr *)&addr, answer->ai_addrlen);
-    evutil_freeaddrinfo(answer);
-
-    if (ret == -1)
+    else
     {
-      luaL_error(L, "udp bind: %s", strerror(errno));
-      return 0;
+      struct sockaddr_in *addr = (struct sockaddr_in *)&bind_addr;
+      addr->sin_family = AF_INET;
+      addr->sin_port = htons(conn->bind_port);
+      addr->sin_addr.s_addr = htonl(INADDR_ANY);
+      bind_addrlen = sizeof(struct sockaddr_in);
     }
   }
-  else
-  {
-    struct sockaddr_in addr;
-    memset((char *)&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(conn->bind_port);
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
-    if (bind(socket_fd, (const struct sockaddr *)&addr, sizeof(addr)) == -1)
+  if (bind(socket_fd, (const struct sockaddr *)&bind_addr, bind_addrlen) == -1)
+  {
+    int err = errno;
+    EVUTIL_CLOSESOCKET(socket_fd);
+    if (L && conn->bind_host)
     {
-      return 0;
+      luaL_error(L, "udp bind: %s", strerror(err));
     }
+    return 0;
   }
 
   if(!conn->bind_port)
   {
-    struct sockaddr_in addr;
+    struct sockaddr_storage addr;
     socklen_t len = sizeof(addr);
     if (getsockname(socket_fd, (struct sockaddr *)&addr, &len) == -1) {
+      EVUTIL_CLOSESOCKET(socket_fd);
       return 0;
     }
     
-    conn->bind_port = ntohs(addr.sin_port);
+    conn->bind_port = udpd_addr_port((struct sockaddr *)&addr);
+  }
+
+  if (conn->reuseport && conn->reuseport_group > 1)
+  {
+#if UDPD_HAS_REUSEPORT_CBPF
+    if (udpd_attach_reuseport_cbpf(socket_fd, conn->reuseport_group) == -1)
+#endif
+    {
+      // the kernel still spreads by its own 4-tuple hash.
+      conn->reuseport_group = 0;
+    }
   }
 
   if (setnonblock(socket_fd) < 0)
   {
+    EVUTIL_CLOSESOCKET(socket_fd);
     return 0;
   }
 
@@ -260,22 +1282,18 @@ static int luaudpd_reconnect(Conn *conn, lua_State *L)
     conn->write_ev = NULL;
   }
 
-  if (conn->onReadRef != LUA_NOREF)
-  {
-    conn->read_ev = event_new(event_mgr_base(), socket_fd, EV_PERSIST | EV_READ,
-                              udpd_readcb, conn);
-    event_add(conn->read_ev, NULL);
-  }
-  else
-  {
-    conn->read_ev = NULL;
-  }
-
   conn->socket_fd = socket_fd;
+  conn->family = family;
+  udpd_conn_update_read_event(conn);
 
   return 1;
 }
 
+int udpd_conn_reconnect(UDPD_CONN *conn, lua_State *L)
+{
+  return luaudpd_reconnect(conn, L);
+}
+
 void udpd_conn_new_callback(int errcode, struct evutil_addrinfo *addr,
                             void *ptr)
 {
@@ -343,7 +1361,43 @@ LUA_API int udpd_new(lua_State *L)
     }
     lua_pop(L, 1);
 
+  lua_getfield(L, 1, "gso");
+  conn->gso = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+
+  lua_getfield(L, 1, "gro");
+  conn->gro = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+
+  // true for the fq qdisc (monotonic clock), "tai" for etf.
+  lua_getfield(L, 1, "txtime");
+  conn->txtime = lua_toboolean(L, -1);
+  conn->txtime_clock = CLOCK_MONOTONIC;
+  if (lua_type(L, -1) == LUA_TSTRING && strcmp(lua_tostring(L, -1), "tai") == 0)
+  {
+    conn->txtime_clock = CLOCK_TAI;
+  }
+  lua_pop(L, 1);
+
+  TAILQ_INIT(&conn->pace_queue);
+  TAILQ_INIT(&conn->pull_queue);
+
+  lua_getfield(L, 1, "reuseport");
+  conn->reuseport = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+
+  SET_INT_FROM_TABLE(L, conn->reuseport_group, 1, "reuseport_group")
+
   SET_FUNC_REF_FROM_TABLE(L, conn->onReadRef, 1, "onread")
+  SET_FUNC_REF_FROM_TABLE(L, conn->onReadvRef, 1, "onreadv")
+
+  lua_getfield(L, 1, "read_budget");
+  conn->read_budget = (int)luaL_optinteger(L, -1, UDPD_DEFAULT_READ_BUDGET);
+  if (conn->read_budget < 1)
+  {
+    conn->read_budget = 1;
+  }
+  lua_pop(L, 1);
   SET_FUNC_REF_FROM_TABLE(L, conn->onSendReadyRef, 1, "onsendready")
 
   DUP_STR_FROM_TABLE(L, conn->host, 1, "host")
@@ -362,7 +1416,7 @@ LUA_API int udpd_new(lua_State *L)
   evutil_snprintf(portbuf, sizeof(portbuf), "%d", conn->port);
 
   struct evutil_addrinfo hints = {0};
-  hints.ai_family = AF_INET;
+  hints.ai_family = conn->host ? AF_UNSPEC : AF_INET;
   hints.ai_socktype = SOCK_DGRAM;
   hints.ai_protocol = IPPROTO_UDP;
   hints.ai_flags = EVUTIL_AI_ADDRCONFIG;
@@ -400,19 +1454,17 @@ void udpd_conn_make_dest_callback(int errcode, struct evutil_addrinfo *addr,
     lua_pushnil(L);
     lua_pushfstring(L, "'%s' -> %s", data->host, evutil_gai_strerror(errcode));
 
-    if (data->yielded)
+    bool yielded = data->yielded;
+    free(data);
+
+    if (yielded)
     {
       FAN_RESUME(L, NULL, 2);
     }
   }
   else
   {
-    Dest *dest = lua_newuserdata(L, sizeof(Dest));
-    luaL_getmetatable(L, LUA_UDPD_DEST_TYPE);
-    lua_setmetatable(L, -2);
-
-    memcpy(&dest->si_client, addr->ai_addr, addr->ai_addrlen);
-    dest->client_len = addr->ai_addrlen;
+    udpd_dest_push(L, addr->ai_addr, addr->ai_addrlen);
 
     bool yielded = data->yielded;
 
@@ -431,11 +1483,32 @@ LUA_API int udpd_conn_make_dest(lua_State *L)
   event_mgr_init();
 
   const char *host = luaL_checkstring(L, 1);
+  int port = (int)luaL_checkinteger(L, 2);
   char portbuf[6];
-  evutil_snprintf(portbuf, sizeof(portbuf), "%d", (int)luaL_checkinteger(L, 2));
+  evutil_snprintf(portbuf, sizeof(portbuf), "%d", port);
 
   lua_settop(L, 2);
 
+  // numeric host, no dns lookup.
+  struct sockaddr_storage ss;
+  memset(&ss, 0, sizeof(ss));
+  struct sockaddr_in *in = (struct sockaddr_in *)&ss;
+  struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&ss;
+  if (evutil_inet_pton(AF_INET, host, &in->sin_addr) == 1)
+  {
+    in->sin_family = AF_INET;
+    in->sin_port = htons(port);
+    udpd_dest_push(L, (struct sockaddr *)in, sizeof(struct sockaddr_in));
+    return 1;
+  }
+  else if (evutil_inet_pton(AF_INET6, host, &in6->sin6_addr) == 1)
+  {
+    in6->sin6_family = AF_INET6;
+    in6->sin6_port = htons(port);
+    udpd_dest_push(L, (struct sockaddr *)in6, sizeof(struct sockaddr_in6));
+    return 1;
+  }
+
   struct make_dest_callback_data *data =
       malloc(sizeof(struct make_dest_callback_data));
 
@@ -444,7 +1517,7 @@ LUA_API int udpd_conn_make_dest(lua_State *L)
   data->yielded = false;
 
   struct evutil_addrinfo hints = {0};
-  hints.ai_family = AF_INET;
+  hints.ai_family = AF_UNSPEC;
   hints.ai_socktype = SOCK_DGRAM;
   hints.ai_protocol = IPPROTO_UDP;
   hints.ai_flags = EVUTIL_AI_ADDRCONFIG;
@@ -465,7 +1538,10 @@ LUA_API int udpd_conn_make_dest(lua_State *L)
 }
 
 static const luaL_Reg udpdlib[] = {
-    {"new", udpd_new}, {"make_dest", udpd_conn_make_dest}, {NULL, NULL}};
+    {"new", udpd_new},
+    {"make_dest", udpd_conn_make_dest},
+    {"dest_cache", udpd_dest_cache},
+    {NULL, NULL}};
 
 LUA_API int udpd_conn_tostring(lua_State *L)
 {
@@ -491,12 +1567,13 @@ LUA_API int udpd_conn_send(lua_State *L)
   if (data && len > 0 && conn->socket_fd && lua_gettop(L) > 2)
   {
     Dest *dest = luaL_checkudata(L, 3, LUA_UDPD_DEST_TYPE);
-    ret = sendto(conn->socket_fd, data, len, 0,
-                 (struct sockaddr *)&dest->si_client, dest->client_len);
+    ret = udpd_conn_sendto(conn, data, len, (struct sockaddr *)&dest->si_client,
+                           dest->client_len);
   }
   else
   {
-    ret = sendto(conn->socket_fd, data, len, 0, &conn->addr, conn->addrlen);
+    ret = sendto(conn->socket_fd, data, len, 0, (struct sockaddr *)&conn->addr,
+                 conn->addrlen);
   }
 
   lua_pushinteger(L, ret);
@@ -510,6 +1587,440 @@ LUA_API int udpd_conn_send(lua_State *L)
   }
 }
 
+#if UDPD_HAS_SEGMENT_OFFLOAD
+static ssize_t udpd_send_segments(int fd, const char *buf, size_t len,
+                                  uint16_t segment_size,
+                                  const struct sockaddr *addr,
+                                  socklen_t addrlen)
+{
+  struct iovec iov = {(void *)buf, len};
+  char control[CMSG_SPACE(sizeof(uint16_t))];
+  memset(control, 0, sizeof(control));
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = (void *)addr;
+  msg.msg_namelen = addrlen;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_UDP;
+  cmsg->cmsg_type = UDP_SEGMENT;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+  memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(segment_size));
+
+  return sendmsg(fd, &msg, 0);
+}
+#endif
+
+// send count datagrams, a run of equal sized ones goes out as one
+// UDP_SEGMENT buffer, return the count sent, errno is set if it's less.
+static int udpd_sendv_iov(Conn *conn, const struct iovec *iov, int count,
+                          const struct sockaddr *addr, socklen_t addrlen)
+{
+  int sent = 0;
+  int i = 0;
+
+  while (i < count)
+  {
+    const char *data = iov[i].iov_base;
+    size_t len = iov[i].iov_len;
+
+#if UDPD_HAS_SEGMENT_OFFLOAD
+    if (conn->gso && len > 0)
+    {
+      // collect a run of equal sized datagrams, a shorter one ends the run.
+      char buf[BUFLEN];
+      size_t total = 0;
+      int segments = 0;
+      int j = i;
+      for (; j < count && segments < UDPD_MAX_SEGMENTS; j++)
+      {
+        size_t seglen = iov[j].iov_len;
+        if (seglen == 0 || seglen > len ||
+            total + seglen > UDPD_MAX_SEGMENT_BYTES)
+        {
+          break;
+        }
+
+        memcpy(buf + total, iov[j].iov_base, seglen);
+        total += seglen;
+        segments++;
+
+        if (seglen < len)
+        {
+          j++;
+          break;
+        }
+      }
+
+      if (segments > 1)
+      {
+        if (udpd_send_segments(conn->socket_fd, buf, total, (uint16_t)len,
+                               addr, addrlen) >= 0)
+        {
+          sent += segments;
+          i = j;
+          continue;
+        }
+
+        if (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT ||
+            errno == EOPNOTSUPP)
+        {
+          // no offload on this kernel/device, send them one by one.
+          conn->gso = 0;
+        }
+        else
+        {
+          break;
+        }
+      }
+    }
+#endif
+
+    if (sendto(conn->socket_fd, data, len, 0, addr, addrlen) < 0)
+    {
+      break;
+    }
+
+    sent++;
+    i++;
+  }
+
+  return sent;
+}
+
+// ========== ffi ==========
+// plain c entry points for luajit ffi, addr NULL sends to the conn address.
+
+ssize_t udpd_ffi_send(Conn *conn, const char *data, size_t len,
+                      const struct sockaddr *addr, socklen_t addrlen)
+{
+  if (!conn->socket_fd)
+  {
+    errno = ENOTCONN;
+    return -1;
+  }
+  if (addr)
+  {
+    return udpd_conn_sendto(conn, data, len, addr, addrlen);
+  }
+  return sendto(conn->socket_fd, data, len, 0, (struct sockaddr *)&conn->addr,
+                conn->addrlen);
+}
+
+int udpd_ffi_sendv(Conn *conn, const struct iovec *iov, int count,
+                   const struct sockaddr *addr, socklen_t addrlen)
+{
+  if (!conn->socket_fd)
+  {
+    errno = ENOTCONN;
+    return -1;
+  }
+
+  struct sockaddr_in6 mapped;
+  if (addr)
+  {
+    addr = udpd_conn_addr(conn, addr, &addrlen, &mapped);
+  }
+  else
+  {
+    addr = (struct sockaddr *)&conn->addr;
+    addrlen = conn->addrlen;
+  }
+  return udpd_sendv_iov(conn, iov, count, addr, addrlen);
+}
+
+// size of the next pulled datagram, -1 if there is none.
+ssize_t udpd_ffi_peek(Conn *conn)
+{
+  UDPD_PULL_PACKET *packet = TAILQ_FIRST(&conn->pull_queue);
+  return packet ? (ssize_t)packet->len : -1;
+}
+
+// take the next pulled datagram, truncated to len, return the bytes copied,
+// -1 if there is none. addr (if not NULL) gets the sender.
+ssize_t udpd_ffi_recv(Conn *conn, char *buf, size_t len,
+                      struct sockaddr_storage *addr, socklen_t *addrlen)
+{
+  UDPD_PULL_PACKET *packet = udpd_pull_take(conn);
+  if (!packet)
+  {
+    return -1;
+  }
+
+  size_t n = packet->len < len ? packet->len : len;
+  memcpy(buf, packet->data, n);
+  if (addr)
+  {
+    memcpy(addr, &packet->addr, packet->addrlen);
+    *addrlen = packet->addrlen;
+  }
+  free(packet);
+  return (ssize_t)n;
+}
+
+LUA_API int udpd_conn_sendv(lua_State *L)
+{
+  Conn *conn = luaL_checkudata(L, 1, LUA_UDPD_CONNECTION_TYPE);
+  luaL_checktype(L, 2, LUA_TTABLE);
+
+  if (!conn->socket_fd)
+  {
+    lua_pushnil(L);
+    lua_pushliteral(L, "socket was not created.");
+    return 2;
+  }
+
+  const struct sockaddr *addr = (struct sockaddr *)&conn->addr;
+  socklen_t addrlen = conn->addrlen;
+  struct sockaddr_in6 mapped;
+  if (lua_gettop(L) > 2 && !lua_isnil(L, 3))
+  {
+    Dest *dest = luaL_checkudata(L, 3, LUA_UDPD_DEST_TYPE);
+    addrlen = dest->client_len;
+    addr = udpd_conn_addr(conn, (struct sockaddr *)&dest->si_client, &addrlen,
+                          &mapped);
+  }
+
+  int count = (int)lua_objlen(L, 2);
+  struct iovec *iov = lua_newuserdata(L, sizeof(struct iovec) * (count + 1));
+  int i = 0;
+  for (; i < count; i++)
+  {
+    lua_rawgeti(L, 2, i + 1);
+    // only strings, a number would be converted to a string nothing keeps.
+    if (lua_type(L, -1) != LUA_TSTRING)
+    {
+      return luaL_error(L, "sendv: datagram #%d is not a string.", i + 1);
+    }
+    size_t len = 0;
+    const char *data = lua_tolstring(L, -1, &len);
+    lua_pop(L, 1);
+
+    // the table keeps the strings alive while they are sent.
+    iov[i].iov_base = (void *)data;
+    iov[i].iov_len = len;
+  }
+
+  int sent = udpd_sendv_iov(conn, iov, count, addr, addrlen);
+  lua_pushinteger(L, sent);
+
+  if (sent < count)
+  {
+    lua_pushstring(L, strerror(errno));
+    return 2;
+  }
+  else
+  {
+    return 1;
+  }
+}
+
+// pull(true, capacity?) returns the id of the conn in the fan.pull queue,
+// datagrams are kept for recv() instead of onread.
+LUA_API int udpd_conn_pull(lua_State *L)
+{
+  Conn *conn = luaL_checkudata(L, 1, LUA_UDPD_CONNECTION_TYPE);
+  if (conn->recv_hook && conn->recv_hook != udpd_pull_hook)
+  {
+    return luaL_error(L, "recv hook in use.");
+  }
+
+  if (lua_isnone(L, 2) || lua_toboolean(L, 2))
+  {
+    lua_Integer capacity = luaL_optinteger(L, 3, UDPD_DEFAULT_PULL_CAPACITY);
+    conn->pull_capacity = capacity > 0 ? (size_t)capacity : 1;
+    udpd_conn_set_recv_hook(conn, udpd_pull_hook, conn);
+    lua_pushinteger(L, fan_pull_enable(&conn->pull));
+    if (conn->pull_count > 0)
+    {
+      fan_pull_ready(&conn->pull);
+    }
+    return 1;
+  }
+
+  if (conn->recv_hook)
+  {
+    udpd_conn_set_recv_hook(conn, NULL, NULL);
+  }
+  udpd_pull_clear(conn);
+  return 0;
+}
+
+LUA_API int udpd_conn_recv(lua_State *L)
+{
+  Conn *conn = luaL_checkudata(L, 1, LUA_UDPD_CONNECTION_TYPE);
+  UDPD_PULL_PACKET *packet = udpd_pull_take(conn);
+  if (!packet)
+  {
+    return 0;
+  }
+
+  lua_pushlstring(L, packet->data, packet->len);
+  udpd_dest_push(L, (struct sockaddr *)&packet->addr, packet->addrlen);
+  free(packet);
+  return 2;
+}
+
+LUA_API int udpd_conn_send_at(lua_State *L)
+{
+  Conn *conn = luaL_checkudata(L, 1, LUA_UDPD_CONNECTION_TYPE);
+  size_t len = 0;
+  const char *data = luaL_checklstring(L, 2, &len);
+  double time = luaL_checknumber(L, 4);
+
+  if (!conn->socket_fd)
+  {
+    lua_pushnil(L);
+    lua_pushliteral(L, "socket was not created.");
+    return 2;
+  }
+
+  const struct sockaddr *addr = (struct sockaddr *)&conn->addr;
+  socklen_t addrlen = conn->addrlen;
+  if (!lua_isnoneornil(L, 3))
+  {
+    Dest *dest = luaL_checkudata(L, 3, LUA_UDPD_DEST_TYPE);
+    addr = (struct sockaddr *)&dest->si_client;
+    addrlen = dest->client_len;
+  }
+
+  double now = udpd_gettime();
+  if (time < now)
+  {
+    conn->pace_stats.late_total++;
+  }
+
+  ssize_t ret = 0;
+#if UDPD_HAS_TXTIME
+  if (conn->txtime)
+  {
+    ret = udpd_send_txtime(conn, data, len, addr, addrlen, time - now);
+    if (ret >= 0)
+    {
+      conn->pace_stats.txtime_total++;
+      if (conn->pace_stats.txtime_total % UDPD_TXTIME_DRAIN_EVERY == 0)
+      {
+        udpd_txtime_drain(conn);
+      }
+      lua_pushinteger(L, ret);
+      return 1;
+    }
+
+    if (errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP)
+    {
+      // the socket took SO_TXTIME but the path refuses it, pace locally.
+      conn->txtime = 0;
+    }
+    else
+    {
+      conn->pace_stats.error_total++;
+      lua_pushinteger(L, ret);
+      lua_pushstring(L, strerror(errno));
+      return 2;
+    }
+  }
+#endif
+
+  if (time <= now + UDPD_PACE_SLACK && TAILQ_EMPTY(&conn->pace_queue))
+  {
+    ret = udpd_conn_sendto(conn, data, len, addr, addrlen);
+    if (ret < 0)
+    {
+      conn->pace_stats.error_total++;
+      lua_pushinteger(L, ret);
+      lua_pushstring(L, strerror(errno));
+      return 2;
+    }
+
+    udpd_pace_record(conn, time, now);
+    lua_pushinteger(L, ret);
+    return 1;
+  }
+
+  UDPD_PACE_PACKET *packet = malloc(sizeof(UDPD_PACE_PACKET) + len);
+  if (!packet)
+  {
+    return luaL_error(L, "no memory.");
+  }
+
+  packet->time = time;
+  memcpy(&packet->addr, addr, addrlen);
+  packet->addrlen = addrlen;
+  packet->len = len;
+  memcpy(packet->data, data, len);
+  udpd_pace_push(conn, packet);
+
+  lua_pushinteger(L, len);
+  return 1;
+}
+
+LUA_API int udpd_conn_send_at_stats(lua_State *L)
+{
+  Conn *conn = luaL_checkudata(L, 1, LUA_UDPD_CONNECTION_TYPE);
+  UDPD_PACE_STATS *stats = &conn->pace_stats;
+
+#if UDPD_HAS_TXTIME
+  udpd_txtime_drain(conn);
+#endif
+
+  lua_newtable(L);
+  lua_pushboolean(L, conn->txtime);
+  lua_setfield(L, -2, "txtime");
+  lua_pushinteger(L, stats->txtime_total);
+  lua_setfield(L, -2, "txtime_total");
+  lua_pushinteger(L, stats->txtime_reported);
+  lua_setfield(L, -2, "txtime_reported");
+  lua_pushinteger(L, stats->txtime_dropped);
+  lua_setfield(L, -2, "txtime_dropped");
+  lua_pushinteger(L, stats->paced_total);
+  lua_setfield(L, -2, "paced_total");
+  lua_pushinteger(L, stats->error_total);
+  lua_setfield(L, -2, "error_total");
+  lua_pushinteger(L, stats->late_total);
+  lua_setfield(L, -2, "late_total");
+  lua_pushinteger(L, conn->pace_count);
+  lua_setfield(L, -2, "pending");
+  lua_Integer measured = stats->paced_total + stats->txtime_reported;
+  lua_pushnumber(L, measured > 0 ? stats->lateness_sum / measured : 0);
+  lua_setfield(L, -2, "lateness_avg");
+  lua_pushnumber(L, stats->lateness_max);
+  lua_setfield(L, -2, "lateness_max");
+  return 1;
+}
+
+LUA_API int udpd_conn_stats(lua_State *L)
+{
+  Conn *conn = luaL_checkudata(L, 1, LUA_UDPD_CONNECTION_TYPE);
+
+  lua_newtable(L);
+  lua_pushinteger(L, conn->recv_total);
+  lua_setfield(L, -2, "recv_total");
+  lua_pushinteger(L, conn->recv_bytes);
+  lua_setfield(L, -2, "recv_bytes");
+  lua_pushboolean(L, conn->reuseport);
+  lua_setfield(L, -2, "reuseport");
+  lua_pushinteger(L, conn->reuseport_group);
+  lua_setfield(L, -2, "reuseport_group");
+  lua_pushinteger(L, conn->pull_count);
+  lua_setfield(L, -2, "pull_pending");
+  lua_pushinteger(L, conn->pull_dropped);
+  lua_setfield(L, -2, "pull_dropped");
+  return 1;
+}
+
+LUA_API int udpd_conn_offload(lua_State *L)
+{
+  Conn *conn = luaL_checkudata(L, 1, LUA_UDPD_CONNECTION_TYPE);
+  lua_pushboolean(L, conn->gso);
+  lua_pushboolean(L, conn->gro);
+  return 2;
+}
+
 LUA_API int udpd_conn_send_request(lua_State *L)
 {
   Conn *conn = luaL_checkudata(L, 1, LUA_UDPD_CONNECTION_TYPE);
@@ -532,9 +2043,9 @@ LUA_API int udpd_conn_send_request(lua_State *L)
 LUA_API int udpd_dest_host(lua_State *L)
 {
   Dest *dest = luaL_checkudata(L, 1, LUA_UDPD_DEST_TYPE);
-  char buf[20] = {0};
+  char buf[INET6_ADDRSTRLEN] = {0};
   const char *out =
-      inet_ntop(AF_INET, (void *)&dest->si_client.sin_addr, buf, 20);
+      udpd_addr_ntop((struct sockaddr *)&dest->si_client, buf, sizeof(buf));
   if (out)
   {
     lua_pushstring(L, buf);
@@ -547,7 +2058,7 @@ LUA_API int udpd_dest_host(lua_State *L)
 LUA_API int udpd_dest_port(lua_State *L)
 {
   Dest *dest = luaL_checkudata(L, 1, LUA_UDPD_DEST_TYPE);
-  lua_pushinteger(L, ntohs(dest->si_client.sin_port));
+  lua_pushinteger(L, udpd_addr_port((struct sockaddr *)&dest->si_client));
   return 1;
 }
 
@@ -555,18 +2066,28 @@ LUA_API int udpd_dest_tostring(lua_State *L)
 {
   Dest *dest = luaL_checkudata(L, 1, LUA_UDPD_DEST_TYPE);
 
-  char buf[20];
-  const char *out =
-      inet_ntop(AF_INET, (void *)&dest->si_client.sin_addr, buf, 20);
+  char buf[INET6_ADDRSTRLEN];
+  const struct sockaddr *addr = (struct sockaddr *)&dest->si_client;
+  const char *out = udpd_addr_ntop(addr, buf, sizeof(buf));
   if (out)
   {
-    lua_pushfstring(L, "%s:%d", out, ntohs(dest->si_client.sin_port));
+    lua_pushfstring(L, addr->sa_family == AF_INET6 ? "[%s]:%d" : "%s:%d", out,
+                    udpd_addr_port(addr));
     return 1;
   }
 
   return 0;
 }
 
+LUA_API int udpd_dest_eq(lua_State *L)
+{
+  Dest *a = luaL_checkudata(L, 1, LUA_UDPD_DEST_TYPE);
+  Dest *b = luaL_checkudata(L, 2, LUA_UDPD_DEST_TYPE);
+  lua_pushboolean(L, udpd_addr_equal((struct sockaddr *)&a->si_client,
+                                     (struct sockaddr *)&b->si_client));
+  return 1;
+}
+
 LUA_API int udpd_conn_get_port(lua_State *L)
 {
   Conn *conn = luaL_checkudata(L, 1, LUA_UDPD_CONNECTION_TYPE);
@@ -581,9 +2102,30 @@ LUA_API int luaopen_fan_udpd(lua_State *L)
   lua_pushcfunction(L, &udpd_conn_send);
   lua_setfield(L, -2, "send");
 
+  lua_pushcfunction(L, &udpd_conn_sendv);
+  lua_setfield(L, -2, "sendv");
+
+  lua_pushcfunction(L, &udpd_conn_pull);
+  lua_setfield(L, -2, "pull");
+
+  lua_pushcfunction(L, &udpd_conn_recv);
+  lua_setfield(L, -2, "recv");
+
   lua_pushcfunction(L, &udpd_conn_send_request);
   lua_setfield(L, -2, "send_req");
 
+  lua_pushcfunction(L, &udpd_conn_send_at);
+  lua_setfield(L, -2, "send_at");
+
+  lua_pushcfunction(L, &udpd_conn_send_at_stats);
+  lua_setfield(L, -2, "send_at_stats");
+
+  lua_pushcfunction(L, &udpd_conn_offload);
+  lua_setfield(L, -2, "offload");
+
+  lua_pushcfunction(L, &udpd_conn_stats);
+  lua_setfield(L, -2, "stats");
+
   lua_pushcfunction(L, &lua_udpd_conn_gc);
   lua_setfield(L, -2, "close");
 
@@ -615,6 +2157,9 @@ LUA_API int luaopen_fan_udpd(lua_State *L)
   lua_pushcfunction(L, &udpd_dest_tostring);
   lua_setfield(L, -2, "__tostring");
 
+  lua_pushcfunction(L, &udpd_dest_eq);
+  lua_setfield(L, -2, "__eq");
+
   lua_pushstring(L, "__index");
   lua_pushvalue(L, -2);
   lua_rawset(L, -3);
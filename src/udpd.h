@@ -0,0 +1,157 @@
+#ifndef udpd_h
+#define udpd_h
+
+#include "pullqueue.h"
+#include "utlua.h"
+
+#define LUA_UDPD_CONNECTION_TYPE "UDPD_CONNECTION_TYPE"
+#define LUA_UDPD_DEST_TYPE "LUA_UDPD_DEST_TYPE"
+
+// called for every datagram instead of the lua onread, used by protocol
+// engines implemented in c on top of udpd.
+typedef void (*udpd_recv_hook)(void *ctx, const char *buf, size_t len,
+                               const struct sockaddr *addr, socklen_t addrlen);
+
+// a datagram waiting in the local pacing queue of send_at.
+typedef struct udpd_pace_packet
+{
+  TAILQ_ENTRY(udpd_pace_packet) next;
+  double time;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  size_t len;
+  char data[];
+} UDPD_PACE_PACKET;
+
+TAILQ_HEAD(udpd_pace_list, udpd_pace_packet);
+
+// a datagram waiting for lua in pull mode.
+typedef struct udpd_pull_packet
+{
+  TAILQ_ENTRY(udpd_pull_packet) next;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  size_t len;
+  char data[];
+} UDPD_PULL_PACKET;
+
+TAILQ_HEAD(udpd_pull_list, udpd_pull_packet);
+
+typedef struct
+{
+  // datagrams handed to the kernel with a SO_TXTIME launch time.
+  lua_Integer txtime_total;
+  // datagrams sent by the local pacing queue (or at once when due).
+  lua_Integer paced_total;
+  lua_Integer error_total;
+  // requested time already passed when send_at was called.
+  lua_Integer late_total;
+  // SO_TXTIME datagrams the kernel reported sent (tx timestamp) or dropped
+  // (SO_EE_ORIGIN_TXTIME), read from the socket error queue.
+  lua_Integer txtime_reported;
+  lua_Integer txtime_dropped;
+
+  // achieved - requested in seconds, for the datagrams paced locally and the
+  // txtime_reported ones.
+  double lateness_sum;
+  double lateness_max;
+} UDPD_PACE_STATS;
+
+typedef struct
+{
+  struct event reconnect_clock;
+
+  lua_State *L;
+  int selfRef;
+
+  lua_State *mainthread;
+
+  int onReadRef;
+  int onReadvRef;
+  int onSendReadyRef;
+
+  // datagrams read per event at most.
+  int read_budget;
+
+  char *host;
+  char *bind_host;
+  int port;
+  int bind_port;
+  int socket_fd;
+  // AF_INET6 sockets are dual stack, ipv4 peers are mapped on send.
+  int family;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+
+  int interface;
+
+  // SO_REUSEPORT, datagrams are steered by source address over a group of
+  // reuseport_group sockets if set.
+  int reuseport;
+  int reuseport_group;
+
+  // segmentation offload, cleared if the kernel refuses it.
+  int gso;
+  int gro;
+
+  // send_at uses SO_TXTIME (fq/etf qdisc) if asked and the kernel takes it,
+  // otherwise a local queue driven by one timer.
+  int txtime;
+  clockid_t txtime_clock;
+  // SO_TIMESTAMPING is on: launch times by timestamp key, matched against
+  // the tx timestamps of the error queue.
+  int txtime_report;
+  uint32_t txtime_key;
+  uint64_t *txtime_requested;
+  struct udpd_pace_list pace_queue;
+  size_t pace_count;
+  struct event *pace_ev;
+  UDPD_PACE_STATS pace_stats;
+
+  // datagrams read from this socket, to check the reuseport balance.
+  lua_Integer recv_total;
+  lua_Integer recv_bytes;
+
+  udpd_recv_hook recv_hook;
+  void *recv_hook_ctx;
+
+  // pull mode queues datagrams here (through the recv hook), up to
+  // pull_capacity, the rest are dropped and counted.
+  FAN_PULL pull;
+  struct udpd_pull_list pull_queue;
+  size_t pull_count;
+  size_t pull_capacity;
+  lua_Integer pull_dropped;
+
+  struct event *read_ev;
+  struct event *write_ev;
+} UDPD_CONN;
+
+typedef struct udpd_dest
+{
+  struct sockaddr_storage si_client;
+  socklen_t client_len;
+
+  // interned dests are kept in a hash table with a lru bound.
+  int ref;
+  size_t hash;
+  struct udpd_dest *hash_next;
+  TAILQ_ENTRY(udpd_dest) lru;
+} UDPD_DEST;
+
+void udpd_conn_set_recv_hook(UDPD_CONN *conn, udpd_recv_hook hook, void *ctx);
+int udpd_conn_reconnect(UDPD_CONN *conn, lua_State *L);
+ssize_t udpd_conn_sendto(UDPD_CONN *conn, const char *buf, size_t len,
+                         const struct sockaddr *addr, socklen_t addrlen);
+
+// push the interned dest of addr, the same peer gets the same userdata.
+UDPD_DEST *udpd_dest_push(lua_State *L, const struct sockaddr *addr,
+                          socklen_t addrlen);
+
+size_t udpd_addr_hash(const struct sockaddr *addr);
+bool udpd_addr_equal(const struct sockaddr *a, const struct sockaddr *b);
+const char *udpd_addr_ntop(const struct sockaddr *addr, char *buf,
+                           size_t size);
+int udpd_addr_port(const struct sockaddr *addr);
+
+#endif
@@ -0,0 +1,59 @@
+-- fan.hash64 and stream:hash64 of every stream backend against xxhash64
+-- test vectors: all 64 bits must come back (a 16 digit hex string before
+-- lua 5.3), and a hash must be usable as the seed of the next one.
+--
+-- usage (from the repo root): lua tests/hash64.lua
+local fan = require "fan"
+
+local SEED = "9e3779b97f4a7c15"
+
+-- data, hash with seed 0, hash with SEED.
+local VECTORS = {
+    {"", "ef46db3751d8e999", "c4349fc93c010000"},
+    {"abc", "44bc2cf5ad770999", "2ed0f59d6b43ac8b"},
+    {"The quick brown fox jumps over the lazy dog", "69a7cfac08595456", "f77175faea435c86"}
+}
+
+local BACKENDS = {"fan.stream.core", "fan.stream.ffi", "fan.stream.bit"}
+
+local failed = false
+
+local function check(name, ok)
+    if not ok then
+        print(name, "FAILED")
+        failed = true
+    end
+end
+
+local function hex(h)
+    if type(h) == "string" then
+        return h
+    end
+    return string.format("%016x", h)
+end
+
+for _, v in ipairs(VECTORS) do
+    local data, plain, seeded = v[1], v[2], v[3]
+    check(string.format("fan.hash64(%q)", data), hex(fan.hash64(data)) == plain)
+    check(string.format("fan.hash64(%q, seed)", data), hex(fan.hash64(data, SEED)) == seeded)
+end
+
+local chained = fan.hash64("abc", fan.hash64(""))
+check("chained seed", hex(chained) == hex(fan.hash64("abc", VECTORS[1][2])))
+
+for _, backend in ipairs(BACKENDS) do
+    local st, stream = pcall(require, backend)
+    if not st then
+        print(backend, "skipped:", stream)
+    else
+        for _, v in ipairs(VECTORS) do
+            local data, plain, seeded = v[1], v[2], v[3]
+            local s = stream.new(data)
+            check(string.format("%s hash64(%q)", backend, data), hex(s:hash64()) == plain)
+            check(string.format("%s hash64(%q, seed)", backend, data), hex(s:hash64(#data, SEED)) == seeded)
+        end
+    end
+end
+
+print(failed and "FAILED" or "ok")
+os.exit(failed and 1 or 0)
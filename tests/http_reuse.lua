@@ -0,0 +1,113 @@
+-- repeated https requests to a local keep-alive server (fan.httpd closes
+-- every connection after the reply, so a small one runs on tcpd here).
+-- after the first one, every request must reuse the shared connection
+-- (num_connects == 0) and http.stats().reused_connections must grow by one
+-- each time. a request with share = false must connect again.
+--
+-- needs the openssl command for a throwaway certificate.
+-- usage (from the repo root): lua tests/http_reuse.lua [requests]
+local fan = require "fan"
+-- connection sharing and stats() are in the libcurl backend.
+local http = require "fan.http.core"
+local tcpd = require "fan.tcpd"
+
+local requests = tonumber(arg[1]) or 5
+
+local dir = os.tmpname()
+os.remove(dir)
+local cert, key = dir .. ".crt", dir .. ".key"
+local made =
+    os.execute(
+    string.format(
+        "openssl req -x509 -newkey rsa:2048 -nodes -subj /CN=localhost -days 1 -keyout %s -out %s >/dev/null 2>&1",
+        key,
+        cert
+    )
+)
+if made ~= 0 and made ~= true then
+    print("openssl not found, skipped.")
+    os.exit(0)
+end
+
+local failed = false
+
+local function check(name, ok)
+    if not ok then
+        print(name, "FAILED")
+        failed = true
+    end
+end
+
+local function get(url, share)
+    return http.get {url = url, cainfo = cert, ssl_verifypeer = 0, ssl_verifyhost = 0, share = share}
+end
+
+fan.loop(
+    function()
+        -- answers each request on the same connection.
+        local serv, port =
+            tcpd.bind {
+            host = "127.0.0.1",
+            ssl = true,
+            cert = cert,
+            key = key,
+            onaccept = function(apt)
+                local input = ""
+                apt:bind {
+                    onread = function(data)
+                        input = input .. data
+                        local head_end = input:find("\r\n\r\n", 1, true)
+                        while head_end do
+                            input = input:sub(head_end + 4)
+                            apt:send("HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello")
+                            head_end = input:find("\r\n\r\n", 1, true)
+                        end
+                    end
+                }
+            end
+        }
+        local url = string.format("https://127.0.0.1:%d/", port)
+
+        local first = get(url)
+        check("first request", first.responseCode == 200 and first.num_connects == 1)
+
+        for i = 1, requests do
+            local before = http.stats()
+            local res = get(url)
+            local after = http.stats()
+            print(
+                string.format(
+                    "request %d: code=%s num_connects=%s reused_connections=%d error=%s",
+                    i,
+                    tostring(res.responseCode),
+                    tostring(res.num_connects),
+                    after.reused_connections,
+                    tostring(res.error)
+                )
+            )
+            check("request " .. i .. " code", res.responseCode == 200 and res.body == "hello")
+            check("request " .. i .. " num_connects", res.num_connects == 0)
+            check("request " .. i .. " reused", after.reused_connections == before.reused_connections + 1)
+        end
+
+        local unshared = get(url, false)
+        check("unshared request", unshared.responseCode == 200 and unshared.num_connects == 1)
+
+        local stats = http.stats()
+        print(
+            string.format(
+                "requests=%d new_connections=%d reused_connections=%d",
+                stats.requests,
+                stats.new_connections,
+                stats.reused_connections
+            )
+        )
+
+        serv:close()
+        fan.loopbreak()
+    end
+)
+
+os.remove(cert)
+os.remove(key)
+os.exit(failed and 1 or 0)
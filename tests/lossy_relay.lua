@@ -0,0 +1,80 @@
+-- udp relay on loopback between one client and a target port, drops and
+-- reorders datagrams to emulate a bad link.
+local fan = require "fan"
+local udpd = require "fan.udpd"
+
+local math = math
+
+local function new(target_port, loss, reorder)
+    local relay = {forwarded = 0, dropped = 0, reordered = 0}
+    local target = udpd.make_dest("127.0.0.1", target_port)
+    local client
+    local held, held_to
+
+    local function forward(data, to)
+        relay.forwarded = relay.forwarded + 1
+        relay.conn:send(data, to)
+    end
+
+    local function release()
+        if held and relay.conn then
+            local data, to = held, held_to
+            held, held_to = nil, nil
+            relay.reordered = relay.reordered + 1
+            forward(data, to)
+        end
+    end
+
+    relay.conn =
+        udpd.new {
+        bind_host = "127.0.0.1",
+        onread = function(data, from)
+            local to
+            if from == target then
+                to = client
+            else
+                client = from
+                to = target
+            end
+            if not to then
+                return
+            end
+
+            if math.random() < loss then
+                relay.dropped = relay.dropped + 1
+                return
+            end
+
+            -- keep one datagram back, it goes out after the next one.
+            if not held and math.random() < reorder then
+                held, held_to = data, to
+                return
+            end
+
+            forward(data, to)
+            release()
+        end
+    }
+    relay.port = relay.conn:getPort()
+
+    -- a held datagram is not kept longer than a few ms on an idle link.
+    coroutine.wrap(
+        function()
+            while relay.conn do
+                fan.sleep(0.005)
+                release()
+            end
+        end
+    )()
+
+    function relay.close()
+        relay.conn:close()
+        relay.conn = nil
+    end
+
+    return relay
+end
+
+return {
+    new = new
+}
@@ -0,0 +1,160 @@
+-- objectbuf.encode must give the bytes of the baseline encoder, and every
+-- sample must decode back to the same object.
+--
+-- the output of a table depends on the iteration order of its keys, so
+-- golden bytes are only kept for samples without hash keys (or a single
+-- one). given the path of a fan.so built from the baseline commit, its
+-- encoder is loaded next to this one and all the samples are compared in
+-- the same lua state. integers out of u30 range go to the varint section,
+-- which the baseline never wrote, those samples only have to decode the
+-- same.
+--
+-- usage (from the repo root): lua tests/objectbuf_encode.lua [baseline/fan.so]
+local fan = require "fan"
+local objectbuf = require "fan.objectbuf"
+local core = require "fan.objectbuf.core"
+
+local baseline = arg[1] and assert(package.loadlib(arg[1], "luaopen_fan_objectbuf_core"))()
+
+local function same(a, b, seen)
+    if type(a) ~= "table" or type(b) ~= "table" then
+        return a == b or (a ~= a and b ~= b)
+    end
+    seen = seen or {}
+    if seen[a] then
+        return seen[a] == b
+    end
+    seen[a] = b
+    for k, v in pairs(a) do
+        if type(k) ~= "table" and not same(v, b[k], seen) then
+            return false
+        end
+    end
+    for k in pairs(b) do
+        if type(k) ~= "table" and a[k] == nil then
+            return false
+        end
+    end
+    return true
+end
+
+-- the same strings on every vm, math.random differs between them.
+local function lcg(seed)
+    local state = seed
+    return function(n)
+        state = (state * 1103515245 + 12345) % 2147483648
+        return state % n + 1
+    end
+end
+
+local function docs_sample(negative)
+    local a = {
+        b = {
+            1234556789,
+            12345.6789,
+            nil,
+            negative and -1234556789 or 1234,
+            -12345.6789,
+            0,
+            "asdfa",
+            d = {
+                e = false
+            }
+        },
+        averyvery = string.rep("long long text", 12)
+    }
+    local random = lcg(0)
+    for i = 1, 100 do
+        table.insert(a.b, string.rep("abc", random(1000)))
+    end
+    return a
+end
+
+local cyclic = {children = {}}
+cyclic.children[1] = {parent = cyclic, name = "child"}
+cyclic.self = cyclic
+
+local duplicates = {}
+for i = 1, 10000 do
+    duplicates[i] = "duplicate string"
+end
+
+-- a string key that reads as an index of the array part ({1, ["1"] = 2}) is
+-- dropped by both encoders, it's left out.
+local mixed = {1, 2, 3, "x", x = 1, y = "x", [1.5] = true, [100] = 2 ^ 31, [0] = "zero"}
+
+local numbers = {}
+for i = 1, 300 do
+    numbers[i] = (i % 3 == 0) and i * 1000003 or i / 7
+end
+
+local shared = {v = 1}
+local graph = {shared, shared, {shared, inner = shared}, [shared] = "table key"}
+
+-- golden: hex of the baseline output, then with the symbol table.
+local samples = {
+    {"true", true, golden = {"01"}},
+    {"false", false, golden = {""}},
+    {"number", 12345.6789, golden = {"8001a1f831e6d61cc840"}},
+    {"u30", 42, golden = {"40012a"}},
+    {"string", "hello", golden = {"20010568656c6c6f"}},
+    {"empty", {}, golden = {"08010100", "08010100"}},
+    {
+        "nested empty",
+        {{}, {{}}, k = {}},
+        golden = {"6802010201016b0505020708050a010002010901000100", "6800000505020708030a010002010901000100"}
+    },
+    {
+        "array",
+        {1, 2.5, "x", "x", true, false, {3, "x"}, 1073741823},
+        golden = {
+            "e8010000000000000440090102030405060708ffffffff0301017802090804030d0d02010f0c0302060d",
+            "e80000000209080504030302010f0d03020703"
+        }
+    },
+    {"docs", docs_sample(false)},
+    {"docs negative", docs_sample(true), varint = true},
+    {"cyclic", cyclic},
+    {"duplicates", duplicates},
+    {"mixed", mixed},
+    {"numbers", numbers},
+    {"graph", graph},
+    {"varints", {-1, -2, 2 ^ 33, [2 ^ 40] = -2 ^ 40}, varint = true}
+}
+
+local failed = false
+
+local function check(name, ok)
+    if not ok then
+        print(name, "FAILED")
+        failed = true
+    end
+end
+
+for _, sample in ipairs(samples) do
+    local name, obj = sample[1], sample[2]
+    local syms = {false}
+    if type(obj) == "table" then
+        syms[2] = objectbuf.symbol(obj)
+    end
+
+    for i, sym in ipairs(syms) do
+        local label = name .. (sym and " +sym" or "")
+        local data = core.encode(obj, sym or nil)
+
+        if sample.golden then
+            check(label .. " golden", fan.data2hex(data, true) == sample.golden[i])
+        end
+        if baseline and not sample.varint then
+            check(label .. " baseline", data == baseline.encode(obj, sym or nil))
+        end
+        check(label .. " decode", same(obj, core.decode(data, sym or nil)))
+        print(string.format("%-20s %8d bytes", label, #data))
+    end
+end
+
+if not baseline then
+    print("no baseline fan.so given, only the golden samples were compared.")
+end
+
+os.exit(failed and 1 or 0)
@@ -0,0 +1,199 @@
+-- fan.pull echo servers over tcpd and udpd, through the luajit ffi bindings
+-- when they are available (the object methods otherwise). onready takes a
+-- single id per call, the ids left behind must still be served.
+--
+-- usage (from the repo root): lua tests/pull.lua [clients] [messages]
+local fan = require "fan"
+local tcpd = require "fan.tcpd"
+local udpd = require "fan.udpd"
+local pull = require "fan.pull"
+local utils = require "fan.utils"
+
+local clients = tonumber(arg[1]) or 8
+local messages = tonumber(arg[2]) or 50
+
+local has_ffi = pull.read_into ~= nil
+local buf = has_ffi and require("ffi").new("char [?]", 65536)
+
+local failed = false
+
+local function check(name, ok)
+    if not ok then
+        print(name, "FAILED")
+        failed = true
+    end
+end
+
+local handlers = {}
+
+pull.onready(
+    function()
+        local id = pull.next()
+        if id and handlers[id] then
+            handlers[id]()
+        end
+    end
+)
+
+local function serve_tcp(apt)
+    local id
+    local turn = 0
+    id = apt:pull()
+    handlers[id] = function()
+        local data
+        if has_ffi and turn % 2 == 1 then
+            local n = pull.read_into(apt, buf, 65536)
+            data = n >= 0 and require("ffi").string(buf, n) or nil
+        else
+            data = pull.read(apt)
+        end
+        turn = turn + 1
+
+        if not data then
+            handlers[id] = nil
+        elseif #data > 0 then
+            if turn % 2 == 0 then
+                pull.send(apt, data)
+            else
+                pull.sendv(apt, {data:sub(1, 1), data:sub(2)})
+            end
+        end
+    end
+end
+
+local function serve_udp(conn)
+    local turn = 0
+    handlers[conn:pull()] = function()
+        while true do
+            local data, addr
+            if has_ffi and turn % 2 == 1 then
+                addr = pull.new_addr()
+                local n = pull.udp_recv_into(conn, buf, 65536, addr)
+                data = n >= 0 and require("ffi").string(buf, n) or nil
+            else
+                data, addr = pull.udp_recv(conn)
+            end
+            if not data then
+                break
+            end
+            turn = turn + 1
+
+            if turn % 2 == 0 then
+                pull.udp_send(conn, data, addr)
+            else
+                pull.udp_sendv(conn, {data}, addr)
+            end
+        end
+    end
+end
+
+local function test_tcp()
+    local port = 20000 + math.random(20000)
+    local serv = tcpd.bind {host = "127.0.0.1", port = port, onaccept = serve_tcp}
+
+    local received = {}
+    local conns = {}
+    for c = 1, clients do
+        received[c] = {}
+        conns[c] =
+            tcpd.connect {
+            host = "127.0.0.1",
+            port = port,
+            onread = function(data)
+                table.insert(received[c], data)
+            end
+        }
+    end
+
+    fan.sleep(0.1)
+    local expected = {}
+    for c = 1, clients do
+        local t = {}
+        for i = 1, messages do
+            t[i] = string.format("%d:%d;", c, i)
+            conns[c]:send(t[i])
+        end
+        expected[c] = table.concat(t)
+    end
+
+    local deadline = utils.gettime() + 5
+    local done = false
+    while not done and utils.gettime() < deadline do
+        fan.sleep(0.05)
+        done = true
+        for c = 1, clients do
+            done = done and table.concat(received[c]) == expected[c]
+        end
+    end
+    check("tcp echo", done)
+    check("tcp sendv number", not pcall(conns[1].sendv, conns[1], {"a", 1}))
+
+    for c = 1, clients do
+        conns[c]:close()
+    end
+    fan.sleep(0.1)
+    check("tcp disconnect", next(handlers) == nil)
+    serv:close()
+end
+
+local function test_udp()
+    local server = udpd.new {bind_host = "127.0.0.1"}
+    serve_udp(server)
+    local dest = udpd.make_dest("127.0.0.1", server:getPort())
+
+    local echoed = 0
+    local conns = {}
+    for c = 1, clients do
+        conns[c] =
+            udpd.new {
+            bind_host = "127.0.0.1",
+            onread = function(data)
+                echoed = echoed + 1
+            end
+        }
+        for i = 1, messages do
+            conns[c]:send(string.format("%d:%d", c, i), dest)
+        end
+        -- let the server drain, a burst of all clients overflows its socket.
+        fan.sleep(0.01)
+    end
+
+    local deadline = utils.gettime() + 5
+    while echoed < clients * messages and utils.gettime() < deadline do
+        fan.sleep(0.05)
+    end
+    check("udp echo", echoed == clients * messages)
+    check("udp sendv number", not pcall(conns[1].sendv, conns[1], {"a", 1}, dest))
+
+    if has_ffi then
+        -- the ffi calls must refuse objects of another kind, not read them
+        -- as the wrong struct.
+        local stream = require("fan.stream").new("x")
+        check("tcp send udpd", not pcall(pull.send, conns[1], "x"))
+        check("tcp sendv udpd", not pcall(pull.sendv, conns[1], {"x"}))
+        check("tcp read udpd", not pcall(pull.read, conns[1]))
+        check("tcp read stream", not pcall(pull.read, stream))
+        check("tcp read_into stream", not pcall(pull.read_into, stream, buf, 1))
+        check("udp send stream", not pcall(pull.udp_send, stream, "x"))
+        check("udp recv stream", not pcall(pull.udp_recv, stream))
+    end
+
+    for c = 1, clients do
+        conns[c]:close()
+    end
+    handlers = {}
+    server:close()
+end
+
+fan.loop(
+    function()
+        math.randomseed(os.time())
+        print(has_ffi and "ffi bindings" or "lua methods")
+        test_tcp()
+        test_udp()
+        print(failed and "FAILED" or "ok")
+        fan.loopbreak()
+    end
+)
+
+os.exit(failed and 1 or 0)
@@ -0,0 +1,122 @@
+-- rudp over a lossy, reordering loopback link, once per congestion control.
+-- every message must arrive intact, the rtt/rto/cwnd estimation and the
+-- resend counters are printed for each run.
+--
+-- usage (from the repo root): lua tests/rudp_lossy.lua [loss] [reorder] [count]
+package.path = "tests/?.lua;" .. package.path
+
+local fan = require "fan"
+local udpd = require "fan.udpd"
+local rudp = require "fan.rudp"
+local utils = require "fan.utils"
+local lossy_relay = require "lossy_relay"
+
+local loss = tonumber(arg[1]) or 0.05
+local reorder = tonumber(arg[2]) or 0.1
+local count = tonumber(arg[3]) or 200
+
+local MTU = 576
+local TIMEOUT = 2
+local BODY_SIZE = MTU - 28 - 8
+local CONGESTIONS = {"fixed", "newreno", "cubic", "bbr"}
+
+-- message i spans 1 to 12 parts, starts with its index.
+local function message(i)
+    local len = (i % 12 + 1) * BODY_SIZE - i % 7
+    local seed = string.format("%08d", i)
+    return string.rep(seed, math.ceil(len / #seed)):sub(1, len)
+end
+
+local function run(congestion)
+    local received = {}
+    local received_count = 0
+    local corrupted = 0
+
+    local server =
+        rudp.new {
+        mtu = MTU,
+        timeout = TIMEOUT,
+        congestion = congestion,
+        accept = true,
+        onread = function(session, buf)
+            local i = tonumber(buf:sub(1, 8))
+            if not i or buf ~= message(i) then
+                corrupted = corrupted + 1
+            elseif not received[i] then
+                received[i] = true
+                received_count = received_count + 1
+            end
+        end
+    }
+    local server_conn = udpd.new {bind_host = "127.0.0.1"}
+    server:attach(server_conn)
+
+    local relay = lossy_relay.new(server_conn:getPort(), loss, reorder)
+
+    local client = rudp.new {mtu = MTU, timeout = TIMEOUT, congestion = congestion}
+    local client_conn = udpd.new {bind_host = "127.0.0.1"}
+    client:attach(client_conn)
+    local session = client:session(udpd.make_dest("127.0.0.1", relay.port))
+
+    local start = utils.gettime()
+    for i = 1, count do
+        session:send(message(i))
+    end
+
+    local deadline = start + 60
+    while received_count < count and corrupted == 0 and utils.gettime() < deadline do
+        fan.sleep(0.05)
+    end
+
+    local elapsed = utils.gettime() - start
+    local stats = session:stats()
+    local rto_ok = stats.rto >= 0.1 and stats.rto <= TIMEOUT
+
+    print(
+        string.format(
+            "%-8s %d/%d corrupted=%d %.2fs sent=%d resent=%d lost=%d dropped=%d reordered=%d " ..
+                "srtt=%.4f rttvar=%.4f rto=%.3f cwnd=%.1f ssthresh=%.1f",
+            congestion,
+            received_count,
+            count,
+            corrupted,
+            elapsed,
+            stats.udp_send_total,
+            stats.udp_resend_total,
+            stats.udp_loss_total,
+            relay.dropped,
+            relay.reordered,
+            stats.srtt,
+            stats.rttvar,
+            stats.rto,
+            stats.cwnd,
+            stats.ssthresh
+        )
+    )
+
+    client:close()
+    client_conn:close()
+    server:close()
+    server_conn:close()
+    relay.close()
+
+    return received_count == count and corrupted == 0 and rto_ok
+end
+
+local failed = false
+
+fan.loop(
+    function()
+        math.randomseed(1)
+        print(string.format("loss=%.2f reorder=%.2f count=%d", loss, reorder, count))
+        for _, congestion in ipairs(CONGESTIONS) do
+            if not run(congestion) then
+                print(congestion, "FAILED")
+                failed = true
+            end
+        end
+        fan.loopbreak()
+    end
+)
+
+os.exit(failed and 1 or 0)
@@ -0,0 +1,118 @@
+-- rudp peers with different mtu over a lossy loopback link, with fec on: the
+-- receiver must rebuild the messages from the parts (and parity) sized by
+-- the sender. a message over the receiver's max_message_size is dropped
+-- without blocking the ones after it.
+--
+-- usage (from the repo root): lua tests/rudp_reassembly.lua [loss] [count]
+package.path = "tests/?.lua;" .. package.path
+
+local fan = require "fan"
+local udpd = require "fan.udpd"
+local rudp = require "fan.rudp"
+local utils = require "fan.utils"
+local lossy_relay = require "lossy_relay"
+
+local loss = tonumber(arg[1]) or 0.05
+local count = tonumber(arg[2]) or 100
+
+local MAX_MESSAGE_SIZE = 256 * 1024
+
+-- the last one spans several hundred parts.
+local function length(i)
+    return i == count and 200000 or i * 97
+end
+
+local failed = false
+
+local function check(name, ok)
+    if not ok then
+        print(name, "FAILED")
+        failed = true
+    end
+end
+
+local function message(i, len)
+    local seed = string.format("%08d", i)
+    return string.rep(seed, math.ceil(len / #seed)):sub(1, len)
+end
+
+local function run(client_mtu, server_mtu)
+    local received = {}
+    local received_count = 0
+    local corrupted = 0
+    local oversized = false
+    local server_session
+
+    local server =
+        rudp.new {
+        mtu = server_mtu,
+        accept = true,
+        max_message_size = MAX_MESSAGE_SIZE,
+        onread = function(session, buf)
+            server_session = session
+            local i = tonumber(buf:sub(1, 8))
+            if i == 0 then
+                oversized = true
+            elseif not i or buf ~= message(i, #buf) or #buf ~= length(i) then
+                corrupted = corrupted + 1
+            elseif not received[i] then
+                received[i] = true
+                received_count = received_count + 1
+            end
+        end
+    }
+    local server_conn = udpd.new {bind_host = "127.0.0.1"}
+    server:attach(server_conn)
+
+    local relay = lossy_relay.new(server_conn:getPort(), loss, 0)
+
+    local client = rudp.new {mtu = client_mtu, fec = 4, timeout = 0.5}
+    local client_conn = udpd.new {bind_host = "127.0.0.1"}
+    client:attach(client_conn)
+    local session = client:session(udpd.make_dest("127.0.0.1", relay.port))
+
+    -- message 0 is larger than the server takes.
+    session:send(message(0, MAX_MESSAGE_SIZE + 1))
+    for i = 1, count do
+        session:send(message(i, length(i)))
+    end
+
+    local deadline = utils.gettime() + 30
+    while received_count < count and corrupted == 0 and utils.gettime() < deadline do
+        fan.sleep(0.05)
+    end
+
+    local stats = session:stats()
+    print(
+        string.format(
+            "mtu %d -> %d: %d/%d corrupted=%d resent=%d recovered=%d",
+            client_mtu,
+            server_mtu,
+            received_count,
+            count,
+            corrupted,
+            stats.udp_resend_total,
+            server_session and server_session.udp_fec_recover_total or 0
+        )
+    )
+    check(string.format("mtu %d -> %d", client_mtu, server_mtu), received_count == count and corrupted == 0)
+    check(string.format("mtu %d -> %d oversized", client_mtu, server_mtu), not oversized)
+
+    client:close()
+    client_conn:close()
+    server:close()
+    server_conn:close()
+    relay.close()
+end
+
+fan.loop(
+    function()
+        math.randomseed(1)
+        run(1400, 576)
+        run(576, 1400)
+        run(576, 576)
+        fan.loopbreak()
+    end
+)
+
+os.exit(failed and 1 or 0)
@@ -0,0 +1,63 @@
+-- a forked peer of a fan.shm channel is killed with SIGKILL, it never
+-- closes its side: the survivor must still read what the peer wrote and
+-- then get ondisconnected.
+--
+-- usage (from the repo root): lua tests/shm_peer_death.lua
+local fan = require "fan"
+local shm = require "fan.shm"
+local utils = require "fan.utils"
+
+local ch = assert(shm.new())
+
+local pid = fan.fork()
+if pid == 0 then
+    fan.loop(
+        function()
+            ch:open {side = 1}
+            ch:send("last words")
+            fan.kill(fan.getpid(), 9)
+        end
+    )
+    os.exit(0)
+end
+
+local failed = false
+
+local function check(name, ok)
+    if not ok then
+        print(name, "FAILED")
+        failed = true
+    end
+end
+
+fan.loop(
+    function()
+        local received = {}
+        local reason
+        ch:open {
+            side = 0,
+            onread = function(buf)
+                table.insert(received, buf)
+            end,
+            ondisconnected = function(msg)
+                reason = msg
+            end
+        }
+
+        local deadline = utils.gettime() + 5
+        while not reason and utils.gettime() < deadline do
+            fan.sleep(0.05)
+        end
+        fan.waitpid(pid, 0)
+
+        check("read before death", table.concat(received) == "last words")
+        check("ondisconnected", reason ~= nil)
+        check("send after death", ch:send("x") == nil)
+        print("received:", table.concat(received), "reason:", reason)
+
+        ch:close()
+        fan.loopbreak()
+    end
+)
+
+os.exit(failed and 1 or 0)
@@ -0,0 +1,93 @@
+-- udpd send_at over loopback, paced locally and with SO_TXTIME: every
+-- datagram must arrive, and send_at_stats must account for the achieved
+-- launch times of both paths. with txtime the kernel reports them through
+-- tx timestamps, without a pacing qdisc on lo they leave early (negative
+-- lateness_avg), with `tc qdisc replace dev lo root fq` they leave on time.
+--
+-- usage (from the repo root): lua tests/udpd_send_at.lua [count] [delay]
+local fan = require "fan"
+local udpd = require "fan.udpd"
+local utils = require "fan.utils"
+
+local count = tonumber(arg[1]) or 200
+local delay = tonumber(arg[2]) or 0.02
+
+local failed = false
+
+local function check(name, ok)
+    if not ok then
+        print(name, "FAILED")
+        failed = true
+    end
+end
+
+local function run(txtime)
+    local label = txtime and "txtime" or "local"
+    local received = 0
+    local server =
+        udpd.new {
+        bind_host = "127.0.0.1",
+        onread = function(buf)
+            received = received + 1
+        end
+    }
+
+    local client = udpd.new {host = "127.0.0.1", port = server:getPort(), txtime = txtime}
+
+    local start = utils.gettime()
+    for i = 1, count do
+        client:send_at(string.format("%08d", i), nil, start + delay + i * 0.0001)
+    end
+
+    local deadline = utils.gettime() + 5
+    while received < count and utils.gettime() < deadline do
+        fan.sleep(0.01)
+    end
+    fan.sleep(0.05)
+
+    local stats = client:send_at_stats()
+    print(
+        string.format(
+            "%-6s received=%d txtime=%s txtime_total=%d reported=%d dropped=%d paced=%d avg=%.6f max=%.6f",
+            label,
+            received,
+            tostring(stats.txtime),
+            stats.txtime_total,
+            stats.txtime_reported,
+            stats.txtime_dropped,
+            stats.paced_total,
+            stats.lateness_avg,
+            stats.lateness_max
+        )
+    )
+
+    if stats.txtime then
+        -- without a pacing qdisc the whole burst leaves at once and may
+        -- overflow the receiver, only the reports are checked.
+        check(label .. " txtime_total", stats.txtime_total == count)
+        -- no reports at all if the device takes no software tx timestamps.
+        local reported = stats.txtime_reported + stats.txtime_dropped
+        check(label .. " txtime_reported", reported == 0 or reported == count)
+    else
+        check(label .. " received", received == count)
+        check(label .. " paced_total", stats.paced_total == count)
+        check(label .. " lateness", stats.lateness_avg >= 0 and stats.lateness_max < 1)
+    end
+
+    client:close()
+    server:close()
+    return stats
+end
+
+fan.loop(
+    function()
+        run(false)
+        local stats = run(true)
+        if stats.txtime and stats.txtime_reported == 0 then
+            print("txtime: no tx timestamps reported on this device.")
+        end
+        fan.loopbreak()
+    end
+)
+
+os.exit(failed and 1 or 0)